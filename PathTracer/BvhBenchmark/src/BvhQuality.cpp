@@ -0,0 +1,183 @@
+#include "BvhQuality.h"
+
+#include "Utils/Threading.h"
+
+// Triangles whose end point overlap is summed by every task
+constexpr const int OverlapChunkSize = 256;
+
+inline float NodeCost(const BVHTreeNode& node, float traversalCost) {
+	return node.numberOfPrimitives > 0 ? (float)node.numberOfPrimitives : traversalCost;
+}
+
+inline DirectX::XMFLOAT3 Lerp(const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b, float t) {
+	return DirectX::XMFLOAT3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+float TriangleArea(const std::array<DirectX::XMFLOAT3, 3>& triangle) {
+	DirectX::XMVECTOR first = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&triangle[1]), DirectX::XMLoadFloat3(&triangle[0]));
+	DirectX::XMVECTOR second = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&triangle[2]), DirectX::XMLoadFloat3(&triangle[0]));
+	return 0.5f * DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVector3Cross(first, second)));
+}
+
+// Area of the part of the triangle inside the box. The triangle is clipped against the 6 planes of the box
+// (Sutherland-Hodgman), which leaves a convex polygon of at most 9 vertices
+float ClippedTriangleArea(const std::array<DirectX::XMFLOAT3, 3>& triangle, const Oblivion::BoundingBox& box) {
+	DirectX::XMFLOAT3 polygon[9], clipped[9];
+	unsigned int numberOfVertices = 3;
+	std::copy(triangle.begin(), triangle.end(), polygon);
+
+	for (unsigned int plane = 0; plane < 6 && numberOfVertices >= 3; ++plane) {
+		auto axis = (Math::Axis)(plane % 3);
+		bool keepBelow = plane >= 3;
+		float limit = Math::GetValueOnAxis(keepBelow ? box.maxPoint : box.minPoint, axis);
+		auto Inside = [&](const DirectX::XMFLOAT3& point) {
+			float value = Math::GetValueOnAxis(point, axis);
+			return keepBelow ? value <= limit : value >= limit;
+		};
+
+		unsigned int numberOfClipped = 0;
+		for (unsigned int i = 0; i < numberOfVertices; ++i) {
+			const auto& current = polygon[i];
+			const auto& next = polygon[(i + 1) % numberOfVertices];
+			bool currentInside = Inside(current);
+			bool nextInside = Inside(next);
+			if (currentInside) {
+				clipped[numberOfClipped++] = current;
+			}
+			if (currentInside != nextInside) {
+				float currentValue = Math::GetValueOnAxis(current, axis);
+				float nextValue = Math::GetValueOnAxis(next, axis);
+				clipped[numberOfClipped++] = Lerp(current, next, (limit - currentValue) / (nextValue - currentValue));
+			}
+		}
+		numberOfVertices = numberOfClipped;
+		std::copy(clipped, clipped + numberOfClipped, polygon);
+	}
+	if (numberOfVertices < 3) {
+		return 0.0f;
+	}
+
+	// Half the length of the sum of the cross products of a fan
+	DirectX::XMVECTOR origin = DirectX::XMLoadFloat3(&polygon[0]);
+	DirectX::XMVECTOR sum = DirectX::XMVectorZero();
+	for (unsigned int i = 1; i + 1 < numberOfVertices; ++i) {
+		DirectX::XMVECTOR first = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&polygon[i]), origin);
+		DirectX::XMVECTOR second = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&polygon[i + 1]), origin);
+		sum = DirectX::XMVectorAdd(sum, DirectX::XMVector3Cross(first, second));
+	}
+	return 0.5f * DirectX::XMVectorGetX(DirectX::XMVector3Length(sum));
+}
+
+BvhQuality MeasureBvhQuality(const std::vector<BVHTreeNode>& nodes, Model& model, float traversalCost) {
+	EVALUATE(!nodes.empty(), "Cannot measure an empty BVH");
+	BvhQuality quality;
+	quality.numberOfNodes = (unsigned int)nodes.size();
+
+	// Nodes are stored depth first, so parents come before their children
+	std::vector<unsigned int> parents(nodes.size(), 0);
+	std::vector<unsigned int> depths(nodes.size(), 0);
+	std::vector<unsigned int> leafOfReference(model.GetPrimitiveCount(), 0);
+	double sahCost = 0.0;
+	for (unsigned int i = 0; i < nodes.size(); ++i) {
+		const auto& node = nodes[i];
+		float area = Oblivion::BoundingBox(node.minAABB, node.maxAABB).SurfaceArea();
+		sahCost += (double)NodeCost(node, traversalCost) * area;
+		quality.maxDepth = std::max(quality.maxDepth, depths[i]);
+		if (node.numberOfPrimitives == 0) {
+			parents[i + 1] = parents[node.secondChildOffset] = i;
+			depths[i + 1] = depths[node.secondChildOffset] = depths[i] + 1;
+			continue;
+		}
+
+		quality.numberOfLeaves++;
+		quality.numberOfReferences += node.numberOfPrimitives;
+		if (quality.leafSizeHistogram.size() <= node.numberOfPrimitives) {
+			quality.leafSizeHistogram.resize(node.numberOfPrimitives + 1, 0);
+		}
+		quality.leafSizeHistogram[node.numberOfPrimitives]++;
+		EVALUATE(node.primitiveOffset + node.numberOfPrimitives <= leafOfReference.size(), "A leaf references primitives up to ",
+				 node.primitiveOffset + node.numberOfPrimitives, ", but the model has only ", leafOfReference.size());
+		for (unsigned int primitive = 0; primitive < node.numberOfPrimitives; ++primitive) {
+			leafOfReference[node.primitiveOffset + primitive] = i;
+		}
+	}
+	float rootArea = Oblivion::BoundingBox(nodes[0].minAABB, nodes[0].maxAABB).SurfaceArea();
+	quality.sahCost = (float)(sahCost / rootArea);
+
+	// Spatial splits leave copies of a triangle in several leaves. The copies are grouped, so that every triangle is
+	// measured once and none of its leaves counts as overlap
+	std::vector<std::pair<std::array<unsigned int, 3>, unsigned int>> references;
+	references.reserve(leafOfReference.size());
+	for (unsigned int i = 0; i < leafOfReference.size(); ++i) {
+		references.emplace_back(model.GetPrimitive(i).indices, leafOfReference[i]);
+	}
+	std::sort(references.begin(), references.end());
+	std::vector<unsigned int> triangleStarts;
+	for (unsigned int i = 0; i < references.size(); ++i) {
+		if (i == 0 || references[i].first != references[i - 1].first) {
+			triangleStarts.push_back(i);
+		}
+	}
+	triangleStarts.push_back((unsigned int)references.size());
+
+	const auto& vertices = model.GetVertices();
+	auto numberOfTriangles = (int64_t)triangleStarts.size() - 1;
+	int64_t numberOfChunks = (numberOfTriangles + OverlapChunkSize - 1) / OverlapChunkSize;
+	std::vector<double> chunkOverlap(numberOfChunks, 0.0), chunkArea(numberOfChunks, 0.0);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			std::vector<unsigned int> ancestors;
+			std::vector<unsigned int> stack;
+			int64_t chunkEnd = std::min((chunkIndex + 1) * OverlapChunkSize, numberOfTriangles);
+			for (int64_t triangleIndex = chunkIndex * OverlapChunkSize; triangleIndex < chunkEnd; ++triangleIndex) {
+				unsigned int start = triangleStarts[triangleIndex], end = triangleStarts[triangleIndex + 1];
+				const auto& indices = references[start].first;
+				std::array<DirectX::XMFLOAT3, 3> triangle = {
+					vertices[indices[0]].position, vertices[indices[1]].position, vertices[indices[2]].position };
+				Oblivion::BoundingBox triangleBB;
+				for (const auto& vertex : triangle) {
+					triangleBB |= vertex;
+				}
+				chunkArea[chunkIndex] += TriangleArea(triangle);
+
+				// The triangle belongs to its leaves and every node above them
+				ancestors.clear();
+				for (unsigned int reference = start; reference < end; ++reference) {
+					unsigned int node = references[reference].second;
+					ancestors.push_back(node);
+					while (node != 0) {
+						node = parents[node];
+						ancestors.push_back(node);
+					}
+				}
+				std::sort(ancestors.begin(), ancestors.end());
+
+				stack.push_back(0);
+				while (!stack.empty()) {
+					unsigned int index = stack.back();
+					stack.pop_back();
+					const auto& node = nodes[index];
+					Oblivion::BoundingBox nodeBB(node.minAABB, node.maxAABB);
+					if ((nodeBB & triangleBB).IsEmpty()) {
+						continue;
+					}
+					if (!std::binary_search(ancestors.begin(), ancestors.end(), index)) {
+						chunkOverlap[chunkIndex] += (double)NodeCost(node, traversalCost) * ClippedTriangleArea(triangle, nodeBB);
+					}
+					if (node.numberOfPrimitives == 0) {
+						stack.push_back(index + 1);
+						stack.push_back(node.secondChildOffset);
+					}
+				}
+			}
+		}, numberOfChunks, 1);
+
+	double totalOverlap = 0.0, totalArea = 0.0;
+	for (int64_t i = 0; i < numberOfChunks; ++i) {
+		totalOverlap += chunkOverlap[i];
+		totalArea += chunkArea[i];
+	}
+	quality.endPointOverlap = totalArea > 0.0 ? (float)(totalOverlap / totalArea) : 0.0f;
+
+	return quality;
+}
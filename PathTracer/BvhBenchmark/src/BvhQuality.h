@@ -0,0 +1,25 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+
+// Metrics of a built model tree, following "On Quality Metrics of Bounding Volume Hierarchies" [Aila et al. 2013].
+// Interior nodes cost traversalCost and leaves cost one per primitive, as in the SAH used by the builders
+struct BvhQuality {
+	unsigned int numberOfNodes = 0;
+	unsigned int numberOfLeaves = 0;
+	// Primitives referenced by the leaves. More than the triangles of the model when spatial splits duplicated some
+	unsigned int numberOfReferences = 0;
+	unsigned int maxDepth = 0;
+	// leafSizeHistogram[i] = number of leaves with i primitives
+	std::vector<unsigned int> leafSizeHistogram;
+	// SAH cost, relative to the area of the root
+	float sahCost = 0.0f;
+	// End point overlap: area of the triangles inside nodes they are not part of, weighted by the cost of those nodes
+	// and relative to the area of all triangles
+	float endPointOverlap = 0.0f;
+};
+
+// model is the one the tree was built for, after its primitives were reordered by the build
+BvhQuality MeasureBvhQuality(const std::vector<BVHTreeNode>& nodes, Model& model, float traversalCost);
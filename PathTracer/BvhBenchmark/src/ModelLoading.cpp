@@ -0,0 +1,26 @@
+#include "ModelLoading.h"
+
+constexpr const unsigned int LoadsPerImporter = 3;
+
+const std::pair<const char*, ModelImporter> ModelImporters[] = {
+	{ "Native", ModelImporter::Native },
+	{ "Assimp", ModelImporter::Assimp },
+};
+
+std::vector<ModelLoadingStatistics> MeasureModelLoading(const std::string& path) {
+	std::vector<ModelLoadingStatistics> statistics;
+	for (const auto& [name, importer] : ModelImporters) {
+		auto& importerStatistics = statistics.emplace_back();
+		importerStatistics.importer = importer;
+		importerStatistics.name = name;
+		importerStatistics.milliseconds = std::numeric_limits<double>::max();
+		for (unsigned int i = 0; i < LoadsPerImporter; ++i) {
+			auto start = std::chrono::high_resolution_clock::now();
+			Model model(path, importer);
+			auto end = std::chrono::high_resolution_clock::now();
+			importerStatistics.milliseconds = std::min(importerStatistics.milliseconds, std::chrono::duration<double, std::milli>(end - start).count());
+			importerStatistics.primitives = model.GetPrimitiveCount();
+		}
+	}
+	return statistics;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+
+struct ModelLoadingStatistics {
+	ModelImporter importer = ModelImporter::Native;
+	const char* name = "";
+	// Best of a few loads, so that every importer reads the file from the page cache
+	double milliseconds = 0.0;
+	unsigned int primitives = 0;
+};
+
+// Loads the model with every importer. The native one falls back to Assimp for what it doesn't read, in which case
+// both take about the same time
+std::vector<ModelLoadingStatistics> MeasureModelLoading(const std::string& path);
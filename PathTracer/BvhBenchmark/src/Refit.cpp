@@ -0,0 +1,81 @@
+#include "Refit.h"
+
+#include "BvhQuality.h"
+#include "Tracing/BinaryBvhTree.h"
+#include "Tracing/TriangleBlocks.h"
+
+// A wave across the model, of a twentieth of its size, so that every vertex moves and most triangles change shape
+std::vector<DirectX::XMFLOAT3> MoveVertices(const std::vector<TraceVertex>& vertices) {
+	Oblivion::BoundingBox bb;
+	for (const auto& vertex : vertices) {
+		bb |= vertex.position;
+	}
+	float extent = std::max({ bb.maxPoint.x - bb.minPoint.x, bb.maxPoint.y - bb.minPoint.y, bb.maxPoint.z - bb.minPoint.z });
+	float amplitude = 0.05f * extent;
+	float frequency = extent > 0.0f ? Math::_2PI / extent : 0.0f;
+
+	std::vector<DirectX::XMFLOAT3> positions(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		positions[i] = vertices[i].position;
+		positions[i].y += amplitude * std::sin(frequency * (positions[i].x + positions[i].z));
+	}
+	return positions;
+}
+
+// Closest hit distance of every ray through the tree, infinity for the rays that miss
+std::vector<float> TraceRays(const std::vector<BVHTreeNode>& nodes, const Model& model, const std::vector<Ray>& rays) {
+	std::vector<TraceModelPrimitive> primitives(model.GetPrimitiveCount());
+	for (unsigned int i = 0; i < model.GetPrimitiveCount(); ++i) {
+		primitives[i] = model.GetPrimitive(i);
+	}
+	TriangleBlocks triangles;
+	triangles.Build(nodes, primitives, model.GetVertices());
+
+	BinaryBvhTree tree(nodes);
+	std::vector<float> distances(rays.size(), std::numeric_limits<float>::infinity());
+	for (size_t i = 0; i < rays.size(); ++i) {
+		Ray ray = rays[i];
+		TriangleBlocks::Hit hit;
+		bool found = tree.Intersect(ray, 0,
+			[&](unsigned int primitiveOffset, unsigned int, Ray& leafRay) {
+				return triangles.IntersectClosest(triangles.FindLeaf(primitiveOffset), leafRay, hit);
+			});
+		if (found) {
+			distances[i] = hit.t;
+		}
+	}
+	return distances;
+}
+
+RefitStatistics MeasureRefit(const BvhTree& tree, const Model& builtModel, const Model& model, BvhTree::SplitMethod splitMethod,
+							 unsigned int maxPrimitivesInNode, const BvhTree::BuildParameters& buildParameters,
+							 const std::vector<Ray>& rays) {
+	// Builds only reorder the primitives, so the vertices of both models move the same way
+	auto positions = MoveVertices(model.GetVertices());
+
+	RefitStatistics statistics;
+	Model refitModel = builtModel;
+	refitModel.SetVertexPositions(positions);
+	BvhTree refitTree = tree;
+	auto start = std::chrono::high_resolution_clock::now();
+	refitTree.Refit(&refitModel);
+	auto end = std::chrono::high_resolution_clock::now();
+	statistics.refitMilliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+
+	Model rebuiltModel = model;
+	rebuiltModel.SetVertexPositions(positions);
+	start = std::chrono::high_resolution_clock::now();
+	auto rebuiltTree = BvhTree::Create(&rebuiltModel, splitMethod, maxPrimitivesInNode, 65536, buildParameters);
+	end = std::chrono::high_resolution_clock::now();
+	statistics.rebuildMilliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+
+	statistics.refitSahCost = MeasureBvhQuality(refitTree.GetNodes(), refitModel, buildParameters.traversalCost).sahCost;
+	statistics.rebuildSahCost = MeasureBvhQuality(rebuiltTree->GetNodes(), rebuiltModel, buildParameters.traversalCost).sahCost;
+
+	auto refitDistances = TraceRays(refitTree.GetNodes(), refitModel, rays);
+	auto rebuildDistances = TraceRays(rebuiltTree->GetNodes(), rebuiltModel, rays);
+	for (size_t i = 0; i < rays.size(); ++i) {
+		statistics.mismatchedRays += refitDistances[i] != rebuildDistances[i] ? 1 : 0;
+	}
+	return statistics;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+#include "Graphics/Optimizations/BvhTree.h"
+#include "Tracing/Ray.h"
+
+struct RefitStatistics {
+	// Refit of the tree after the vertices moved, and a build of the moved model with the same split method
+	double refitMilliseconds = 0.0;
+	double rebuildMilliseconds = 0.0;
+	// SAH costs of both trees. A refit keeps the topology of the old vertices, so it is usually worse than a rebuild
+	float refitSahCost = 0.0f;
+	float rebuildSahCost = 0.0f;
+	// Rays that found a different closest hit distance, or a hit in only one of the trees. Must be 0
+	unsigned int mismatchedRays = 0;
+};
+
+// Moves the vertices of the model as a frame of an animation does, then refits a copy of tree and builds the moved model
+// again. Both trees trace the rays, so a refit that misses geometry shows up as mismatched rays. The rays must start
+// outside the model: a box the ray starts in is skipped once its exit is past the closest hit so far, as in the shaders,
+// so rays from inside can find different hits in two valid trees. builtModel is the model the tree was built for, after
+// the build reordered it, and model is the one before the build
+RefitStatistics MeasureRefit(const BvhTree& tree, const Model& builtModel, const Model& model, BvhTree::SplitMethod splitMethod,
+							 unsigned int maxPrimitivesInNode, const BvhTree::BuildParameters& buildParameters,
+							 const std::vector<Ray>& rays);
@@ -0,0 +1,258 @@
+#include "TraversalCache.h"
+
+#include "Utils/Threading.h"
+
+// Rays traced by every task, on a cache of its own
+constexpr const int RaysPerCache = 4096;
+
+class SimulatedCache {
+public:
+	SimulatedCache(const CacheParameters& parameters) :
+		mLineSize(parameters.lineSize), mAssociativity(parameters.associativity),
+		mNumberOfSets(std::max(1u, parameters.size / (parameters.lineSize * parameters.associativity))),
+		mTags((size_t)mNumberOfSets * mAssociativity, EmptyTag) {
+	}
+
+	// Touches every line of [address, address + size) and returns how many of them missed
+	unsigned int Access(uint64_t address, unsigned int size, unsigned int& numberOfLines) {
+		unsigned int misses = 0;
+		uint64_t firstLine = address / mLineSize, lastLine = (address + size - 1) / mLineSize;
+		for (uint64_t line = firstLine; line <= lastLine; ++line) {
+			misses += AccessLine(line) ? 0 : 1;
+			numberOfLines++;
+		}
+		return misses;
+	}
+
+private:
+	// The ways of a set are kept from the most to the least recently used
+	bool AccessLine(uint64_t line) {
+		uint64_t* ways = &mTags[(line % mNumberOfSets) * mAssociativity];
+		unsigned int way = 0;
+		while (way < mAssociativity && ways[way] != line) {
+			++way;
+		}
+		bool hit = way < mAssociativity;
+		std::copy_backward(ways, ways + std::min(way, mAssociativity - 1), ways + std::min(way + 1, mAssociativity));
+		ways[0] = line;
+		return hit;
+	}
+
+private:
+	static constexpr uint64_t EmptyTag = std::numeric_limits<uint64_t>::max();
+
+	unsigned int mLineSize;
+	unsigned int mAssociativity;
+	unsigned int mNumberOfSets;
+	std::vector<uint64_t> mTags;
+};
+
+std::vector<Ray> GenerateRays(const Oblivion::BoundingBox& bounds, RayDistribution distribution, unsigned int numberOfRays,
+							  unsigned int seed) {
+	std::mt19937 generator(seed);
+	std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+	std::normal_distribution<float> normal;
+
+	DirectX::XMVECTOR minPoint = DirectX::XMLoadFloat3(&bounds.minPoint);
+	DirectX::XMVECTOR maxPoint = DirectX::XMLoadFloat3(&bounds.maxPoint);
+	DirectX::XMVECTOR center = DirectX::XMVectorScale(DirectX::XMVectorAdd(minPoint, maxPoint), 0.5f);
+	float radius = std::max(0.5f * DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(maxPoint, minPoint))), 1e-6f);
+
+	std::vector<Ray> rays;
+	rays.reserve(numberOfRays);
+	if (distribution == RayDistribution::Primary) {
+		// Seen from above and to the side, from far enough for the bounding sphere to fill the image
+		DirectX::XMVECTOR forward = DirectX::XMVector3Normalize(DirectX::XMVectorSet(-0.4f, -0.3f, -1.0f, 0.0f));
+		DirectX::XMVECTOR right = DirectX::XMVector3Normalize(DirectX::XMVector3Cross(DirectX::XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), forward));
+		DirectX::XMVECTOR up = DirectX::XMVector3Cross(forward, right);
+		DirectX::XMVECTOR eye = DirectX::XMVectorSubtract(center, DirectX::XMVectorScale(forward, 3.0f * radius));
+		float halfSide = radius / std::sqrt(8.0f);
+
+		auto width = (unsigned int)std::ceil(std::sqrt((float)numberOfRays));
+		DirectX::XMFLOAT3 origin;
+		DirectX::XMStoreFloat3(&origin, eye);
+		for (unsigned int i = 0; i < numberOfRays; ++i) {
+			float x = ((float)(i % width) + uniform(generator)) / width * 2.0f - 1.0f;
+			float y = 1.0f - ((float)(i / width) + uniform(generator)) / width * 2.0f;
+			DirectX::XMVECTOR direction = DirectX::XMVectorAdd(forward, DirectX::XMVectorAdd(
+				DirectX::XMVectorScale(right, x * halfSide), DirectX::XMVectorScale(up, y * halfSide)));
+			DirectX::XMFLOAT3 rayDirection;
+			DirectX::XMStoreFloat3(&rayDirection, DirectX::XMVector3Normalize(direction));
+			rays.emplace_back(origin, rayDirection);
+		}
+	} else if (distribution == RayDistribution::Shadow) {
+		// A light as wide as the bounding sphere, a radius above the top of the box
+		float lightHeight = bounds.maxPoint.y + radius;
+		DirectX::XMFLOAT3 lightCenter;
+		DirectX::XMStoreFloat3(&lightCenter, center);
+		for (unsigned int i = 0; i < numberOfRays; ++i) {
+			DirectX::XMFLOAT3 origin(bounds.minPoint.x + (bounds.maxPoint.x - bounds.minPoint.x) * uniform(generator),
+									 bounds.minPoint.y + (bounds.maxPoint.y - bounds.minPoint.y) * uniform(generator),
+									 bounds.minPoint.z + (bounds.maxPoint.z - bounds.minPoint.z) * uniform(generator));
+			DirectX::XMFLOAT3 lightPoint(lightCenter.x + radius * (uniform(generator) - 0.5f), lightHeight,
+										 lightCenter.z + radius * (uniform(generator) - 0.5f));
+			DirectX::XMVECTOR toLight = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&lightPoint), DirectX::XMLoadFloat3(&origin));
+			float distance = DirectX::XMVectorGetX(DirectX::XMVector3Length(toLight));
+			DirectX::XMFLOAT3 direction;
+			DirectX::XMStoreFloat3(&direction, DirectX::XMVectorScale(toLight, 1.0f / distance));
+			rays.emplace_back(origin, direction, 0.0f, distance);
+		}
+	} else {
+		for (unsigned int i = 0; i < numberOfRays; ++i) {
+			DirectX::XMFLOAT3 origin(bounds.minPoint.x + (bounds.maxPoint.x - bounds.minPoint.x) * uniform(generator),
+									 bounds.minPoint.y + (bounds.maxPoint.y - bounds.minPoint.y) * uniform(generator),
+									 bounds.minPoint.z + (bounds.maxPoint.z - bounds.minPoint.z) * uniform(generator));
+			// A normalized gaussian vector is uniform on the sphere
+			DirectX::XMFLOAT3 direction;
+			do {
+				direction = DirectX::XMFLOAT3(normal(generator), normal(generator), normal(generator));
+			} while (direction.x == 0.0f && direction.y == 0.0f && direction.z == 0.0f);
+			DirectX::XMStoreFloat3(&direction, DirectX::XMVector3Normalize(DirectX::XMLoadFloat3(&direction)));
+			rays.emplace_back(origin, direction);
+		}
+	}
+	return rays;
+}
+
+inline bool IntersectNodeBox(const BVHTreeNode& node, const Ray& ray, const float (&inverseDirection)[3]) {
+	const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float minimum[3] = { node.minAABB.x, node.minAABB.y, node.minAABB.z };
+	const float maximum[3] = { node.maxAABB.x, node.maxAABB.y, node.maxAABB.z };
+	float tMin = ray.tMin, tMax = ray.tMax;
+	for (unsigned int axis = 0; axis < 3; ++axis) {
+		float tNear = (minimum[axis] - origin[axis]) * inverseDirection[axis];
+		float tFar = (maximum[axis] - origin[axis]) * inverseDirection[axis];
+		if (tNear > tFar) {
+			std::swap(tNear, tFar);
+		}
+		tMin = std::max(tMin, tNear);
+		tMax = std::min(tMax, tFar);
+	}
+	return tMin <= tMax;
+}
+
+// Moller-Trumbore. Shrinks tMax on a closer hit
+inline bool IntersectTriangle(const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b, const DirectX::XMFLOAT3& c, Ray& ray) {
+	DirectX::XMVECTOR origin = DirectX::XMLoadFloat3(&ray.origin);
+	DirectX::XMVECTOR direction = DirectX::XMLoadFloat3(&ray.direction);
+	DirectX::XMVECTOR first = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&b), DirectX::XMLoadFloat3(&a));
+	DirectX::XMVECTOR second = DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&c), DirectX::XMLoadFloat3(&a));
+	DirectX::XMVECTOR p = DirectX::XMVector3Cross(direction, second);
+	float determinant = DirectX::XMVectorGetX(DirectX::XMVector3Dot(first, p));
+	if (std::abs(determinant) < 1e-12f) {
+		return false;
+	}
+	float inverseDeterminant = 1.0f / determinant;
+	DirectX::XMVECTOR toOrigin = DirectX::XMVectorSubtract(origin, DirectX::XMLoadFloat3(&a));
+	float u = DirectX::XMVectorGetX(DirectX::XMVector3Dot(toOrigin, p)) * inverseDeterminant;
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+	DirectX::XMVECTOR q = DirectX::XMVector3Cross(toOrigin, first);
+	float v = DirectX::XMVectorGetX(DirectX::XMVector3Dot(direction, q)) * inverseDeterminant;
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+	float t = DirectX::XMVectorGetX(DirectX::XMVector3Dot(second, q)) * inverseDeterminant;
+	if (t < ray.tMin || t > ray.tMax) {
+		return false;
+	}
+	ray.tMax = t;
+	return true;
+}
+
+TraversalCacheStatistics MeasureTraversalCache(const std::vector<BVHTreeNode>& nodes, Model& model, const std::vector<Ray>& rays,
+											   const CacheParameters& cacheParameters, std::vector<unsigned int>* visitCounts,
+											   TraversalQuery query) {
+	EVALUATE(!nodes.empty(), "Cannot trace an empty BVH");
+	EVALUATE(cacheParameters.lineSize > 0 && cacheParameters.associativity > 0, "The cache needs lines and ways");
+	const auto& vertices = model.GetVertices();
+
+	int64_t numberOfChunks = ((int64_t)rays.size() + RaysPerCache - 1) / RaysPerCache;
+	std::vector<uint64_t> chunkNodes(numberOfChunks, 0), chunkLines(numberOfChunks, 0), chunkMisses(numberOfChunks, 0);
+	std::vector<uint64_t> chunkPrimitives(numberOfChunks, 0), chunkHits(numberOfChunks, 0);
+	std::vector<std::vector<unsigned int>> chunkVisits(visitCounts != nullptr ? numberOfChunks : 0);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			SimulatedCache cache(cacheParameters);
+			unsigned int* visits = nullptr;
+			if (visitCounts != nullptr) {
+				chunkVisits[chunkIndex].resize(nodes.size(), 0);
+				visits = chunkVisits[chunkIndex].data();
+			}
+			std::vector<unsigned int> stack;
+			int64_t chunkEnd = std::min((chunkIndex + 1) * RaysPerCache, (int64_t)rays.size());
+			for (int64_t rayIndex = chunkIndex * RaysPerCache; rayIndex < chunkEnd; ++rayIndex) {
+				Ray ray = rays[rayIndex];
+				const float inverseDirection[3] = { 1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z };
+				const bool directionIsNegative[3] = { inverseDirection[0] < 0.0f, inverseDirection[1] < 0.0f, inverseDirection[2] < 0.0f };
+
+				unsigned int index = 0;
+				bool hit = false;
+				while (true) {
+					unsigned int numberOfLines = 0;
+					chunkMisses[chunkIndex] += cache.Access((uint64_t)index * sizeof(BVHTreeNode), sizeof(BVHTreeNode), numberOfLines);
+					chunkLines[chunkIndex] += numberOfLines;
+					chunkNodes[chunkIndex]++;
+
+					const auto& node = nodes[index];
+					if (IntersectNodeBox(node, ray, inverseDirection)) {
+						if (visits != nullptr) {
+							visits[index]++;
+						}
+						if (node.numberOfPrimitives == 0) {
+							bool firstChildAbove = (node.axis & BVH_FIRST_CHILD_ABOVE) != 0;
+							if (directionIsNegative[node.axis & BVH_AXIS_MASK] != firstChildAbove) {
+								stack.push_back(index + 1);
+								index = node.secondChildOffset;
+							} else {
+								stack.push_back(node.secondChildOffset);
+								index = index + 1;
+							}
+							continue;
+						}
+						for (unsigned int i = 0; i < node.numberOfPrimitives; ++i) {
+							const auto& indices = model.GetPrimitive(node.primitiveOffset + i).indices;
+							chunkPrimitives[chunkIndex]++;
+							if (IntersectTriangle(vertices[indices[0]].position, vertices[indices[1]].position, vertices[indices[2]].position, ray)) {
+								hit = true;
+								if (query == TraversalQuery::AnyHit) {
+									break;
+								}
+							}
+						}
+					}
+					if (stack.empty() || (hit && query == TraversalQuery::AnyHit)) {
+						stack.clear();
+						break;
+					}
+					index = stack.back();
+					stack.pop_back();
+				}
+				chunkHits[chunkIndex] += hit ? 1 : 0;
+			}
+		}, numberOfChunks, 1);
+
+	TraversalCacheStatistics statistics;
+	for (int64_t i = 0; i < numberOfChunks; ++i) {
+		statistics.nodesPerRay += (double)chunkNodes[i];
+		statistics.primitivesPerRay += (double)chunkPrimitives[i];
+		statistics.hitRatio += (double)chunkHits[i];
+		statistics.linesPerRay += (double)chunkLines[i];
+		statistics.missesPerRay += (double)chunkMisses[i];
+		if (visitCounts != nullptr) {
+			visitCounts->resize(nodes.size(), 0);
+			for (unsigned int node = 0; node < nodes.size(); ++node) {
+				(*visitCounts)[node] += chunkVisits[i][node];
+			}
+		}
+	}
+	if (!rays.empty()) {
+		statistics.nodesPerRay /= rays.size();
+		statistics.primitivesPerRay /= rays.size();
+		statistics.hitRatio /= rays.size();
+		statistics.linesPerRay /= rays.size();
+		statistics.missesPerRay /= rays.size();
+	}
+	return statistics;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+#include "Tracing/Ray.h"
+
+// Set associative data cache with LRU replacement, which is fed the nodes fetched by a CPU traversal. The defaults are
+// the L1 data cache of a desktop core
+struct CacheParameters {
+	unsigned int lineSize = 64;
+	unsigned int size = 32 * 1024;
+	unsigned int associativity = 8;
+};
+
+struct TraversalCacheStatistics {
+	double nodesPerRay = 0.0;
+	double primitivesPerRay = 0.0;
+	// Fraction of the rays that hit a primitive
+	double hitRatio = 0.0;
+	// Cache lines touched by the fetched nodes. A node can straddle two lines
+	double linesPerRay = 0.0;
+	double missesPerRay = 0.0;
+};
+
+enum class RayDistribution {
+	// Rays of a pinhole camera looking at the whole model, traced in scanline order
+	Primary,
+	// Rays starting anywhere in the bounding box of the model, in random directions, as bounces would
+	Diffuse,
+	// Segments from anywhere in the bounding box of the model to a square light above it, ending at the light
+	Shadow
+};
+
+enum class TraversalQuery {
+	// Front to back until no closer hit can be found, as the shaders do for camera rays and bounces
+	ClosestHit,
+	// Stops at the first hit, as the shaders do for shadow rays
+	AnyHit
+};
+
+std::vector<Ray> GenerateRays(const Oblivion::BoundingBox& bounds, RayDistribution distribution, unsigned int numberOfRays,
+							  unsigned int seed);
+
+// Traversal of every ray, front to back like the shaders. Rays are split into groups, each of them traced on its own
+// cold cache as a core would, so the results don't depend on the number of threads. Only the node fetches go through
+// the cache. visitCounts, when given, gets the number of rays that hit the box of every node added to it. Both
+// children of a node are always fetched, so only the hits tell which one is on the hot path
+TraversalCacheStatistics MeasureTraversalCache(const std::vector<BVHTreeNode>& nodes, Model& model, const std::vector<Ray>& rays,
+											   const CacheParameters& cacheParameters, std::vector<unsigned int>* visitCounts = nullptr,
+											   TraversalQuery query = TraversalQuery::ClosestHit);
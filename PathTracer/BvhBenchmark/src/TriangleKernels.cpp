@@ -0,0 +1,51 @@
+#include "TriangleKernels.h"
+
+// Triangles every ray is tested against, about the leaves a ray opens in a traversal
+constexpr const unsigned int TrianglesPerRay = 512;
+
+std::vector<TriangleKernelStatistics> MeasureTriangleKernels(const Model& model, const std::vector<Ray>& rays, unsigned int leafSize) {
+	leafSize = std::max(leafSize, 1u);
+	std::vector<TraceModelPrimitive> primitives(model.GetPrimitiveCount());
+	for (unsigned int i = 0; i < model.GetPrimitiveCount(); ++i) {
+		primitives[i] = model.GetPrimitive(i);
+	}
+	const auto& vertices = model.GetVertices();
+	unsigned int numberOfLeaves = ((unsigned int)primitives.size() + leafSize - 1) / leafSize;
+	unsigned int leavesPerRay = std::min(std::max(TrianglesPerRay / leafSize, 1u), numberOfLeaves);
+
+	std::vector<TriangleKernel> kernels = { TriangleKernel::Scalar, TriangleKernel::SSE };
+	if (TriangleBlocks::GetBestKernel() == TriangleKernel::AVX2) {
+		kernels.push_back(TriangleKernel::AVX2);
+	}
+
+	std::vector<TriangleKernelStatistics> statistics;
+	for (auto kernel : kernels) {
+		TriangleBlocks blocks(kernel);
+		std::vector<unsigned int> leafSizes;
+		for (unsigned int first = 0; first < primitives.size(); first += leafSize) {
+			leafSizes.push_back(std::min(leafSize, (unsigned int)primitives.size() - first));
+			blocks.AddLeaf(primitives, first, leafSizes.back(), vertices);
+		}
+
+		auto& kernelStatistics = statistics.emplace_back();
+		kernelStatistics.kernel = kernel;
+		uint64_t trianglesTested = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (unsigned int i = 0; i < rays.size(); ++i) {
+			Ray ray = rays[i];
+			TriangleBlocks::Hit hit;
+			bool hitAny = false;
+			unsigned int firstLeaf = (unsigned int)(((uint64_t)i * leavesPerRay) % numberOfLeaves);
+			for (unsigned int j = 0; j < leavesPerRay; ++j) {
+				unsigned int leaf = (firstLeaf + j) % numberOfLeaves;
+				hitAny |= blocks.IntersectClosest(leaf, ray, hit);
+				trianglesTested += leafSizes[leaf];
+			}
+			kernelStatistics.hits += hitAny ? 1 : 0;
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration<double>(end - start).count();
+		kernelStatistics.trianglesPerSecond = seconds > 0.0 ? (double)trianglesTested / seconds : 0.0;
+	}
+	return statistics;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+#include "Tracing/TriangleBlocks.h"
+
+struct TriangleKernelStatistics {
+	TriangleKernel kernel = TriangleKernel::Scalar;
+	double trianglesPerSecond = 0.0;
+	// Rays that hit one of the triangles they were tested against. The same for every kernel
+	unsigned int hits = 0;
+};
+
+// Packs the triangles of the model into leaves of leafSize, in the order of the model, for every kernel the CPU
+// supports, and tests every ray against a window of consecutive leaves on one thread. The window is small enough to
+// stay in the cache, so that the kernels are measured and not the memory
+std::vector<TriangleKernelStatistics> MeasureTriangleKernels(const Model& model, const std::vector<Ray>& rays, unsigned int leafSize);
@@ -0,0 +1,81 @@
+#include "WideTraversal.h"
+
+#include "Graphics/Optimizations/WideBvhTree.h"
+#include "Tracing/BinaryBvhTree.h"
+#include "Tracing/TriangleBlocks.h"
+
+// Closest hit of every ray and any hit of every shadow ray through tree, and how long they took
+template <typename Tree>
+void MeasureTree(const Tree& tree, unsigned int rootIndex, const TriangleBlocks& triangles, const std::vector<Ray>& rays,
+				 const std::vector<Ray>& shadowRays, WideTraversalStatistics& statistics) {
+	auto start = std::chrono::high_resolution_clock::now();
+	for (const auto& cameraRay : rays) {
+		Ray ray = cameraRay;
+		TriangleBlocks::Hit hit;
+		bool found = tree.Intersect(ray, rootIndex,
+			[&](unsigned int primitiveOffset, unsigned int, Ray& leafRay) {
+				return triangles.IntersectClosest(triangles.FindLeaf(primitiveOffset), leafRay, hit);
+			});
+		statistics.hits += found ? 1 : 0;
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration<double>(end - start).count();
+	statistics.raysPerSecond = seconds > 0.0 ? (double)rays.size() / seconds : 0.0;
+
+	start = std::chrono::high_resolution_clock::now();
+	for (const auto& shadowRay : shadowRays) {
+		bool occluded = tree.Occluded(shadowRay, rootIndex,
+			[&](unsigned int primitiveOffset, unsigned int, const Ray& leafRay) {
+				return triangles.IntersectAny(triangles.FindLeaf(primitiveOffset), leafRay);
+			});
+		statistics.occludedShadowRays += occluded ? 1 : 0;
+	}
+	end = std::chrono::high_resolution_clock::now();
+	seconds = std::chrono::duration<double>(end - start).count();
+	statistics.shadowRaysPerSecond = seconds > 0.0 ? (double)shadowRays.size() / seconds : 0.0;
+}
+
+template <unsigned int Width, bool Quantized>
+WideTraversalStatistics MeasureWideTree(const std::vector<BVHTreeNode>& nodes, const TriangleBlocks& triangles,
+										const std::vector<Ray>& rays, const std::vector<Ray>& shadowRays) {
+	WideBvhTree<Width, Quantized> tree;
+	unsigned int rootIndex = tree.Collapse(nodes);
+
+	WideTraversalStatistics statistics;
+	statistics.tree = "BVH" + std::to_string(Width) + (Quantized ? "Quantized" : "");
+	statistics.childTests = Width == 8 && IsWideBvhAVXEnabled() ? "AVX" : "SSE";
+	statistics.numberOfNodes = (unsigned int)tree.GetNodes().size();
+	statistics.bytes = tree.GetNodes().size() * sizeof(typename WideBvhTree<Width, Quantized>::Node);
+	MeasureTree(tree, rootIndex, triangles, rays, shadowRays, statistics);
+	return statistics;
+}
+
+std::vector<WideTraversalStatistics> MeasureWideTraversal(const std::vector<BVHTreeNode>& nodes, const Model& model,
+														  const std::vector<Ray>& rays, const std::vector<Ray>& shadowRays) {
+	std::vector<TraceModelPrimitive> primitives(model.GetPrimitiveCount());
+	for (unsigned int i = 0; i < model.GetPrimitiveCount(); ++i) {
+		primitives[i] = model.GetPrimitive(i);
+	}
+	TriangleBlocks triangles;
+	triangles.Build(nodes, primitives, model.GetVertices());
+
+	std::vector<WideTraversalStatistics> statistics;
+	auto& binary = statistics.emplace_back();
+	binary.tree = "BVH2";
+	binary.childTests = "SSE";
+	binary.numberOfNodes = (unsigned int)nodes.size();
+	binary.bytes = nodes.size() * sizeof(BVHTreeNode);
+	MeasureTree(BinaryBvhTree(nodes), 0, triangles, rays, shadowRays, binary);
+
+	statistics.push_back(MeasureWideTree<4, false>(nodes, triangles, rays, shadowRays));
+	statistics.push_back(MeasureWideTree<8, false>(nodes, triangles, rays, shadowRays));
+	statistics.push_back(MeasureWideTree<4, true>(nodes, triangles, rays, shadowRays));
+	statistics.push_back(MeasureWideTree<8, true>(nodes, triangles, rays, shadowRays));
+	if (IsWideBvhAVXEnabled()) {
+		SetWideBvhAVX(false);
+		statistics.push_back(MeasureWideTree<8, false>(nodes, triangles, rays, shadowRays));
+		statistics.push_back(MeasureWideTree<8, true>(nodes, triangles, rays, shadowRays));
+		SetWideBvhAVX(true);
+	}
+	return statistics;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+#include "Tracing/Ray.h"
+
+struct WideTraversalStatistics {
+	// BVH2 for the binary tree of the build, BVH4 and BVH8 for the trees collapsed from it, with a Quantized suffix when
+	// the nodes are compressed
+	std::string tree;
+	// Instructions the children of a node are tested with: SSE, or AVX for the 8 wide trees on CPUs that have it
+	std::string childTests;
+	unsigned int numberOfNodes = 0;
+	size_t bytes = 0;
+	// Closest hits, on one thread
+	double raysPerSecond = 0.0;
+	// Rays that hit the model. The same for every tree
+	unsigned int hits = 0;
+	// Any hits of the shadow rays, on one thread
+	double shadowRaysPerSecond = 0.0;
+	unsigned int occludedShadowRays = 0;
+};
+
+// Traces the rays through the binary tree of a build and through its 4 and 8 wide versions, plain and quantized, which
+// the CPU path tracer walks single rays with when a scene asks for "TraversalWidth" and "CompressedNodes". Leaves are
+// intersected with the best triangle kernel, so the trees only differ by their nodes. With AVX, the 8 wide trees are
+// measured a second time with SSE child tests. model is the one the tree was built for, after the build reordered it
+std::vector<WideTraversalStatistics> MeasureWideTraversal(const std::vector<BVHTreeNode>& nodes, const Model& model,
+														  const std::vector<Ray>& rays, const std::vector<Ray>& shadowRays);
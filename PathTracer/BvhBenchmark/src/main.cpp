@@ -0,0 +1,412 @@
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS
+
+#include <Oblivion.h>
+#include "Graphics/Model.h"
+#include "Graphics/Optimizations/BvhTree.h"
+#include "Utils/Threading.h"
+#include "BvhQuality.h"
+#include "ModelLoading.h"
+#include "Refit.h"
+#include "TraversalCache.h"
+#include "TriangleKernels.h"
+#include "WideTraversal.h"
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+std::ofstream gLogsFile;
+
+// Version of the report layout, bumped whenever a field changes meaning
+constexpr const unsigned int ReportVersion = 8;
+
+const std::pair<const char*, BvhTree::SplitMethod> SplitMethods[] = {
+	{ "SAH", BvhTree::SplitMethod::SAH },
+	{ "MiddlePoint", BvhTree::SplitMethod::MiddlePoint },
+	{ "EqualCount", BvhTree::SplitMethod::EqualCounts },
+	{ "HLBVH", BvhTree::SplitMethod::HLBVH },
+	{ "SBVH", BvhTree::SplitMethod::SBVH },
+};
+
+const std::pair<const char*, BvhTree::NodeLayout> NodeLayouts[] = {
+	{ "DepthFirst", BvhTree::NodeLayout::DepthFirst },
+	{ "SubtreeSize", BvhTree::NodeLayout::SubtreeSize },
+	{ "HotPathFirst", BvhTree::NodeLayout::HotPathFirst },
+	{ "CacheOblivious", BvhTree::NodeLayout::CacheOblivious },
+};
+
+const std::pair<const char*, RayDistribution> RayDistributions[] = {
+	{ "primary", RayDistribution::Primary },
+	{ "diffuse", RayDistribution::Diffuse },
+};
+
+struct BenchmarkOptions {
+	std::vector<std::string> scenes;
+	std::string outputFile;
+	unsigned int restructurePasses = 0;
+	// Rays of every distribution traced through every node layout
+	unsigned int numberOfRays = 0;
+	CacheParameters cache;
+};
+
+std::optional<BenchmarkOptions> ParseCommandLine(int argc, const char* argv[]) {
+	try {
+		using namespace boost::program_options;
+
+		BenchmarkOptions options;
+
+		options_description visibleOptions{ "Allowed options" };
+		visibleOptions.add_options()
+			("help,h", "Help screen")
+			("output,o", value<std::string>(&options.outputFile)->default_value("BvhReport.json"), "File the JSON report is written to")
+			("restructure-passes", value<unsigned int>(&options.restructurePasses)->default_value(0),
+								   "Treelet restructuring passes run after every build")
+			("rays", value<unsigned int>(&options.numberOfRays)->default_value(65536),
+					 "Rays of every distribution traced to count the cache misses of the node layouts")
+			("cache-size", value<unsigned int>(&options.cache.size)->default_value(options.cache.size), "Size in bytes of the simulated cache")
+			("cache-line", value<unsigned int>(&options.cache.lineSize)->default_value(options.cache.lineSize), "Line size in bytes of the simulated cache")
+			("cache-ways", value<unsigned int>(&options.cache.associativity)->default_value(options.cache.associativity),
+						   "Associativity of the simulated cache")
+			;
+
+		options_description hiddenOptions{ "Hidden options" };
+		hiddenOptions.add_options()
+			("scenes", value<std::vector<std::string>>(&options.scenes), "Scene files or directories")
+			;
+
+		options_description cmdlineOptions;
+		cmdlineOptions.add(visibleOptions).add(hiddenOptions);
+
+		positional_options_description scenesOption;
+		scenesOption.add("scenes", -1);
+
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(cmdlineOptions).positional(scenesOption).run(), vm);
+		notify(vm);
+
+		if (vm.count("help")) {
+			std::cout << "Usage: BvhBenchmark.exe [options] [scenes or directories, Examples by default]\n" << visibleOptions << "\n";
+			return std::nullopt;
+		}
+		if (options.cache.lineSize == 0 || options.cache.associativity == 0 ||
+			options.cache.size < options.cache.lineSize * options.cache.associativity) {
+			std::cerr << "The cache must hold at least one set of lines\n";
+			return std::nullopt;
+		}
+		if (options.scenes.empty()) {
+			options.scenes.push_back("Examples");
+		}
+		return options;
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return std::nullopt;
+	}
+}
+
+// Every JSON scene given directly or found in a given directory, sorted so that reports of different versions line up
+std::vector<std::filesystem::path> FindScenes(const std::vector<std::string>& inputs) {
+	std::vector<std::filesystem::path> scenes;
+	for (const auto& input : inputs) {
+		if (std::filesystem::is_directory(input)) {
+			for (const auto& entry : std::filesystem::directory_iterator(input)) {
+				if (entry.is_regular_file() && entry.path().extension() == ".json") {
+					scenes.push_back(std::filesystem::absolute(entry.path()));
+				}
+			}
+		} else {
+			EVALUATE(std::filesystem::exists(input), "Scene ", input, " doesn't exist");
+			scenes.push_back(std::filesystem::absolute(input));
+		}
+	}
+	std::sort(scenes.begin(), scenes.end());
+	return scenes;
+}
+
+std::string EscapeJSON(const std::string& text) {
+	std::string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			escaped += '\\';
+		}
+		escaped += c;
+	}
+	return escaped;
+}
+
+const std::pair<const char*, TraversalQuery> TraversalQueries[] = {
+	{ "closestHit", TraversalQuery::ClosestHit },
+	{ "anyHit", TraversalQuery::AnyHit },
+};
+
+struct LayoutReport {
+	std::string name;
+	// One per ray distribution
+	std::vector<TraversalCacheStatistics> statistics;
+};
+
+void WriteTraversalStatistics(std::ostream& stream, const TraversalCacheStatistics& statistics) {
+	stream << "{ \"nodesPerRay\": " << statistics.nodesPerRay << ", \"primitivesPerRay\": " << statistics.primitivesPerRay
+		<< ", \"linesPerRay\": " << statistics.linesPerRay << ", \"missesPerRay\": " << statistics.missesPerRay
+		<< ", \"hitRatio\": " << statistics.hitRatio << " }";
+}
+
+void WriteBuildReport(std::ostream& stream, const char* splitMethod, double buildMilliseconds, const BvhQuality& quality,
+					  const std::vector<LayoutReport>& layouts, const std::vector<TraversalCacheStatistics>& shadowRays,
+					  const std::vector<WideTraversalStatistics>& wideTraversal, const RefitStatistics& refit) {
+	stream << "            {\n";
+	stream << "              \"splitMethod\": \"" << splitMethod << "\",\n";
+	stream << "              \"buildMilliseconds\": " << buildMilliseconds << ",\n";
+	stream << "              \"nodes\": " << quality.numberOfNodes << ",\n";
+	stream << "              \"leaves\": " << quality.numberOfLeaves << ",\n";
+	stream << "              \"references\": " << quality.numberOfReferences << ",\n";
+	stream << "              \"maxDepth\": " << quality.maxDepth << ",\n";
+	stream << "              \"sahCost\": " << quality.sahCost << ",\n";
+	stream << "              \"endPointOverlap\": " << quality.endPointOverlap << ",\n";
+	stream << "              \"leafSizeHistogram\": [";
+	for (unsigned int i = 0; i < quality.leafSizeHistogram.size(); ++i) {
+		stream << (i == 0 ? "" : ", ") << quality.leafSizeHistogram[i];
+	}
+	stream << "],\n";
+	stream << "              \"layouts\": [\n";
+	for (unsigned int i = 0; i < layouts.size(); ++i) {
+		stream << "                {\n";
+		stream << "                  \"layout\": \"" << layouts[i].name << "\",\n";
+		for (unsigned int j = 0; j < std::size(RayDistributions); ++j) {
+			stream << "                  \"" << RayDistributions[j].first << "\": ";
+			WriteTraversalStatistics(stream, layouts[i].statistics[j]);
+			stream << (j + 1 < std::size(RayDistributions) ? ",\n" : "\n");
+		}
+		stream << "                }" << (i + 1 < layouts.size() ? ",\n" : "\n");
+	}
+	stream << "              ],\n";
+	stream << "              \"shadowRays\": {\n";
+	for (unsigned int i = 0; i < std::size(TraversalQueries); ++i) {
+		stream << "                \"" << TraversalQueries[i].first << "\": ";
+		WriteTraversalStatistics(stream, shadowRays[i]);
+		stream << (i + 1 < std::size(TraversalQueries) ? ",\n" : "\n");
+	}
+	stream << "              },\n";
+	stream << "              \"wideTraversal\": [\n";
+	for (unsigned int i = 0; i < wideTraversal.size(); ++i) {
+		stream << "                { \"tree\": \"" << wideTraversal[i].tree << "\", \"childTests\": \"" << wideTraversal[i].childTests
+			<< "\", \"nodes\": " << wideTraversal[i].numberOfNodes
+			<< ", \"bytes\": " << wideTraversal[i].bytes << ", \"raysPerSecond\": " << wideTraversal[i].raysPerSecond
+			<< ", \"hits\": " << wideTraversal[i].hits << ", \"shadowRaysPerSecond\": " << wideTraversal[i].shadowRaysPerSecond
+			<< ", \"occludedShadowRays\": " << wideTraversal[i].occludedShadowRays << " }" << (i + 1 < wideTraversal.size() ? ",\n" : "\n");
+	}
+	stream << "              ],\n";
+	stream << "              \"refit\": { \"refitMilliseconds\": " << refit.refitMilliseconds << ", \"rebuildMilliseconds\": "
+		<< refit.rebuildMilliseconds << ", \"refitSahCost\": " << refit.refitSahCost << ", \"rebuildSahCost\": " << refit.rebuildSahCost
+		<< ", \"mismatchedRays\": " << refit.mismatchedRays << " }\n";
+	stream << "            }";
+}
+
+// Traces the rays through every node layout of the tree. HotPathFirst is measured twice: ordered by surface area, and by
+// the visits of another set of rays of the same distributions
+std::vector<LayoutReport> BenchmarkLayouts(BvhTree& tree, Model& model, const std::vector<std::vector<Ray>>& rays,
+										   const std::vector<std::vector<Ray>>& trainingRays, const CacheParameters& cache) {
+	std::vector<LayoutReport> reports;
+	auto MeasureLayout = [&](const std::string& name, BvhTree& layoutTree) {
+		auto& report = reports.emplace_back();
+		report.name = name;
+		for (const auto& distributionRays : rays) {
+			report.statistics.push_back(MeasureTraversalCache(layoutTree.GetNodes(), model, distributionRays, cache));
+		}
+	};
+
+	for (const auto& [name, layout] : NodeLayouts) {
+		BvhTree layoutTree = tree;
+		layoutTree.ApplyLayout(layout);
+		MeasureLayout(name, layoutTree);
+	}
+
+	std::vector<unsigned int> visitCounts;
+	for (const auto& distributionRays : trainingRays) {
+		MeasureTraversalCache(tree.GetNodes(), model, distributionRays, cache, &visitCounts);
+	}
+	BvhTree layoutTree = tree;
+	layoutTree.ApplyLayout(BvhTree::NodeLayout::HotPathFirst, visitCounts);
+	MeasureLayout("HotPathFirstMeasured", layoutTree);
+
+	return reports;
+}
+
+// Builds every model of the scene with every split method, with the leaf size and build parameters the scene asks for
+void BenchmarkScene(std::ostream& stream, const std::filesystem::path& scenePath, const BenchmarkOptions& options) {
+	boost::property_tree::ptree pt;
+	boost::property_tree::json_parser::read_json(scenePath.string(), pt);
+
+	// Model paths are relative to the scene
+	auto oldCwd = std::filesystem::current_path();
+	std::filesystem::current_path(scenePath.parent_path());
+
+	stream << "    {\n";
+	stream << "      \"scene\": \"" << EscapeJSON(scenePath.filename().string()) << "\",\n";
+	stream << "      \"models\": [\n";
+
+	auto acceleratedStructuresOptional = pt.get_child_optional("AcceleratedModel");
+	bool firstModel = true;
+	if (acceleratedStructuresOptional.has_value()) {
+		for (const auto& it : *acceleratedStructuresOptional) {
+			const auto& currentModel = it.second;
+			auto path = currentModel.get_child("Path").get_value<std::string>();
+			auto maxPrimitivesInNode = currentModel.get_child("MaxPrimitivesInNode").get_value<unsigned int>();
+
+			BvhTree::BuildParameters buildParameters;
+			buildParameters.numberOfBuckets = currentModel.get<unsigned int>("SAHBuckets", buildParameters.numberOfBuckets);
+			buildParameters.traversalCost = currentModel.get<float>("SAHTraversalCost", buildParameters.traversalCost);
+			buildParameters.spatialSplitAlpha = currentModel.get<float>("SBVHAlpha", buildParameters.spatialSplitAlpha);
+			buildParameters.spatialSplitBudget = currentModel.get<float>("SBVHDuplicationBudget", buildParameters.spatialSplitBudget);
+			buildParameters.treeletSize = currentModel.get<unsigned int>("TreeletSize", buildParameters.treeletSize);
+			buildParameters.preSplitThreshold = currentModel.get<float>("PreSplitThreshold", buildParameters.preSplitThreshold);
+			buildParameters.preSplitBudget = currentModel.get<float>("PreSplitBudget", buildParameters.preSplitBudget);
+			buildParameters.restructurePasses = options.restructurePasses;
+
+			std::cerr << "Loading " << path << "\n";
+			const Model model(path);
+
+			stream << (firstModel ? "" : ",\n");
+			firstModel = false;
+			stream << "        {\n";
+			stream << "          \"path\": \"" << EscapeJSON(path) << "\",\n";
+			stream << "          \"primitives\": " << model.GetPrimitiveCount() << ",\n";
+			stream << "          \"maxPrimitivesInNode\": " << maxPrimitivesInNode << ",\n";
+
+			auto loading = MeasureModelLoading(path);
+			stream << "          \"loading\": [\n";
+			for (unsigned int i = 0; i < loading.size(); ++i) {
+				std::cerr << "  " << loading[i].name << " import: " << loading[i].milliseconds << " ms, " << loading[i].primitives << " primitives\n";
+				stream << "            { \"importer\": \"" << loading[i].name << "\", \"milliseconds\": " << loading[i].milliseconds
+					<< ", \"primitives\": " << loading[i].primitives << " }" << (i + 1 < loading.size() ? ",\n" : "\n");
+			}
+			stream << "          ],\n";
+
+			// The same rays go through every build
+			Oblivion::BoundingBox modelBB;
+			for (unsigned int j = 0; j < model.GetPrimitiveCount(); ++j) {
+				modelBB |= model.GetPrimitiveBoundingBox(j);
+			}
+			std::vector<std::vector<Ray>> rays, trainingRays;
+			for (unsigned int j = 0; j < std::size(RayDistributions); ++j) {
+				rays.push_back(GenerateRays(modelBB, RayDistributions[j].second, options.numberOfRays, 2 * j));
+				trainingRays.push_back(GenerateRays(modelBB, RayDistributions[j].second, options.numberOfRays, 2 * j + 1));
+			}
+			auto shadowRays = GenerateRays(modelBB, RayDistribution::Shadow, options.numberOfRays, 2 * (unsigned int)std::size(RayDistributions));
+			std::vector<Ray> traversalRays;
+			for (const auto& distributionRays : rays) {
+				traversalRays.insert(traversalRays.end(), distributionRays.begin(), distributionRays.end());
+			}
+
+			auto kernels = MeasureTriangleKernels(model, rays[0], maxPrimitivesInNode);
+			stream << "          \"triangleKernels\": [\n";
+			for (unsigned int i = 0; i < kernels.size(); ++i) {
+				std::cerr << "  " << TriangleBlocks::GetKernelName(kernels[i].kernel) << " kernel: " << kernels[i].trianglesPerSecond / 1e6
+					<< " M triangles/s\n";
+				stream << "            { \"kernel\": \"" << TriangleBlocks::GetKernelName(kernels[i].kernel) << "\", \"width\": "
+					<< TriangleBlocks::GetKernelWidth(kernels[i].kernel) << ", \"trianglesPerSecond\": " << kernels[i].trianglesPerSecond
+					<< ", \"hits\": " << kernels[i].hits << " }" << (i + 1 < kernels.size() ? ",\n" : "\n");
+			}
+			stream << "          ],\n";
+
+			stream << "          \"builds\": [\n";
+			for (unsigned int i = 0; i < std::size(SplitMethods); ++i) {
+				// Builds reorder the primitives, so every one starts from a fresh copy
+				Model builtModel = model;
+				auto start = std::chrono::high_resolution_clock::now();
+				auto tree = BvhTree::Create(&builtModel, SplitMethods[i].second, maxPrimitivesInNode, 65536, buildParameters);
+				auto end = std::chrono::high_resolution_clock::now();
+				double buildMilliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+
+				auto quality = MeasureBvhQuality(tree->GetNodes(), builtModel, buildParameters.traversalCost);
+				std::cerr << "  " << SplitMethods[i].first << ": " << buildMilliseconds << " ms, SAH " << quality.sahCost
+					<< ", EPO " << quality.endPointOverlap << "\n";
+
+				auto layouts = BenchmarkLayouts(*tree, builtModel, rays, trainingRays, options.cache);
+				for (const auto& layout : layouts) {
+					std::cerr << "    " << layout.name << ": " << layout.statistics[0].missesPerRay << " primary, "
+						<< layout.statistics[1].missesPerRay << " diffuse misses per ray\n";
+				}
+
+				// Shadow rays only need to know whether anything is in the way
+				std::vector<TraversalCacheStatistics> shadowStatistics;
+				for (const auto& [name, query] : TraversalQueries) {
+					shadowStatistics.push_back(MeasureTraversalCache(tree->GetNodes(), builtModel, shadowRays, options.cache, nullptr, query));
+				}
+				std::cerr << "    Shadow rays: " << shadowStatistics[0].nodesPerRay << " closest hit, " << shadowStatistics[1].nodesPerRay
+					<< " any hit nodes per ray\n";
+
+				// The rays of every distribution and the shadow rays through the trees the CPU path tracer can walk
+				auto wideTraversal = MeasureWideTraversal(tree->GetNodes(), builtModel, traversalRays, shadowRays);
+				for (const auto& wideTree : wideTraversal) {
+					std::cerr << "    " << wideTree.tree << " (" << wideTree.childTests << "): " << wideTree.raysPerSecond / 1e6 << " M rays/s, "
+						<< wideTree.shadowRaysPerSecond / 1e6 << " M shadow rays/s, " << wideTree.bytes << " bytes\n";
+				}
+
+				// Animated models refit their trees instead of building them again, so the refit has to find the same hits.
+				// Primary rays start outside the model
+				auto refit = MeasureRefit(*tree, builtModel, model, SplitMethods[i].second, maxPrimitivesInNode, buildParameters, rays[0]);
+				std::cerr << "    Refit: " << refit.refitMilliseconds << " ms, SAH " << refit.refitSahCost << ", rebuild: "
+					<< refit.rebuildMilliseconds << " ms, SAH " << refit.rebuildSahCost << ", " << refit.mismatchedRays << " mismatched rays\n";
+
+				WriteBuildReport(stream, SplitMethods[i].first, buildMilliseconds, quality, layouts, shadowStatistics, wideTraversal, refit);
+				stream << (i + 1 < std::size(SplitMethods) ? ",\n" : "\n");
+			}
+			stream << "          ]\n";
+			stream << "        }";
+		}
+	}
+
+	stream << "\n      ]\n";
+	stream << "    }";
+
+	std::filesystem::current_path(oldCwd);
+}
+
+int main(int argc, const char* argv[]) {
+
+#ifdef LOG_TO_FILE
+	gLogsFile.open("BvhBenchmarkLogs.txt");
+	EVALUATESHOW(gLogsFile.is_open(), "Unable to open BvhBenchmarkLogs.txt for writing");
+#endif
+
+	auto options = ParseCommandLine(argc, argv);
+	if (!options.has_value()) {
+		return 0;
+	}
+
+	int result = 0;
+	try {
+		auto scenes = FindScenes(options->scenes);
+		auto outputFile = std::filesystem::absolute(options->outputFile);
+
+		std::ostringstream stream;
+		stream << "{\n";
+		stream << "  \"version\": " << ReportVersion << ",\n";
+		stream << "  \"appVersion\": \"" << APP_VERSION << "\",\n";
+		stream << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n";
+		stream << "  \"triangleKernel\": \"" << TriangleBlocks::GetKernelName(TriangleBlocks::GetBestKernel()) << "\",\n";
+		stream << "  \"restructurePasses\": " << options->restructurePasses << ",\n";
+		stream << "  \"raysPerDistribution\": " << options->numberOfRays << ",\n";
+		stream << "  \"cache\": { \"size\": " << options->cache.size << ", \"lineSize\": " << options->cache.lineSize
+			<< ", \"associativity\": " << options->cache.associativity << " },\n";
+		stream << "  \"scenes\": [\n";
+		for (unsigned int i = 0; i < scenes.size(); ++i) {
+			std::cerr << "Benchmarking " << scenes[i].string() << "\n";
+			BenchmarkScene(stream, scenes[i], *options);
+			stream << (i + 1 < scenes.size() ? ",\n" : "\n");
+		}
+		stream << "  ]\n";
+		stream << "}\n";
+
+		std::ofstream output(outputFile);
+		EVALUATE(output.is_open(), "Unable to open ", outputFile.string(), " for writing");
+		output << stream.str();
+		std::cerr << "Report written to " << outputFile.string() << "\n";
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		result = 1;
+	}
+
+	Threading::Reset();
+	return result;
+}
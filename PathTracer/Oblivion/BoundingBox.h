@@ -100,6 +100,23 @@ namespace Oblivion {
 			return *this;
 		}
 
+		BoundingBox operator & (const BoundingBox& rhs) const {
+			BoundingBox bb;
+			bb.minPoint.x = std::max(minPoint.x, rhs.minPoint.x);
+			bb.minPoint.y = std::max(minPoint.y, rhs.minPoint.y);
+			bb.minPoint.z = std::max(minPoint.z, rhs.minPoint.z);
+
+			bb.maxPoint.x = std::min(maxPoint.x, rhs.maxPoint.x);
+			bb.maxPoint.y = std::min(maxPoint.y, rhs.maxPoint.y);
+			bb.maxPoint.z = std::min(maxPoint.z, rhs.maxPoint.z);
+
+			return bb;
+		}
+
+		bool IsEmpty() const {
+			return minPoint.x > maxPoint.x || minPoint.y > maxPoint.y || minPoint.z > maxPoint.z;
+		}
+
 	};
 
 }
\ No newline at end of file
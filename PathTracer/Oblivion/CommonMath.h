@@ -2,11 +2,8 @@
 
 #include <cstdint>
 #include <functional>
+#include <stdexcept>
 #include <DirectXMath.h>
-#include <directxcollision.h>
-
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h> // For HRESULT
 
 namespace Math {
     enum class Axis {
@@ -128,7 +125,7 @@ namespace Math {
             case Math::Axis::Z:
                 return vct.z;
             default:
-                throw std::exception("What kind of axis did you pass?");
+                throw std::runtime_error("What kind of axis did you pass?");
         }
     }
 }
@@ -1,6 +1,11 @@
 #pragma once
 
 #include <exception>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
 #include <comdef.h>
 #include <corecrt_wstring.h>
 #include "Conversions.h"
@@ -54,17 +59,17 @@ template <class ... Args>
 constexpr void getInitializationError( Args... arg ) {
 	return appendToString( arg );
 }
+#endif // _WIN32
 
 
 #define THROW_ERROR(...) {char message[1024];\
-sprintf_s(message, "File: %s, line: %d; Error: ", __FILE__, __LINE__);\
-sprintf_s(message + strlen(message),sizeof(message),__VA_ARGS__);\
-std::exception error(message);\
-throw error;}
+snprintf(message, sizeof(message), "File: %s, line: %d; Error: ", __FILE__, __LINE__);\
+snprintf(message + strlen(message), sizeof(message) - strlen(message), __VA_ARGS__);\
+throw std::runtime_error(message);}
 
 #define CSTR_MESSAGE(...) Oblivion::appendToString(__VA_ARGS__).c_str()
 #define EVALUATE(expr, ...) if (!(expr)) {\
-throw std::exception(Oblivion::appendToString("Error occured in file ", __FILE__, " at line ", __LINE__, ": ", __VA_ARGS__).c_str()); }
+throw std::runtime_error(Oblivion::appendToString("Error occured in file ", __FILE__, " at line ", __LINE__, ": ", __VA_ARGS__).c_str()); }
 
 #define EVALUATEBK(expr, ...) if (!(expr)) {\
 Oblivion::DebugPrintLine("Error occured in file ", __FILE__, " at line ", __LINE__, ": ", __VA_ARGS__);\
@@ -104,12 +109,12 @@ try {\
 expression;\
 } catch (const std::exception& e) {\
 char message[1024];\
-sprintf_s(message, sizeof(message), __VA_ARGS__); \
+snprintf(message, sizeof(message), __VA_ARGS__); \
 Oblivion::DebugPrintLine("Error occured when runnin expression located at line: ", __LINE__, ", file: ", __FILE__, ";\nError message: ", e.what());\
 Oblivion::DebugPrintLine("Info message: ", message);\
 } catch (...) {\
 char message[1024];\
-sprintf_s(message, sizeof(message), __VA_ARGS__); \
+snprintf(message, sizeof(message), __VA_ARGS__); \
 Oblivion::DebugPrintLine("Unexpected error occured when runnin expression located at line: ", __LINE__, ", file: ", __FILE__);\
 Oblivion::DebugPrintLine("Info message: ", message);\
 }\
@@ -129,8 +134,10 @@ Oblivion::DebugPrintLine("Info message: ", message);\
 }()
 
 
+#if defined(_WIN32)
 inline void ThrowIfFailed(HRESULT hr) {
 	if (FAILED(hr)) {
 		throw Exceptions::FailedHResultException(hr);
 	}
 }
+#endif // _WIN32
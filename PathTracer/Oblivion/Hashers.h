@@ -3,12 +3,13 @@
 #include <cstdint>
 #include <functional>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h> // For HRESULT
 #include <d3d12.h>
+#endif
 
 
-// Hashers for view descriptions.
 namespace std {
     // Source: https://stackoverflow.com/questions/2590677/how-do-i-combine-hash-values-in-c0x
     template <typename T>
@@ -17,6 +18,9 @@ namespace std {
         seed ^= hasher( v ) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
     }
 
+#if defined(_WIN32)
+    // Hashers for view descriptions.
+
     template<>
     struct hash<D3D12_SHADER_RESOURCE_VIEW_DESC> {
         std::size_t operator()( const D3D12_SHADER_RESOURCE_VIEW_DESC& srvDesc ) const noexcept
@@ -141,4 +145,5 @@ namespace std {
             return seed;
         }
     };
+#endif // _WIN32
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#if defined(_WIN32)
 // Windows stuff
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
@@ -23,6 +24,10 @@ using Microsoft::WRL::ComPtr;
 #include <directxcollision.h>
 #include <d3dcompiler.h>
 #include <wincodec.h>
+#else
+// Only the CPU side builds on other platforms, which needs nothing but the portable DirectXMath headers
+#include <DirectXMath.h>
+#endif
 
 
 // Standard stuff
@@ -48,6 +53,10 @@ using Microsoft::WRL::ComPtr;
 #include <iostream>
 #include <filesystem>
 #include <random>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cfloat>
 
 
 // My stuff
@@ -76,7 +85,12 @@ using Microsoft::WRL::ComPtr;
 #define _128MiB _MiB(128)
 #define _256MiB _MiB(256)
 
+#if defined(_MSC_VER)
 #define OBLIVION_ALIGN(x) __declspec(align(x))
+#else
+// The structures shared with the shaders are multiples of 16 bytes by their members, so only their alignment is lost
+#define OBLIVION_ALIGN(x)
+#endif
 
 #define STR1(x) #x
 #define STR(x) STR1(x)
@@ -84,7 +98,9 @@ using Microsoft::WRL::ComPtr;
 #define WSTR(x) WSTR1(x)
 #define NAME_D3D12_OBJECT(x) x->SetName( WSTR(__FILE__ "(" STR(__LINE__) "): " L#x) )
 
+#ifndef ENABLE_LOGS
 #define ENABLE_LOGS 0
+#endif
 #define LOG_TO_FILE 1
 
 extern std::ofstream gLogsFile;
@@ -101,7 +117,7 @@ namespace Oblivion {
     constexpr const wchar_t* wAPPLICATION_NAME = L"Game";
     constexpr const wchar_t* wENGINE_NAME = L"Oblivion";
     
-    constexpr const UINT MIN_WINDOW_SIZE = 200;
+    constexpr const unsigned int MIN_WINDOW_SIZE = 200;
 
 #pragma region appendToString()
 
@@ -144,7 +160,7 @@ namespace Oblivion {
 #pragma endregion
 
     template <typename type, typename... Args>
-    constexpr auto DebugPrint(const type& arg, Args... args) {
+    constexpr auto DebugPrint([[maybe_unused]] const type& arg, [[maybe_unused]] Args... args) {
 #if DEBUG || _DEBUG || ENABLE_LOGS
         auto outputString = appendToString(arg, args...);
 #if defined _USE_OUPUT_DEBUG_STRING_
@@ -159,7 +175,7 @@ namespace Oblivion {
 #endif // DEBUG || _DEBUG || ENABLE_LOGS
     }
     template <typename type, typename... Args>
-    constexpr auto DebugPrintLine(const type& arg, Args... args) {
+    constexpr auto DebugPrintLine([[maybe_unused]] const type& arg, [[maybe_unused]] Args... args) {
 #if DEBUG || _DEBUG || ENABLE_LOGS
         auto outputString = appendToString(arg, args..., '\n');
 #if defined _USE_OUPUT_DEBUG_STRING_
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <istream>
+#include <cctype>
 
 namespace DirectX {
     template <class IStream>
@@ -32,4 +33,22 @@ namespace DirectX {
         }
         return stream;
     }
+
+    // Reads the 12 values of a 3x4 matrix, row by row. They can be separated by commas or by spaces
+    template <class IStream>
+    inline IStream& operator >> (IStream& stream, DirectX::XMFLOAT3X4& data) {
+        auto SkipSeparators = [&stream]() {
+            while (std::isspace(stream.peek()) || stream.peek() == ',' || stream.peek() == '(' || stream.peek() == ')') {
+                stream.get();
+            }
+        };
+        for (unsigned int row = 0; row < 3; ++row) {
+            for (unsigned int column = 0; column < 4; ++column) {
+                SkipSeparators();
+                stream >> data.m[row][column];
+            }
+        }
+        SkipSeparators();
+        return stream;
+    }
 }
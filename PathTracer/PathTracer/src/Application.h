@@ -8,19 +8,7 @@
 #include "Graphics/Texture.h"
 #include "Graphics/SceneLoader.h"
 #include "Gameplay/Camera.h"
-
-enum class OblivionMode {
-    Debug, None
-};
-
-struct OblivionInitialization {
-    unsigned int numSamples;
-    OblivionMode applicationMode;
-    std::vector<std::string> inputFiles;
-    std::string outputFile;
-    std::string configFile;
-    float maxSecondsPerFrame;
-};
+#include "OblivionInitialization.h"
 
 
 class Application : public ISingletone<Application> {
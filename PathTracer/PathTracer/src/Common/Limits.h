@@ -8,6 +8,11 @@
 #define MODEL_PRIMITIVE_TYPE 1
 #define SCENE_PRIMITIVE_TYPE 2
 
+// The axis of an interior BVH node is stored in the low bits. The first child is the one below the split, unless
+// BVH_FIRST_CHILD_ABOVE is set because the node layout swapped the children
+#define BVH_AXIS_MASK 3
+#define BVH_FIRST_CHILD_ABOVE 4
+
 #define MAX_TEXTURE_COLUMNS 16384
 #define MAX_TEXTURES_IN_TEXTURE_ARRAY 2048
 
@@ -0,0 +1,66 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include <DirectXPackedVector.h>
+#include "ShaderObjects.h"
+
+// TraceVertex in 20 bytes instead of 48, for the CPU tracer only, as the shaders read TraceVertex as float4 texels. The
+// normal is folded onto an octahedron and kept as two 16 bit fixed point numbers, a few thousandths of a degree apart, and
+// the texture coordinates as two halfs, as only xy is ever sampled. The material comes from the scene primitive. Zero
+// normals can't be encoded and come back as +z
+struct CompactTraceVertex {
+	DirectX::XMFLOAT3 position;
+	int16_t normal[2];
+	DirectX::PackedVector::HALF texCoords[2];
+};
+
+static_assert(sizeof(CompactTraceVertex) == 20, "CompactTraceVertex must stay packed");
+
+inline float SignNotZero(float value) {
+	return value >= 0.0f ? 1.0f : -1.0f;
+}
+
+inline int16_t EncodeSnorm16(float value) {
+	return (int16_t)std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+inline CompactTraceVertex CompactVertex(const TraceVertex& vertex) {
+	CompactTraceVertex compact;
+	compact.position = vertex.position;
+
+	const auto& n = vertex.normal;
+	float length = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+	float x = length > 0.0f ? n.x / length : 0.0f;
+	float y = length > 0.0f ? n.y / length : 0.0f;
+	// The lower half of the octahedron is unfolded over the corners of the square
+	if (n.z < 0.0f) {
+		float foldedX = (1.0f - std::fabs(y)) * SignNotZero(x);
+		y = (1.0f - std::fabs(x)) * SignNotZero(y);
+		x = foldedX;
+	}
+	compact.normal[0] = EncodeSnorm16(x);
+	compact.normal[1] = EncodeSnorm16(y);
+
+	compact.texCoords[0] = DirectX::PackedVector::XMConvertFloatToHalf(vertex.texCoords.x);
+	compact.texCoords[1] = DirectX::PackedVector::XMConvertFloatToHalf(vertex.texCoords.y);
+	return compact;
+}
+
+// Normalized
+inline DirectX::XMVECTOR DecodeNormal(const CompactTraceVertex& vertex) {
+	float x = vertex.normal[0] * (1.0f / 32767.0f);
+	float y = vertex.normal[1] * (1.0f / 32767.0f);
+	float z = 1.0f - std::fabs(x) - std::fabs(y);
+	if (z < 0.0f) {
+		float unfoldedX = (1.0f - std::fabs(y)) * SignNotZero(x);
+		y = (1.0f - std::fabs(x)) * SignNotZero(y);
+		x = unfoldedX;
+	}
+	return DirectX::XMVector3Normalize(DirectX::XMVectorSet(x, y, z, 0.0f));
+}
+
+inline DirectX::XMFLOAT2 DecodeTexCoords(const CompactTraceVertex& vertex) {
+	return DirectX::XMFLOAT2(DirectX::PackedVector::XMConvertHalfToFloat(vertex.texCoords[0]),
+							 DirectX::PackedVector::XMConvertHalfToFloat(vertex.texCoords[1]));
+}
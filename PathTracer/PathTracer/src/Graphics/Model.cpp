@@ -4,46 +4,49 @@
 #include "assimp/Importer.hpp"
 #include "assimp/postprocess.h"
 
-Oblivion::BoundingBox ModelPrimitive::GetBoundingBox() {
-	return boundingBox;
+Model::Model(const std::string& path, ModelImporter importer) {
+	if (importer == ModelImporter::Native) {
+		auto extension = std::filesystem::path(path).extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](char c) { return (char)std::tolower(c); });
+		if (extension == ".obj" || extension == ".stl") {
+			if (TRY_RETURN_VALUE(LoadNative(path, extension == ".obj"), true, false)) {
+				return;
+			}
+			Oblivion::DebugPrintLine("Falling back to Assimp for ", path);
+			mIndices.clear();
+			mPrimitiveBounds.clear();
+			mVertices.clear();
+		}
+	}
+	LoadWithAssimp(path);
 }
 
-Model::Model(const std::string& path) {
+void Model::LoadWithAssimp(const std::string& path) {
 	Oblivion::DebugPrintLine("Loading model from ", path);
 
 	auto objectImporter = std::make_shared<Assimp::Importer>();
-	auto scene = objectImporter->ReadFile(path,
-										  // aiPostProcessSteps::aiProcess_CalcTangentSpace |
-										  aiPostProcessSteps::aiProcess_GenNormals |
-										  aiPostProcessSteps::aiProcess_FlipWindingOrder |
-										  aiPostProcessSteps::aiProcess_MakeLeftHanded |
-										  aiPostProcessSteps::aiProcess_Triangulate | aiProcess_SortByPType | 
-										  aiPostProcessSteps::aiProcess_OptimizeMeshes);
+	auto scene = objectImporter->ReadFile(path, GetImportFlags());
 	EVALUATE(scene, "Unable to load scene from ", path);
 
-	scene->mRootNode;
-
 	ProcessMesh(scene, scene->mRootNode,
 				[&](const aiMesh* currentMesh) {
 					auto indexOffset = CopyVertices(currentMesh);
 					BuildPrimitives(currentMesh, indexOffset);
 					
 					Oblivion::DebugPrintLine("Processing mesh ", currentMesh->mName.C_Str());
-
-					for (unsigned int i = 0; i < currentMesh->mNumFaces; ++i) {
-						auto currentFace = currentMesh->mFaces[i];
-						mRenderLines.emplace_back(currentMesh->mVertices[currentFace.mIndices[0]],
-												  currentMesh->mVertices[currentFace.mIndices[1]], DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
-						mRenderLines.emplace_back(currentMesh->mVertices[currentFace.mIndices[1]],
-												  currentMesh->mVertices[currentFace.mIndices[2]], DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
-						mRenderLines.emplace_back(currentMesh->mVertices[currentFace.mIndices[0]],
-												  currentMesh->mVertices[currentFace.mIndices[2]], DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
-					}
-
 				});
 
 }
 
+unsigned int Model::GetImportFlags() {
+	return // aiPostProcessSteps::aiProcess_CalcTangentSpace |
+		aiPostProcessSteps::aiProcess_GenNormals |
+		aiPostProcessSteps::aiProcess_FlipWindingOrder |
+		aiPostProcessSteps::aiProcess_MakeLeftHanded |
+		aiPostProcessSteps::aiProcess_Triangulate | aiProcess_SortByPType |
+		aiPostProcessSteps::aiProcess_OptimizeMeshes;
+}
+
 unsigned int Model::CopyVertices(const struct aiMesh* mesh) {
 
 	unsigned int initialSize = (unsigned int)mVertices.size();
@@ -53,7 +56,8 @@ unsigned int Model::CopyVertices(const struct aiMesh* mesh) {
 		TraceVertex newVertex;
 		newVertex.position = mesh->mVertices[i];
 		newVertex.normal = mesh->mNormals[i];
-		newVertex.materialIndex = mesh->mMaterialIndex;
+		newVertex.pad0 = 0.0f;
+		newVertex.pad1 = 0.0f;
 
 		DirectX::XMFLOAT4 texCoords;
 		if (mesh->HasTextureCoords(0)) {
@@ -75,8 +79,9 @@ unsigned int Model::CopyVertices(const struct aiMesh* mesh) {
 
 void Model::BuildPrimitives(const struct aiMesh* mesh, unsigned int indexOffset) {
 
-	auto initialSize = mPrimitives.size();
-	mPrimitives.reserve(initialSize + mesh->mNumFaces);
+	auto initialSize = mPrimitiveBounds.size();
+	mIndices.reserve(3 * (initialSize + mesh->mNumFaces));
+	mPrimitiveBounds.reserve(initialSize + mesh->mNumFaces);
 
 	for (unsigned int i = 0; i < mesh->mNumFaces; ++i) {
 		auto& currentFace = mesh->mFaces[i];
@@ -84,15 +89,15 @@ void Model::BuildPrimitives(const struct aiMesh* mesh, unsigned int indexOffset)
 
 		if (currentFace.mNumIndices == 3) {
 			// Normal case
-			auto primitive = std::make_shared<ModelPrimitive>();
+			Oblivion::BoundingBox bb;
 			for (unsigned int j = 0; j < currentFace.mNumIndices; ++j) {
 				auto& currentIndex = currentFace.mIndices[j];
 
-				((ModelPrimitive*)primitive.get())->indices[j] = currentIndex + indexOffset;
-				((ModelPrimitive*)primitive.get())->boundingBox |= mesh->mVertices[currentIndex];
+				mIndices.push_back(currentIndex + indexOffset);
+				bb |= mesh->mVertices[currentIndex];
 			}
 
-			mPrimitives.push_back(primitive);
+			mPrimitiveBounds.push_back(bb);
 		}
 	}
 
@@ -109,18 +114,108 @@ void Model::ProcessMesh(const aiScene* scene, const aiNode* rootNode, std::funct
 	}
 }
 
-std::vector<std::shared_ptr<ModelPrimitive>>& Model::GetPrimitives() {
-	return mPrimitives;
+void Model::SetVertexPositions(const std::vector<DirectX::XMFLOAT3>& positions) {
+	EVALUATE(positions.size() == mVertices.size(), "Expected ", mVertices.size(), " positions, got ", positions.size());
+	for (size_t i = 0; i < positions.size(); ++i) {
+		mVertices[i].position = positions[i];
+	}
+	for (size_t i = 0; i < mPrimitiveBounds.size(); ++i) {
+		Oblivion::BoundingBox bb;
+		for (unsigned int j = 0; j < 3; ++j) {
+			bb |= mVertices[mIndices[3 * i + j]].position;
+		}
+		mPrimitiveBounds[i] = bb;
+	}
+	mRenderLines.clear();
+}
+
+unsigned int Model::GetPrimitiveCount() const {
+	return (unsigned int)mPrimitiveBounds.size();
+}
+
+Oblivion::BoundingBox Model::GetPrimitiveBoundingBox(unsigned int index) const {
+	return mPrimitiveBounds[index];
+}
+
+ModelPrimitive Model::GetPrimitive(unsigned int index) const {
+	return ModelPrimitive{ { mIndices[3 * index], mIndices[3 * index + 1], mIndices[3 * index + 2] } };
+}
+
+void Model::ReorderPrimitives(const std::vector<unsigned int>& order) {
+	// Spatial splits may reference the same primitive from more than one leaf
+	EVALUATE(order.size() >= mPrimitiveBounds.size(), "Expected at least as many new primitives (",
+			 mPrimitiveBounds.size(), "), but there are only ", order.size());
+
+	std::vector<unsigned int> indices(3 * order.size());
+	std::vector<Oblivion::BoundingBox> primitiveBounds(order.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		EVALUATE(order[i] < mPrimitiveBounds.size(), "Invalid primitive index ", order[i], " when reordering");
+		indices[3 * i] = mIndices[3 * order[i]];
+		indices[3 * i + 1] = mIndices[3 * order[i] + 1];
+		indices[3 * i + 2] = mIndices[3 * order[i] + 2];
+		primitiveBounds[i] = mPrimitiveBounds[order[i]];
+	}
+
+	mIndices = std::move(indices);
+	mPrimitiveBounds = std::move(primitiveBounds);
 }
 
-void Model::ReorderPrimitives(std::vector<std::shared_ptr<ModelPrimitive>>& orderedPrimitives) {
-	EVALUATE(orderedPrimitives.size() == mPrimitives.size(), "Expected new primitives to be exactly the same size (",
-			 mPrimitives.size(), "), but they aren't (", orderedPrimitives.size(), ")");
+Oblivion::BoundingBox Model::ClipPrimitive(unsigned int index, const Oblivion::BoundingBox& box) const {
+	// Sutherland-Hodgman: clip the triangle against the 6 planes of the box. Every plane adds at most one vertex
+	constexpr const int MaxClippedVertices = 9;
+	DirectX::XMFLOAT3 polygon[MaxClippedVertices], clipped[MaxClippedVertices];
+	int numberOfVertices = 3;
+	for (int i = 0; i < 3; ++i) {
+		polygon[i] = mVertices[mIndices[3 * index + i]].position;
+	}
+
+	for (int axis = 0; axis < 3 && numberOfVertices > 0; ++axis) {
+		for (int side = 0; side < 2 && numberOfVertices > 0; ++side) {
+			float plane = Math::GetValueOnAxis(side == 0 ? box.minPoint : box.maxPoint, (Math::Axis)axis);
+			// Signed distance to the plane, positive inside the box
+			auto Distance = [&](const DirectX::XMFLOAT3& point) {
+				float value = Math::GetValueOnAxis(point, (Math::Axis)axis);
+				return side == 0 ? value - plane : plane - value;
+			};
+
+			int numberOfClipped = 0;
+			for (int i = 0; i < numberOfVertices; ++i) {
+				const auto& current = polygon[i];
+				const auto& next = polygon[(i + 1) % numberOfVertices];
+				float currentDistance = Distance(current), nextDistance = Distance(next);
+				if (currentDistance >= 0.0f) {
+					clipped[numberOfClipped++] = current;
+				}
+				if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f)) {
+					float t = currentDistance / (currentDistance - nextDistance);
+					clipped[numberOfClipped++] = current + (next - current) * t;
+				}
+			}
+			std::copy(clipped, clipped + numberOfClipped, polygon);
+			numberOfVertices = numberOfClipped;
+		}
+	}
 
-	mPrimitives = std::move(orderedPrimitives);
+	Oblivion::BoundingBox bb;
+	for (int i = 0; i < numberOfVertices; ++i) {
+		bb |= polygon[i];
+	}
+	// Keep the result inside the box even when the intersection points are off by a rounding error
+	return bb & box;
 }
 
 const std::vector<Line>& Model::GetRenderLines() const {
+	if (mRenderLines.empty()) {
+		mRenderLines.reserve(mIndices.size());
+		for (size_t i = 0; i < mIndices.size(); i += 3) {
+			const auto& v0 = mVertices[mIndices[i]].position;
+			const auto& v1 = mVertices[mIndices[i + 1]].position;
+			const auto& v2 = mVertices[mIndices[i + 2]].position;
+			mRenderLines.emplace_back(v0, v1, DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
+			mRenderLines.emplace_back(v1, v2, DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
+			mRenderLines.emplace_back(v0, v2, DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f));
+		}
+	}
 	return mRenderLines;
 }
 
@@ -128,8 +223,12 @@ std::vector<TraceVertex>& Model::GetVertices() {
 	return mVertices;
 }
 
+const std::vector<TraceVertex>& Model::GetVertices() const {
+	return mVertices;
+}
+
 unsigned int Model::GetIndexCount() {
-	return (unsigned int)mPrimitives.size() * 3;
+	return (unsigned int)mIndices.size();
 }
 
 unsigned int Model::GetVertexCount() {
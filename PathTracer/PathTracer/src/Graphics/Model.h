@@ -13,12 +13,8 @@ namespace Assimp {
 
 struct ModelPrimitive {
 	std::array<unsigned int, 3> indices;
-	Oblivion::BoundingBox boundingBox;
 
-
-	Oblivion::BoundingBox GetBoundingBox();
-
-	operator TraceModelPrimitive() {
+	operator TraceModelPrimitive() const {
 		TraceModelPrimitive mp;
 		mp.index0 = indices[0];
 		mp.index1 = indices[1];
@@ -28,22 +24,65 @@ struct ModelPrimitive {
 	}
 };
 
+enum class ModelImporter {
+	// The readers of Model for OBJ and binary STL files, which map the file and parse it in parallel. Assimp reads the
+	// other formats, and the files that use something the readers don't support
+	Native,
+	Assimp
+};
+
 class Model : public AccelerableStructure<ModelPrimitive> {
+public:
+	// Vertices are merged when their positions fall in the same cell of a grid of positionTolerance, or are equal when it
+	// is zero, and no component of their normals and texture coordinates differs by more than the other tolerances
+	struct WeldParameters {
+		bool enabled = true;
+		float positionTolerance = 0.0f;
+		float normalTolerance = 0.0f;
+		float texCoordTolerance = 0.0f;
+	};
+
 public:
 
 	Model() = default;
-	Model(const std::string& path);
+	Model(const std::string& path, ModelImporter importer = ModelImporter::Native);
+
+	// Imports give every triangle vertices of its own. Merges the vertices the triangles can share and rewrites the
+	// indices, which must be done before the tree is built
+	void WeldVertices(const WeldParameters& parameters);
+	// Moves the vertices, as a frame of an animation does, without changing the primitives or their order. Trees built for
+	// the model can then be refit (BvhTree::Refit) instead of built again
+	void SetVertexPositions(const std::vector<DirectX::XMFLOAT3>& positions);
+
+	// Post processing steps of the import, part of what identifies an imported model
+	static unsigned int GetImportFlags();
 
 	// Inherited via AccelerableStructure
-	virtual std::vector<std::shared_ptr<ModelPrimitive>>& GetPrimitives() override;
-	virtual void ReorderPrimitives(std::vector<std::shared_ptr<ModelPrimitive>>&) override;
+	virtual unsigned int GetPrimitiveCount() const override;
+	virtual Oblivion::BoundingBox GetPrimitiveBoundingBox(unsigned int index) const override;
+	virtual void ReorderPrimitives(const std::vector<unsigned int>& order) override;
+	virtual Oblivion::BoundingBox ClipPrimitive(unsigned int index, const Oblivion::BoundingBox& box) const override;
+
+	ModelPrimitive GetPrimitive(unsigned int index) const;
 
 	const std::vector<Line>& GetRenderLines() const;
 	std::vector<TraceVertex>& GetVertices();
+	const std::vector<TraceVertex>& GetVertices() const;
 
 	unsigned int GetIndexCount();
 	unsigned int GetVertexCount();
 
+private:
+	void LoadWithAssimp(const std::string& path);
+
+	// The readers give the result of an import with GetImportFlags: z mirrored, the winding flipped, quads split as
+	// Triangulate does and face normals where the file has none. They throw on what they don't support
+	void LoadNative(const std::string& path, bool obj);
+	void LoadOBJ(const std::string& path, const class MappedFile& file);
+	void LoadSTL(const class MappedFile& file);
+	// Sizes the arrays for the given number of triangles, each with vertices of its own
+	void ResizeTriangles(size_t numberOfTriangles);
+
 private:
 	unsigned int CopyVertices(const struct aiMesh* mesh);
 	void BuildPrimitives(const struct aiMesh* mesh, unsigned int indexOffset);
@@ -52,11 +91,15 @@ private:
 	void ProcessMesh(const struct aiScene* scene, const struct aiNode* rootNode, std::function<void(const struct aiMesh*)> callback);
 
 private:
-	std::vector<std::shared_ptr<ModelPrimitive>> mPrimitives;
+	// The primitives are stored as a structure of arrays: primitive i uses the vertices mIndices[3 * i] .. mIndices[3 * i + 2]
+	// and is bounded by mPrimitiveBounds[i]
+	std::vector<unsigned int> mIndices;
+	std::vector<Oblivion::BoundingBox> mPrimitiveBounds;
 
 	std::vector<TraceVertex> mVertices;
 
-	std::vector<Line> mRenderLines;
+	// Built from the primitives the first time they are asked for, as only wireframe renders use them
+	mutable std::vector<Line> mRenderLines;
 
 };
 
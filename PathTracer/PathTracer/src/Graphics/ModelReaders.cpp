@@ -0,0 +1,464 @@
+#include "Model.h"
+#include "../Utils/MappedFile.h"
+#include "../Utils/Threading.h"
+
+#include <charconv>
+
+// OBJ files are split at line boundaries into chunks of about this size, which are parsed in parallel
+constexpr const size_t OBJChunkSize = 1 << 20;
+// Facets of a binary STL file read by a task
+constexpr const int64_t STLFacetsPerTask = 8192;
+constexpr const size_t STLHeaderSize = 84;
+constexpr const size_t STLFacetSize = 50;
+
+enum class OBJStatement {
+	Position, TexCoord, Normal, Face, Other
+};
+
+// Indices into the attributes of the whole file, -1 when the corner has none
+struct OBJCorner {
+	int position;
+	int texCoord;
+	int normal;
+};
+
+// Polygons of more than 4 corners need the ear clipping of Assimp
+struct OBJFace {
+	OBJCorner corners[4];
+	unsigned int numberOfCorners;
+};
+
+struct OBJChunk {
+	const char* begin;
+	const char* end;
+
+	// Statements of the chunk, then where its first ones go in the arrays of the whole file
+	size_t positions = 0, texCoords = 0, normals = 0, faces = 0, triangles = 0;
+	size_t firstPosition = 0, firstTexCoord = 0, firstNormal = 0, firstFace = 0, firstTriangle = 0;
+	// Corners of the faces of the chunk, and those of them that have texture coordinates and normals
+	size_t corners = 0, cornersWithTexCoord = 0, cornersWithNormal = 0;
+
+	// Exceptions can't leave the tasks of the pool, so the first error of the chunk is kept here, with its line in the chunk
+	size_t lines = 0;
+	std::string error;
+	size_t errorLine = 0;
+};
+
+inline const char* SkipSpaces(const char* it, const char* end) {
+	while (it < end && (*it == ' ' || *it == '\t' || *it == '\r')) {
+		++it;
+	}
+	return it;
+}
+
+inline const char* SkipToken(const char* it, const char* end) {
+	while (it < end && *it != ' ' && *it != '\t' && *it != '\r') {
+		++it;
+	}
+	return it;
+}
+
+// Returns nullptr when there is no number at it
+inline const char* ParseFloat(const char* it, const char* end, float& value) {
+	it = SkipSpaces(it, end);
+	// from_chars doesn't take a leading '+'
+	if (it < end && *it == '+') {
+		++it;
+	}
+	auto result = std::from_chars(it, end, value);
+	return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+inline const char* ParseInteger(const char* it, const char* end, int& value) {
+	auto result = std::from_chars(it, end, value);
+	return result.ec == std::errc() ? result.ptr : nullptr;
+}
+
+// Leaves it after the keyword of the statement
+inline OBJStatement GetOBJStatement(const char*& it, const char* end) {
+	it = SkipSpaces(it, end);
+	auto IsSpace = [](char c) { return c == ' ' || c == '\t'; };
+	if (end - it >= 2 && it[0] == 'v' && IsSpace(it[1])) {
+		it += 2;
+		return OBJStatement::Position;
+	}
+	if (end - it >= 3 && it[0] == 'v' && it[1] == 't' && IsSpace(it[2])) {
+		it += 3;
+		return OBJStatement::TexCoord;
+	}
+	if (end - it >= 3 && it[0] == 'v' && it[1] == 'n' && IsSpace(it[2])) {
+		it += 3;
+		return OBJStatement::Normal;
+	}
+	if (end - it >= 2 && it[0] == 'f' && IsSpace(it[1])) {
+		it += 2;
+		return OBJStatement::Face;
+	}
+	return OBJStatement::Other;
+}
+
+// Visits the lines with their index, without the comment that ends them. Returns the number of lines
+template <typename Visit>
+size_t ForEachLine(const char* begin, const char* end, const Visit& visit) {
+	size_t line = 0;
+	for (; begin < end; ++line) {
+		const char* lineEnd = (const char*)memchr(begin, '\n', end - begin);
+		if (lineEnd == nullptr) {
+			lineEnd = end;
+		}
+		const char* comment = (const char*)memchr(begin, '#', lineEnd - begin);
+		visit(begin, comment == nullptr ? lineEnd : comment, line);
+		begin = lineEnd + 1;
+	}
+	return line;
+}
+
+// OBJ indices start at 1, and negative ones count back from the last attribute defined before the face. Returns -1 for 0
+// and for the indices past the attributes of the file, counting back or forward
+inline int ResolveOBJIndex(int index, size_t definedBefore, size_t defined) {
+	int resolved = index > 0 ? index - 1 : (int)definedBefore + index;
+	return index != 0 && resolved >= 0 && (size_t)resolved < defined ? resolved : -1;
+}
+
+inline DirectX::XMFLOAT3 Cross(const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b) {
+	return DirectX::XMFLOAT3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline float Dot(const DirectX::XMFLOAT3& a, const DirectX::XMFLOAT3& b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// As aiVector3D::Normalize, so that the same quads are split the same way. Zero vectors become NaNs
+inline DirectX::XMFLOAT3 Normalize(const DirectX::XMFLOAT3& v) {
+	float invLength = 1.0f / std::sqrt(Dot(v, v));
+	return DirectX::XMFLOAT3(v.x * invLength, v.y * invLength, v.z * invLength);
+}
+
+// As aiVector3D::NormalizeSafe: zero vectors stay zero
+inline DirectX::XMFLOAT3 NormalizeSafe(const DirectX::XMFLOAT3& v) {
+	float length = std::sqrt(Dot(v, v));
+	return length > 0.0f ? Normalize(v) : v;
+}
+
+// The corner the quad is fanned from: its concave corner if it has one, as in TriangulateProcess
+inline unsigned int GetQuadFanCorner(const DirectX::XMFLOAT3 (&quad)[4]) {
+	for (unsigned int i = 0; i < 4; ++i) {
+		const auto& v = quad[i];
+		auto left = Normalize(quad[(i + 3) % 4] - v);
+		auto diagonal = Normalize(quad[(i + 2) % 4] - v);
+		auto right = Normalize(quad[(i + 1) % 4] - v);
+		if (std::acos(Dot(left, diagonal)) + std::acos(Dot(right, diagonal)) > Math::PI) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+void Model::LoadNative(const std::string& path, bool obj) {
+	Oblivion::DebugPrintLine("Reading model from ", path);
+	MappedFile file(path);
+	if (obj) {
+		LoadOBJ(path, file);
+	} else {
+		LoadSTL(file);
+	}
+	EVALUATE(!mPrimitiveBounds.empty(), "There are no triangles in ", path);
+}
+
+void Model::ResizeTriangles(size_t numberOfTriangles) {
+	EVALUATE(3 * numberOfTriangles <= std::numeric_limits<unsigned int>::max(), "Too many triangles (", numberOfTriangles, ")");
+	mVertices.resize(3 * numberOfTriangles);
+	mIndices.resize(3 * numberOfTriangles);
+	mPrimitiveBounds.resize(numberOfTriangles);
+}
+
+void Model::LoadOBJ(const std::string& path, const MappedFile& file) {
+	const char* data = (const char*)file.GetData();
+	const char* end = data + file.GetSize();
+
+	std::vector<OBJChunk> chunks;
+	for (const char* begin = data; begin < end;) {
+		const char* chunkEnd = begin + std::min(OBJChunkSize, (size_t)(end - begin));
+		const char* lineEnd = (const char*)memchr(chunkEnd, '\n', end - chunkEnd);
+		chunkEnd = lineEnd == nullptr ? end : lineEnd + 1;
+		auto& chunk = chunks.emplace_back();
+		chunk.begin = begin;
+		chunk.end = chunkEnd;
+		begin = chunkEnd;
+	}
+	auto ThrowChunkErrors = [&]() {
+		size_t firstLine = 1;
+		for (const auto& chunk : chunks) {
+			EVALUATE(chunk.error.empty(), chunk.error, " at line ", firstLine + chunk.errorLine, " of ", path);
+			firstLine += chunk.lines;
+		}
+	};
+
+	// Count the statements of every chunk, to know where each one writes
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t index) {
+			auto& chunk = chunks[index];
+			chunk.lines = ForEachLine(chunk.begin, chunk.end, [&](const char* it, const char* lineEnd, size_t line) {
+				switch (GetOBJStatement(it, lineEnd)) {
+				case OBJStatement::Position:
+					chunk.positions++;
+					break;
+				case OBJStatement::TexCoord:
+					chunk.texCoords++;
+					break;
+				case OBJStatement::Normal:
+					chunk.normals++;
+					break;
+				case OBJStatement::Face: {
+					unsigned int numberOfCorners = 0;
+					for (it = SkipSpaces(it, lineEnd); it < lineEnd; it = SkipSpaces(SkipToken(it, lineEnd), lineEnd)) {
+						numberOfCorners++;
+					}
+					if ((numberOfCorners < 3 || numberOfCorners > 4) && chunk.error.empty()) {
+						chunk.error = Oblivion::appendToString("Faces of ", numberOfCorners, " corners are not supported");
+						chunk.errorLine = line;
+					}
+					chunk.faces++;
+					chunk.triangles += numberOfCorners > 2 ? numberOfCorners - 2 : 0;
+					break;
+				}
+				default:
+					break;
+				}
+			});
+		}, chunks.size(), 1);
+	ThrowChunkErrors();
+
+	size_t positions = 0, texCoords = 0, normals = 0, faces = 0, triangles = 0;
+	for (auto& chunk : chunks) {
+		chunk.firstPosition = positions;
+		chunk.firstTexCoord = texCoords;
+		chunk.firstNormal = normals;
+		chunk.firstFace = faces;
+		chunk.firstTriangle = triangles;
+		positions += chunk.positions;
+		texCoords += chunk.texCoords;
+		normals += chunk.normals;
+		faces += chunk.faces;
+		triangles += chunk.triangles;
+	}
+	EVALUATE(positions <= (size_t)std::numeric_limits<int>::max(), "Too many vertices (", positions, ")");
+
+	// Parse the attributes, mirrored on z, and the corners of the faces
+	std::vector<DirectX::XMFLOAT3> filePositions(positions), fileNormals(normals);
+	std::vector<DirectX::XMFLOAT4> fileTexCoords(texCoords);
+	std::vector<OBJFace> fileFaces(faces);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t index) {
+			auto& chunk = chunks[index];
+			size_t position = chunk.firstPosition, texCoord = chunk.firstTexCoord, normal = chunk.firstNormal, face = chunk.firstFace;
+			ForEachLine(chunk.begin, chunk.end, [&](const char* it, const char* lineEnd, size_t line) {
+				if (!chunk.error.empty()) {
+					return;
+				}
+				// The lines after an error are skipped, so this ends up as the line of the error
+				chunk.errorLine = line;
+				float x = 0.0f, y = 0.0f, z = 0.0f;
+				switch (GetOBJStatement(it, lineEnd)) {
+				case OBJStatement::Position:
+					if ((it = ParseFloat(it, lineEnd, x)) && (it = ParseFloat(it, lineEnd, y)) && (it = ParseFloat(it, lineEnd, z)) &&
+						SkipSpaces(it, lineEnd) == lineEnd) {
+						filePositions[position++] = DirectX::XMFLOAT3(x, y, -z);
+					} else {
+						// Also vertices with weights or colors, which Assimp reads
+						chunk.error = "Unsupported vertex";
+					}
+					break;
+				case OBJStatement::TexCoord:
+					if ((it = ParseFloat(it, lineEnd, x)) && (it = ParseFloat(it, lineEnd, y))) {
+						// The third coordinate is optional
+						ParseFloat(it, lineEnd, z);
+						fileTexCoords[texCoord++] = DirectX::XMFLOAT4(x, y, z, 0.0f);
+					} else {
+						chunk.error = "Unsupported texture coordinates";
+					}
+					break;
+				case OBJStatement::Normal:
+					if ((it = ParseFloat(it, lineEnd, x)) && (it = ParseFloat(it, lineEnd, y)) && (it = ParseFloat(it, lineEnd, z))) {
+						fileNormals[normal++] = DirectX::XMFLOAT3(x, y, -z);
+					} else {
+						chunk.error = "Unsupported normal";
+					}
+					break;
+				case OBJStatement::Face: {
+					// v, v/vt, v//vn or v/vt/vn
+					auto& currentFace = fileFaces[face++];
+					currentFace.numberOfCorners = 0;
+					for (it = SkipSpaces(it, lineEnd); it < lineEnd; it = SkipSpaces(it, lineEnd)) {
+						auto& corner = currentFace.corners[currentFace.numberOfCorners++];
+						int value = 0;
+						const char* next = ParseInteger(it, lineEnd, value);
+						if (next == nullptr) {
+							chunk.error = "Unsupported face";
+							return;
+						}
+						// -1 stands for a missing attribute from here on, so invalid indices leave the file to Assimp
+						corner.position = ResolveOBJIndex(value, position, positions);
+						corner.texCoord = corner.normal = -1;
+						if (corner.position < 0) {
+							chunk.error = "Invalid face index";
+							return;
+						}
+						it = next;
+						if (it < lineEnd && *it == '/') {
+							++it;
+							if ((next = ParseInteger(it, lineEnd, value))) {
+								corner.texCoord = ResolveOBJIndex(value, texCoord, texCoords);
+								if (corner.texCoord < 0) {
+									chunk.error = "Invalid face index";
+									return;
+								}
+								it = next;
+							}
+							if (it < lineEnd && *it == '/') {
+								++it;
+								if ((next = ParseInteger(it, lineEnd, value))) {
+									corner.normal = ResolveOBJIndex(value, normal, normals);
+									if (corner.normal < 0) {
+										chunk.error = "Invalid face index";
+										return;
+									}
+									it = next;
+								}
+							}
+						}
+						if (it < lineEnd && *it != ' ' && *it != '\t' && *it != '\r') {
+							chunk.error = "Unsupported face";
+							return;
+						}
+						chunk.corners++;
+						chunk.cornersWithTexCoord += corner.texCoord >= 0 ? 1 : 0;
+						chunk.cornersWithNormal += corner.normal >= 0 ? 1 : 0;
+					}
+					break;
+				}
+				default:
+					break;
+				}
+			});
+		}, chunks.size(), 1);
+	ThrowChunkErrors();
+
+	// Assimp gives zeros to the corners that miss an attribute other corners of their mesh have, and meshes follow
+	// groups and materials. Files with such corners are left to it
+	size_t corners = 0, cornersWithTexCoord = 0, cornersWithNormal = 0;
+	for (const auto& chunk : chunks) {
+		corners += chunk.corners;
+		cornersWithTexCoord += chunk.cornersWithTexCoord;
+		cornersWithNormal += chunk.cornersWithNormal;
+	}
+	EVALUATE(cornersWithTexCoord == 0 || cornersWithTexCoord == corners, "Faces with and without texture coordinates are not supported");
+	EVALUATE(cornersWithNormal == 0 || cornersWithNormal == corners, "Faces with and without normals are not supported");
+
+	// Triangulate the faces into the final arrays. Every corner gets a vertex of its own, as the OBJ importer of Assimp does
+	ResizeTriangles(triangles);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t index) {
+			auto& chunk = chunks[index];
+			size_t triangle = chunk.firstTriangle;
+			for (size_t faceIndex = chunk.firstFace; faceIndex < chunk.firstFace + chunk.faces; ++faceIndex) {
+				const auto& face = fileFaces[faceIndex];
+				unsigned int numberOfCorners = face.numberOfCorners;
+
+				// The winding is flipped before the triangulation
+				OBJCorner corners[4];
+				DirectX::XMFLOAT3 cornerPositions[4];
+				for (unsigned int i = 0; i < numberOfCorners; ++i) {
+					corners[i] = face.corners[numberOfCorners - 1 - i];
+					cornerPositions[i] = filePositions[corners[i].position];
+				}
+
+				unsigned int fan = numberOfCorners == 4 ? GetQuadFanCorner(cornerPositions) : 0;
+				unsigned int triangleCorners[2][3];
+				// GenFaceNormals stores the normal of a triangle in its vertices, which the triangles of a quad share:
+				// the second one wins on the diagonal
+				DirectX::XMFLOAT3 faceNormals[4];
+				for (unsigned int i = 0; i + 2 < numberOfCorners; ++i) {
+					auto& current = triangleCorners[i];
+					current[0] = fan;
+					current[1] = (fan + i + 1) % 4;
+					current[2] = (fan + i + 2) % 4;
+					auto faceNormal = NormalizeSafe(Cross(cornerPositions[current[1]] - cornerPositions[current[0]],
+														  cornerPositions[current[2]] - cornerPositions[current[0]]));
+					for (unsigned int j = 0; j < 3; ++j) {
+						faceNormals[current[j]] = faceNormal;
+					}
+				}
+
+				for (unsigned int i = 0; i + 2 < numberOfCorners; ++i, ++triangle) {
+					Oblivion::BoundingBox bb;
+					for (unsigned int j = 0; j < 3; ++j) {
+						unsigned int cornerIndex = triangleCorners[i][j];
+						const auto& corner = corners[cornerIndex];
+						auto vertexIndex = 3 * triangle + j;
+						auto& vertex = mVertices[vertexIndex];
+						vertex.position = cornerPositions[cornerIndex];
+						vertex.pad0 = 0.0f;
+						vertex.normal = corner.normal >= 0 ? fileNormals[corner.normal] : faceNormals[cornerIndex];
+						vertex.pad1 = 0.0f;
+						vertex.texCoords = corner.texCoord >= 0 ? fileTexCoords[corner.texCoord] : DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f);
+						mIndices[vertexIndex] = (unsigned int)vertexIndex;
+						bb |= vertex.position;
+					}
+					mPrimitiveBounds[triangle] = bb;
+				}
+			}
+		}, chunks.size(), 1);
+}
+
+void Model::LoadSTL(const MappedFile& file) {
+	const unsigned char* data = file.GetData();
+	size_t size = file.GetSize();
+
+	// ASCII files are left to Assimp, as they are rarely large
+	uint32_t numberOfFacets = 0;
+	if (size >= STLHeaderSize) {
+		memcpy(&numberOfFacets, data + 80, sizeof(numberOfFacets));
+	}
+	EVALUATE(size >= STLHeaderSize && size == STLHeaderSize + STLFacetSize * (size_t)numberOfFacets, "Not a binary STL file");
+	// Materialise files have a default color for the facets in their header
+	const char colorTag[] = "COLOR=";
+	EVALUATE(std::search(data, data + 80, colorTag, colorTag + 6) == data + 80, "STL files with colors are not supported");
+
+	ResizeTriangles(numberOfFacets);
+	std::atomic<bool> coloredFacets = false;
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t task) {
+			size_t lastFacet = std::min((size_t)numberOfFacets, (size_t)(task + 1) * STLFacetsPerTask);
+			for (size_t facet = (size_t)task * STLFacetsPerTask; facet < lastFacet; ++facet) {
+				// A normal, 3 vertices and an attribute that has a color when its highest bit is set
+				const unsigned char* facetData = data + STLHeaderSize + STLFacetSize * facet;
+				float values[12];
+				uint16_t attribute;
+				memcpy(values, facetData, sizeof(values));
+				memcpy(&attribute, facetData + sizeof(values), sizeof(attribute));
+				if (attribute & 0x8000u) {
+					coloredFacets = true;
+				}
+
+				// The normal of the facet for all its vertices, even when it is zero, as Assimp doesn't generate normals
+				// for meshes that have some. The winding is flipped, so the last vertex comes first
+				DirectX::XMFLOAT3 normal(values[0], values[1], -values[2]);
+				Oblivion::BoundingBox bb;
+				for (unsigned int j = 0; j < 3; ++j) {
+					const float* position = values + 3 * (3 - j);
+					auto vertexIndex = 3 * facet + j;
+					auto& vertex = mVertices[vertexIndex];
+					vertex.position = DirectX::XMFLOAT3(position[0], position[1], -position[2]);
+					vertex.pad0 = 0.0f;
+					vertex.normal = normal;
+					vertex.pad1 = 0.0f;
+					vertex.texCoords = DirectX::XMFLOAT4(1.0f, 0.0f, 0.0f, 1.0f);
+					mIndices[vertexIndex] = (unsigned int)vertexIndex;
+					bb |= vertex.position;
+				}
+				mPrimitiveBounds[facet] = bb;
+			}
+		}, (numberOfFacets + STLFacetsPerTask - 1) / STLFacetsPerTask, 1);
+	EVALUATE(!coloredFacets, "STL facets with colors are not supported");
+}
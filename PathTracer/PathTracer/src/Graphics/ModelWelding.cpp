@@ -0,0 +1,170 @@
+#include "Model.h"
+#include "../Utils/MappedFile.h"
+#include "../Utils/Threading.h"
+
+// Vertices are spread over partitions by the hash of their cell, and the partitions are welded in parallel. Vertices that
+// can be merged always end up in the same one
+constexpr const unsigned int WeldPartitions = 256;
+constexpr const int64_t WeldVerticesPerTask = 65536;
+constexpr const unsigned int NoWeldVertex = std::numeric_limits<unsigned int>::max();
+
+struct WeldCell {
+	int64_t x, y, z;
+
+	bool operator == (const WeldCell& rhs) const {
+		return x == rhs.x && y == rhs.y && z == rhs.z;
+	}
+};
+
+inline int64_t GetWeldCoordinate(float value, float tolerance) {
+	if (tolerance > 0.0f) {
+		double cell = std::floor((double)value / tolerance);
+		return cell == cell ? (int64_t)std::clamp(cell, -9e18, 9e18) : 0;
+	}
+	// 0 and -0 are the same position
+	value += 0.0f;
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+inline bool IsWithin(float a, float b, float tolerance) {
+	// NaNs never match
+	return std::fabs(a - b) <= tolerance;
+}
+
+inline bool CanWeld(const TraceVertex& a, const TraceVertex& b, const Model::WeldParameters& parameters) {
+	return IsWithin(a.normal.x, b.normal.x, parameters.normalTolerance) && IsWithin(a.normal.y, b.normal.y, parameters.normalTolerance) &&
+		IsWithin(a.normal.z, b.normal.z, parameters.normalTolerance) &&
+		IsWithin(a.texCoords.x, b.texCoords.x, parameters.texCoordTolerance) && IsWithin(a.texCoords.y, b.texCoords.y, parameters.texCoordTolerance) &&
+		IsWithin(a.texCoords.z, b.texCoords.z, parameters.texCoordTolerance) && IsWithin(a.texCoords.w, b.texCoords.w, parameters.texCoordTolerance);
+}
+
+void Model::WeldVertices(const WeldParameters& parameters) {
+	if (!parameters.enabled || mVertices.empty()) {
+		return;
+	}
+	auto numberOfVertices = (unsigned int)mVertices.size();
+	auto numberOfTasks = (numberOfVertices + WeldVerticesPerTask - 1) / WeldVerticesPerTask;
+	auto ForEachTask = [&](int64_t count, const std::function<void(int64_t, unsigned int, unsigned int)>& function) {
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t task) {
+				auto first = (unsigned int)(task * WeldVerticesPerTask);
+				auto last = (unsigned int)std::min<int64_t>(count, (task + 1) * WeldVerticesPerTask);
+				function(task, first, last);
+			}, (count + WeldVerticesPerTask - 1) / WeldVerticesPerTask, 1);
+	};
+
+	// Cells and hashes of the vertices, and how many of every task go to every partition
+	std::vector<WeldCell> cells(numberOfVertices);
+	std::vector<uint64_t> hashes(numberOfVertices);
+	std::vector<std::array<unsigned int, WeldPartitions>> partitionCounts(numberOfTasks);
+	ForEachTask(numberOfVertices, [&](int64_t task, unsigned int first, unsigned int last) {
+		auto& counts = partitionCounts[task];
+		counts.fill(0);
+		for (unsigned int i = first; i < last; ++i) {
+			const auto& position = mVertices[i].position;
+			auto& cell = cells[i];
+			cell.x = GetWeldCoordinate(position.x, parameters.positionTolerance);
+			cell.y = GetWeldCoordinate(position.y, parameters.positionTolerance);
+			cell.z = GetWeldCoordinate(position.z, parameters.positionTolerance);
+			hashes[i] = HashBytes(&cell, sizeof(cell));
+			counts[hashes[i] % WeldPartitions]++;
+		}
+	});
+
+	// Vertices sorted by partition. Every task writes after the tasks before it, so that the vertices of a partition stay
+	// in the order of the model and the first of them is kept
+	std::vector<unsigned int> partitionStarts(WeldPartitions + 1, 0);
+	std::vector<std::array<unsigned int, WeldPartitions>> taskOffsets(numberOfTasks);
+	for (unsigned int partition = 0, offset = 0; partition < WeldPartitions; ++partition) {
+		partitionStarts[partition] = offset;
+		for (unsigned int task = 0; task < numberOfTasks; ++task) {
+			taskOffsets[task][partition] = offset;
+			offset += partitionCounts[task][partition];
+		}
+		partitionStarts[partition + 1] = offset;
+	}
+	std::vector<unsigned int> sortedVertices(numberOfVertices);
+	ForEachTask(numberOfVertices, [&](int64_t task, unsigned int first, unsigned int last) {
+		auto& offsets = taskOffsets[task];
+		for (unsigned int i = first; i < last; ++i) {
+			sortedVertices[offsets[hashes[i] % WeldPartitions]++] = i;
+		}
+	});
+
+	// Every vertex is merged into the first vertex before it that it can be merged with, or kept. The vertices kept with the
+	// same hash are chained through nextKept
+	std::vector<unsigned int> kept(numberOfVertices);
+	std::vector<unsigned int> nextKept(numberOfVertices, NoWeldVertex);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t partition) {
+			std::unordered_map<uint64_t, unsigned int> firstKept;
+			firstKept.reserve(partitionStarts[partition + 1] - partitionStarts[partition]);
+			for (unsigned int i = partitionStarts[partition]; i < partitionStarts[partition + 1]; ++i) {
+				auto vertex = sortedVertices[i];
+				auto [it, inserted] = firstKept.try_emplace(hashes[vertex], vertex);
+				kept[vertex] = vertex;
+				if (inserted) {
+					continue;
+				}
+				auto last = it->second;
+				for (auto candidate = it->second; candidate != NoWeldVertex; candidate = nextKept[candidate]) {
+					if (cells[candidate] == cells[vertex] && CanWeld(mVertices[candidate], mVertices[vertex], parameters)) {
+						kept[vertex] = candidate;
+						break;
+					}
+					last = candidate;
+				}
+				if (kept[vertex] == vertex) {
+					nextKept[last] = vertex;
+				}
+			}
+		}, WeldPartitions, 1);
+
+	// New indices of the kept vertices, in the order of the model
+	std::vector<unsigned int> keptPerTask(numberOfTasks, 0);
+	ForEachTask(numberOfVertices, [&](int64_t task, unsigned int first, unsigned int last) {
+		for (unsigned int i = first; i < last; ++i) {
+			keptPerTask[task] += kept[i] == i ? 1 : 0;
+		}
+	});
+	unsigned int numberOfKept = 0;
+	for (auto& count : keptPerTask) {
+		auto offset = numberOfKept;
+		numberOfKept += count;
+		count = offset;
+	}
+	std::vector<unsigned int> newIndices(numberOfVertices);
+	std::vector<TraceVertex> weldedVertices(numberOfKept);
+	ForEachTask(numberOfVertices, [&](int64_t task, unsigned int first, unsigned int last) {
+		auto newIndex = keptPerTask[task];
+		for (unsigned int i = first; i < last; ++i) {
+			if (kept[i] == i) {
+				weldedVertices[newIndex] = mVertices[i];
+				newIndices[i] = newIndex++;
+			}
+		}
+	});
+	// The vertex kept instead of another one comes before it, so it has its new index by now
+	ForEachTask(mIndices.size(), [&](int64_t, unsigned int first, unsigned int last) {
+		for (unsigned int i = first; i < last; ++i) {
+			mIndices[i] = newIndices[kept[mIndices[i]]];
+		}
+	});
+	mVertices = std::move(weldedVertices);
+	mRenderLines.clear();
+
+	// Merged positions can move by up to a cell
+	if (parameters.positionTolerance > 0.0f) {
+		ForEachTask(mPrimitiveBounds.size(), [&](int64_t, unsigned int first, unsigned int last) {
+			for (unsigned int i = first; i < last; ++i) {
+				Oblivion::BoundingBox bb;
+				for (unsigned int j = 0; j < 3; ++j) {
+					bb |= mVertices[mIndices[3 * i + j]].position;
+				}
+				mPrimitiveBounds[i] = bb;
+			}
+		});
+	}
+}
@@ -4,6 +4,7 @@
 
 #include "../Model.h"
 #include "../Scene.h"
+#include "../../Utils/Threading.h"
 
 struct BVHPrimitiveInfo {
 	unsigned int index;
@@ -20,37 +21,169 @@ struct BVHPrimitiveInfo {
 	}
 };
 
-struct BVHNode {
+// The builders write the nodes depth first, straight into their final array: the first child of an interior node
+// follows it and the second one is found at secondChildOffset
+inline unsigned int EmitLeaf(std::vector<BVHTreeNode>& nodes, const Oblivion::BoundingBox& bb, int firstIndex, int nPrimitives) {
+	BVHTreeNode& node = nodes.emplace_back();
+	node.minAABB = bb.minPoint;
+	node.maxAABB = bb.maxPoint;
+	node.primitiveOffset = firstIndex;
+	node.numberOfPrimitives = nPrimitives;
+	return (unsigned int)nodes.size() - 1;
+}
 
-	std::unique_ptr<BVHNode> children[2];
-	Oblivion::BoundingBox boundingBox;
-	Math::Axis splitAxis;
-	int firstIndex, numberOfPrimitives;
-	unsigned int index;
+// The second child offset is filled in once the first subtree has been written
+inline unsigned int EmitInterior(std::vector<BVHTreeNode>& nodes, const Oblivion::BoundingBox& bb, Math::Axis axis) {
+	BVHTreeNode& node = nodes.emplace_back();
+	node.minAABB = bb.minPoint;
+	node.maxAABB = bb.maxPoint;
+	node.axis = static_cast<unsigned int>(axis);
+	return (unsigned int)nodes.size() - 1;
+}
+
+inline Oblivion::BoundingBox GetNodeBoundingBox(const BVHTreeNode& node) {
+	return Oblivion::BoundingBox(node.minAABB, node.maxAABB);
+}
 
-	void InitAsLeaf(const Oblivion::BoundingBox& bb, int first, int nPrimitives) {
-		firstIndex = first;
-		numberOfPrimitives = nPrimitives;
-		boundingBox = bb;
-		children[0] = nullptr;
-		children[1] = nullptr;
-		Oblivion::DebugPrintLine("Created leaf with ", nPrimitives, " primitives");
+inline void SetValueOnAxis(DirectX::XMFLOAT3& vct, Math::Axis axis, float value) {
+	switch (axis) {
+		case Math::Axis::X:
+			vct.x = value;
+			break;
+		case Math::Axis::Y:
+			vct.y = value;
+			break;
+		case Math::Axis::Z:
+			vct.z = value;
+			break;
 	}
+}
 
-	void InitAsInterior(Math::Axis splitAxis_, std::unique_ptr<BVHNode>&& children0, std::unique_ptr<BVHNode>&& children1) {
-		children[0] = std::move(children0);
-		children[1] = std::move(children1);
-		splitAxis = splitAxis_;
+// Appends a subtree that was built in a separate array, moving its child offsets to their new position
+void AppendSubtree(std::vector<BVHTreeNode>& nodes, const std::vector<BVHTreeNode>& subtree) {
+	auto baseOffset = (unsigned int)nodes.size();
+	nodes.insert(nodes.end(), subtree.begin(), subtree.end());
+	for (auto it = nodes.begin() + baseOffset; it != nodes.end(); ++it) {
+		if (it->numberOfPrimitives == 0) {
+			it->secondChildOffset += baseOffset;
+		}
+	}
+}
 
-		boundingBox = children[0]->boundingBox | children[1]->boundingBox;
+// Builds both children of nodes[nodeIndex] through BuildChild(childIndex, nodes). For large subtrees the second child is
+// built on another task into its own array, which is appended once both children are done
+template <typename buildChild>
+void BuildChildren(std::vector<BVHTreeNode>& nodes, unsigned int nodeIndex, bool parallel, size_t secondChildMaxNodes, buildChild&& BuildChild) {
+	if (!parallel) {
+		BuildChild(0, nodes);
+		nodes[nodeIndex].secondChildOffset = (unsigned int)nodes.size();
+		BuildChild(1, nodes);
+		return;
 	}
+
+	std::vector<BVHTreeNode> secondChildNodes;
+	secondChildNodes.reserve(secondChildMaxNodes);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t childIndex) {
+			BuildChild((int)childIndex, childIndex == 0 ? nodes : secondChildNodes);
+		}, 2, 1);
+	nodes[nodeIndex].secondChildOffset = (unsigned int)nodes.size();
+	AppendSubtree(nodes, secondChildNodes);
+}
+
+// Nodes with more primitives than this build their children as separate tasks
+constexpr const int ParallelBuildThreshold = 4096;
+// Ranges with more primitives than this compute their bounds and buckets in parallel chunks
+constexpr const int ParallelBinningThreshold = 65536;
+constexpr const int BinningChunkSize = 16384;
+// Nodes of a level refit by every task
+constexpr const int RefitChunkSize = 1024;
+// Cost of traversing the nodes HLBVH builds above its treelets, which are few and close to the root
+constexpr const float HLBVHUpperTraversalCost = .125f;
+
+struct MortonPrimitive {
+	// Position in the primitive infos, which is not the index of the primitive once references were pre-split
+	unsigned int referenceIndex;
+	unsigned int mortonCode;
 };
 
-struct BucketInfo {
-	int count;
-	Oblivion::BoundingBox bb;
+struct LBVHTreelet {
+	int startIndex = 0, numberOfPrimitives = 0;
+	// Filled once the treelet is built
+	Oblivion::BoundingBox boundingBox = {};
+	std::vector<BVHTreeNode> nodes = {};
 };
 
+// Spread the lower 10 bits of x so that there are two zero bits between every bit
+inline unsigned int LeftShift3(unsigned int x) {
+	if (x == (1 << 10)) --x;
+	x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+	x = (x | (x << 8))  & 0b00000011000000001111000000001111;
+	x = (x | (x << 4))  & 0b00000011000011000011000011000011;
+	x = (x | (x << 2))  & 0b00001001001001001001001001001001;
+	return x;
+}
+
+inline unsigned int EncodeMorton3(const DirectX::XMFLOAT3& v) {
+	return (LeftShift3((unsigned int)v.x) << 2) | (LeftShift3((unsigned int)v.y) << 1) | LeftShift3((unsigned int)v.z);
+}
+
+// Stable LSD radix sort on the 30 bit morton codes. Every pass builds a histogram per chunk in parallel,
+// computes where every (bucket, chunk) pair starts and then scatters the chunks in parallel
+void RadixSort(std::vector<MortonPrimitive>& v) {
+	constexpr const int bitsPerPass = 6;
+	constexpr const int numberOfBits = 30;
+	constexpr const int numberOfPasses = numberOfBits / bitsPerPass;
+	constexpr const int numberOfBuckets = 1 << bitsPerPass;
+	constexpr const int bitMask = (1 << bitsPerPass) - 1;
+	constexpr const int64_t chunkSize = 16384;
+
+	std::vector<MortonPrimitive> tempVector(v.size());
+	int64_t numberOfChunks = std::max((int64_t)1, ((int64_t)v.size() + chunkSize - 1) / chunkSize);
+	std::vector<std::array<int, numberOfBuckets>> chunkOffsets(numberOfChunks);
+
+	for (int pass = 0; pass < numberOfPasses; ++pass) {
+		int lowBit = pass * bitsPerPass;
+
+		std::vector<MortonPrimitive>& in = (pass & 1) ? tempVector : v;
+		std::vector<MortonPrimitive>& out = (pass & 1) ? v : tempVector;
+
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t chunkIndex) {
+				auto& counts = chunkOffsets[chunkIndex];
+				counts.fill(0);
+				int64_t chunkEnd = std::min((chunkIndex + 1) * chunkSize, (int64_t)in.size());
+				for (int64_t i = chunkIndex * chunkSize; i < chunkEnd; ++i) {
+					int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+					counts[bucket]++;
+				}
+			}, numberOfChunks, 1);
+
+		int currentOffset = 0;
+		for (int bucket = 0; bucket < numberOfBuckets; ++bucket) {
+			for (int64_t chunkIndex = 0; chunkIndex < numberOfChunks; ++chunkIndex) {
+				int count = chunkOffsets[chunkIndex][bucket];
+				chunkOffsets[chunkIndex][bucket] = currentOffset;
+				currentOffset += count;
+			}
+		}
+
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t chunkIndex) {
+				auto& offsets = chunkOffsets[chunkIndex];
+				int64_t chunkEnd = std::min((chunkIndex + 1) * chunkSize, (int64_t)in.size());
+				for (int64_t i = chunkIndex * chunkSize; i < chunkEnd; ++i) {
+					int bucket = (in[i].mortonCode >> lowBit) & bitMask;
+					out[offsets[bucket]++] = in[i];
+				}
+			}, numberOfChunks, 1);
+	}
+
+	if (numberOfPasses & 1) {
+		std::swap(v, tempVector);
+	}
+}
+
 std::optional<BvhTree::SplitMethod> BvhTree::GetSplitMethodByName(const std::string& str) {
 	if (boost::iequals(str, "SAH")) {
 		return SplitMethod::SAH;
@@ -60,6 +193,21 @@ std::optional<BvhTree::SplitMethod> BvhTree::GetSplitMethodByName(const std::str
 		return SplitMethod::EqualCounts;
 	} else if (boost::iequals(str, "HLBVH")) {
 		return SplitMethod::HLBVH;
+	} else if (boost::iequals(str, "SBVH")) {
+		return SplitMethod::SBVH;
+	}
+	return std::nullopt;
+}
+
+std::optional<BvhTree::NodeLayout> BvhTree::GetNodeLayoutByName(const std::string& str) {
+	if (boost::iequals(str, "DepthFirst")) {
+		return NodeLayout::DepthFirst;
+	} else if (boost::iequals(str, "SubtreeSize")) {
+		return NodeLayout::SubtreeSize;
+	} else if (boost::iequals(str, "HotPathFirst")) {
+		return NodeLayout::HotPathFirst;
+	} else if (boost::iequals(str, "CacheOblivious")) {
+		return NodeLayout::CacheOblivious;
 	}
 	return std::nullopt;
 }
@@ -78,86 +226,292 @@ std::vector<BVHTreeNode>& BvhTree::GetNodes() {
 }
 
 template <unsigned int nodeType>
-int BvhTree::FlattenBVH(const std::unique_ptr<struct BVHNode>& root, int& offset, int maxPrimitivesInLeaf) {
+void BvhTree::FinalizeNodes(unsigned int maxPrimitivesInLeaf) {
+	for (auto& node : mNodes) {
+		EVALUATE(node.numberOfPrimitives <= maxPrimitivesInLeaf, "Too many primitives (", node.numberOfPrimitives, ") in a leaf node. Maximum allowed = ", maxPrimitivesInLeaf);
+		node.nodeType = nodeType;
+	}
+}
+
+template <typename primitiveType>
+std::vector<BVHPrimitiveInfo> BvhTree::BuildPrimitives(const AccelerableStructure<primitiveType>* accelerableStructure) {
+	unsigned int primitiveCount = accelerableStructure->GetPrimitiveCount();
+	std::vector<BVHPrimitiveInfo> primitivesInfo(primitiveCount, BVHPrimitiveInfo(0, Oblivion::BoundingBox()));
+
+	int64_t numberOfChunks = ((int64_t)primitiveCount + BinningChunkSize - 1) / BinningChunkSize;
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			unsigned int chunkEnd = (unsigned int)std::min((chunkIndex + 1) * BinningChunkSize, (int64_t)primitiveCount);
+			for (unsigned int i = (unsigned int)chunkIndex * BinningChunkSize; i < chunkEnd; ++i) {
+				primitivesInfo[i] = BVHPrimitiveInfo(i, accelerableStructure->GetPrimitiveBoundingBox(i));
+			}
+		}, numberOfChunks, 1);
+
+	if (mBuildParameters.preSplitThreshold > 0.0f && primitiveCount > 0) {
+		PreSplitPrimitives(accelerableStructure, primitivesInfo);
+	}
 
-	BVHTreeNode& currentNode = mNodes.at(offset);
-	currentNode.minAABB = root->boundingBox.minPoint;
-	currentNode.maxAABB = root->boundingBox.maxPoint;
-	currentNode.nodeType = nodeType;
+	return primitivesInfo;
+}
 
-	int myOffset = offset++;
+template <typename primitiveType>
+void BvhTree::PreSplitPrimitives(const AccelerableStructure<primitiveType>* accelerableStructure, std::vector<BVHPrimitiveInfo>& primitivesInfo) {
+	Oblivion::BoundingBox bb;
+	for (const auto& info : primitivesInfo) {
+		bb |= info.boundingBox;
+	}
+	float areaThreshold = mBuildParameters.preSplitThreshold * bb.SurfaceArea();
+	auto budget = (size_t)(mBuildParameters.preSplitBudget * primitivesInfo.size());
+	primitivesInfo.reserve(primitivesInfo.size() + budget);
 
-	if (root->numberOfPrimitives > 0) {
-		// This must be a leaf
-		EVALUATE(root->children[0] == nullptr && root->children[1] == nullptr, "Can't have a leaf node with children!");
-		EVALUATE(root->numberOfPrimitives <= maxPrimitivesInLeaf, "Too many primitives (", root->numberOfPrimitives, ") in a leaf node. Maximum allowed = ", maxPrimitivesInLeaf);
+	// The largest boxes are split first, so that the budget goes where it saves the most
+	auto SmallerBox = [&](unsigned int first, unsigned int second) {
+		return primitivesInfo[first].boundingBox.SurfaceArea() < primitivesInfo[second].boundingBox.SurfaceArea();
+	};
+	std::priority_queue<unsigned int, std::vector<unsigned int>, decltype(SmallerBox)> largestBoxes(SmallerBox);
+	for (unsigned int i = 0; i < primitivesInfo.size(); ++i) {
+		if (primitivesInfo[i].boundingBox.SurfaceArea() > areaThreshold) {
+			largestBoxes.push(i);
+		}
+	}
 
-		currentNode.numberOfPrimitives = root->numberOfPrimitives;
-		currentNode.primitiveOffset = root->firstIndex;
+	size_t addedReferences = 0;
+	while (!largestBoxes.empty() && addedReferences < budget) {
+		unsigned int reference = largestBoxes.top();
+		largestBoxes.pop();
+
+		// Halve the box on its longest axis and keep the bounds of the part of the primitive in every half
+		unsigned int primitiveIndex = primitivesInfo[reference].index;
+		auto referenceBB = primitivesInfo[reference].boundingBox;
+		auto axis = referenceBB.MaximumExtent();
+		float middle = (Math::GetValueOnAxis(referenceBB.minPoint, axis) + Math::GetValueOnAxis(referenceBB.maxPoint, axis)) * 0.5f;
+		auto lowerBB = referenceBB, upperBB = referenceBB;
+		SetValueOnAxis(lowerBB.maxPoint, axis, middle);
+		SetValueOnAxis(upperBB.minPoint, axis, middle);
+		lowerBB = accelerableStructure->ClipPrimitive(primitiveIndex, lowerBB) & referenceBB;
+		upperBB = accelerableStructure->ClipPrimitive(primitiveIndex, upperBB) & referenceBB;
+		if (lowerBB.IsEmpty() || upperBB.IsEmpty()) {
+			// Rounding left the primitive on one side only
+			continue;
+		}
 
-	} else {
-		currentNode.axis = static_cast<unsigned int>(root->splitAxis);
-		currentNode.numberOfPrimitives = 0;
+		primitivesInfo[reference].boundingBox = lowerBB;
+		primitivesInfo.emplace_back(primitiveIndex, upperBB);
+		addedReferences++;
+		for (unsigned int part : { reference, (unsigned int)primitivesInfo.size() - 1 }) {
+			if (primitivesInfo[part].boundingBox.SurfaceArea() > areaThreshold) {
+				largestBoxes.push(part);
+			}
+		}
+	}
+
+	Oblivion::DebugPrintLine("Pre-split ", addedReferences, " references, ", primitivesInfo.size(), " in total");
+}
 
-		FlattenBVH<nodeType>(root->children[0], offset, maxPrimitivesInLeaf);
-		currentNode.secondChildOffset = FlattenBVH<nodeType>(root->children[1], offset, maxPrimitivesInLeaf);
+// Computes the bounds of the primitives and of their centroids. Large ranges are reduced in parallel chunks
+void ComputeBounds(const std::vector<BVHPrimitiveInfo>& primitiveInfo, int start, int end,
+				   Oblivion::BoundingBox& bb, Oblivion::BoundingBox& centroidsBB) {
+	int nPrimitives = end - start;
+	if (nPrimitives < ParallelBinningThreshold) {
+		for (int i = start; i < end; ++i) {
+			bb |= primitiveInfo[i].boundingBox;
+			centroidsBB |= primitiveInfo[i].boundingBox.Center();
+		}
+		return;
 	}
 
+	int numberOfChunks = (nPrimitives + BinningChunkSize - 1) / BinningChunkSize;
+	std::vector<std::pair<Oblivion::BoundingBox, Oblivion::BoundingBox>> chunkBounds(numberOfChunks);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			auto& [chunkBB, chunkCentroidsBB] = chunkBounds[chunkIndex];
+			int chunkStart = start + (int)chunkIndex * BinningChunkSize;
+			int chunkEnd = std::min(chunkStart + BinningChunkSize, end);
+			for (int i = chunkStart; i < chunkEnd; ++i) {
+				chunkBB |= primitiveInfo[i].boundingBox;
+				chunkCentroidsBB |= primitiveInfo[i].boundingBox.Center();
+			}
+		}, numberOfChunks, 1);
 
-	return myOffset;
+	for (const auto& [chunkBB, chunkCentroidsBB] : chunkBounds) {
+		bb |= chunkBB;
+		centroidsBB |= chunkCentroidsBB;
+	}
 }
 
-template <typename primitiveType>
-std::vector<BVHPrimitiveInfo> BvhTree::BuildPrimitives(const std::vector<primitiveType>& primitives) {
-	std::vector<BVHPrimitiveInfo> primitivesInfo;
-	primitivesInfo.reserve(primitives.size());
+// The bins are stored as a structure of arrays, so the sweeps in FindSAHSplit run over contiguous floats
+struct SAHBins {
+	float minX[BvhTree::MaxBuckets], minY[BvhTree::MaxBuckets], minZ[BvhTree::MaxBuckets];
+	float maxX[BvhTree::MaxBuckets], maxY[BvhTree::MaxBuckets], maxZ[BvhTree::MaxBuckets];
+	int count[BvhTree::MaxBuckets];
+
+	SAHBins() {
+		std::fill(std::begin(minX), std::end(minX), FLT_MAX);
+		std::fill(std::begin(minY), std::end(minY), FLT_MAX);
+		std::fill(std::begin(minZ), std::end(minZ), FLT_MAX);
+		std::fill(std::begin(maxX), std::end(maxX), -FLT_MAX);
+		std::fill(std::begin(maxY), std::end(maxY), -FLT_MAX);
+		std::fill(std::begin(maxZ), std::end(maxZ), -FLT_MAX);
+		std::fill(std::begin(count), std::end(count), 0);
+	}
 
-	for (unsigned int i = 0; i < primitives.size(); ++i) {
-		primitivesInfo.emplace_back(i, primitives[i]->GetBoundingBox());
+	void Add(int bucket, const Oblivion::BoundingBox& bb) {
+		minX[bucket] = std::min(minX[bucket], bb.minPoint.x);
+		minY[bucket] = std::min(minY[bucket], bb.minPoint.y);
+		minZ[bucket] = std::min(minZ[bucket], bb.minPoint.z);
+		maxX[bucket] = std::max(maxX[bucket], bb.maxPoint.x);
+		maxY[bucket] = std::max(maxY[bucket], bb.maxPoint.y);
+		maxZ[bucket] = std::max(maxZ[bucket], bb.maxPoint.z);
+		count[bucket]++;
 	}
 
-	return primitivesInfo;
+	void Merge(const SAHBins& rhs, unsigned int numberOfBuckets) {
+		for (unsigned int i = 0; i < numberOfBuckets; ++i) {
+			minX[i] = std::min(minX[i], rhs.minX[i]);
+			minY[i] = std::min(minY[i], rhs.minY[i]);
+			minZ[i] = std::min(minZ[i], rhs.minZ[i]);
+			maxX[i] = std::max(maxX[i], rhs.maxX[i]);
+			maxY[i] = std::max(maxY[i], rhs.maxY[i]);
+			maxZ[i] = std::max(maxZ[i], rhs.maxZ[i]);
+			count[i] += rhs.count[i];
+		}
+	}
+};
+
+struct SAHSplit {
+	int axis = -1;
+	int bucket = -1;
+	float cost = FLT_MAX;
+	Oblivion::BoundingBox leftBB, rightBB;
+};
+
+// Must stay in sync with the bucket computed while binning in FindSAHSplit
+inline int GetSAHBucket(const Oblivion::BoundingBox& centroidsBB, const Oblivion::BoundingBox& bb, Math::Axis axis, unsigned int numberOfBuckets) {
+	int bucket = int(numberOfBuckets * Math::GetValueOnAxis(centroidsBB.Offset(bb.Center()), axis));
+	return std::clamp(bucket, 0, (int)numberOfBuckets - 1);
 }
 
-template <typename primitiveType>
-std::unique_ptr<struct BVHNode> BvhTree::RecursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, SplitMethod splitMethod, unsigned int maxPrimitiveInNodes,
-														const std::vector<primitiveType>& primitives, std::vector<primitiveType>& newPrimitives,
-														int start, int end, unsigned int* numNodes) {
-	EVALUATE(end > start,  "Cannot pass a start larger than the end: ", start, " >= ", end);
-	
-	if (numNodes) {
-		(*numNodes)++;
+inline float SurfaceArea(float minX, float minY, float minZ, float maxX, float maxY, float maxZ) {
+	float dx = maxX - minX, dy = maxY - minY, dz = maxZ - minZ;
+	return 2.f * (dx * dy + dx * dz + dy * dz);
+}
+
+// Evaluates every bucket boundary on the three axes. A sweep from the right stores the area and count of
+// the right side of each candidate, and a sweep from the left finishes the cost, so each axis costs O(buckets)
+template <typename getBoundingBox>
+SAHSplit FindSAHSplit(int count, getBoundingBox&& GetBoundingBox, const Oblivion::BoundingBox& bb,
+					  const Oblivion::BoundingBox& centroidsBB, const BvhTree::BuildParameters& parameters) {
+	const unsigned int numberOfBuckets = parameters.numberOfBuckets;
+	bool validAxis[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		validAxis[axis] = Math::GetValueOnAxis(centroidsBB.maxPoint, (Math::Axis)axis) -
+			Math::GetValueOnAxis(centroidsBB.minPoint, (Math::Axis)axis) >= Math::EPSILON;
 	}
 
-	Oblivion::BoundingBox bb;
-	for (int i = start; i < end; ++i) {
-		bb |= primitiveInfo[i].boundingBox;
+	auto FillChunk = [&](int chunkStart, int chunkEnd, SAHBins (&bins)[3]) {
+		for (int i = chunkStart; i < chunkEnd; ++i) {
+			const Oblivion::BoundingBox& primitiveBB = GetBoundingBox(i);
+			auto offset = centroidsBB.Offset(primitiveBB.Center());
+			for (int axis = 0; axis < 3; ++axis) {
+				if (validAxis[axis]) {
+					int bucket = int(numberOfBuckets * Math::GetValueOnAxis(offset, (Math::Axis)axis));
+					bins[axis].Add(std::clamp(bucket, 0, (int)numberOfBuckets - 1), primitiveBB);
+				}
+			}
+		}
+	};
+
+	SAHBins bins[3];
+	if (count < ParallelBinningThreshold) {
+		FillChunk(0, count, bins);
+	} else {
+		struct ChunkBins {
+			SAHBins bins[3];
+		};
+		int numberOfChunks = (count + BinningChunkSize - 1) / BinningChunkSize;
+		std::vector<ChunkBins> chunkBins(numberOfChunks);
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t chunkIndex) {
+				int chunkStart = (int)chunkIndex * BinningChunkSize;
+				int chunkEnd = std::min(chunkStart + BinningChunkSize, count);
+				FillChunk(chunkStart, chunkEnd, chunkBins[chunkIndex].bins);
+			}, numberOfChunks, 1);
+
+		for (const auto& chunk : chunkBins) {
+			for (int axis = 0; axis < 3; ++axis) {
+				bins[axis].Merge(chunk.bins[axis], numberOfBuckets);
+			}
+		}
 	}
 
-	std::unique_ptr<BVHNode> currentNode = std::make_unique<BVHNode>();
+	float nodeArea = bb.SurfaceArea();
+	float invNodeArea = nodeArea > 0.0f ? 1.0f / nodeArea : 0.0f;
 
-	int nPrimitives = end - start;
-	if (nPrimitives == 1) {
-		int indexStart = (int)newPrimitives.size();
-		for (int i = start; i < end; ++i) {
-			auto primitiveIndex = primitiveInfo[i].index;
-			newPrimitives.push_back(primitives[primitiveIndex]);
+	SAHSplit best;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (!validAxis[axis]) {
+			continue;
 		}
-		currentNode->InitAsLeaf(bb, indexStart, nPrimitives);
-	} else {
-		Oblivion::BoundingBox centroidsBB;
-		for (int i = start; i < end; ++i) {
-			centroidsBB |= primitiveInfo[i].boundingBox.Center();
+		const SAHBins& axisBins = bins[axis];
+
+		Oblivion::BoundingBox rightBB[BvhTree::MaxBuckets];
+		float rightArea[BvhTree::MaxBuckets];
+		int rightCount[BvhTree::MaxBuckets];
+		float minX = FLT_MAX, minY = FLT_MAX, minZ = FLT_MAX;
+		float maxX = -FLT_MAX, maxY = -FLT_MAX, maxZ = -FLT_MAX;
+		int accumulatedCount = 0;
+		for (int i = (int)numberOfBuckets - 1; i > 0; --i) {
+			minX = std::min(minX, axisBins.minX[i]); maxX = std::max(maxX, axisBins.maxX[i]);
+			minY = std::min(minY, axisBins.minY[i]); maxY = std::max(maxY, axisBins.maxY[i]);
+			minZ = std::min(minZ, axisBins.minZ[i]); maxZ = std::max(maxZ, axisBins.maxZ[i]);
+			accumulatedCount += axisBins.count[i];
+			rightCount[i] = accumulatedCount;
+			rightBB[i] = Oblivion::BoundingBox({ minX, minY, minZ }, { maxX, maxY, maxZ });
+			rightArea[i] = accumulatedCount > 0 ? SurfaceArea(minX, minY, minZ, maxX, maxY, maxZ) : 0.0f;
 		}
 
+		minX = minY = minZ = FLT_MAX;
+		maxX = maxY = maxZ = -FLT_MAX;
+		accumulatedCount = 0;
+		for (int i = 0; i < (int)numberOfBuckets - 1; ++i) {
+			minX = std::min(minX, axisBins.minX[i]); maxX = std::max(maxX, axisBins.maxX[i]);
+			minY = std::min(minY, axisBins.minY[i]); maxY = std::max(maxY, axisBins.maxY[i]);
+			minZ = std::min(minZ, axisBins.minZ[i]); maxZ = std::max(maxZ, axisBins.maxZ[i]);
+			accumulatedCount += axisBins.count[i];
+			if (accumulatedCount == 0 || rightCount[i + 1] == 0) {
+				continue;
+			}
+
+			float leftArea = SurfaceArea(minX, minY, minZ, maxX, maxY, maxZ);
+			float cost = parameters.traversalCost +
+				(accumulatedCount * leftArea + rightCount[i + 1] * rightArea[i + 1]) * invNodeArea;
+			if (cost < best.cost) {
+				best.axis = axis;
+				best.bucket = i;
+				best.cost = cost;
+				best.leftBB = Oblivion::BoundingBox({ minX, minY, minZ }, { maxX, maxY, maxZ });
+				best.rightBB = rightBB[i + 1];
+			}
+		}
+	}
+	return best;
+}
+
+void BvhTree::RecursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo, SplitMethod splitMethod, unsigned int maxPrimitiveInNodes,
+							 int start, int end, std::vector<BVHTreeNode>& nodes) {
+	EVALUATE(end > start,  "Cannot pass a start larger than the end: ", start, " >= ", end);
+
+	Oblivion::BoundingBox bb, centroidsBB;
+	ComputeBounds(primitiveInfo, start, end, bb, centroidsBB);
+
+	// The primitives are partitioned in place, so a leaf simply references its range in primitiveInfo
+	int nPrimitives = end - start;
+	if (nPrimitives == 1) {
+		EmitLeaf(nodes, bb, start, nPrimitives);
+	} else {
 		auto axis = centroidsBB.MaximumExtent();
 		if (fabs(Math::GetValueOnAxis(centroidsBB.minPoint, axis) - Math::GetValueOnAxis(centroidsBB.maxPoint, axis)) < Math::EPSILON) {
-			int indexStart = (int)newPrimitives.size();
-			for (int i = start; i < end; ++i) {
-				auto primitiveIndex = primitiveInfo[i].index;
-				newPrimitives.push_back(primitives[primitiveIndex]);
-			}
-			currentNode->InitAsLeaf(bb, indexStart, nPrimitives);
+			EmitLeaf(nodes, bb, start, nPrimitives);
 		} else {
 			int mid;
 			switch (splitMethod) {
@@ -170,9 +524,9 @@ std::unique_ptr<struct BVHNode> BvhTree::RecursiveBuild(std::vector<BVHPrimitive
 					if (midPoint != primitiveInfo.begin() + start && midPoint != primitiveInfo.begin() + end) break;
 					Oblivion::DebugPrintLine("Middle point did not give a good enough solution. Trying EqualCounts");
 				}
-				__fallthrough;
+				[[fallthrough]];
 				case BvhTree::SplitMethod::EqualCounts: {
-					mid = int((start + end) * 0.5f);
+					mid = (start + end) / 2;
 					std::nth_element(primitiveInfo.begin() + start, primitiveInfo.begin() + mid, primitiveInfo.begin() + end,
 									 [&](const BVHPrimitiveInfo& lhs, const BVHPrimitiveInfo& rhs) {
 										 return Math::GetValueOnAxis(lhs.boundingBox.Center(), axis) < Math::GetValueOnAxis(rhs.boundingBox.Center(), axis);
@@ -180,142 +534,947 @@ std::unique_ptr<struct BVHNode> BvhTree::RecursiveBuild(std::vector<BVHPrimitive
 					break;
 				}
 				case BvhTree::SplitMethod::HLBVH: 
-					EVALUATE(false, "HLBVH split is not ready yet");
+					EVALUATE(false, "HLBVH trees are built by HLBVHBuild, not by RecursiveBuild");
+					break;
+				case BvhTree::SplitMethod::SBVH:
+					EVALUATE(false, "SBVH trees are built by SBVHBuild, not by RecursiveBuild");
 					break;
 				case BvhTree::SplitMethod::SAH:
 				default:
 					if (nPrimitives <= 2) {
-						mid = int((start + end) * 0.5f);
+						mid = (start + end) / 2;
 						std::nth_element(primitiveInfo.begin() + start, primitiveInfo.begin() + mid, primitiveInfo.begin() + end,
 										 [&](const BVHPrimitiveInfo& lhs, const BVHPrimitiveInfo& rhs) {
 											 return Math::GetValueOnAxis(lhs.boundingBox.Center(), axis) < Math::GetValueOnAxis(rhs.boundingBox.Center(), axis);
 										 });
 					} else {
-						constexpr const unsigned int numberOfBuckets = 12;
-						BucketInfo buckets[numberOfBuckets] = {};
-						for (int i = start; i < end; ++i) {
-							int bucket = int(numberOfBuckets *
-											 Math::GetValueOnAxis(centroidsBB.Offset(primitiveInfo[i].boundingBox.Center()), axis));
-
-							if (bucket == numberOfBuckets) {
-								bucket -= 1;
-							}
-
-							buckets[bucket].count++;
-							buckets[bucket].bb |= primitiveInfo[i].boundingBox;
-						}
-
-						float cost[numberOfBuckets - 1];
-						for (int i = 0; i < numberOfBuckets - 1; ++i) {
-							Oblivion::BoundingBox b0, b1;
-							int count0 = 0, count1 = 0;
-							for (int j = 0; j <= i; ++j) {
-								b0 |= buckets[j].bb;
-								count0 += buckets[j].count;
-							}
-							for (int j = i + 1; j < numberOfBuckets; ++j) {
-								b1 |= buckets[j].bb;
-								count1 += buckets[j].count;
-							}
-
-							cost[i] = 1.0f + (count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea()) / bb.SurfaceArea();
-						}
-
-						auto minBucket = std::min_element(std::begin(cost), std::end(cost)) - cost;
-						auto minCost = cost[minBucket];
+						auto split = FindSAHSplit(nPrimitives,
+												  [&](int i) -> const Oblivion::BoundingBox& { return primitiveInfo[start + i].boundingBox; },
+												  bb, centroidsBB, mBuildParameters);
 
 						float leafCost = (float)nPrimitives;
-						if (nPrimitives > (int)maxPrimitiveInNodes || minCost < leafCost) {
+						if (split.axis != -1 && (nPrimitives > (int)maxPrimitiveInNodes || split.cost < leafCost)) {
+							axis = (Math::Axis)split.axis;
 							auto midPoint = std::partition(primitiveInfo.begin() + start, primitiveInfo.begin() + end,
 														   [&](const BVHPrimitiveInfo& primitiveInfo) {
-															   int bucket = int(numberOfBuckets *
-																				Math::GetValueOnAxis(centroidsBB.Offset(primitiveInfo.boundingBox.Center()), axis));
-															   if (bucket == numberOfBuckets)
-																   bucket -= 1;
-															   EVALUATE(bucket >= 0 && bucket < (int)numberOfBuckets, "Something went really wrong? x2 :))");
-															   return bucket <= minBucket;
+															   return GetSAHBucket(centroidsBB, primitiveInfo.boundingBox, axis,
+																				   mBuildParameters.numberOfBuckets) <= split.bucket;
 														   });
 							mid = int(midPoint - primitiveInfo.begin());
+						} else if (nPrimitives > (int)maxPrimitiveInNodes) {
+							mid = (start + end) / 2;
+							std::nth_element(primitiveInfo.begin() + start, primitiveInfo.begin() + mid, primitiveInfo.begin() + end,
+											 [&](const BVHPrimitiveInfo& lhs, const BVHPrimitiveInfo& rhs) {
+												 return Math::GetValueOnAxis(lhs.boundingBox.Center(), axis) < Math::GetValueOnAxis(rhs.boundingBox.Center(), axis);
+											 });
 						} else {
-							int indexStart = (int)newPrimitives.size();
-							for (int i = start; i < end; ++i) {
-								auto primitiveIndex = primitiveInfo[i].index;
-								newPrimitives.push_back(primitives[primitiveIndex]);
-							}
-							currentNode->InitAsLeaf(bb, indexStart, nPrimitives);
-							return currentNode;
+							EmitLeaf(nodes, bb, start, nPrimitives);
+							return;
 						}
 					}
 			}
-			currentNode->InitAsInterior(axis,
-										RecursiveBuild(primitiveInfo, splitMethod, maxPrimitiveInNodes,
-													   primitives, newPrimitives, start, mid, numNodes),
-										RecursiveBuild(primitiveInfo, splitMethod, maxPrimitiveInNodes,
-													   primitives, newPrimitives, mid, end, numNodes));
+
+			// Fork: the children's ranges don't overlap, so they can be partitioned concurrently
+			auto nodeIndex = EmitInterior(nodes, bb, axis);
+			BuildChildren(nodes, nodeIndex, nPrimitives > ParallelBuildThreshold, 2 * size_t(end - mid) - 1,
+						  [&](int childIndex, std::vector<BVHTreeNode>& childNodes) {
+							  if (childIndex == 0) {
+								  RecursiveBuild(primitiveInfo, splitMethod, maxPrimitiveInNodes, start, mid, childNodes);
+							  } else {
+								  RecursiveBuild(primitiveInfo, splitMethod, maxPrimitiveInNodes, mid, end, childNodes);
+							  }
+						  });
+		}
+	}
+}
+
+void BvhTree::HLBVHBuild(const std::vector<BVHPrimitiveInfo>& primitiveInfo, unsigned int maxPrimitiveInNodes,
+						 std::vector<BVHPrimitiveInfo>& orderedPrimitiveInfo, std::vector<BVHTreeNode>& nodes) {
+	EVALUATE(primitiveInfo.size() > 0, "Cannot build a HLBVH without primitives");
+
+	constexpr const int64_t chunkSize = 4096;
+	int64_t numberOfChunks = ((int64_t)primitiveInfo.size() + chunkSize - 1) / chunkSize;
+
+	// Bounds of the centroids, reduced per chunk
+	std::vector<Oblivion::BoundingBox> chunkBounds(numberOfChunks);
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			int64_t chunkEnd = std::min((chunkIndex + 1) * chunkSize, (int64_t)primitiveInfo.size());
+			for (int64_t i = chunkIndex * chunkSize; i < chunkEnd; ++i) {
+				chunkBounds[chunkIndex] |= primitiveInfo[i].boundingBox.Center();
+			}
+		}, numberOfChunks, 1);
+
+	Oblivion::BoundingBox centroidsBB;
+	for (const auto& it : chunkBounds) {
+		centroidsBB |= it;
+	}
+
+	// Quantize the centroids on a 1024^3 grid and interleave the coordinates
+	constexpr const int mortonBits = 10;
+	constexpr const float mortonScale = (float)(1 << mortonBits);
+	std::vector<MortonPrimitive> mortonPrimitives(primitiveInfo.size());
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunkIndex) {
+			int64_t chunkEnd = std::min((chunkIndex + 1) * chunkSize, (int64_t)primitiveInfo.size());
+			for (int64_t i = chunkIndex * chunkSize; i < chunkEnd; ++i) {
+				auto centroidOffset = centroidsBB.Offset(primitiveInfo[i].boundingBox.Center());
+				mortonPrimitives[i].referenceIndex = (unsigned int)i;
+				mortonPrimitives[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
+			}
+		}, numberOfChunks, 1);
+
+	RadixSort(mortonPrimitives);
+
+	// Primitives sharing the 12 high bits of their morton code fall in the same cell of a 16^3 grid => one treelet per cell
+	std::vector<LBVHTreelet> treeletsToBuild;
+	constexpr const unsigned int treeletMask = 0b00111111111111000000000000000000;
+	for (int start = 0, end = 1; end <= (int)mortonPrimitives.size(); ++end) {
+		if (end == (int)mortonPrimitives.size() ||
+			((mortonPrimitives[start].mortonCode & treeletMask) != (mortonPrimitives[end].mortonCode & treeletMask))) {
+			treeletsToBuild.push_back({ start, end - start });
+			start = end;
+		}
+	}
+
+	std::atomic<int> orderedPrimitivesOffset = 0;
+	orderedPrimitiveInfo.resize(primitiveInfo.size(), BVHPrimitiveInfo(0, Oblivion::BoundingBox()));
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t index) {
+			auto& treelet = treeletsToBuild[index];
+			constexpr const int firstBitIndex = 29 - 12;
+			EmitLBVH(primitiveInfo, &mortonPrimitives[treelet.startIndex], treelet.numberOfPrimitives, firstBitIndex,
+					 maxPrimitiveInNodes, orderedPrimitiveInfo, orderedPrimitivesOffset, treelet.nodes);
+			treelet.boundingBox = GetNodeBoundingBox(treelet.nodes[0]);
+		}, (int64_t)treeletsToBuild.size(), 1);
+
+	EVALUATE(orderedPrimitivesOffset == (int)primitiveInfo.size(), "HLBVH placed ", orderedPrimitivesOffset.load(), " primitives out of ", primitiveInfo.size());
+
+	size_t totalNodes = treeletsToBuild.size() - 1;
+	for (const auto& treelet : treeletsToBuild) {
+		totalNodes += treelet.nodes.size();
+	}
+	nodes.reserve(totalNodes);
+	BuildUpperSAH(treeletsToBuild, 0, (int)treeletsToBuild.size(), nodes);
+}
+
+void BvhTree::EmitLBVH(const std::vector<BVHPrimitiveInfo>& primitiveInfo, const MortonPrimitive* mortonPrimitives,
+					   int nPrimitives, int bitIndex, unsigned int maxPrimitiveInNodes,
+					   std::vector<BVHPrimitiveInfo>& orderedPrimitiveInfo, std::atomic<int>& orderedPrimitivesOffset,
+					   std::vector<BVHTreeNode>& nodes) {
+	EVALUATE(nPrimitives > 0, "Cannot emit a LBVH node without primitives");
+
+	if (nPrimitives <= (int)maxPrimitiveInNodes) {
+		Oblivion::BoundingBox bb;
+		int indexStart = orderedPrimitivesOffset.fetch_add(nPrimitives);
+		for (int i = 0; i < nPrimitives; ++i) {
+			auto referenceIndex = mortonPrimitives[i].referenceIndex;
+			orderedPrimitiveInfo[indexStart + i] = primitiveInfo[referenceIndex];
+			bb |= primitiveInfo[referenceIndex].boundingBox;
+		}
+		EmitLeaf(nodes, bb, indexStart, nPrimitives);
+		return;
+	}
+
+	int splitOffset;
+	Math::Axis axis;
+	if (bitIndex == -1) {
+		// The morton codes ran out on primitives that fall in the same cell, like duplicated geometry: the range is
+		// split in the middle so that no leaf gets more than maxPrimitiveInNodes
+		Oblivion::BoundingBox centroidsBB;
+		for (int i = 0; i < nPrimitives; ++i) {
+			centroidsBB |= primitiveInfo[mortonPrimitives[i].referenceIndex].boundingBox.Center();
+		}
+		splitOffset = nPrimitives / 2;
+		axis = centroidsBB.MaximumExtent();
+	} else {
+		int mask = 1 << bitIndex;
+		if ((mortonPrimitives[0].mortonCode & mask) == (mortonPrimitives[nPrimitives - 1].mortonCode & mask)) {
+			// All the primitives are on the same side of this plane
+			EmitLBVH(primitiveInfo, mortonPrimitives, nPrimitives, bitIndex - 1, maxPrimitiveInNodes,
+					 orderedPrimitiveInfo, orderedPrimitivesOffset, nodes);
+			return;
+		}
+
+		// Binary search for the first primitive that has the bit set
+		int searchStart = 0, searchEnd = nPrimitives - 1;
+		while (searchStart + 1 != searchEnd) {
+			int mid = (searchStart + searchEnd) / 2;
+			if ((mortonPrimitives[searchStart].mortonCode & mask) == (mortonPrimitives[mid].mortonCode & mask)) {
+				searchStart = mid;
+			} else {
+				searchEnd = mid;
+			}
+		}
+		splitOffset = searchEnd;
+
+		// The bits are interleaved as xyz, with z on the lowest bit
+		axis = static_cast<Math::Axis>(2 - bitIndex % 3);
+	}
+
+	// The bounds are only known once both children have been emitted
+	auto nodeIndex = EmitInterior(nodes, Oblivion::BoundingBox(), axis);
+	int childBitIndex = std::max(bitIndex - 1, -1);
+	EmitLBVH(primitiveInfo, mortonPrimitives, splitOffset, childBitIndex, maxPrimitiveInNodes,
+			 orderedPrimitiveInfo, orderedPrimitivesOffset, nodes);
+	nodes[nodeIndex].secondChildOffset = (unsigned int)nodes.size();
+	EmitLBVH(primitiveInfo, &mortonPrimitives[splitOffset], nPrimitives - splitOffset, childBitIndex, maxPrimitiveInNodes,
+			 orderedPrimitiveInfo, orderedPrimitivesOffset, nodes);
+
+	auto bb = GetNodeBoundingBox(nodes[nodeIndex + 1]) | GetNodeBoundingBox(nodes[nodes[nodeIndex].secondChildOffset]);
+	nodes[nodeIndex].minAABB = bb.minPoint;
+	nodes[nodeIndex].maxAABB = bb.maxPoint;
+}
+
+void BvhTree::BuildUpperSAH(std::vector<LBVHTreelet>& treelets, int start, int end, std::vector<BVHTreeNode>& nodes) {
+	EVALUATE(end > start, "Cannot pass a start larger than the end: ", start, " >= ", end);
+
+	int nTreelets = end - start;
+	if (nTreelets == 1) {
+		AppendSubtree(nodes, treelets[start].nodes);
+		treelets[start].nodes = std::vector<BVHTreeNode>();
+		return;
+	}
+
+	Oblivion::BoundingBox bb, centroidsBB;
+	for (int i = start; i < end; ++i) {
+		bb |= treelets[i].boundingBox;
+		centroidsBB |= treelets[i].boundingBox.Center();
+	}
+	auto axis = centroidsBB.MaximumExtent();
+
+	int mid = (start + end) / 2;
+	if (fabs(Math::GetValueOnAxis(centroidsBB.minPoint, axis) - Math::GetValueOnAxis(centroidsBB.maxPoint, axis)) >= Math::EPSILON) {
+		auto upperParameters = mBuildParameters;
+		upperParameters.traversalCost = HLBVHUpperTraversalCost;
+		auto split = FindSAHSplit(nTreelets,
+								  [&](int i) -> const Oblivion::BoundingBox& { return treelets[start + i].boundingBox; },
+								  bb, centroidsBB, upperParameters);
+		if (split.axis != -1) {
+			axis = (Math::Axis)split.axis;
+			auto midPoint = std::partition(treelets.begin() + start, treelets.begin() + end,
+										   [&](const LBVHTreelet& treelet) {
+											   return GetSAHBucket(centroidsBB, treelet.boundingBox, axis, mBuildParameters.numberOfBuckets) <= split.bucket;
+										   });
+			mid = int(midPoint - treelets.begin());
+		}
+	}
+
+	auto nodeIndex = EmitInterior(nodes, bb, axis);
+	BuildUpperSAH(treelets, start, mid, nodes);
+	nodes[nodeIndex].secondChildOffset = (unsigned int)nodes.size();
+	BuildUpperSAH(treelets, mid, end, nodes);
+}
+
+// Bins of a spatial split along one axis. A bin covers [start, end): a reference enters the bin of its minimum and exits
+// the bin of its maximum, but a maximum right on the start of a bin exits in the bin before, so that a reference that
+// only touches a plane stays on one side of it
+struct SpatialBins {
+	float minValue = 0.0f;
+	float binWidth = 0.0f;
+	int numberOfBins = 1;
+
+	int GetEntryBin(float value) const {
+		return std::clamp(int((value - minValue) / binWidth), 0, numberOfBins - 1);
+	}
+
+	int GetExitBin(float value, int entryBin) const {
+		return std::clamp(int(std::ceil((value - minValue) / binWidth)) - 1, entryBin, numberOfBins - 1);
+	}
+
+	float GetBinStart(int bin) const {
+		return minValue + bin * binWidth;
+	}
+};
+
+struct SpatialSplit {
+	int axis = -1;
+	SpatialBins bins;
+	// The left child gets the bins up to this one
+	int bin = 0;
+	float position = 0.0f;
+	float cost = FLT_MAX;
+	int leftCount = 0, rightCount = 0;
+	Oblivion::BoundingBox leftBB, rightBB;
+};
+
+// Bins the references by the space they cover rather than by their centroids. A reference that crosses
+// several bins is clipped to each one, and counted once where it enters and once where it exits
+template <typename clipPrimitive>
+SpatialSplit FindSpatialSplit(const std::vector<BVHPrimitiveInfo>& references, const Oblivion::BoundingBox& bb,
+							  const BvhTree::BuildParameters& parameters, clipPrimitive&& ClipPrimitive) {
+	const int numberOfBins = (int)parameters.numberOfBuckets;
+	float nodeArea = bb.SurfaceArea();
+	float invNodeArea = nodeArea > 0.0f ? 1.0f / nodeArea : 0.0f;
+
+	SpatialSplit best;
+	for (int axisIndex = 0; axisIndex < 3; ++axisIndex) {
+		auto axis = (Math::Axis)axisIndex;
+		float minValue = Math::GetValueOnAxis(bb.minPoint, axis);
+		float extent = Math::GetValueOnAxis(bb.maxPoint, axis) - minValue;
+		if (extent < Math::EPSILON) {
+			continue;
+		}
+		SpatialBins spatialBins{ minValue, extent / numberOfBins, numberOfBins };
+
+		Oblivion::BoundingBox bins[BvhTree::MaxBuckets];
+		int entries[BvhTree::MaxBuckets] = {}, exits[BvhTree::MaxBuckets] = {};
+		for (const auto& reference : references) {
+			int firstBin = spatialBins.GetEntryBin(Math::GetValueOnAxis(reference.boundingBox.minPoint, axis));
+			int lastBin = spatialBins.GetExitBin(Math::GetValueOnAxis(reference.boundingBox.maxPoint, axis), firstBin);
+			entries[firstBin]++;
+			exits[lastBin]++;
+
+			if (firstBin == lastBin) {
+				bins[firstBin] |= reference.boundingBox;
+				continue;
+			}
+			for (int bin = firstBin; bin <= lastBin; ++bin) {
+				Oblivion::BoundingBox binBB = reference.boundingBox;
+				if (bin != firstBin) {
+					SetValueOnAxis(binBB.minPoint, axis, spatialBins.GetBinStart(bin));
+				}
+				if (bin != lastBin) {
+					SetValueOnAxis(binBB.maxPoint, axis, spatialBins.GetBinStart(bin + 1));
+				}
+				auto clippedBB = ClipPrimitive(reference, binBB);
+				if (!clippedBB.IsEmpty()) {
+					bins[bin] |= clippedBB;
+				}
+			}
+		}
+
+		Oblivion::BoundingBox rightBB[BvhTree::MaxBuckets];
+		int rightCount[BvhTree::MaxBuckets];
+		Oblivion::BoundingBox accumulatedBB;
+		int accumulatedCount = 0;
+		for (int i = numberOfBins - 1; i > 0; --i) {
+			accumulatedBB |= bins[i];
+			accumulatedCount += exits[i];
+			rightBB[i] = accumulatedBB;
+			rightCount[i] = accumulatedCount;
+		}
+
+		accumulatedBB = Oblivion::BoundingBox();
+		accumulatedCount = 0;
+		for (int i = 0; i < numberOfBins - 1; ++i) {
+			accumulatedBB |= bins[i];
+			accumulatedCount += entries[i];
+			if (accumulatedCount == 0 || rightCount[i + 1] == 0 || accumulatedBB.IsEmpty() || rightBB[i + 1].IsEmpty()) {
+				continue;
+			}
+
+			float cost = parameters.traversalCost +
+				(accumulatedCount * accumulatedBB.SurfaceArea() + rightCount[i + 1] * rightBB[i + 1].SurfaceArea()) * invNodeArea;
+			if (cost < best.cost) {
+				best.axis = axisIndex;
+				best.bins = spatialBins;
+				best.bin = i;
+				best.position = spatialBins.GetBinStart(i + 1);
+				best.cost = cost;
+				best.leftCount = accumulatedCount;
+				best.rightCount = rightCount[i + 1];
+				best.leftBB = accumulatedBB;
+				best.rightBB = rightBB[i + 1];
+			}
 		}
 	}
-	return currentNode;
+	return best;
 }
 
-void RenderBVHTree(const std::unique_ptr<BVHNode>& root, std::function<void(const Oblivion::BoundingBox& bb)> renderBoundingBox) {
+template <typename primitiveType>
+struct SBVHBuildState {
+	AccelerableStructure<primitiveType>* accelerableStructure;
+	unsigned int maxPrimitiveInNodes;
+	// Spatial splits are only tried when the children of the best object split overlap by more than this area
+	float minimumOverlapArea;
+	// Number of references that may still be duplicated
+	std::atomic<int> remainingDuplicates;
+
+	std::mutex orderedReferencesMutex;
+	std::vector<BVHPrimitiveInfo>& orderedReferences;
+
+	Oblivion::BoundingBox ClipReference(const BVHPrimitiveInfo& reference, const Oblivion::BoundingBox& box) {
+		// A reference may already be a clipped part of its primitive, so the result can't grow past it
+		return accelerableStructure->ClipPrimitive(reference.index, box) & reference.boundingBox;
+	}
+};
+
+template <typename primitiveType>
+void BvhTree::SBVHBuild(AccelerableStructure<primitiveType>* accelerableStructure, std::vector<BVHPrimitiveInfo>&& references,
+						unsigned int maxPrimitiveInNodes, std::vector<BVHPrimitiveInfo>& orderedReferences, std::vector<BVHTreeNode>& nodes) {
+	Oblivion::BoundingBox rootBB, rootCentroidsBB;
+	ComputeBounds(references, 0, (int)references.size(), rootBB, rootCentroidsBB);
+
+	SBVHBuildState<primitiveType> state{ accelerableStructure, maxPrimitiveInNodes,
+		mBuildParameters.spatialSplitAlpha * rootBB.SurfaceArea(),
+		int(mBuildParameters.spatialSplitBudget * references.size()),
+		{}, orderedReferences };
+	orderedReferences.reserve(size_t(references.size() * (1.0f + mBuildParameters.spatialSplitBudget)));
+
+	SBVHRecursiveBuild(state, references, nodes);
+}
+
+template <typename primitiveType>
+void BvhTree::SBVHRecursiveBuild(SBVHBuildState<primitiveType>& state, std::vector<BVHPrimitiveInfo>& references, std::vector<BVHTreeNode>& nodes) {
+	EVALUATE(!references.empty(), "Cannot build a SBVH node without any references");
+
+	Oblivion::BoundingBox bb, centroidsBB;
+	int nReferences = (int)references.size();
+	ComputeBounds(references, 0, nReferences, bb, centroidsBB);
+
+	auto CreateLeaf = [&]() {
+		std::unique_lock<std::mutex> lock(state.orderedReferencesMutex);
+		EmitLeaf(nodes, bb, (int)state.orderedReferences.size(), nReferences);
+		std::copy(references.begin(), references.end(), std::back_inserter(state.orderedReferences));
+	};
+
+	if (nReferences == 1) {
+		CreateLeaf();
+		return;
+	}
+
+	auto objectSplit = FindSAHSplit(nReferences,
+									[&](int i) -> const Oblivion::BoundingBox& { return references[i].boundingBox; },
+									bb, centroidsBB, mBuildParameters);
+
+	bool trySpatialSplit = state.remainingDuplicates > 0;
+	if (objectSplit.axis != -1) {
+		auto overlapBB = objectSplit.leftBB & objectSplit.rightBB;
+		trySpatialSplit = trySpatialSplit && !overlapBB.IsEmpty() && overlapBB.SurfaceArea() > state.minimumOverlapArea;
+	}
+
+	SpatialSplit spatialSplit;
+	if (trySpatialSplit) {
+		spatialSplit = FindSpatialSplit(references, bb, mBuildParameters,
+										[&](const BVHPrimitiveInfo& reference, const Oblivion::BoundingBox& box) {
+											return state.ClipReference(reference, box);
+										});
+	}
+
+	float leafCost = (float)nReferences;
+	float splitCost = std::min(objectSplit.cost, spatialSplit.cost);
+	if (nReferences <= (int)state.maxPrimitiveInNodes && splitCost >= leafCost) {
+		CreateLeaf();
+		return;
+	}
+
+	Math::Axis axis = centroidsBB.MaximumExtent();
+	std::vector<BVHPrimitiveInfo> left, right;
+	if (spatialSplit.axis != -1 && spatialSplit.cost < objectSplit.cost) {
+		// Reserve the worst case, the references that don't need to be duplicated are given back below
+		int straddling = spatialSplit.leftCount + spatialSplit.rightCount - nReferences;
+		if (state.remainingDuplicates.fetch_sub(straddling) >= straddling) {
+			axis = (Math::Axis)spatialSplit.axis;
+			float position = spatialSplit.position;
+			Oblivion::BoundingBox leftBB = spatialSplit.leftBB, rightBB = spatialSplit.rightBB;
+			int leftCount = spatialSplit.leftCount, rightCount = spatialSplit.rightCount;
+			int duplicates = 0;
+
+			left.reserve(leftCount);
+			right.reserve(rightCount);
+			for (const auto& reference : references) {
+				// Sides are decided by bins, as when the references were counted
+				int entryBin = spatialSplit.bins.GetEntryBin(Math::GetValueOnAxis(reference.boundingBox.minPoint, axis));
+				int exitBin = spatialSplit.bins.GetExitBin(Math::GetValueOnAxis(reference.boundingBox.maxPoint, axis), entryBin);
+				if (exitBin <= spatialSplit.bin) {
+					left.push_back(reference);
+					continue;
+				} else if (entryBin > spatialSplit.bin) {
+					right.push_back(reference);
+					continue;
+				}
+
+				// Reference unsplitting: keep the whole reference on one side when that is cheaper than duplicating it
+				float duplicateCost = leftBB.SurfaceArea() * leftCount + rightBB.SurfaceArea() * rightCount;
+				float leftOnlyCost = (leftBB | reference.boundingBox).SurfaceArea() * leftCount + rightBB.SurfaceArea() * (rightCount - 1);
+				float rightOnlyCost = leftBB.SurfaceArea() * (leftCount - 1) + (rightBB | reference.boundingBox).SurfaceArea() * rightCount;
+				if (leftOnlyCost < duplicateCost && leftOnlyCost <= rightOnlyCost) {
+					left.push_back(reference);
+					leftBB |= reference.boundingBox;
+					rightCount--;
+					continue;
+				} else if (rightOnlyCost < duplicateCost) {
+					right.push_back(reference);
+					rightBB |= reference.boundingBox;
+					leftCount--;
+					continue;
+				}
+
+				Oblivion::BoundingBox leftPart = reference.boundingBox, rightPart = reference.boundingBox;
+				SetValueOnAxis(leftPart.maxPoint, axis, position);
+				SetValueOnAxis(rightPart.minPoint, axis, position);
+				leftPart = state.ClipReference(reference, leftPart);
+				rightPart = state.ClipReference(reference, rightPart);
+				if (leftPart.IsEmpty()) {
+					right.push_back(reference);
+				} else if (rightPart.IsEmpty()) {
+					left.push_back(reference);
+				} else {
+					left.emplace_back(reference.index, leftPart);
+					right.emplace_back(reference.index, rightPart);
+					duplicates++;
+				}
+			}
+			state.remainingDuplicates += straddling - duplicates;
 
-	// renderBoundingBox(root->boundingBox);
+			// Duplicating every reference in one of the children wouldn't make any progress
+			if (left.empty() || right.empty() || (int)left.size() == nReferences || (int)right.size() == nReferences) {
+				state.remainingDuplicates += duplicates;
+				left.clear();
+				right.clear();
+			}
+		} else {
+			state.remainingDuplicates += straddling;
+		}
+	}
 
-	/*if (root->children[0] != nullptr) {
-		RenderBVHTree(root->children[0], renderBoundingBox);
+	if (left.empty() && right.empty()) {
+		int mid;
+		if (objectSplit.axis != -1) {
+			axis = (Math::Axis)objectSplit.axis;
+			auto midPoint = std::partition(references.begin(), references.end(),
+										   [&](const BVHPrimitiveInfo& reference) {
+											   return GetSAHBucket(centroidsBB, reference.boundingBox, axis, mBuildParameters.numberOfBuckets) <= objectSplit.bucket;
+										   });
+			mid = int(midPoint - references.begin());
+		} else {
+			mid = nReferences / 2;
+			std::nth_element(references.begin(), references.begin() + mid, references.end(),
+							 [&](const BVHPrimitiveInfo& lhs, const BVHPrimitiveInfo& rhs) {
+								 return Math::GetValueOnAxis(lhs.boundingBox.Center(), axis) < Math::GetValueOnAxis(rhs.boundingBox.Center(), axis);
+							 });
+		}
+		left.assign(references.begin(), references.begin() + mid);
+		right.assign(references.begin() + mid, references.end());
 	}
-	if (root->children[1] != nullptr) {
-		RenderBVHTree(root->children[1], renderBoundingBox);
-	}*/
+	// The children own their references from now on
+	references = std::vector<BVHPrimitiveInfo>();
+
+	auto nodeIndex = EmitInterior(nodes, bb, axis);
+	BuildChildren(nodes, nodeIndex, nReferences > ParallelBuildThreshold, 2 * right.size(),
+				  [&](int childIndex, std::vector<BVHTreeNode>& childNodes) {
+					  SBVHRecursiveBuild(state, childIndex == 0 ? left : right, childNodes);
+				  });
+}
+
+void RenderBVHTree(const std::vector<BVHTreeNode>& nodes, std::function<void(const Oblivion::BoundingBox& bb)> renderBoundingBox) {
 
-	std::queue<std::pair<const std::unique_ptr<BVHNode>&, unsigned int>> boundingBoxes;
-	boundingBoxes.push({ root, 0 });
+	std::queue<std::pair<unsigned int, unsigned int>> boundingBoxes;
+	boundingBoxes.push({ 0, 0 });
 
 	constexpr const unsigned int MaxDepth = 3;
 	while (!boundingBoxes.empty()) {
-		auto front = boundingBoxes.front();
+		auto [nodeIndex, depth] = boundingBoxes.front();
 		boundingBoxes.pop();
-		auto depth = front.second;
 		if (depth >= MaxDepth)
 			break;
 
-		if (front.first) {
-			renderBoundingBox(front.first->boundingBox);
-			boundingBoxes.push({ front.first->children[0], depth + 1 });
-			boundingBoxes.push({ front.first->children[1], depth + 1 });
+		const auto& node = nodes[nodeIndex];
+		renderBoundingBox(GetNodeBoundingBox(node));
+		if (node.numberOfPrimitives == 0) {
+			boundingBoxes.push({ nodeIndex + 1, depth + 1 });
+			boundingBoxes.push({ node.secondChildOffset, depth + 1 });
 		}
 	}
 
 
 }
 
+// Sorts the nodes by depth, so that every level is a contiguous range of indices: the nodes of level d are
+// nodesByDepth[levelOffsets[d]] up to nodesByDepth[levelOffsets[d + 1]]
+void SortNodesByDepth(const std::vector<unsigned int>& depths, unsigned int maxDepth, std::vector<unsigned int>& nodesByDepth,
+					  std::vector<unsigned int>& levelOffsets) {
+	levelOffsets.assign(maxDepth + 2, 0);
+	for (auto depth : depths) {
+		levelOffsets[depth + 1]++;
+	}
+	for (unsigned int depth = 0; depth <= maxDepth; ++depth) {
+		levelOffsets[depth + 1] += levelOffsets[depth];
+	}
+	nodesByDepth.resize(depths.size());
+	auto nextOffsets = levelOffsets;
+	for (unsigned int i = 0; i < depths.size(); ++i) {
+		nodesByDepth[nextOffsets[depths[i]]++] = i;
+	}
+}
+
+// Node of a tree being restructured. The children are explicit, so that treelets can be rewired in place; leaves keep
+// their index in the original array
+struct RestructureNode {
+	Oblivion::BoundingBox boundingBox;
+	// SAH cost of the subtree, not divided by the area of the root
+	float cost;
+	unsigned int children[2];
+};
+
+// Treelets restructured by every task
+constexpr const int RestructureChunkSize = 64;
+
+// Replaces the treelet under treeletRoot with the topology of lowest SAH cost. The treelet is grown from the root by
+// opening the leaf with the largest area, then every way of splitting every subset of its leaves is evaluated, from the
+// smallest subsets up [Karras & Aila 2013]. Only nodes below treeletRoot are written
+void RestructureTreelet(std::vector<RestructureNode>& tree, const std::vector<BVHTreeNode>& nodes, unsigned int treeletRoot,
+						unsigned int treeletSize, float traversalCost) {
+	unsigned int leaves[BvhTree::MaxTreeletSize];
+	unsigned int interiors[BvhTree::MaxTreeletSize - 1];
+	unsigned int numberOfLeaves = 0, numberOfInteriors = 0;
+	leaves[numberOfLeaves++] = tree[treeletRoot].children[0];
+	leaves[numberOfLeaves++] = tree[treeletRoot].children[1];
+	interiors[numberOfInteriors++] = treeletRoot;
+	while (numberOfLeaves < treeletSize) {
+		int largestLeaf = -1;
+		float largestArea = -1.0f;
+		for (unsigned int i = 0; i < numberOfLeaves; ++i) {
+			if (nodes[leaves[i]].numberOfPrimitives == 0 && tree[leaves[i]].boundingBox.SurfaceArea() > largestArea) {
+				largestArea = tree[leaves[i]].boundingBox.SurfaceArea();
+				largestLeaf = (int)i;
+			}
+		}
+		if (largestLeaf == -1) {
+			break;
+		}
+		unsigned int opened = leaves[largestLeaf];
+		interiors[numberOfInteriors++] = opened;
+		leaves[largestLeaf] = tree[opened].children[0];
+		leaves[numberOfLeaves++] = tree[opened].children[1];
+	}
+	if (numberOfLeaves < 3) {
+		// Two leaves can only be arranged one way
+		return;
+	}
+
+	// Subsets of the treelet leaves are bit masks. Every subset of a mask is a smaller number, so a single pass in
+	// increasing order has the best cost of every part ready when a mask is split
+	Oblivion::BoundingBox subsetBoundingBox[1 << BvhTree::MaxTreeletSize];
+	float subsetCost[1 << BvhTree::MaxTreeletSize];
+	unsigned int subsetPartition[1 << BvhTree::MaxTreeletSize];
+	unsigned int numberOfSubsets = 1u << numberOfLeaves;
+	for (unsigned int subset = 1; subset < numberOfSubsets; ++subset) {
+		unsigned int lowestBit = subset & (~subset + 1);
+		unsigned int lowestLeaf = 0;
+		while ((1u << lowestLeaf) != lowestBit) {
+			++lowestLeaf;
+		}
+		if (subset == lowestBit) {
+			subsetBoundingBox[subset] = tree[leaves[lowestLeaf]].boundingBox;
+			subsetCost[subset] = tree[leaves[lowestLeaf]].cost;
+			continue;
+		}
+		subsetBoundingBox[subset] = subsetBoundingBox[subset ^ lowestBit] | subsetBoundingBox[lowestBit];
+
+		// Only the parts holding the lowest leaf, so that every split is evaluated once
+		float bestCost = std::numeric_limits<float>::infinity();
+		unsigned int bestPartition = 0;
+		for (unsigned int part = (subset - 1) & subset; part != 0; part = (part - 1) & subset) {
+			if ((part & lowestBit) == 0) {
+				continue;
+			}
+			float cost = subsetCost[part] + subsetCost[subset ^ part];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestPartition = part;
+			}
+		}
+		subsetCost[subset] = traversalCost * subsetBoundingBox[subset].SurfaceArea() + bestCost;
+		subsetPartition[subset] = bestPartition;
+	}
+
+	unsigned int allLeaves = numberOfSubsets - 1;
+	if (subsetCost[allLeaves] >= tree[treeletRoot].cost * (1.0f - 1e-6f)) {
+		return;
+	}
+
+	// Rebuild the treelet with the same interior nodes. The first one taken is the root, so the treelet stays where it was
+	unsigned int nextInterior = 0;
+	std::function<unsigned int(unsigned int)> BuildSubset = [&](unsigned int subset) -> unsigned int {
+		if ((subset & (subset - 1)) == 0) {
+			unsigned int leaf = 0;
+			while ((1u << leaf) != subset) {
+				++leaf;
+			}
+			return leaves[leaf];
+		}
+		unsigned int index = interiors[nextInterior++];
+		unsigned int firstChild = BuildSubset(subsetPartition[subset]);
+		unsigned int secondChild = BuildSubset(subset ^ subsetPartition[subset]);
+		tree[index].children[0] = firstChild;
+		tree[index].children[1] = secondChild;
+		tree[index].boundingBox = subsetBoundingBox[subset];
+		tree[index].cost = subsetCost[subset];
+		return index;
+	};
+	BuildSubset(allLeaves);
+}
+
+// Writes the restructured subtree depth first, with the children ordered along the axis that separates them the most
+void EmitRestructuredNode(const std::vector<RestructureNode>& tree, const std::vector<BVHTreeNode>& oldNodes, unsigned int index,
+						  std::vector<BVHTreeNode>& nodes) {
+	if (oldNodes[index].numberOfPrimitives > 0) {
+		nodes.push_back(oldNodes[index]);
+		return;
+	}
+
+	const auto& node = tree[index];
+	const auto& firstBB = tree[node.children[0]].boundingBox;
+	const auto& secondBB = tree[node.children[1]].boundingBox;
+	DirectX::XMFLOAT3 firstCentroid((firstBB.minPoint.x + firstBB.maxPoint.x) * 0.5f, (firstBB.minPoint.y + firstBB.maxPoint.y) * 0.5f,
+									(firstBB.minPoint.z + firstBB.maxPoint.z) * 0.5f);
+	DirectX::XMFLOAT3 secondCentroid((secondBB.minPoint.x + secondBB.maxPoint.x) * 0.5f, (secondBB.minPoint.y + secondBB.maxPoint.y) * 0.5f,
+									 (secondBB.minPoint.z + secondBB.maxPoint.z) * 0.5f);
+	Oblivion::BoundingBox centroidsBB;
+	centroidsBB |= firstCentroid;
+	centroidsBB |= secondCentroid;
+	Math::Axis axis = centroidsBB.MaximumExtent();
+	bool swapChildren = Math::GetValueOnAxis(firstCentroid, axis) > Math::GetValueOnAxis(secondCentroid, axis);
+
+	unsigned int nodeIndex = EmitInterior(nodes, node.boundingBox, axis);
+	EmitRestructuredNode(tree, oldNodes, node.children[swapChildren ? 1 : 0], nodes);
+	nodes[nodeIndex].secondChildOffset = (unsigned int)nodes.size();
+	EmitRestructuredNode(tree, oldNodes, node.children[swapChildren ? 0 : 1], nodes);
+}
+
 template <typename primitiveType>
-std::shared_ptr<BvhTree> BvhTree::Create(AccelerableStructure<primitiveType>* accelerableStructure, SplitMethod splitType,
-										 unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf) {
-	auto tree = std::shared_ptr<BvhTree>(new BvhTree);
+void BvhTree::Refit(const AccelerableStructure<primitiveType>* accelerableStructure) {
+	EVALUATE(!mNodes.empty(), "Cannot refit an empty BVH");
+	unsigned int primitiveCount = accelerableStructure->GetPrimitiveCount();
+
+	// Parents are stored before their children, so a single pass finds the depth of every node
+	std::vector<unsigned int> depths(mNodes.size(), 0);
+	unsigned int maxDepth = 0;
+	for (unsigned int i = 0; i < mNodes.size(); ++i) {
+		const auto& node = mNodes[i];
+		if (node.numberOfPrimitives == 0) {
+			depths[i + 1] = depths[node.secondChildOffset] = depths[i] + 1;
+			maxDepth = std::max(maxDepth, depths[i] + 1);
+		} else {
+			EVALUATE(node.primitiveOffset + node.numberOfPrimitives <= primitiveCount, "A leaf references primitives up to ",
+					 node.primitiveOffset + node.numberOfPrimitives, ", but the structure has only ", primitiveCount);
+		}
+	}
 
-	auto structurePrimitives = accelerableStructure->GetPrimitives();
+	std::vector<unsigned int> nodesByDepth, levelOffsets;
+	SortNodesByDepth(depths, maxDepth, nodesByDepth, levelOffsets);
+
+	// The nodes of a level only read the level below, so each level is refit in parallel once the deeper ones are done
+	for (int depth = (int)maxDepth; depth >= 0; --depth) {
+		unsigned int levelStart = levelOffsets[depth];
+		unsigned int levelEnd = levelOffsets[depth + 1];
+		int64_t numberOfChunks = ((int64_t)levelEnd - levelStart + RefitChunkSize - 1) / RefitChunkSize;
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t chunkIndex) {
+				unsigned int chunkStart = levelStart + (unsigned int)chunkIndex * RefitChunkSize;
+				unsigned int chunkEnd = std::min(chunkStart + RefitChunkSize, levelEnd);
+				for (unsigned int i = chunkStart; i < chunkEnd; ++i) {
+					auto& node = mNodes[nodesByDepth[i]];
+					Oblivion::BoundingBox bb;
+					if (node.numberOfPrimitives > 0) {
+						for (unsigned int primitive = 0; primitive < node.numberOfPrimitives; ++primitive) {
+							bb |= accelerableStructure->GetPrimitiveBoundingBox(node.primitiveOffset + primitive);
+						}
+					} else {
+						const auto& firstChild = mNodes[nodesByDepth[i] + 1];
+						const auto& secondChild = mNodes[node.secondChildOffset];
+						bb = Oblivion::BoundingBox(firstChild.minAABB, firstChild.maxAABB) |
+							Oblivion::BoundingBox(secondChild.minAABB, secondChild.maxAABB);
+					}
+					node.minAABB = bb.minPoint;
+					node.maxAABB = bb.maxPoint;
+				}
+			}, numberOfChunks, 1);
+	}
 
-	auto primitives = tree->BuildPrimitives(structurePrimitives);
+	mRenderLines.clear();
+	BuildRenderLines();
+}
 
-	unsigned int totalNodes = 0;
-	decltype(structurePrimitives) newPrimitives;
-	newPrimitives.reserve(structurePrimitives.size());
-	auto root = tree->RecursiveBuild(primitives, splitType, maxPrimitiveInNodes, structurePrimitives, newPrimitives,
-									 0, (int)primitives.size(), &totalNodes);
+void BvhTree::Restructure(unsigned int treeletSize, unsigned int numberOfPasses) {
+	EVALUATE(treeletSize >= 3 && treeletSize <= MaxTreeletSize, "The treelet size must be between 3 and ", MaxTreeletSize,
+			 ", got ", treeletSize);
 
-	int offset = 0;
-	tree->mNodes.resize(totalNodes);
-	if constexpr (std::is_same_v<primitiveType, ModelPrimitive>) {
-		tree->FlattenBVH<MODEL_PRIMITIVE_TYPE>(root, offset, maxPrimitivesInLeaf);
-	} else if constexpr (std::is_same_v<primitiveType, ScenePrimitive>) {
-		tree->FlattenBVH<SCENE_PRIMITIVE_TYPE>(root, offset, maxPrimitivesInLeaf);
+	std::vector<RestructureNode> tree(mNodes.size());
+	for (unsigned int i = 0; i < mNodes.size(); ++i) {
+		tree[i].boundingBox = GetNodeBoundingBox(mNodes[i]);
+		tree[i].children[0] = i + 1;
+		tree[i].children[1] = mNodes[i].secondChildOffset;
+	}
+	// Children are stored after their parents
+	for (int i = (int)mNodes.size() - 1; i >= 0; --i) {
+		float area = tree[i].boundingBox.SurfaceArea();
+		if (mNodes[i].numberOfPrimitives > 0) {
+			tree[i].cost = area * mNodes[i].numberOfPrimitives;
+		} else {
+			tree[i].cost = mBuildParameters.traversalCost * area + tree[tree[i].children[0]].cost + tree[tree[i].children[1]].cost;
+		}
+	}
+	float initialCost = tree[0].cost;
+
+	std::vector<unsigned int> depths(mNodes.size());
+	std::vector<unsigned int> stack;
+	std::vector<unsigned int> nodesByDepth, levelOffsets;
+	for (unsigned int pass = 0; pass < numberOfPasses; ++pass) {
+		unsigned int maxDepth = 0;
+		depths[0] = 0;
+		stack.push_back(0);
+		while (!stack.empty()) {
+			unsigned int index = stack.back();
+			stack.pop_back();
+			maxDepth = std::max(maxDepth, depths[index]);
+			if (mNodes[index].numberOfPrimitives == 0) {
+				for (auto child : tree[index].children) {
+					depths[child] = depths[index] + 1;
+					stack.push_back(child);
+				}
+			}
+		}
+		SortNodesByDepth(depths, maxDepth, nodesByDepth, levelOffsets);
+
+		// A treelet only rewires nodes below its root, so the roots of a level can be processed in parallel once the
+		// deeper levels are done, and every treelet is built from subtrees that were already optimized
+		for (int depth = (int)maxDepth - 1; depth >= 0; --depth) {
+			unsigned int levelStart = levelOffsets[depth];
+			unsigned int levelEnd = levelOffsets[depth + 1];
+			int64_t numberOfChunks = ((int64_t)levelEnd - levelStart + RestructureChunkSize - 1) / RestructureChunkSize;
+			Threading::Get()->ParralelForImmediate(
+				[&](int64_t chunkIndex) {
+					unsigned int chunkStart = levelStart + (unsigned int)chunkIndex * RestructureChunkSize;
+					unsigned int chunkEnd = std::min(chunkStart + RestructureChunkSize, levelEnd);
+					for (unsigned int i = chunkStart; i < chunkEnd; ++i) {
+						if (mNodes[nodesByDepth[i]].numberOfPrimitives == 0) {
+							RestructureTreelet(tree, mNodes, nodesByDepth[i], treeletSize, mBuildParameters.traversalCost);
+						}
+					}
+				}, numberOfChunks, 1);
+		}
+	}
+
+	std::vector<BVHTreeNode> nodes;
+	nodes.reserve(mNodes.size());
+	EmitRestructuredNode(tree, mNodes, 0, nodes);
+	mNodes = std::move(nodes);
+
+	Oblivion::DebugPrintLine("Restructured the BVH in ", numberOfPasses, " passes. SAH cost ",
+							 initialCost / tree[0].boundingBox.SurfaceArea(), " -> ", tree[0].cost / tree[0].boundingBox.SurfaceArea());
+}
+
+void BvhTree::ApplyLayout(NodeLayout layout, const std::vector<unsigned int>& visitCounts) {
+	EVALUATE(!mNodes.empty(), "Cannot lay out an empty BVH");
+	EVALUATE(visitCounts.empty() || visitCounts.size() == mNodes.size(), "Expected a visit count for each of the ", mNodes.size(),
+			 " nodes, got ", visitCounts.size());
+
+	std::vector<std::array<unsigned int, 2>> children(mNodes.size());
+	std::vector<bool> swapChildren(mNodes.size(), false);
+	for (unsigned int i = 0; i < mNodes.size(); ++i) {
+		if (mNodes[i].numberOfPrimitives == 0) {
+			children[i] = { i + 1, mNodes[i].secondChildOffset };
+		}
+	}
+
+	if (layout == NodeLayout::SubtreeSize || layout == NodeLayout::HotPathFirst) {
+		// Children are stored after their parents, so a reverse pass sees them first
+		std::vector<float> weights(mNodes.size());
+		for (int i = (int)mNodes.size() - 1; i >= 0; --i) {
+			if (layout == NodeLayout::SubtreeSize) {
+				weights[i] = mNodes[i].numberOfPrimitives > 0 ? 1.0f : 1.0f + weights[children[i][0]] + weights[children[i][1]];
+			} else {
+				weights[i] = visitCounts.empty() ? GetNodeBoundingBox(mNodes[i]).SurfaceArea() : (float)visitCounts[i];
+			}
+		}
+		for (unsigned int i = 0; i < mNodes.size(); ++i) {
+			if (mNodes[i].numberOfPrimitives > 0) {
+				continue;
+			}
+			float firstWeight = weights[children[i][0]], secondWeight = weights[children[i][1]];
+			swapChildren[i] = layout == NodeLayout::SubtreeSize ? firstWeight > secondWeight : secondWeight > firstWeight;
+			if (swapChildren[i]) {
+				std::swap(children[i][0], children[i][1]);
+			}
+		}
+	}
+
+	std::vector<unsigned int> order;
+	order.reserve(mNodes.size());
+	if (layout != NodeLayout::CacheOblivious) {
+		std::vector<unsigned int> stack = { 0 };
+		while (!stack.empty()) {
+			unsigned int index = stack.back();
+			stack.pop_back();
+			order.push_back(index);
+			if (mNodes[index].numberOfPrimitives == 0) {
+				stack.push_back(children[index][1]);
+				stack.push_back(children[index][0]);
+			}
+		}
 	} else {
-		static_assert(false, "Unknown primitive type");
+		// A chain starts at the root or at a second child and follows the first children down to a leaf. Chains have to
+		// be stored whole, but can go anywhere, so they are the nodes of the tree laid out in van Emde Boas order: the
+		// top half of the levels first, then every subtree hanging from it, each laid out the same way.
+		// chainLevels[i] = levels of chains in the subtree of node i
+		std::vector<unsigned int> chainLevels(mNodes.size(), 1);
+		for (int i = (int)mNodes.size() - 1; i >= 0; --i) {
+			if (mNodes[i].numberOfPrimitives == 0) {
+				chainLevels[i] = std::max(chainLevels[children[i][0]], chainLevels[children[i][1]] + 1);
+			}
+		}
+
+		std::vector<unsigned int> hangingChains;
+		auto ForEachChainNode = [&](unsigned int chain, auto&& func) {
+			for (unsigned int index = chain; ; index = children[index][0]) {
+				func(index);
+				if (mNodes[index].numberOfPrimitives > 0) {
+					break;
+				}
+			}
+		};
+		std::function<void(unsigned int, unsigned int)> EmitChains = [&](unsigned int chain, unsigned int levels) {
+			levels = std::min(levels, chainLevels[chain]);
+			if (levels == 1) {
+				ForEachChainNode(chain, [&](unsigned int index) { order.push_back(index); });
+				return;
+			}
+			unsigned int topLevels = levels / 2;
+			EmitChains(chain, topLevels);
+
+			std::vector<unsigned int> bottomChains = { chain };
+			for (unsigned int level = 0; level < topLevels; ++level) {
+				std::vector<unsigned int> nextChains;
+				for (auto bottomChain : bottomChains) {
+					ForEachChainNode(bottomChain, [&](unsigned int index) {
+						if (mNodes[index].numberOfPrimitives == 0) {
+							nextChains.push_back(children[index][1]);
+						}
+					});
+				}
+				bottomChains = std::move(nextChains);
+			}
+			for (auto bottomChain : bottomChains) {
+				EmitChains(bottomChain, levels - topLevels);
+			}
+		};
+		EmitChains(0, chainLevels[0]);
 	}
+	EVALUATE(order.size() == mNodes.size(), "The layout placed ", order.size(), " out of ", mNodes.size(), " nodes");
 
-	accelerableStructure->ReorderPrimitives(newPrimitives);
+	std::vector<unsigned int> newIndices(mNodes.size());
+	for (unsigned int i = 0; i < order.size(); ++i) {
+		newIndices[order[i]] = i;
+	}
+	std::vector<BVHTreeNode> nodes;
+	nodes.reserve(mNodes.size());
+	for (unsigned int i = 0; i < order.size(); ++i) {
+		auto& node = nodes.emplace_back(mNodes[order[i]]);
+		if (node.numberOfPrimitives > 0) {
+			continue;
+		}
+		node.secondChildOffset = newIndices[children[order[i]][1]];
+		if (swapChildren[order[i]]) {
+			node.axis ^= BVH_FIRST_CHILD_ABOVE;
+		}
+	}
+	mNodes = std::move(nodes);
+}
 
+void BvhTree::BuildRenderLines() {
 	auto RenderBoundingBox = [&](const Oblivion::BoundingBox& bb) {
 
 		float minX = bb.minPoint.x;
@@ -329,31 +1488,95 @@ std::shared_ptr<BvhTree> BvhTree::Create(AccelerableStructure<primitiveType>* ac
 		// float colorMultiplier = float(ab) / MaxDepth;
 		// float colorMultiplier = 1.0f;
 
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, minZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
 
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, maxZ), DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
 
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, maxY, maxZ), DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(minX, minY, maxZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
 
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
-		tree->mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT3(maxX, minY, maxZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, minY, minZ), DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
+		mRenderLines.emplace_back(DirectX::XMFLOAT3(maxX, maxY, minZ), DirectX::XMFLOAT3(minX, maxY, minZ), DirectX::XMFLOAT4(0.0f, 1.0f, 0.0f, 1.0f));
 	};
 
 
-	RenderBVHTree(root, RenderBoundingBox);
+	RenderBVHTree(mNodes, RenderBoundingBox);
+}
+
+template <typename primitiveType>
+std::shared_ptr<BvhTree> BvhTree::Create(AccelerableStructure<primitiveType>* accelerableStructure, SplitMethod splitType,
+										 unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf,
+										 const BuildParameters& buildParameters) {
+	EVALUATE(buildParameters.numberOfBuckets >= 2 && buildParameters.numberOfBuckets <= MaxBuckets,
+			 "The number of SAH buckets must be between 2 and ", MaxBuckets, ", got ", buildParameters.numberOfBuckets);
+	auto tree = std::shared_ptr<BvhTree>(new BvhTree);
+	tree->mBuildParameters = buildParameters;
+
+	auto primitives = tree->BuildPrimitives(accelerableStructure);
+	EVALUATE(!primitives.empty(), "Cannot build a BVH without any primitives");
+
+	// A binary tree with a primitive per leaf is the largest a build can get without spatial splits
+	size_t maxNodes = 2 * primitives.size() - 1;
+	std::vector<BVHPrimitiveInfo> orderedPrimitives;
+	if (splitType == SplitMethod::HLBVH) {
+		tree->HLBVHBuild(primitives, maxPrimitiveInNodes, orderedPrimitives, tree->mNodes);
+		primitives = std::vector<BVHPrimitiveInfo>();
+	} else if (splitType == SplitMethod::SBVH) {
+		tree->mNodes.reserve(maxNodes);
+		tree->SBVHBuild(accelerableStructure, std::move(primitives), maxPrimitiveInNodes, orderedPrimitives, tree->mNodes);
+	} else {
+		tree->mNodes.reserve(maxNodes);
+		tree->RecursiveBuild(primitives, splitType, maxPrimitiveInNodes, 0, (int)primitives.size(), tree->mNodes);
+		orderedPrimitives = std::move(primitives);
+	}
+
+	if (buildParameters.restructurePasses > 0) {
+		tree->Restructure(buildParameters.treeletSize, buildParameters.restructurePasses);
+	}
+	if (buildParameters.nodeLayout != NodeLayout::DepthFirst) {
+		tree->ApplyLayout(buildParameters.nodeLayout);
+	}
+
+	std::vector<unsigned int> primitivesOrder;
+	primitivesOrder.reserve(orderedPrimitives.size());
+	for (const auto& info : orderedPrimitives) {
+		primitivesOrder.push_back(info.index);
+	}
+
+	if constexpr (std::is_same_v<primitiveType, ModelPrimitive>) {
+		tree->FinalizeNodes<MODEL_PRIMITIVE_TYPE>(maxPrimitivesInLeaf);
+	} else if constexpr (std::is_same_v<primitiveType, ScenePrimitive>) {
+		tree->FinalizeNodes<SCENE_PRIMITIVE_TYPE>(maxPrimitivesInLeaf);
+	} else {
+		static_assert(sizeof(primitiveType) == 0, "Unknown primitive type");
+	}
+
+	accelerableStructure->ReorderPrimitives(primitivesOrder);
+
+	tree->BuildRenderLines();
 
 	return tree;
 }
 
 
+std::shared_ptr<BvhTree> BvhTree::Create(std::vector<BVHTreeNode>&& nodes) {
+	EVALUATE(!nodes.empty(), "Cannot create a BVH without any nodes");
+	auto tree = std::shared_ptr<BvhTree>(new BvhTree);
+	tree->mNodes = std::move(nodes);
+	return tree;
+}
+
 template std::shared_ptr<BvhTree> BvhTree::Create(AccelerableStructure<ModelPrimitive>* accelerableStructure,
-												  BvhTree::SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf);
+												  BvhTree::SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf,
+												  const BvhTree::BuildParameters& buildParameters);
 template std::shared_ptr<BvhTree> BvhTree::Create(AccelerableStructure<ScenePrimitive>* accelerableStructure,
-												  BvhTree::SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf);
+												  BvhTree::SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf,
+												  const BvhTree::BuildParameters& buildParameters);
+template void BvhTree::Refit(const AccelerableStructure<ModelPrimitive>* accelerableStructure);
+template void BvhTree::Refit(const AccelerableStructure<ScenePrimitive>* accelerableStructure);
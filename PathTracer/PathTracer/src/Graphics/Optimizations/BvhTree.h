@@ -5,41 +5,114 @@
 #include "../ShaderObjects.h"
 #include "./Interfaces/AccelerableStructure.h"
 
+template <typename primitiveType>
+struct SBVHBuildState;
+
 class BvhTree {
 
 public:
 	enum class SplitMethod {
-		SAH, MiddlePoint, EqualCounts, HLBVH
+		SAH, MiddlePoint, EqualCounts, HLBVH, SBVH
 	};
 	static std::optional<SplitMethod> GetSplitMethodByName(const std::string& str);
 
+	// Order in which the nodes are stored. The first child of a node always follows it, so a layout picks which child
+	// comes first and where the subtrees of the second children go
+	//  DepthFirst: the order of the build
+	//  SubtreeSize: the smaller subtree first, which keeps the second child as close to its parent as possible
+	//  HotPathFirst: the child a ray is most likely to visit first, by surface area or by measured visits
+	//  CacheOblivious: van Emde Boas order of the chains of first children, so that nearby levels share cache lines and
+	//                  pages whatever their size
+	enum class NodeLayout {
+		DepthFirst, SubtreeSize, HotPathFirst, CacheOblivious
+	};
+	static std::optional<NodeLayout> GetNodeLayoutByName(const std::string& str);
+
+	static constexpr const unsigned int MaxBuckets = 64;
+	// Treelets larger than this have too many partitions to evaluate
+	static constexpr const unsigned int MaxTreeletSize = 8;
+	struct BuildParameters {
+		// Number of bins in which the centroids are split on every axis when evaluating SAH candidates
+		unsigned int numberOfBuckets = 12;
+		// Cost of traversing an interior node, relative to the cost of intersecting a primitive
+		float traversalCost = 1.0f;
+		// SBVH only: spatial splits are tried when the children of the best object split overlap by more than this
+		// fraction of the root's surface area
+		float spatialSplitAlpha = 1e-5f;
+		// SBVH only: how many references may be duplicated, relative to the number of primitives
+		float spatialSplitBudget = 0.3f;
+		// Passes of treelet restructuring run after the build. Every interior node is the root of a treelet with up to
+		// treeletSize leaves, which is rearranged into the topology with the lowest SAH cost
+		unsigned int restructurePasses = 0;
+		unsigned int treeletSize = 7;
+		// Early split clipping: before the build, the references whose box has a larger surface area than this fraction
+		// of the bounds of the structure are halved, and every half only bounds the part of the primitive inside it,
+		// largest boxes first. 0 turns it off. A few splits of the largest triangles help, thousands of small pieces
+		// cost more than they save
+		float preSplitThreshold = 0.0f;
+		// How many references the pre-split may add, relative to the number of primitives
+		float preSplitBudget = 0.3f;
+		NodeLayout nodeLayout = NodeLayout::DepthFirst;
+	};
+
 public:
 	const std::vector<Line>& GetRenderLines() const;
 	Oblivion::BoundingBox GetBoundingBox() const;
 
 	std::vector<BVHTreeNode>& GetNodes();
 
+	// Recomputes the bounds of every node, bottom up and one level at a time, after the primitives of the structure
+	// the tree was built for have moved. The topology and the order of the primitives are kept, so leaves must still
+	// index the primitives of the structure
+	template <typename primitiveType>
+	void Refit(const AccelerableStructure<primitiveType>* accelerableStructure);
+
+	// Stores the nodes in another order without changing the tree. Parents stay before their children.
+	// visitCounts[i] = number of rays that hit the box of node i; HotPathFirst uses them instead of the surface areas when given
+	void ApplyLayout(NodeLayout layout, const std::vector<unsigned int>& visitCounts = {});
+
 private:
 	template <typename primitiveType>
-	std::vector<struct BVHPrimitiveInfo> BuildPrimitives(const std::vector<primitiveType>& primitives);
+	std::vector<struct BVHPrimitiveInfo> BuildPrimitives(const AccelerableStructure<primitiveType>* accelerableStructure);
+	template <typename primitiveType>
+	void PreSplitPrimitives(const AccelerableStructure<primitiveType>* accelerableStructure, std::vector<struct BVHPrimitiveInfo>& primitivesInfo);
+	void RecursiveBuild(std::vector<struct BVHPrimitiveInfo>& primitiveInfo, SplitMethod splitType, unsigned int maxPrimitiveInNodes,
+						int start, int end, std::vector<BVHTreeNode>& nodes);
+
+	void HLBVHBuild(const std::vector<struct BVHPrimitiveInfo>& primitiveInfo, unsigned int maxPrimitiveInNodes,
+					std::vector<struct BVHPrimitiveInfo>& orderedPrimitiveInfo, std::vector<BVHTreeNode>& nodes);
+	void EmitLBVH(const std::vector<struct BVHPrimitiveInfo>& primitiveInfo, const struct MortonPrimitive* mortonPrimitives,
+				  int nPrimitives, int bitIndex, unsigned int maxPrimitiveInNodes,
+				  std::vector<struct BVHPrimitiveInfo>& orderedPrimitiveInfo, std::atomic<int>& orderedPrimitivesOffset,
+				  std::vector<BVHTreeNode>& nodes);
+	void BuildUpperSAH(std::vector<struct LBVHTreelet>& treelets, int start, int end, std::vector<BVHTreeNode>& nodes);
+
+	template <typename primitiveType>
+	void SBVHBuild(AccelerableStructure<primitiveType>* accelerableStructure, std::vector<struct BVHPrimitiveInfo>&& references,
+				   unsigned int maxPrimitiveInNodes, std::vector<struct BVHPrimitiveInfo>& orderedReferences, std::vector<BVHTreeNode>& nodes);
 	template <typename primitiveType>
-	std::unique_ptr<struct BVHNode> RecursiveBuild(std::vector<struct BVHPrimitiveInfo>& primitiveInfo, SplitMethod splitType, unsigned int maxPrimitiveInNodes,
-												   const std::vector<primitiveType>& primitives, std::vector<primitiveType>& newPrimitives,
-												   int start, int end, unsigned int* numNodes = nullptr);
+	void SBVHRecursiveBuild(SBVHBuildState<primitiveType>& state, std::vector<struct BVHPrimitiveInfo>& references, std::vector<BVHTreeNode>& nodes);
 
 	template <unsigned int NodeType>
-	int FlattenBVH(const std::unique_ptr<struct BVHNode>& root, int& offset, int maxPrimitivesInLeaf);
+	void FinalizeNodes(unsigned int maxPrimitivesInLeaf);
+	void Restructure(unsigned int treeletSize, unsigned int numberOfPasses);
+	void BuildRenderLines();
 
 public:
 	template <typename primitiveType>
 	static std::shared_ptr<BvhTree> Create(AccelerableStructure<primitiveType>* accelerableStructure,
-										   SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf);
+										   SplitMethod splitType, unsigned int maxPrimitiveInNodes, unsigned int maxPrimitivesInLeaf,
+										   const BuildParameters& buildParameters);
+	// A tree built before, e.g. read back from a cache. There are no render lines
+	static std::shared_ptr<BvhTree> Create(std::vector<BVHTreeNode>&& nodes);
 
 private:
 	std::vector<Line> mRenderLines;
 
 	std::vector<BVHTreeNode> mNodes;
 
+	BuildParameters mBuildParameters;
+
 private:
 	BvhTree() = default;
 
@@ -6,7 +6,15 @@
 template <class primitiveType>
 class AccelerableStructure {
 public:
-	virtual std::vector<std::shared_ptr<primitiveType>>& GetPrimitives() = 0;
-	virtual void ReorderPrimitives(std::vector<std::shared_ptr<primitiveType>>&) = 0;
+	virtual unsigned int GetPrimitiveCount() const = 0;
+	virtual Oblivion::BoundingBox GetPrimitiveBoundingBox(unsigned int index) const = 0;
+	// After this call primitive i is the one that was at order[i]. An index may appear more than once
+	virtual void ReorderPrimitives(const std::vector<unsigned int>& order) = 0;
+
+	// Returns the bounds of the part of the primitive that lies inside box. Used by spatial splits, structures
+	// that can't clip their primitives exactly fall back to the overlap of the primitive's bounds with the box
+	virtual Oblivion::BoundingBox ClipPrimitive(unsigned int index, const Oblivion::BoundingBox& box) const {
+		return GetPrimitiveBoundingBox(index) & box;
+	}
 
 };
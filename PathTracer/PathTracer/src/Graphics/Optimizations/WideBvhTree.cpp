@@ -0,0 +1,269 @@
+#include "WideBvhTree.h"
+
+#if defined(WIDE_BVH_SSE) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// MSVC emits the intrinsics of any instruction set, GCC and Clang only in functions that ask for it
+#if defined(_MSC_VER)
+#define TARGET_AVX
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#endif
+
+static bool gWideBvhAVX = []() {
+#if !defined(WIDE_BVH_SSE)
+	return false;
+#elif defined(_MSC_VER)
+	// AVX needs the OS to save the ymm registers
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx");
+#endif
+}();
+
+bool IsWideBvhAVXEnabled() {
+	return gWideBvhAVX;
+}
+
+void SetWideBvhAVX(bool enabled) {
+#if defined(WIDE_BVH_SSE)
+	gWideBvhAVX = enabled;
+#endif
+}
+
+#if defined(WIDE_BVH_SSE)
+TARGET_AVX unsigned int IntersectEightChildrenAVX(const float* const* nearPlanes, const float* const* farPlanes, const float* origin,
+												  const float* inverseDirection, float tMin, float tMax, float* distances) {
+	__m256 originX = _mm256_set1_ps(origin[0]);
+	__m256 originY = _mm256_set1_ps(origin[1]);
+	__m256 originZ = _mm256_set1_ps(origin[2]);
+	__m256 inverseDirectionX = _mm256_set1_ps(inverseDirection[0]);
+	__m256 inverseDirectionY = _mm256_set1_ps(inverseDirection[1]);
+	__m256 inverseDirectionZ = _mm256_set1_ps(inverseDirection[2]);
+
+	__m256 tNearX = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlanes[0]), originX), inverseDirectionX);
+	__m256 tNearY = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlanes[1]), originY), inverseDirectionY);
+	__m256 tNearZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlanes[2]), originZ), inverseDirectionZ);
+	__m256 tFarX = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlanes[0]), originX), inverseDirectionX);
+	__m256 tFarY = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlanes[1]), originY), inverseDirectionY);
+	__m256 tFarZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlanes[2]), originZ), inverseDirectionZ);
+
+	// Same operand order as the SSE version, so both agree on NaN distances
+	__m256 tEntry = _mm256_max_ps(tNearZ, _mm256_max_ps(tNearY, _mm256_max_ps(tNearX, _mm256_set1_ps(tMin))));
+	__m256 tExit = _mm256_min_ps(tFarZ, _mm256_min_ps(tFarY, _mm256_min_ps(tFarX, _mm256_set1_ps(tMax))));
+	_mm256_storeu_ps(distances, tEntry);
+	return (unsigned int)_mm256_movemask_ps(_mm256_cmp_ps(tEntry, tExit, _CMP_LE_OQ));
+}
+#endif
+
+inline float NodeSurfaceArea(const BVHTreeNode& node) {
+	float dx = node.maxAABB.x - node.minAABB.x;
+	float dy = node.maxAABB.y - node.minAABB.y;
+	float dz = node.maxAABB.z - node.minAABB.z;
+	return 2.0f * (dx * dy + dx * dz + dy * dz);
+}
+
+// Quantizes a plane of a child on the grid of its node, rounding outwards
+inline uint8_t QuantizePlane(float value, float origin, float scale, bool roundUp) {
+	float position = (value - origin) / scale;
+	int quantized = (int)(roundUp ? std::ceil(position) : std::floor(position));
+	quantized = std::clamp(quantized, 0, 255);
+	// The division can round the wrong way
+	while (roundUp && quantized < 255 && origin + (float)quantized * scale < value) {
+		++quantized;
+	}
+	while (!roundUp && quantized > 0 && origin + (float)quantized * scale > value) {
+		--quantized;
+	}
+	return (uint8_t)quantized;
+}
+
+template <unsigned int Width, bool Quantized>
+unsigned int WideBvhTree<Width, Quantized>::Collapse(const std::vector<BVHTreeNode>& nodes, unsigned int rootIndex) {
+	EVALUATE(rootIndex < nodes.size(), "Cannot collapse the tree at ", rootIndex, " out of ", nodes.size(), " nodes");
+	return CollapseNode(nodes, rootIndex, 0);
+}
+
+template <unsigned int Width, bool Quantized>
+void WideBvhTree<Width, Quantized>::Reserve(size_t numberOfNodes) {
+	mNodes.reserve(numberOfNodes);
+}
+
+template <unsigned int Width, bool Quantized>
+unsigned int WideBvhTree<Width, Quantized>::CollapseNode(const std::vector<BVHTreeNode>& nodes, unsigned int binaryIndex, unsigned int depth) {
+	EVALUATE(depth < MaxDepth, "The BVH is too deep to be traversed as a ", Width, " wide tree (more than ", MaxDepth, " levels)");
+
+	std::array<unsigned int, Width> children;
+	unsigned int numberOfChildren = 0;
+	const auto& binaryNode = nodes[binaryIndex];
+	if (binaryNode.numberOfPrimitives > 0) {
+		// A tree made of a single leaf
+		children[numberOfChildren++] = binaryIndex;
+	} else {
+		children[numberOfChildren++] = binaryIndex + 1;
+		children[numberOfChildren++] = binaryNode.secondChildOffset;
+	}
+
+	// Pull up the grandchildren of the largest interior child until the node is full: that is the child most likely
+	// to be hit, so it is the box test worth saving
+	while (numberOfChildren < Width) {
+		int largestChild = -1;
+		float largestArea = -1.0f;
+		for (unsigned int i = 0; i < numberOfChildren; ++i) {
+			const auto& child = nodes[children[i]];
+			if (child.numberOfPrimitives == 0 && NodeSurfaceArea(child) > largestArea) {
+				largestArea = NodeSurfaceArea(child);
+				largestChild = (int)i;
+			}
+		}
+		if (largestChild == -1) {
+			break;
+		}
+
+		unsigned int opened = children[largestChild];
+		children[largestChild] = opened + 1;
+		children[numberOfChildren++] = nodes[opened].secondChildOffset;
+	}
+
+	// Children are written after their parent, so the wide nodes are stored depth first as well
+	auto wideIndex = (unsigned int)mNodes.size();
+	mNodes.emplace_back();
+
+	std::array<const BVHTreeNode*, Width> childNodes;
+	std::array<unsigned int, Width> childOffsets;
+	for (unsigned int i = 0; i < numberOfChildren; ++i) {
+		const auto& child = nodes[children[i]];
+		childNodes[i] = &child;
+		if (child.numberOfPrimitives > 0) {
+			EVALUATE(!Quantized || child.numberOfPrimitives <= std::numeric_limits<uint16_t>::max(), "Too many primitives (",
+					 child.numberOfPrimitives, ") in a leaf for a quantized tree");
+			childOffsets[i] = child.primitiveOffset;
+		} else {
+			childOffsets[i] = CollapseNode(nodes, children[i], depth + 1);
+		}
+	}
+	EncodeNode(mNodes[wideIndex], childNodes.data(), childOffsets.data(), numberOfChildren);
+
+	return wideIndex;
+}
+
+template <unsigned int Width, bool Quantized>
+void WideBvhTree<Width, Quantized>::EncodeNode(Node& node, const BVHTreeNode* const* children, const unsigned int* childOffsets,
+											   unsigned int numberOfChildren) {
+	if constexpr (!Quantized) {
+		for (unsigned int i = 0; i < Width; ++i) {
+			node.minX[i] = node.minY[i] = node.minZ[i] = std::numeric_limits<float>::infinity();
+			node.maxX[i] = node.maxY[i] = node.maxZ[i] = -std::numeric_limits<float>::infinity();
+			node.childOffset[i] = 0;
+			node.numberOfPrimitives[i] = 0;
+		}
+		for (unsigned int i = 0; i < numberOfChildren; ++i) {
+			node.minX[i] = children[i]->minAABB.x;
+			node.minY[i] = children[i]->minAABB.y;
+			node.minZ[i] = children[i]->minAABB.z;
+			node.maxX[i] = children[i]->maxAABB.x;
+			node.maxY[i] = children[i]->maxAABB.y;
+			node.maxZ[i] = children[i]->maxAABB.z;
+			node.childOffset[i] = childOffsets[i];
+			node.numberOfPrimitives[i] = children[i]->numberOfPrimitives;
+		}
+	} else {
+		Oblivion::BoundingBox nodeBB;
+		for (unsigned int i = 0; i < numberOfChildren; ++i) {
+			nodeBB |= Oblivion::BoundingBox(children[i]->minAABB, children[i]->maxAABB);
+		}
+
+		const float minimum[3] = { nodeBB.minPoint.x, nodeBB.minPoint.y, nodeBB.minPoint.z };
+		const float maximum[3] = { nodeBB.maxPoint.x, nodeBB.maxPoint.y, nodeBB.maxPoint.z };
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			node.origin[axis] = minimum[axis];
+			// A power of two step, so that the grid covers the node. It has to be positive even for flat nodes, to keep
+			// the unused slots empty
+			float extent = maximum[axis] - minimum[axis];
+			int exponent = 0;
+			if (extent > 0.0f) {
+				std::frexp(extent / 255.0f, &exponent);
+			}
+			node.scale[axis] = std::ldexp(1.0f, exponent);
+			while (node.origin[axis] + 255.0f * node.scale[axis] < maximum[axis]) {
+				node.scale[axis] *= 2.0f;
+			}
+		}
+
+		uint8_t* minPlanes[3] = { node.minX, node.minY, node.minZ };
+		uint8_t* maxPlanes[3] = { node.maxX, node.maxY, node.maxZ };
+		for (unsigned int i = 0; i < Width; ++i) {
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				minPlanes[axis][i] = 255;
+				maxPlanes[axis][i] = 0;
+			}
+			node.childOffset[i] = 0;
+			node.numberOfPrimitives[i] = 0;
+		}
+		for (unsigned int i = 0; i < numberOfChildren; ++i) {
+			const float childMinimum[3] = { children[i]->minAABB.x, children[i]->minAABB.y, children[i]->minAABB.z };
+			const float childMaximum[3] = { children[i]->maxAABB.x, children[i]->maxAABB.y, children[i]->maxAABB.z };
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				minPlanes[axis][i] = QuantizePlane(childMinimum[axis], node.origin[axis], node.scale[axis], false);
+				maxPlanes[axis][i] = QuantizePlane(childMaximum[axis], node.origin[axis], node.scale[axis], true);
+			}
+			node.childOffset[i] = childOffsets[i];
+			node.numberOfPrimitives[i] = (uint16_t)children[i]->numberOfPrimitives;
+		}
+	}
+}
+
+template <unsigned int Width, bool Quantized>
+const std::vector<typename WideBvhTree<Width, Quantized>::Node>& WideBvhTree<Width, Quantized>::GetNodes() const {
+	return mNodes;
+}
+
+template <unsigned int Width, bool Quantized>
+WideSceneTree<Width, Quantized>::WideSceneTree(const std::vector<BVHTreeNode>& sceneTree, const std::vector<TraceScenePrimitive>& scenePrimitives,
+											   const std::vector<BVHTreeNode>& modelTrees) {
+	// A binary tree with n nodes has about n / 2 interior nodes and every wide node replaces up to Width - 1 of them
+	mSceneTree.Reserve(sceneTree.size() / (2 * (Width - 1)) + 1);
+	mSceneRoot = mSceneTree.Collapse(sceneTree);
+
+	mModelTrees.Reserve(modelTrees.size() / (2 * (Width - 1)) + scenePrimitives.size());
+	std::unordered_map<unsigned int, unsigned int> collapsedRoots;
+	mModelRoots.reserve(scenePrimitives.size());
+	mWorldToObject.reserve(scenePrimitives.size());
+	for (const auto& primitive : scenePrimitives) {
+		mWorldToObject.push_back(primitive.worldToObject);
+		auto it = collapsedRoots.find(primitive.modelOffset);
+		if (it == collapsedRoots.end()) {
+			it = collapsedRoots.emplace(primitive.modelOffset, mModelTrees.Collapse(modelTrees, primitive.modelOffset)).first;
+		}
+		mModelRoots.push_back(it->second);
+	}
+
+	auto wideNodes = mSceneTree.GetNodes().size() + mModelTrees.GetNodes().size();
+	Oblivion::DebugPrintLine("Collapsed ", sceneTree.size() + modelTrees.size(), " binary nodes (",
+							 (sceneTree.size() + modelTrees.size()) * sizeof(BVHTreeNode), " bytes) into ", wideNodes,
+							 Quantized ? " quantized" : "", " nodes of width ", Width, " (", wideNodes * sizeof(typename WideBvhTree<Width, Quantized>::Node), " bytes)");
+}
+
+template <unsigned int Width, bool Quantized>
+const WideBvhTree<Width, Quantized>& WideSceneTree<Width, Quantized>::GetSceneTree() const {
+	return mSceneTree;
+}
+
+template <unsigned int Width, bool Quantized>
+const WideBvhTree<Width, Quantized>& WideSceneTree<Width, Quantized>::GetModelTrees() const {
+	return mModelTrees;
+}
+
+
+template class WideBvhTree<4, false>;
+template class WideBvhTree<8, false>;
+template class WideBvhTree<4, true>;
+template class WideBvhTree<8, true>;
+template class WideSceneTree<4, false>;
+template class WideSceneTree<8, false>;
+template class WideSceneTree<4, true>;
+template class WideSceneTree<8, true>;
@@ -0,0 +1,383 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "../ShaderObjects.h"
+#include "../../Tracing/Ray.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define WIDE_BVH_SSE
+#include <immintrin.h>
+#endif
+
+// The children of 8 wide nodes are tested with AVX when the CPU supports it, as two SSE halves otherwise. The choice is
+// made once from the CPU, like the triangle kernel, and SetWideBvhAVX overrides it while no ray is traced, to compare both
+bool IsWideBvhAVXEnabled();
+void SetWideBvhAVX(bool enabled);
+
+#if defined(WIDE_BVH_SSE)
+// AVX version of WideBvhTree::IntersectChildren for 8 children, compiled for AVX whatever the flags of the build
+unsigned int IntersectEightChildrenAVX(const float* const* nearPlanes, const float* const* farPlanes, const float* origin,
+									   const float* inverseDirection, float tMin, float tMax, float* distances);
+#endif
+
+// Node of a BVH with up to Width children. The boxes of the children are stored as SoA, so that a ray can be tested
+// against all of them at once. Unused slots hold an inverted box, which no ray can hit
+template <unsigned int Width>
+OBLIVION_ALIGN(32) struct WideBVHNode {
+	float minX[Width];
+	float minY[Width];
+	float minZ[Width];
+	float maxX[Width];
+	float maxY[Width];
+	float maxZ[Width];
+
+	// Interior children: index of their node. Leaf children: offset of their first primitive
+	unsigned int childOffset[Width];
+	// Zero for interior children and unused slots
+	unsigned int numberOfPrimitives[Width];
+};
+
+// Compressed version of WideBVHNode: the children boxes are quantized to 8 bits on a grid that covers the node, which
+// halves the size of the node (128 instead of 256 bytes for BVH8, 80 instead of 128 for BVH4).
+// A plane is decoded as origin + quantized * scale. The planes are rounded outwards, so a decoded box always contains
+// the child. Unused slots have minimum planes above the maximum ones.
+// Only the CPU tracer decodes them: BVHTreeNode.hlsli has no decoder, and the shaders walk the full binary nodes whatever
+// the scene asks for
+template <unsigned int Width>
+OBLIVION_ALIGN(16) struct QuantizedWideBVHNode {
+	float origin[3];
+	float scale[3];
+
+	uint8_t minX[Width];
+	uint8_t minY[Width];
+	uint8_t minZ[Width];
+	uint8_t maxX[Width];
+	uint8_t maxY[Width];
+	uint8_t maxZ[Width];
+
+	unsigned int childOffset[Width];
+	uint16_t numberOfPrimitives[Width];
+};
+
+// BVH4 / BVH8 obtained by collapsing a binary BvhTree, optionally with quantized nodes. Only used for traversal on the
+// CPU, the shaders keep using the binary nodes
+template <unsigned int Width, bool Quantized = false>
+class WideBvhTree {
+	static_assert(Width == 4 || Width == 8, "Only 4 and 8 wide trees are supported");
+
+public:
+	using Node = std::conditional_t<Quantized, QuantizedWideBVHNode<Width>, WideBVHNode<Width>>;
+
+	static constexpr const unsigned int MaxDepth = 64;
+	static constexpr const unsigned int StackSize = MaxDepth * (Width - 1) + 1;
+
+public:
+	// Appends the collapsed version of the binary tree rooted at nodes[rootIndex] and returns the index of its root
+	unsigned int Collapse(const std::vector<BVHTreeNode>& nodes, unsigned int rootIndex = 0);
+	void Reserve(size_t numberOfNodes);
+
+	// Closest hit traversal of the tree rooted at rootIndex. intersectLeaf(primitiveOffset, numberOfPrimitives, ray) is
+	// called for every leaf reached by the ray and must return true and shrink ray.tMax when it finds a closer hit
+	template <typename LeafIntersector>
+	bool Intersect(Ray& ray, unsigned int rootIndex, LeafIntersector&& intersectLeaf) const;
+	// Any hit traversal for visibility queries: returns as soon as occludedLeaf(primitiveOffset, numberOfPrimitives, ray)
+	// finds anything in [ray.tMin, ray.tMax]. Children are not sorted, since no closer hit can cut the traversal short
+	template <typename LeafOccluder>
+	bool Occluded(const Ray& ray, unsigned int rootIndex, LeafOccluder&& occludedLeaf) const;
+
+	const std::vector<Node>& GetNodes() const;
+
+private:
+	unsigned int CollapseNode(const std::vector<BVHTreeNode>& nodes, unsigned int binaryIndex, unsigned int depth);
+	static void EncodeNode(Node& node, const BVHTreeNode* const* children, const unsigned int* childOffsets, unsigned int numberOfChildren);
+
+	struct TraversalRay {
+		float origin[3];
+		float inverseDirection[3];
+		bool directionIsNegative[3];
+		bool useAVX;
+	};
+	static TraversalRay GetTraversalRay(const Ray& ray);
+	// Planes of the children boxes, in the order minX, minY, minZ, maxX, maxY, maxZ. Quantized nodes are decoded into
+	// decodedPlanes
+	using ChildPlanes = std::array<const float*, 6>;
+	static ChildPlanes GetChildPlanes(const Node& node, float (&decodedPlanes)[6][Width]);
+	static unsigned int IntersectChildren(const ChildPlanes& planes, const TraversalRay& ray, float tMin, float tMax,
+										  float* distances);
+
+private:
+	std::vector<Node> mNodes;
+};
+
+// Wide version of the two level structure built by SceneLoader: the scene tree, whose primitives are the instances, and
+// the trees of every model
+template <unsigned int Width, bool Quantized = false>
+class WideSceneTree {
+
+public:
+	WideSceneTree(const std::vector<BVHTreeNode>& sceneTree, const std::vector<TraceScenePrimitive>& scenePrimitives,
+				  const std::vector<BVHTreeNode>& modelTrees);
+
+public:
+	// intersectModelLeaf(instanceIndex, primitiveOffset, numberOfPrimitives, objectRay) intersects a leaf of a model tree
+	// with the ray moved into the space of the instance, with the same contract as in WideBvhTree::Intersect
+	template <typename ModelLeafIntersector>
+	bool Intersect(Ray& ray, ModelLeafIntersector&& intersectModelLeaf) const;
+	// occludedModelLeaf(instanceIndex, primitiveOffset, numberOfPrimitives, objectRay) with the contract of
+	// WideBvhTree::Occluded
+	template <typename ModelLeafOccluder>
+	bool Occluded(const Ray& ray, ModelLeafOccluder&& occludedModelLeaf) const;
+
+	const WideBvhTree<Width, Quantized>& GetSceneTree() const;
+	const WideBvhTree<Width, Quantized>& GetModelTrees() const;
+
+private:
+	WideBvhTree<Width, Quantized> mSceneTree;
+	unsigned int mSceneRoot;
+
+	WideBvhTree<Width, Quantized> mModelTrees;
+	// Root of the collapsed model tree and world to object transform of every scene primitive
+	std::vector<unsigned int> mModelRoots;
+	std::vector<DirectX::XMFLOAT3X4> mWorldToObject;
+};
+
+template <unsigned int Width, bool Quantized>
+typename WideBvhTree<Width, Quantized>::ChildPlanes WideBvhTree<Width, Quantized>::GetChildPlanes(const Node& node,
+																								   float (&decodedPlanes)[6][Width]) {
+	if constexpr (!Quantized) {
+		return { node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ };
+	} else {
+		const uint8_t* quantizedPlanes[6] = { node.minX, node.minY, node.minZ, node.maxX, node.maxY, node.maxZ };
+		for (unsigned int plane = 0; plane < 6; ++plane) {
+			float origin = node.origin[plane % 3];
+			float scale = node.scale[plane % 3];
+#if defined(WIDE_BVH_SSE)
+			__m128i zero = _mm_setzero_si128();
+			__m128 originLanes = _mm_set1_ps(origin);
+			__m128 scaleLanes = _mm_set1_ps(scale);
+			for (unsigned int lane = 0; lane < Width; lane += 4) {
+				int32_t packed;
+				std::memcpy(&packed, quantizedPlanes[plane] + lane, sizeof(packed));
+				__m128i widened = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+				__m128 decoded = _mm_add_ps(originLanes, _mm_mul_ps(_mm_cvtepi32_ps(widened), scaleLanes));
+				_mm_storeu_ps(decodedPlanes[plane] + lane, decoded);
+			}
+#else
+			for (unsigned int lane = 0; lane < Width; ++lane) {
+				decodedPlanes[plane][lane] = origin + (float)quantizedPlanes[plane][lane] * scale;
+			}
+#endif
+		}
+		return { decodedPlanes[0], decodedPlanes[1], decodedPlanes[2], decodedPlanes[3], decodedPlanes[4], decodedPlanes[5] };
+	}
+}
+
+template <unsigned int Width, bool Quantized>
+unsigned int WideBvhTree<Width, Quantized>::IntersectChildren(const ChildPlanes& planes, const TraversalRay& ray, float tMin, float tMax,
+															  float* distances) {
+	const float* nearX = ray.directionIsNegative[0] ? planes[3] : planes[0];
+	const float* nearY = ray.directionIsNegative[1] ? planes[4] : planes[1];
+	const float* nearZ = ray.directionIsNegative[2] ? planes[5] : planes[2];
+	const float* farX = ray.directionIsNegative[0] ? planes[0] : planes[3];
+	const float* farY = ray.directionIsNegative[1] ? planes[1] : planes[4];
+	const float* farZ = ray.directionIsNegative[2] ? planes[2] : planes[5];
+
+	// The slab distances can be NaN when the ray starts on a plane it is parallel to. Keeping them as the first operand
+	// of min / max makes the SIMD versions ignore them
+#if defined(WIDE_BVH_SSE)
+	if constexpr (Width == 8) {
+		if (ray.useAVX) {
+			const float* nearPlanes[3] = { nearX, nearY, nearZ };
+			const float* farPlanes[3] = { farX, farY, farZ };
+			return IntersectEightChildrenAVX(nearPlanes, farPlanes, ray.origin, ray.inverseDirection, tMin, tMax, distances);
+		}
+	}
+#endif
+
+#if defined(WIDE_BVH_SSE)
+	__m128 originX = _mm_set1_ps(ray.origin[0]);
+	__m128 originY = _mm_set1_ps(ray.origin[1]);
+	__m128 originZ = _mm_set1_ps(ray.origin[2]);
+	__m128 inverseDirectionX = _mm_set1_ps(ray.inverseDirection[0]);
+	__m128 inverseDirectionY = _mm_set1_ps(ray.inverseDirection[1]);
+	__m128 inverseDirectionZ = _mm_set1_ps(ray.inverseDirection[2]);
+	__m128 tMinimum = _mm_set1_ps(tMin);
+	__m128 tMaximum = _mm_set1_ps(tMax);
+
+	unsigned int mask = 0;
+	for (unsigned int lane = 0; lane < Width; lane += 4) {
+		__m128 tNearX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX + lane), originX), inverseDirectionX);
+		__m128 tNearY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY + lane), originY), inverseDirectionY);
+		__m128 tNearZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ + lane), originZ), inverseDirectionZ);
+		__m128 tFarX = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX + lane), originX), inverseDirectionX);
+		__m128 tFarY = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY + lane), originY), inverseDirectionY);
+		__m128 tFarZ = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ + lane), originZ), inverseDirectionZ);
+
+		__m128 tEntry = _mm_max_ps(tNearZ, _mm_max_ps(tNearY, _mm_max_ps(tNearX, tMinimum)));
+		__m128 tExit = _mm_min_ps(tFarZ, _mm_min_ps(tFarY, _mm_min_ps(tFarX, tMaximum)));
+		_mm_storeu_ps(distances + lane, tEntry);
+		mask |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(tEntry, tExit)) << lane;
+	}
+	return mask;
+#else
+	unsigned int mask = 0;
+	for (unsigned int lane = 0; lane < Width; ++lane) {
+		float tEntry = tMin, tExit = tMax;
+		const float* nearPlanes[3] = { nearX, nearY, nearZ };
+		const float* farPlanes[3] = { farX, farY, farZ };
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			float tNear = (nearPlanes[axis][lane] - ray.origin[axis]) * ray.inverseDirection[axis];
+			float tFar = (farPlanes[axis][lane] - ray.origin[axis]) * ray.inverseDirection[axis];
+			tEntry = tNear > tEntry ? tNear : tEntry;
+			tExit = tFar < tExit ? tFar : tExit;
+		}
+		distances[lane] = tEntry;
+		mask |= (unsigned int)(tEntry <= tExit) << lane;
+	}
+	return mask;
+#endif
+}
+
+template <unsigned int Width, bool Quantized>
+typename WideBvhTree<Width, Quantized>::TraversalRay WideBvhTree<Width, Quantized>::GetTraversalRay(const Ray& ray) {
+	TraversalRay traversalRay;
+	const float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	const float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	for (unsigned int axis = 0; axis < 3; ++axis) {
+		traversalRay.origin[axis] = origin[axis];
+		traversalRay.inverseDirection[axis] = 1.0f / direction[axis];
+		traversalRay.directionIsNegative[axis] = traversalRay.inverseDirection[axis] < 0.0f;
+	}
+	traversalRay.useAVX = Width == 8 && IsWideBvhAVXEnabled();
+	return traversalRay;
+}
+
+template <unsigned int Width, bool Quantized>
+template <typename LeafIntersector>
+bool WideBvhTree<Width, Quantized>::Intersect(Ray& ray, unsigned int rootIndex, LeafIntersector&& intersectLeaf) const {
+	const TraversalRay traversalRay = GetTraversalRay(ray);
+
+	struct StackEntry {
+		unsigned int offset;
+		unsigned int numberOfPrimitives;
+		float distance;
+	};
+	StackEntry stack[StackSize];
+	unsigned int stackIndex = 0;
+	stack[stackIndex++] = { rootIndex, 0, ray.tMin };
+
+	bool hit = false;
+	while (stackIndex > 0) {
+		const StackEntry entry = stack[--stackIndex];
+		if (entry.distance > ray.tMax) {
+			// A closer hit was found since this entry was pushed
+			continue;
+		}
+
+		if (entry.numberOfPrimitives > 0) {
+			if (intersectLeaf(entry.offset, entry.numberOfPrimitives, ray)) {
+				hit = true;
+			}
+			continue;
+		}
+
+		const auto& node = mNodes[entry.offset];
+		float decodedPlanes[6][Width];
+		float distances[Width];
+		unsigned int mask = IntersectChildren(GetChildPlanes(node, decodedPlanes), traversalRay, ray.tMin, ray.tMax, distances);
+
+		// Push the children sorted from far to near, so the closest one is visited first
+		unsigned int firstPushed = stackIndex;
+		for (unsigned int lane = 0; lane < Width; ++lane) {
+			if ((mask & (1u << lane)) == 0) {
+				continue;
+			}
+			StackEntry child = { node.childOffset[lane], node.numberOfPrimitives[lane], distances[lane] };
+			unsigned int position = stackIndex++;
+			while (position > firstPushed && stack[position - 1].distance < child.distance) {
+				stack[position] = stack[position - 1];
+				--position;
+			}
+			stack[position] = child;
+		}
+	}
+
+	return hit;
+}
+
+template <unsigned int Width, bool Quantized>
+template <typename LeafOccluder>
+bool WideBvhTree<Width, Quantized>::Occluded(const Ray& ray, unsigned int rootIndex, LeafOccluder&& occludedLeaf) const {
+	const TraversalRay traversalRay = GetTraversalRay(ray);
+
+	struct StackEntry {
+		unsigned int offset;
+		unsigned int numberOfPrimitives;
+	};
+	StackEntry stack[StackSize];
+	unsigned int stackIndex = 0;
+	stack[stackIndex++] = { rootIndex, 0 };
+
+	while (stackIndex > 0) {
+		const StackEntry entry = stack[--stackIndex];
+		if (entry.numberOfPrimitives > 0) {
+			if (occludedLeaf(entry.offset, entry.numberOfPrimitives, ray)) {
+				return true;
+			}
+			continue;
+		}
+
+		const auto& node = mNodes[entry.offset];
+		float decodedPlanes[6][Width];
+		float distances[Width];
+		unsigned int mask = IntersectChildren(GetChildPlanes(node, decodedPlanes), traversalRay, ray.tMin, ray.tMax, distances);
+		for (unsigned int lane = 0; lane < Width; ++lane) {
+			if ((mask & (1u << lane)) != 0) {
+				stack[stackIndex++] = { node.childOffset[lane], node.numberOfPrimitives[lane] };
+			}
+		}
+	}
+
+	return false;
+}
+
+template <unsigned int Width, bool Quantized>
+template <typename ModelLeafIntersector>
+bool WideSceneTree<Width, Quantized>::Intersect(Ray& ray, ModelLeafIntersector&& intersectModelLeaf) const {
+	return mSceneTree.Intersect(ray, mSceneRoot,
+		[&](unsigned int primitiveOffset, unsigned int numberOfPrimitives, Ray& sceneRay) {
+			bool hit = false;
+			for (unsigned int i = primitiveOffset; i < primitiveOffset + numberOfPrimitives; ++i) {
+				Ray objectRay = TransformRay(mWorldToObject[i], sceneRay);
+				bool instanceHit = mModelTrees.Intersect(objectRay, mModelRoots[i],
+					[&](unsigned int modelPrimitiveOffset, unsigned int modelNumberOfPrimitives, Ray& modelRay) {
+						return intersectModelLeaf(i, modelPrimitiveOffset, modelNumberOfPrimitives, modelRay);
+					});
+				if (instanceHit) {
+					sceneRay.tMax = objectRay.tMax;
+					hit = true;
+				}
+			}
+			return hit;
+		});
+}
+
+template <unsigned int Width, bool Quantized>
+template <typename ModelLeafOccluder>
+bool WideSceneTree<Width, Quantized>::Occluded(const Ray& ray, ModelLeafOccluder&& occludedModelLeaf) const {
+	return mSceneTree.Occluded(ray, mSceneRoot,
+		[&](unsigned int primitiveOffset, unsigned int numberOfPrimitives, const Ray& sceneRay) {
+			for (unsigned int i = primitiveOffset; i < primitiveOffset + numberOfPrimitives; ++i) {
+				Ray objectRay = TransformRay(mWorldToObject[i], sceneRay);
+				bool instanceOccluded = mModelTrees.Occluded(objectRay, mModelRoots[i],
+					[&](unsigned int modelPrimitiveOffset, unsigned int modelNumberOfPrimitives, const Ray& modelRay) {
+						return occludedModelLeaf(i, modelPrimitiveOffset, modelNumberOfPrimitives, modelRay);
+					});
+				if (instanceOccluded) {
+					return true;
+				}
+			}
+			return false;
+		});
+}
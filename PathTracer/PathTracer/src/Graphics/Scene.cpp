@@ -1,45 +1,133 @@
 #include "Scene.h"
 
-Oblivion::BoundingBox ScenePrimitive::GetBoundingBox() {
-	return boundingBox;
+// Bounds of the 8 corners of the box, moved to world space
+Oblivion::BoundingBox TransformBoundingBox(const Oblivion::BoundingBox& bb, DirectX::FXMMATRIX objectToWorld) {
+	Oblivion::BoundingBox worldBB;
+	for (unsigned int corner = 0; corner < 8; ++corner) {
+		DirectX::XMFLOAT3 point((corner & 1) ? bb.maxPoint.x : bb.minPoint.x,
+								(corner & 2) ? bb.maxPoint.y : bb.minPoint.y,
+								(corner & 4) ? bb.maxPoint.z : bb.minPoint.z);
+		DirectX::XMFLOAT3 worldPoint;
+		DirectX::XMStoreFloat3(&worldPoint, DirectX::XMVector3TransformCoord(DirectX::XMLoadFloat3(&point), objectToWorld));
+		worldBB |= worldPoint;
+	}
+	return worldBB;
 }
 
-Scene::Scene(std::vector<std::shared_ptr<BvhTree>>& treeModels) {
+Scene::Scene(std::vector<std::shared_ptr<BvhTree>>& treeModels, const std::vector<SceneInstance>& instances) :
+	mInstances(instances) {
 
 	unsigned int totalNodes = 0;
 	for (const auto& it : treeModels) {
 		totalNodes += (unsigned int)it->GetNodes().size();
 	}
 
+	// Every model tree is stored once, no matter how many times it is instanced. The trees are copied before their
+	// offsets are moved, so they can still be refit
+	mModelOffsets.reserve(treeModels.size());
 	mModels.reserve(totalNodes);
-	mPrimitives.reserve(treeModels.size());
 	for (unsigned int i = 0; i < treeModels.size(); ++i) {
-		unsigned int currentOffset = (unsigned int)mModels.size();
+		auto modelOffset = (unsigned int)mModels.size();
+		mModelOffsets.push_back(modelOffset);
 
-		auto& nodes = treeModels[i]->GetNodes();
-		for (auto& node : nodes) {
-			if (node.secondChildOffset != 0) {
-				node.secondChildOffset += (unsigned int)mModels.size();
+		const auto& nodes = treeModels[i]->GetNodes();
+		std::copy(nodes.begin(), nodes.end(), std::back_inserter(mModels));
+		for (auto node = mModels.begin() + modelOffset; node != mModels.end(); ++node) {
+			if (node->secondChildOffset != 0) {
+				node->secondChildOffset += modelOffset;
 			}
 		}
-		std::copy(nodes.begin(), nodes.end(), std::back_inserter(mModels));
+	}
 
-		mPrimitives.push_back(std::make_shared<ScenePrimitive>(currentOffset, treeModels[i]->GetBoundingBox()));
+	for (const auto& instance : mInstances) {
+		EVALUATE(instance.modelIndex < treeModels.size(), "Instance of model ", instance.modelIndex, ", but there are only ",
+				 treeModels.size(), " models");
 	}
+	PlaceInstances();
+}
+
+void Scene::PlaceInstances() {
+	mTreeOffsets.clear();
+	mPrimitiveBounds.clear();
+	mWorldToObject.clear();
+	mMaterialIndices.clear();
+
+	mTreeOffsets.reserve(mInstances.size());
+	mPrimitiveBounds.reserve(mInstances.size());
+	mWorldToObject.reserve(mInstances.size());
+	mMaterialIndices.reserve(mInstances.size());
+	for (const auto& instance : mInstances) {
+		DirectX::XMMATRIX objectToWorld = DirectX::XMLoadFloat3x4(&instance.objectToWorld);
+		DirectX::XMFLOAT3X4 worldToObject;
+		DirectX::XMStoreFloat3x4(&worldToObject, DirectX::XMMatrixInverse(nullptr, objectToWorld));
+
+		const auto& modelRoot = mModels[mModelOffsets[instance.modelIndex]];
+		mTreeOffsets.push_back(mModelOffsets[instance.modelIndex]);
+		mPrimitiveBounds.push_back(TransformBoundingBox(Oblivion::BoundingBox(modelRoot.minAABB, modelRoot.maxAABB), objectToWorld));
+		mWorldToObject.push_back(worldToObject);
+		mMaterialIndices.push_back(instance.materialIndex);
+	}
+}
+
+unsigned int Scene::GetPrimitiveCount() const {
+	return (unsigned int)mTreeOffsets.size();
+}
 
+Oblivion::BoundingBox Scene::GetPrimitiveBoundingBox(unsigned int index) const {
+	return mPrimitiveBounds[index];
 }
 
-std::vector<std::shared_ptr<ScenePrimitive>>& Scene::GetPrimitives() {
-	return mPrimitives;
+ScenePrimitive Scene::GetPrimitive(unsigned int index) const {
+	return ScenePrimitive(mTreeOffsets[index], mPrimitiveBounds[index], mWorldToObject[index], mMaterialIndices[index]);
 }
 
-void Scene::ReorderPrimitives(std::vector<std::shared_ptr<ScenePrimitive>>& orderedPrimitives) {
-	EVALUATE(orderedPrimitives.size() == mPrimitives.size(), "Expected new primitives to be exactly the same size (",
-			 mPrimitives.size(), "), but they aren't (", orderedPrimitives.size(), ")");
+void Scene::ReorderPrimitives(const std::vector<unsigned int>& order) {
+	EVALUATE(order.size() >= mTreeOffsets.size(), "Expected at least as many new primitives (",
+			 mTreeOffsets.size(), "), but there are only ", order.size());
+
+	std::vector<unsigned int> treeOffsets(order.size());
+	std::vector<Oblivion::BoundingBox> primitiveBounds(order.size());
+	std::vector<DirectX::XMFLOAT3X4> worldToObject(order.size());
+	std::vector<unsigned int> materialIndices(order.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		EVALUATE(order[i] < mTreeOffsets.size(), "Invalid primitive index ", order[i], " when reordering");
+		treeOffsets[i] = mTreeOffsets[order[i]];
+		primitiveBounds[i] = mPrimitiveBounds[order[i]];
+		worldToObject[i] = mWorldToObject[order[i]];
+		materialIndices[i] = mMaterialIndices[order[i]];
+	}
 
-	mPrimitives = std::move(orderedPrimitives);
+	mTreeOffsets = std::move(treeOffsets);
+	mPrimitiveBounds = std::move(primitiveBounds);
+	mWorldToObject = std::move(worldToObject);
+	mMaterialIndices = std::move(materialIndices);
 }
 
 std::vector<BVHTreeNode>& Scene::GetModelTree() {
 	return mModels;
 }
+
+void Scene::SetInstanceTransform(unsigned int instanceIndex, const DirectX::XMFLOAT3X4& objectToWorld) {
+	EVALUATE(instanceIndex < mInstances.size(), "Invalid instance ", instanceIndex, ", there are only ", mInstances.size());
+	mInstances[instanceIndex].objectToWorld = objectToWorld;
+}
+
+void Scene::RefitModel(unsigned int modelIndex, BvhTree& modelTree) {
+	EVALUATE(modelIndex < mModelOffsets.size(), "Invalid model ", modelIndex, ", there are only ", mModelOffsets.size());
+	const auto& nodes = modelTree.GetNodes();
+	unsigned int modelOffset = mModelOffsets[modelIndex];
+	unsigned int modelEnd = modelIndex + 1 < mModelOffsets.size() ? mModelOffsets[modelIndex + 1] : (unsigned int)mModels.size();
+	EVALUATE(nodes.size() == modelEnd - modelOffset, "Model ", modelIndex, " has ", modelEnd - modelOffset,
+			 " nodes, but the refit tree has ", nodes.size());
+
+	for (unsigned int i = 0; i < nodes.size(); ++i) {
+		mModels[modelOffset + i].minAABB = nodes[i].minAABB;
+		mModels[modelOffset + i].maxAABB = nodes[i].maxAABB;
+	}
+}
+
+std::shared_ptr<BvhTree> Scene::BuildTree(BvhTree::SplitMethod splitMethod) {
+	// Spatial splits may have duplicated instances in the last build, so start again from the instances
+	PlaceInstances();
+	return BvhTree::Create(this, splitMethod, 5, 65536, BvhTree::BuildParameters());
+}
@@ -6,22 +6,36 @@
 #include "ShaderObjects.h"
 #include "Optimizations/BvhTree.h"
 
+// Placement of a model in the scene. Every instance of a model shares its tree
+struct SceneInstance {
+	unsigned int modelIndex;
+	DirectX::XMFLOAT3X4 objectToWorld;
+	unsigned int materialIndex;
+
+	SceneInstance(unsigned int modelIndex, const DirectX::XMFLOAT3X4& objectToWorld, unsigned int materialIndex) :
+		modelIndex(modelIndex), objectToWorld(objectToWorld), materialIndex(materialIndex) {
+	}
+};
+
 struct ScenePrimitive {
 	unsigned int treeOffset;
 	Oblivion::BoundingBox boundingBox;
+	DirectX::XMFLOAT3X4 worldToObject;
+	unsigned int materialIndex;
 
-	Oblivion::BoundingBox GetBoundingBox();
-
-	ScenePrimitive(unsigned int treeOffset, const Oblivion::BoundingBox& bb) :
-		treeOffset(treeOffset), boundingBox(bb) {
+	ScenePrimitive(unsigned int treeOffset, const Oblivion::BoundingBox& bb, const DirectX::XMFLOAT3X4& worldToObject,
+				   unsigned int materialIndex) :
+		treeOffset(treeOffset), boundingBox(bb), worldToObject(worldToObject), materialIndex(materialIndex) {
 	}
 
-	operator TraceScenePrimitive() {
+	operator TraceScenePrimitive() const {
 		TraceScenePrimitive tp;
 		
 		tp.minAABB = boundingBox.minPoint;
 		tp.maxAABB = boundingBox.maxPoint;
 		tp.modelOffset = treeOffset;
+		tp.materialIndex = materialIndex;
+		tp.worldToObject = worldToObject;
 		
 		return tp;
 	}
@@ -32,18 +46,41 @@ struct ScenePrimitive {
 class Scene : public AccelerableStructure<ScenePrimitive> {
 
 public:
-	Scene(std::vector<std::shared_ptr<BvhTree>>& treeModels);
+	Scene(std::vector<std::shared_ptr<BvhTree>>& treeModels, const std::vector<SceneInstance>& instances);
 
 public: 
 	// Inherited via AccelerableStructure
-	virtual std::vector<std::shared_ptr<ScenePrimitive>>& GetPrimitives() override;
+	virtual unsigned int GetPrimitiveCount() const override;
+	virtual Oblivion::BoundingBox GetPrimitiveBoundingBox(unsigned int index) const override;
 
-	virtual void ReorderPrimitives(std::vector<std::shared_ptr<ScenePrimitive>>&) override;
+	virtual void ReorderPrimitives(const std::vector<unsigned int>& order) override;
+
+	ScenePrimitive GetPrimitive(unsigned int index) const;
 
 	std::vector<BVHTreeNode>& GetModelTree();
 
+	// Moves an instance. It is only seen by the scene tree after the next BuildTree
+	void SetInstanceTransform(unsigned int instanceIndex, const DirectX::XMFLOAT3X4& objectToWorld);
+	// Copies the bounds of a model tree that was refit (BvhTree::Refit) after its geometry changed
+	void RefitModel(unsigned int modelIndex, BvhTree& modelTree);
+	// Builds the tree over the instances. The model trees are left as they are, so this is all that has to be done
+	// when only the instances moved
+	std::shared_ptr<BvhTree> BuildTree(BvhTree::SplitMethod splitMethod);
+
 private:
-	std::vector<std::shared_ptr<ScenePrimitive>> mPrimitives;
+	void PlaceInstances();
+
+private:
+	std::vector<SceneInstance> mInstances;
+	// The model tree i starts at mModelOffsets[i] in mModels
+	std::vector<unsigned int> mModelOffsets;
+
+	// Primitive i is an instance of the model tree that starts at mTreeOffsets[i]. It is bounded by mPrimitiveBounds[i]
+	// in world space, rays reach its tree through mWorldToObject[i] and it is shaded with mMaterialIndices[i]
+	std::vector<unsigned int> mTreeOffsets;
+	std::vector<Oblivion::BoundingBox> mPrimitiveBounds;
+	std::vector<DirectX::XMFLOAT3X4> mWorldToObject;
+	std::vector<unsigned int> mMaterialIndices;
 
 	std::vector<BVHTreeNode> mModels;
 };
@@ -0,0 +1,936 @@
+#include "SceneDescription.h"
+#include "Optimizations/BvhTree.h"
+#include "../Utils/Threading.h"
+#include "../Common/Limits.h"
+#include "../Utils/CacheFile.h"
+
+#include <iomanip>
+
+// Bumped whenever the layout of the caches or of one of the structures in them changes
+constexpr const uint32_t SceneCacheVersion = 6;
+constexpr const char* SceneCacheExtension = ".scenecache";
+constexpr const uint32_t MeshCacheVersion = 2;
+constexpr const char* MeshCacheDirectory = "MeshCache";
+constexpr const char* MeshCacheExtension = ".meshcache";
+
+enum SceneCacheSection {
+    LinesSection, MaterialsSection, VertexBufferSection, ModelPrimitivesSection, ScenePrimitivesSection, SceneTreeSection,
+    ModelTreesSection, ModelRangesSection, SceneCacheSectionCount
+};
+
+enum MeshCacheSection {
+    MeshVerticesSection, MeshPrimitivesSection, MeshTreeSection, MeshCacheSectionCount
+};
+
+// A model ready to be centralized: its vertices, its primitives in the order of the leaves of its tree, and the tree
+struct SceneDescription::ImportedModel {
+    std::vector<TraceVertex> vertices;
+    std::vector<TraceModelPrimitive> primitives;
+    std::shared_ptr<BvhTree> tree;
+};
+
+// The triangles of a centralized model, which its tree is refit over. The primitives are in the order of the leaves and
+// the vertices are those of the whole scene, so nothing can be reordered
+template <typename Vertex>
+class CentralizedModel : public AccelerableStructure<ModelPrimitive> {
+public:
+    CentralizedModel(const Vertex* vertices, const TraceModelPrimitive* primitives, unsigned int primitiveCount) :
+        mVertices(vertices), mPrimitives(primitives), mPrimitiveCount(primitiveCount) {
+    }
+
+    virtual unsigned int GetPrimitiveCount() const override {
+        return mPrimitiveCount;
+    }
+
+    virtual Oblivion::BoundingBox GetPrimitiveBoundingBox(unsigned int index) const override {
+        const auto& primitive = mPrimitives[index];
+        Oblivion::BoundingBox bb;
+        bb |= mVertices[primitive.index0].position;
+        bb |= mVertices[primitive.index1].position;
+        bb |= mVertices[primitive.index2].position;
+        return bb;
+    }
+
+    virtual void ReorderPrimitives(const std::vector<unsigned int>&) override {
+        EVALUATE(false, "The primitives of a centralized model can't be reordered");
+    }
+
+private:
+    const Vertex* mVertices;
+    const TraceModelPrimitive* mPrimitives;
+    unsigned int mPrimitiveCount;
+};
+
+SceneDescription::SceneDescription(const std::vector<std::string>& inputFiles) : mInputFiles(inputFiles) {
+}
+
+void SceneDescription::Load() {
+
+    for (const auto& it : mInputFiles) {
+        LoadFile(it);
+    }
+
+    EVALUATE(mSpheres.size() < MAX_SPHERES, "Too many spheres provided (", mSpheres.size(), " >= ", MAX_SPHERES, ")");
+    // EVALUATE(mLines.size() < MAX_LINES, "Too many lines provided (%lld >= %d)", mLines.size(), MAX_LINES);
+
+    if (!mUseCache || mModelsInfo.empty()) {
+        CentralizeModels();
+    } else {
+        std::string cachePath = GetCachePath();
+        uint64_t cacheHash = GetCacheHash();
+        if (std::filesystem::exists(cachePath) && TRY_RETURN_VALUE(LoadCache(cachePath, cacheHash), true, false)) {
+            Oblivion::DebugPrintLine("Loaded ", mModelsInfo.size(), " models from cache ", cachePath);
+        } else {
+            CentralizeModels();
+            TRY_PRINT_ERROR(WriteCache(cachePath, cacheHash));
+        }
+    }
+
+    BuildWideSceneTree();
+}
+
+void SceneDescription::CompactVertexBuffer() {
+    mCompactVertexBuffer.resize(mVertexBuffer.size());
+    Threading::Get()->ParralelForImmediate(
+        [&](int64_t index) {
+            mCompactVertexBuffer[index] = CompactVertex(mVertexBuffer[index]);
+        }, (int64_t)mVertexBuffer.size(), 4096);
+    Oblivion::DebugPrintLine("Compacted ", mVertexBuffer.size(), " vertices: ", mVertexBuffer.size() * sizeof(TraceVertex), " -> ",
+                             mCompactVertexBuffer.size() * sizeof(CompactTraceVertex), " bytes");
+
+    mVertexBuffer.clear();
+    mVertexBuffer.shrink_to_fit();
+}
+
+const std::vector<Sphere>& SceneDescription::GetSpheres() const {
+    return mSpheres;
+}
+
+const std::vector<Line>& SceneDescription::GetLines() const {
+    return mLines;
+}
+
+const std::vector<Light>& SceneDescription::GetLights() const {
+    return mLights;
+}
+
+const std::vector<Material>& SceneDescription::GetMaterials() const {
+    return mMaterials;
+}
+
+const std::vector<TraceVertex>& SceneDescription::GetVertexBuffer() const {
+    return mVertexBuffer;
+}
+
+const std::vector<CompactTraceVertex>& SceneDescription::GetCompactVertexBuffer() const {
+    return mCompactVertexBuffer;
+}
+
+const std::vector<TraceModelPrimitive>& SceneDescription::GetModelPrimitives() const {
+    return mModelPrimitives;
+}
+
+const std::vector<TraceScenePrimitive>& SceneDescription::GetScenePrimitives() const {
+    return mScenePrimitives;
+}
+
+const std::vector<BVHTreeNode>& SceneDescription::GetSceneTree() const {
+    return mSceneTree;
+}
+
+const std::vector<BVHTreeNode>& SceneDescription::GetModelTrees() const {
+    return mModelTrees;
+}
+
+const std::string& SceneDescription::GetSkyboxPath() const {
+    return mSkyboxPath;
+}
+
+unsigned int SceneDescription::GetTraversalWidth() const {
+    return mTraversalWidth;
+}
+
+bool SceneDescription::GetCompressedNodes() const {
+    return mCompressedNodes;
+}
+
+const std::vector<std::string>& SceneDescription::GetTexturesToLoad() const {
+    return mTexturesToLoad;
+}
+
+void SceneDescription::LoadFile(const std::string& path) {
+
+    std::string jsonExtension = ".json";
+    if (boost::algorithm::ends_with(path, jsonExtension)) {
+        LoadJSON(path);
+    }
+}
+
+void SceneDescription::LoadSkybox(const std::string&, const boost::property_tree::ptree& pt) {
+
+    auto optionalSkybox = pt.get_child_optional("Skybox");
+    if (optionalSkybox.has_value()) {
+        // Relative to the scene file, which is the working directory while it is parsed
+        std::string skyboxPathString = optionalSkybox->get_value<std::string>();
+        mSkyboxPath = std::filesystem::absolute(std::filesystem::path(skyboxPathString)).string();
+    }
+
+}
+
+void SceneDescription::LoadSpheres(const std::string&, const boost::property_tree::ptree& pt) {
+    
+    // Maybe improve this?
+    auto spheresOptional = pt.get_child_optional("Spheres");
+    if (spheresOptional.has_value()) {
+        auto& spheres = *spheresOptional;
+        mSpheres.reserve(spheres.size());
+        for (auto it = spheres.begin(); it != spheres.end(); ++it) {
+            auto& currentSphere = it->second;
+
+            auto position = currentSphere.get_child("Position").get_value<DirectX::XMFLOAT3>();
+            auto radius = currentSphere.get_child("Radius").get_value<float>();
+            auto color = currentSphere.get_child("Color").get_value<DirectX::XMFLOAT4>();
+            auto lightPropertiesOptional = currentSphere.get_child_optional("Light Properties");
+            DirectX::XMFLOAT2 lightProperties;
+            if (lightPropertiesOptional.has_value()) {
+                lightProperties = lightPropertiesOptional.get().get_value<DirectX::XMFLOAT2>();
+            } else {
+                lightProperties = { 0.0f,0.0f };
+            }
+
+            mSpheres.emplace_back(position, radius, color, lightProperties);
+        }
+    }
+
+}
+
+void SceneDescription::LoadLines(const std::string&, const boost::property_tree::ptree& pt) {
+    auto linesOptional = pt.get_child_optional("Lines");
+    if (linesOptional.has_value()) {
+        auto& lines = *linesOptional;
+        mLines.reserve(lines.size());
+        for (auto it = lines.begin(); it != lines.end(); ++it) {
+            auto& currentLine = it->second;
+
+            auto start = currentLine.get_child("Start").get_value<DirectX::XMFLOAT3>();
+            auto end = currentLine.get_child("End").get_value<DirectX::XMFLOAT3>();
+            auto color = currentLine.get_child("Color").get_value<DirectX::XMFLOAT4>();
+
+            mLines.emplace_back(start, end, color);
+        }
+    }
+}
+
+void SceneDescription::LoadLights(const std::string&, const boost::property_tree::ptree& pt) {
+    auto lightsOptional = pt.get_child_optional("Lights");
+    if (lightsOptional.has_value()) {
+        auto& lights = lightsOptional.get();
+        for (auto it = lights.begin(); it != lights.end(); ++it) {
+            auto& currentLight = it->second;
+
+            auto position = currentLight.get_child("Position").get_value<DirectX::XMFLOAT3>();
+            auto radius = currentLight.get_child("Radius").get_value<float>();
+            auto emission = currentLight.get_child("Emissive").get_value<DirectX::XMFLOAT4>();
+
+            mLights.emplace_back(position, emission, radius);
+        }
+    }
+}
+
+void SceneDescription::LoadMaterials(const std::string&, const boost::property_tree::ptree& pt) {
+    auto materials = pt.get_child("Material");
+
+    mMaterials.reserve(materials.size());
+    for (auto it = materials.begin(); it != materials.end(); ++it) {
+        auto& currentMaterial = it->second;
+        std::string materialName = it->first;
+
+        if (mMaterialNameToMaterialIndex.find(materialName) != mMaterialNameToMaterialIndex.end()) {
+            Oblivion::DebugPrintLine("Material ", materialName, " already loaded... Skipping");
+            break;
+        }
+
+        Oblivion::DebugPrintLine("Loading material ", materialName);
+
+        Material m;
+
+        auto diffuseOptional = currentMaterial.get_child_optional("Diffuse");
+        if (diffuseOptional.has_value()) {
+            auto color = diffuseOptional->get_value<DirectX::XMFLOAT3>();
+            m.diffuseColor = DirectX::XMFLOAT4(color.x, color.y, color.z, 1.0f);
+        }
+
+        auto emissiveOptional = currentMaterial.get_child_optional("Emissive");
+        if (emissiveOptional.has_value()) {
+            auto color = emissiveOptional->get_value<DirectX::XMFLOAT3>();
+            m.emissiveColor = DirectX::XMFLOAT4(color.x, color.y, color.z, 1.0f);
+        }
+
+        auto metallicOptional = currentMaterial.get_child_optional("Metallic");
+        if (metallicOptional.has_value()) {
+            m.metallic = metallicOptional->get_value<float>();
+        }
+
+        auto roughnessOptional = currentMaterial.get_child_optional("Roughness");
+        if (roughnessOptional.has_value()) {
+            m.roughness = roughnessOptional->get_value<float>();
+        }
+
+        auto iorOptional = currentMaterial.get_child_optional("IoR");
+        if (iorOptional.has_value()) {
+            m.ior = iorOptional->get_value<float>();
+        }
+
+        auto textureNameOptional = currentMaterial.get_child_optional("Diffuse Texture");
+        if (textureNameOptional.has_value()) {
+            m.textureIndex = mTexturesToLoad.size();
+            std::string path = std::filesystem::absolute(std::filesystem::path(textureNameOptional->get_value<std::string>())).string();
+            mTexturesToLoad.push_back(path);
+        }
+
+        auto materialTypeOptional = currentMaterial.get_child_optional("Material Type");
+        if (materialTypeOptional.has_value()) {
+            MaterialType type;
+            auto materialType = materialTypeOptional->get_value<std::string>();
+            if (boost::iequals(materialType, "diffuse")) {
+                type = MaterialType::Diffuse;
+            } else if (boost::iequals(materialType, "specular")) {
+                type = MaterialType::Specular;
+            } else {
+                EVALUATE(false, "Material type: ", materialType, " does not exist. Try: \"diffuse\" or \"specular\"");
+            }
+            m.materialType = type;
+        }
+
+        mMaterialNameToMaterialIndex.insert({ materialName, (unsigned int)mMaterials.size() });
+        mMaterials.push_back(m);
+    }
+    
+}
+
+void SceneDescription::LoadModels(const std::string&, const boost::property_tree::ptree& pt) {
+
+    // Todo: split this in LoadModels & BuildModels & AggregateModels
+
+    auto acceleratedStructuresOptional = pt.get_child_optional("AcceleratedModel");
+    if (!acceleratedStructuresOptional.has_value()) {
+        return;
+    }
+
+    auto& acceleratedStructures = *acceleratedStructuresOptional;
+    if (acceleratedStructures.size() == 0) {
+        return;
+    }
+    Oblivion::DebugPrintLine("Preparing to load ", acceleratedStructures.size(), " models");
+    mModelsInfo.reserve(acceleratedStructures.size() + mModelsInfo.size());
+    for (auto it = acceleratedStructures.begin(); it != acceleratedStructures.end(); ++it) {
+        auto& currentModel = it->second;
+
+        auto path = currentModel.get_child("Path").get_value<std::string>();
+        auto maxPrimitivesInNode = currentModel.get_child("MaxPrimitivesInNode").get_value<unsigned int>();
+        
+        auto splitMethod = BvhTree::GetSplitMethodByName(currentModel.get_child("SplitMethod").get_value<std::string>());
+        EVALUATE(splitMethod.has_value(), "Invalid split method for mesh at index ", mModelsInfo.size() + 1);
+
+        bool wireframeRender = false;
+        auto wireframeRenderOptional = currentModel.get_child_optional("WireframeRender");
+        if (wireframeRenderOptional.has_value()) {
+            wireframeRender = wireframeRenderOptional.get().get_value<bool>();
+        }
+
+        bool bvhRender = false;
+        auto bvhRenderOptional = currentModel.get_child_optional("BvhRender");
+        if (bvhRenderOptional.has_value()) {
+            bvhRender = bvhRenderOptional.get().get_value<bool>();
+        }
+
+        BvhTree::BuildParameters buildParameters;
+        auto sahBucketsOptional = currentModel.get_child_optional("SAHBuckets");
+        if (sahBucketsOptional.has_value()) {
+            buildParameters.numberOfBuckets = sahBucketsOptional.get().get_value<unsigned int>();
+            EVALUATE(buildParameters.numberOfBuckets >= 2 && buildParameters.numberOfBuckets <= BvhTree::MaxBuckets,
+                     "SAHBuckets must be between 2 and ", BvhTree::MaxBuckets, " for mesh at index ", mModelsInfo.size() + 1);
+        }
+
+        auto sahTraversalCostOptional = currentModel.get_child_optional("SAHTraversalCost");
+        if (sahTraversalCostOptional.has_value()) {
+            buildParameters.traversalCost = sahTraversalCostOptional.get().get_value<float>();
+        }
+
+        auto sbvhAlphaOptional = currentModel.get_child_optional("SBVHAlpha");
+        if (sbvhAlphaOptional.has_value()) {
+            buildParameters.spatialSplitAlpha = sbvhAlphaOptional.get().get_value<float>();
+        }
+
+        auto sbvhDuplicationBudgetOptional = currentModel.get_child_optional("SBVHDuplicationBudget");
+        if (sbvhDuplicationBudgetOptional.has_value()) {
+            buildParameters.spatialSplitBudget = sbvhDuplicationBudgetOptional.get().get_value<float>();
+        }
+
+        auto preSplitThresholdOptional = currentModel.get_child_optional("PreSplitThreshold");
+        if (preSplitThresholdOptional.has_value()) {
+            buildParameters.preSplitThreshold = preSplitThresholdOptional.get().get_value<float>();
+        }
+
+        auto preSplitBudgetOptional = currentModel.get_child_optional("PreSplitBudget");
+        if (preSplitBudgetOptional.has_value()) {
+            buildParameters.preSplitBudget = preSplitBudgetOptional.get().get_value<float>();
+        }
+
+        auto restructurePassesOptional = currentModel.get_child_optional("TreeletRestructurePasses");
+        if (restructurePassesOptional.has_value()) {
+            buildParameters.restructurePasses = restructurePassesOptional.get().get_value<unsigned int>();
+        }
+
+        auto treeletSizeOptional = currentModel.get_child_optional("TreeletSize");
+        if (treeletSizeOptional.has_value()) {
+            buildParameters.treeletSize = treeletSizeOptional.get().get_value<unsigned int>();
+            EVALUATE(buildParameters.treeletSize >= 3 && buildParameters.treeletSize <= BvhTree::MaxTreeletSize,
+                     "TreeletSize must be between 3 and ", BvhTree::MaxTreeletSize, " for mesh at index ", mModelsInfo.size() + 1);
+        }
+
+        auto nodeLayoutOptional = currentModel.get_child_optional("NodeLayout");
+        if (nodeLayoutOptional.has_value()) {
+            auto nodeLayout = BvhTree::GetNodeLayoutByName(nodeLayoutOptional.get().get_value<std::string>());
+            EVALUATE(nodeLayout.has_value(), "Invalid node layout for mesh at index ", mModelsInfo.size() + 1);
+            buildParameters.nodeLayout = *nodeLayout;
+        }
+
+        Model::WeldParameters weldParameters;
+        auto weldVerticesOptional = currentModel.get_child_optional("WeldVertices");
+        if (weldVerticesOptional.has_value()) {
+            weldParameters.enabled = weldVerticesOptional.get().get_value<bool>();
+        }
+
+        auto weldPositionToleranceOptional = currentModel.get_child_optional("WeldPositionTolerance");
+        if (weldPositionToleranceOptional.has_value()) {
+            weldParameters.positionTolerance = weldPositionToleranceOptional.get().get_value<float>();
+        }
+
+        auto weldNormalToleranceOptional = currentModel.get_child_optional("WeldNormalTolerance");
+        if (weldNormalToleranceOptional.has_value()) {
+            weldParameters.normalTolerance = weldNormalToleranceOptional.get().get_value<float>();
+        }
+
+        auto weldTexCoordToleranceOptional = currentModel.get_child_optional("WeldTexCoordTolerance");
+        if (weldTexCoordToleranceOptional.has_value()) {
+            weldParameters.texCoordTolerance = weldTexCoordToleranceOptional.get().get_value<float>();
+        }
+        EVALUATE(weldParameters.positionTolerance >= 0.0f && weldParameters.normalTolerance >= 0.0f && weldParameters.texCoordTolerance >= 0.0f,
+                 "Weld tolerances can't be negative for mesh at index ", mModelsInfo.size() + 1);
+
+        auto materialName = currentModel.get_child("Material").get_value<std::string>();
+
+        auto instances = LoadInstances(currentModel);
+
+        path = std::filesystem::absolute(std::filesystem::path(path)).string();
+        mModelsInfo.emplace_back(path, *splitMethod, maxPrimitivesInNode, buildParameters, weldParameters, wireframeRender, bvhRender,
+                                 materialName, std::move(instances));
+    }
+
+    try {
+        auto sceneSplitMethod = BvhTree::GetSplitMethodByName(pt.get_child("SceneAcceleration").get_value<std::string>());
+        EVALUATE(sceneSplitMethod.has_value(), "Invalid scene split method");
+        mSceneSplit = *sceneSplitMethod;
+    } catch (...) {
+        Oblivion::DebugPrintLine("Cannot covnert to scene split method. Using default = SAH");
+        mSceneSplit = BvhTree::SplitMethod::SAH;
+    }
+
+    auto traversalWidthOptional = pt.get_child_optional("TraversalWidth");
+    if (traversalWidthOptional.has_value()) {
+        mTraversalWidth = traversalWidthOptional.get().get_value<unsigned int>();
+        EVALUATE(mTraversalWidth == 2 || mTraversalWidth == 4 || mTraversalWidth == 8,
+                 "TraversalWidth must be 2, 4 or 8, but it is ", mTraversalWidth);
+    }
+
+    auto compressedNodesOptional = pt.get_child_optional("CompressedNodes");
+    if (compressedNodesOptional.has_value()) {
+        mCompressedNodes = compressedNodesOptional.get().get_value<bool>();
+    }
+
+    auto sceneCacheOptional = pt.get_child_optional("SceneCache");
+    if (sceneCacheOptional.has_value()) {
+        mUseCache = mUseCache && sceneCacheOptional.get().get_value<bool>();
+    }
+
+    auto cacheMetadataKeyOptional = pt.get_child_optional("SceneCacheMetadataKey");
+    if (cacheMetadataKeyOptional.has_value()) {
+        mCacheMetadataKey = mCacheMetadataKey || cacheMetadataKeyOptional.get().get_value<bool>();
+    }
+}
+
+std::vector<SceneDescription::InstanceInfo> SceneDescription::LoadInstances(const boost::property_tree::ptree& model) {
+    std::vector<InstanceInfo> instances;
+
+    auto instancesOptional = model.get_child_optional("Instances");
+    if (!instancesOptional.has_value()) {
+        // A model without instances is placed once, as it is in its file
+        DirectX::XMFLOAT3X4 identity;
+        DirectX::XMStoreFloat3x4(&identity, DirectX::XMMatrixIdentity());
+        instances.emplace_back(identity, "");
+        return instances;
+    }
+
+    instances.reserve(instancesOptional->size());
+    for (auto it = instancesOptional->begin(); it != instancesOptional->end(); ++it) {
+        auto& currentInstance = it->second;
+
+        // Either a full 3x4 matrix, or a scale, a rotation (pitch, yaw and roll in degrees) and a position
+        DirectX::XMFLOAT3X4 objectToWorld;
+        auto transformOptional = currentInstance.get_child_optional("Transform");
+        if (transformOptional.has_value()) {
+            objectToWorld = transformOptional->get_value<DirectX::XMFLOAT3X4>();
+        } else {
+            DirectX::XMFLOAT3 scale(1.0f, 1.0f, 1.0f), rotation(0.0f, 0.0f, 0.0f), position(0.0f, 0.0f, 0.0f);
+            auto scaleOptional = currentInstance.get_child_optional("Scale");
+            if (scaleOptional.has_value()) {
+                scale = scaleOptional->get_value<DirectX::XMFLOAT3>();
+            }
+            auto rotationOptional = currentInstance.get_child_optional("Rotation");
+            if (rotationOptional.has_value()) {
+                rotation = rotationOptional->get_value<DirectX::XMFLOAT3>();
+            }
+            auto positionOptional = currentInstance.get_child_optional("Position");
+            if (positionOptional.has_value()) {
+                position = positionOptional->get_value<DirectX::XMFLOAT3>();
+            }
+
+            DirectX::XMMATRIX transform =
+                DirectX::XMMatrixScaling(scale.x, scale.y, scale.z) *
+                DirectX::XMMatrixRotationRollPitchYaw(DirectX::XMConvertToRadians(rotation.x), DirectX::XMConvertToRadians(rotation.y),
+                                                      DirectX::XMConvertToRadians(rotation.z)) *
+                DirectX::XMMatrixTranslation(position.x, position.y, position.z);
+            DirectX::XMStoreFloat3x4(&objectToWorld, transform);
+        }
+
+        std::string materialName;
+        auto materialOptional = currentInstance.get_child_optional("Material");
+        if (materialOptional.has_value()) {
+            materialName = materialOptional->get_value<std::string>();
+        }
+
+        instances.emplace_back(objectToWorld, materialName);
+    }
+
+    return instances;
+}
+
+void SceneDescription::CentralizeModels() {
+    Oblivion::DebugPrintLine("Start loading ", mModelsInfo.size(), " models");
+    std::vector<ImportedModel> models;
+    models.resize(mModelsInfo.size());
+    std::mutex linesMutex;
+    std::atomic<unsigned int> totalVertices = 0;
+    std::atomic<unsigned int> cachedModels = 0;
+    Threading::Get()->ParralelForImmediate(
+        [&](int64_t index) {
+            const auto& constructionInfo = mModelsInfo.at(index);
+            auto& importedModel = models[index];
+
+            // The debug lines come from the imported mesh and from the build, so those models are always rebuilt
+            bool useMeshCache = mUseCache && !constructionInfo.wireframeRender && !constructionInfo.bvhRender;
+            uint64_t cacheHash = 0;
+            std::string cachePath;
+            if (useMeshCache) {
+                cacheHash = GetMeshCacheHash(constructionInfo);
+                cachePath = GetMeshCachePath(cacheHash);
+                if (std::filesystem::exists(cachePath) && TRY_RETURN_VALUE(LoadMeshCache(cachePath, cacheHash, importedModel), true, false)) {
+                    totalVertices += (unsigned int)importedModel.vertices.size();
+                    cachedModels++;
+                    return;
+                }
+            }
+
+            auto model = std::make_unique<Model>(constructionInfo.path);
+            if (constructionInfo.weldParameters.enabled) {
+                auto importedVertices = model->GetVertexCount();
+                model->WeldVertices(constructionInfo.weldParameters);
+                Oblivion::DebugPrintLine("Welded the vertices of ", constructionInfo.path, ": ", importedVertices, " -> ", model->GetVertexCount(),
+                                         " vertices, ", importedVertices * sizeof(TraceVertex), " -> ",
+                                         model->GetVertexCount() * sizeof(TraceVertex), " bytes");
+            }
+            totalVertices += model->GetVertexCount();
+            if (constructionInfo.wireframeRender) {
+                const auto& renderLines = model->GetRenderLines();
+                std::unique_lock<std::mutex> lock(linesMutex);
+                std::move(renderLines.begin(), renderLines.end(), std::back_inserter(mLines));
+            }
+
+            auto bvhTree = BvhTree::Create(model.get(), constructionInfo.splitMethod, constructionInfo.maxPrimitivesInNode, 65536,
+                                           constructionInfo.buildParameters);
+            if (constructionInfo.bvhRender) {
+                const auto& renderLines = bvhTree->GetRenderLines();
+                std::unique_lock<std::mutex> lock(linesMutex);
+                std::move(renderLines.begin(), renderLines.end(), std::back_inserter(mLines));
+            }
+
+            auto primitiveCount = model->GetPrimitiveCount();
+            importedModel.primitives.reserve(primitiveCount);
+            for (unsigned int primitiveIndex = 0; primitiveIndex < primitiveCount; ++primitiveIndex) {
+                importedModel.primitives.push_back(model->GetPrimitive(primitiveIndex));
+            }
+            importedModel.vertices = std::move(model->GetVertices());
+            importedModel.tree = std::move(bvhTree);
+
+            if (useMeshCache) {
+                TRY_PRINT_ERROR(WriteMeshCache(cachePath, cacheHash, importedModel));
+            }
+        }, mModelsInfo.size(), 1);
+    Oblivion::DebugPrintLine("Finished loading ", mModelsInfo.size(), " models, ", cachedModels.load(), " of them from the mesh cache");
+
+    mModelBvhTrees.clear();
+    mModelRanges.clear();
+    mModelBvhTrees.reserve(models.size());
+    mModelRanges.reserve(models.size());
+    {
+        Oblivion::DebugPrintLine("Centralizing Vertex & Index Buffers & Primitives & Materials");
+        mVertexBuffer.reserve(totalVertices);
+        unsigned int totalNodes = 0;
+        for (unsigned int i = 0; i < models.size(); ++i) {
+            auto& model = models[i];
+
+            // The trees keep offsets into the primitives of their model, so that they can be refit. Only the flattened
+            // copy in mModelTrees is moved to mModelPrimitives
+            mModelRanges.push_back({ totalNodes, (unsigned int)mModelPrimitives.size(), (unsigned int)mVertexBuffer.size() });
+            totalNodes += (unsigned int)model.tree->GetNodes().size();
+            mModelBvhTrees.push_back(model.tree);
+
+            auto vertexOffset = (unsigned int)mVertexBuffer.size();
+            mModelPrimitives.reserve(model.primitives.size() + mModelPrimitives.size());
+            for (auto primitive : model.primitives) {
+                primitive.index0 += vertexOffset;
+                primitive.index1 += vertexOffset;
+                primitive.index2 += vertexOffset;
+                mModelPrimitives.push_back(primitive);
+            }
+
+            std::move(model.vertices.begin(), model.vertices.end(), std::back_inserter(mVertexBuffer));
+        }
+    }
+
+    {
+        Oblivion::DebugPrintLine("Building scene BVH");
+        auto instances = GetSceneInstances();
+        Oblivion::DebugPrintLine("Placing ", instances.size(), " instances of ", mModelsInfo.size(), " models");
+
+        mScene = std::make_unique<Scene>(mModelBvhTrees, instances);
+        BuildSceneTree();
+
+        Oblivion::DebugPrintLine("Centralizing Scene BVH and Models BVH");
+        // mSceneTree is already centralized from before
+
+        Oblivion::DebugPrintLine("Scene tree: ", mSceneTree);
+        FlattenModelTrees();
+    }
+    mMovedModels.assign(mModelsInfo.size(), false);
+}
+
+std::vector<SceneInstance> SceneDescription::GetSceneInstances() const {
+    std::vector<SceneInstance> instances;
+    for (unsigned int i = 0; i < mModelsInfo.size(); ++i) {
+        const auto& constructionInfo = mModelsInfo[i];
+        for (const auto& instance : constructionInfo.instances) {
+            const auto& materialName = instance.materialName.empty() ? constructionInfo.usedMaterialName : instance.materialName;
+            auto material = mMaterialNameToMaterialIndex.find(materialName);
+            EVALUATE(material != mMaterialNameToMaterialIndex.end(), "Unknown material ", materialName, " used by an instance of ",
+                     constructionInfo.path);
+            instances.emplace_back(i, instance.objectToWorld, material->second);
+        }
+    }
+    return instances;
+}
+
+void SceneDescription::BuildSceneTree() {
+    auto sceneBvh = mScene->BuildTree(mSceneSplit);
+    mSceneTree = std::move(sceneBvh->GetNodes());
+    auto primitiveCount = mScene->GetPrimitiveCount();
+    mScenePrimitives.clear();
+    mScenePrimitives.reserve(primitiveCount);
+    for (unsigned int primitiveIndex = 0; primitiveIndex < primitiveCount; ++primitiveIndex) {
+        mScenePrimitives.push_back(mScene->GetPrimitive(primitiveIndex));
+    }
+}
+
+void SceneDescription::FlattenModelTrees() {
+    mModelTrees = mScene->GetModelTree();
+    for (unsigned int i = 0; i < mModelRanges.size(); ++i) {
+        const auto& range = mModelRanges[i];
+        auto nodesEnd = range.firstNode + (unsigned int)mModelBvhTrees[i]->GetNodes().size();
+        for (auto node = mModelTrees.begin() + range.firstNode; node != mModelTrees.begin() + nodesEnd; ++node) {
+            if (node->numberOfPrimitives != 0) {
+                node->primitiveOffset += range.firstPrimitive;
+            }
+        }
+    }
+}
+
+void SceneDescription::RestoreModelTrees() {
+    Oblivion::DebugPrintLine("Restoring the trees of ", mModelsInfo.size(), " models for an update");
+    mModelBvhTrees.clear();
+    mModelBvhTrees.reserve(mModelRanges.size());
+    for (unsigned int i = 0; i < mModelRanges.size(); ++i) {
+        const auto& range = mModelRanges[i];
+        auto nodesEnd = i + 1 < mModelRanges.size() ? mModelRanges[i + 1].firstNode : (unsigned int)mModelTrees.size();
+        std::vector<BVHTreeNode> nodes(mModelTrees.begin() + range.firstNode, mModelTrees.begin() + nodesEnd);
+        for (auto& node : nodes) {
+            if (node.numberOfPrimitives != 0) {
+                node.primitiveOffset -= range.firstPrimitive;
+            } else {
+                node.secondChildOffset -= range.firstNode;
+            }
+        }
+        mModelBvhTrees.push_back(BvhTree::Create(std::move(nodes)));
+    }
+    mScene = std::make_unique<Scene>(mModelBvhTrees, GetSceneInstances());
+    mMovedModels.assign(mModelsInfo.size(), false);
+}
+
+unsigned int SceneDescription::GetModelCount() const {
+    return (unsigned int)mModelRanges.size();
+}
+
+unsigned int SceneDescription::GetModelFirstVertex(unsigned int modelIndex) const {
+    EVALUATE(modelIndex < mModelRanges.size(), "Invalid model ", modelIndex, ", there are only ", mModelRanges.size());
+    return mModelRanges[modelIndex].firstVertex;
+}
+
+unsigned int SceneDescription::GetModelVertexCount(unsigned int modelIndex) const {
+    EVALUATE(modelIndex < mModelRanges.size(), "Invalid model ", modelIndex, ", there are only ", mModelRanges.size());
+    auto vertexCount = (unsigned int)std::max(mVertexBuffer.size(), mCompactVertexBuffer.size());
+    auto verticesEnd = modelIndex + 1 < mModelRanges.size() ? mModelRanges[modelIndex + 1].firstVertex : vertexCount;
+    return verticesEnd - mModelRanges[modelIndex].firstVertex;
+}
+
+void SceneDescription::SetModelVertices(unsigned int modelIndex, const std::vector<TraceVertex>& vertices) {
+    auto vertexCount = GetModelVertexCount(modelIndex);
+    EVALUATE(vertices.size() == vertexCount, "Model ", modelIndex, " has ", vertexCount, " vertices, got ", vertices.size());
+    if (!mScene) {
+        RestoreModelTrees();
+    }
+
+    auto firstVertex = mModelRanges[modelIndex].firstVertex;
+    if (mCompactVertexBuffer.empty()) {
+        std::copy(vertices.begin(), vertices.end(), mVertexBuffer.begin() + firstVertex);
+    } else {
+        std::transform(vertices.begin(), vertices.end(), mCompactVertexBuffer.begin() + firstVertex, CompactVertex);
+    }
+    mMovedModels[modelIndex] = true;
+}
+
+void SceneDescription::SetInstanceTransform(unsigned int instanceIndex, const DirectX::XMFLOAT3X4& objectToWorld) {
+    if (!mScene) {
+        RestoreModelTrees();
+    }
+    mScene->SetInstanceTransform(instanceIndex, objectToWorld);
+}
+
+void SceneDescription::UpdateTrees() {
+    if (!mScene) {
+        RestoreModelTrees();
+    }
+
+    for (unsigned int i = 0; i < mModelRanges.size(); ++i) {
+        if (!mMovedModels[i]) {
+            continue;
+        }
+        const auto& range = mModelRanges[i];
+        auto primitivesEnd = i + 1 < mModelRanges.size() ? mModelRanges[i + 1].firstPrimitive : (unsigned int)mModelPrimitives.size();
+        auto primitiveCount = primitivesEnd - range.firstPrimitive;
+        auto& tree = *mModelBvhTrees[i];
+        if (mCompactVertexBuffer.empty()) {
+            CentralizedModel<TraceVertex> model(mVertexBuffer.data(), mModelPrimitives.data() + range.firstPrimitive, primitiveCount);
+            tree.Refit(&model);
+        } else {
+            CentralizedModel<CompactTraceVertex> model(mCompactVertexBuffer.data(), mModelPrimitives.data() + range.firstPrimitive,
+                                                       primitiveCount);
+            tree.Refit(&model);
+        }
+        mScene->RefitModel(i, tree);
+
+        // Only the bounds changed, the leaves of the flattened copy still point at the right primitives
+        const auto& nodes = tree.GetNodes();
+        for (unsigned int j = 0; j < nodes.size(); ++j) {
+            mModelTrees[range.firstNode + j].minAABB = nodes[j].minAABB;
+            mModelTrees[range.firstNode + j].maxAABB = nodes[j].maxAABB;
+        }
+        mMovedModels[i] = false;
+    }
+
+    BuildSceneTree();
+    BuildWideSceneTree();
+}
+
+void SceneDescription::BuildWideSceneTree() {
+    if (mTraversalWidth == 4 && mCompressedNodes) {
+        mWideSceneTree.emplace<WideSceneTree<4, true>>(mSceneTree, mScenePrimitives, mModelTrees);
+    } else if (mTraversalWidth == 4) {
+        mWideSceneTree.emplace<WideSceneTree<4>>(mSceneTree, mScenePrimitives, mModelTrees);
+    } else if (mTraversalWidth == 8 && mCompressedNodes) {
+        mWideSceneTree.emplace<WideSceneTree<8, true>>(mSceneTree, mScenePrimitives, mModelTrees);
+    } else if (mTraversalWidth == 8) {
+        mWideSceneTree.emplace<WideSceneTree<8>>(mSceneTree, mScenePrimitives, mModelTrees);
+    }
+}
+
+std::string SceneDescription::GetCachePath() const {
+    return std::filesystem::absolute(std::filesystem::path(mInputFiles.front()).replace_extension(SceneCacheExtension)).string();
+}
+
+uint64_t SceneDescription::GetCacheHash() const {
+    uint64_t hash = HashBytes(&SceneCacheVersion, sizeof(SceneCacheVersion));
+    auto hashFile = [&](const std::string& path) {
+        if (mCacheMetadataKey) {
+            hash = HashFileMetadata(path, hash);
+        } else {
+            hash = HashBytes(path.data(), path.size(), hash);
+            hash = HashFileContent(path, hash);
+        }
+    };
+
+    // The scene files hold every build setting, and the paths of the models are absolute, so a moved scene is rebuilt.
+    // Files a model pulls in on its own, like material libraries, are not covered
+    for (const auto& path : mInputFiles) {
+        hashFile(std::filesystem::absolute(path).string());
+    }
+    for (const auto& modelInfo : mModelsInfo) {
+        hashFile(modelInfo.path);
+    }
+    return hash;
+}
+
+void SceneDescription::LoadCache(const std::string& path, uint64_t hash) {
+    CacheFile file(path, SceneCacheVersion, hash, SceneCacheSectionCount);
+
+    // Read into copies, so that a broken cache leaves the scene as it was. The scene owns its arrays rather than viewing the
+    // mapping, as CompactVertexBuffer and UpdateTrees change them and everything that reads the scene takes vectors. The
+    // copy is most of a warm start: about 50 of 65 ms for a 88 MB cache
+    std::vector<Line> lines;
+    std::vector<Material> materials;
+    std::vector<TraceVertex> vertexBuffer;
+    std::vector<TraceModelPrimitive> modelPrimitives;
+    std::vector<TraceScenePrimitive> scenePrimitives;
+    std::vector<BVHTreeNode> sceneTree;
+    std::vector<BVHTreeNode> modelTrees;
+    std::vector<ModelRange> modelRanges;
+    file.ReadSection(LinesSection, lines);
+    file.ReadSection(MaterialsSection, materials);
+    file.ReadSection(VertexBufferSection, vertexBuffer);
+    file.ReadSection(ModelPrimitivesSection, modelPrimitives);
+    file.ReadSection(ScenePrimitivesSection, scenePrimitives);
+    file.ReadSection(SceneTreeSection, sceneTree);
+    file.ReadSection(ModelTreesSection, modelTrees);
+    file.ReadSection(ModelRangesSection, modelRanges);
+    EVALUATE(modelRanges.size() == mModelsInfo.size(), "Cache ", path, " has ", modelRanges.size(), " models instead of ",
+             mModelsInfo.size());
+
+    mLines = std::move(lines);
+    mMaterials = std::move(materials);
+    mVertexBuffer = std::move(vertexBuffer);
+    mModelPrimitives = std::move(modelPrimitives);
+    mScenePrimitives = std::move(scenePrimitives);
+    mSceneTree = std::move(sceneTree);
+    mModelTrees = std::move(modelTrees);
+    mModelRanges = std::move(modelRanges);
+}
+
+void SceneDescription::WriteCache(const std::string& path, uint64_t hash) const {
+    std::vector<CacheFile::Section> sections(SceneCacheSectionCount);
+    sections[LinesSection] = { mLines.data(), mLines.size(), sizeof(Line) };
+    sections[MaterialsSection] = { mMaterials.data(), mMaterials.size(), sizeof(Material) };
+    sections[VertexBufferSection] = { mVertexBuffer.data(), mVertexBuffer.size(), sizeof(TraceVertex) };
+    sections[ModelPrimitivesSection] = { mModelPrimitives.data(), mModelPrimitives.size(), sizeof(TraceModelPrimitive) };
+    sections[ScenePrimitivesSection] = { mScenePrimitives.data(), mScenePrimitives.size(), sizeof(TraceScenePrimitive) };
+    sections[SceneTreeSection] = { mSceneTree.data(), mSceneTree.size(), sizeof(BVHTreeNode) };
+    sections[ModelTreesSection] = { mModelTrees.data(), mModelTrees.size(), sizeof(BVHTreeNode) };
+    sections[ModelRangesSection] = { mModelRanges.data(), mModelRanges.size(), sizeof(ModelRange) };
+
+    auto size = CacheFile::Write(path, SceneCacheVersion, hash, sections);
+    Oblivion::DebugPrintLine("Wrote scene cache ", path, " of ", size, " bytes");
+}
+
+std::string SceneDescription::GetMeshCachePath(uint64_t hash) const {
+    // Shared by the scenes of a directory, which often use the same models. Named after the hash only, so that copies of
+    // a model under other names share their entry
+    auto directory = std::filesystem::absolute(std::filesystem::path(mInputFiles.front())).parent_path() / MeshCacheDirectory;
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << hash << MeshCacheExtension;
+    return (directory / name.str()).string();
+}
+
+uint64_t SceneDescription::GetMeshCacheHash(const AcceleratedStructureInfo& modelInfo) {
+    // Only the content of the file, so that a model moved or shared between directories keeps its entry
+    uint64_t hash = HashFileContent(modelInfo.path, HashBytes(&MeshCacheVersion, sizeof(MeshCacheVersion)));
+    auto hashValue = [&](const auto& value) {
+        hash = HashBytes(&value, sizeof(value), hash);
+    };
+
+    hashValue(Model::GetImportFlags());
+    hashValue(modelInfo.splitMethod);
+    hashValue(modelInfo.maxPrimitivesInNode);
+    const auto& parameters = modelInfo.buildParameters;
+    hashValue(parameters.numberOfBuckets);
+    hashValue(parameters.traversalCost);
+    hashValue(parameters.spatialSplitAlpha);
+    hashValue(parameters.spatialSplitBudget);
+    hashValue(parameters.restructurePasses);
+    hashValue(parameters.treeletSize);
+    hashValue(parameters.preSplitThreshold);
+    hashValue(parameters.preSplitBudget);
+    hashValue(parameters.nodeLayout);
+    const auto& weldParameters = modelInfo.weldParameters;
+    hashValue(weldParameters.enabled);
+    hashValue(weldParameters.positionTolerance);
+    hashValue(weldParameters.normalTolerance);
+    hashValue(weldParameters.texCoordTolerance);
+    return hash;
+}
+
+void SceneDescription::LoadMeshCache(const std::string& path, uint64_t hash, ImportedModel& model) {
+    CacheFile file(path, MeshCacheVersion, hash, MeshCacheSectionCount);
+
+    std::vector<BVHTreeNode> nodes;
+    file.ReadSection(MeshVerticesSection, model.vertices);
+    file.ReadSection(MeshPrimitivesSection, model.primitives);
+    file.ReadSection(MeshTreeSection, nodes);
+    EVALUATE(!nodes.empty(), "Cache ", path, " has no tree");
+    model.tree = BvhTree::Create(std::move(nodes));
+}
+
+void SceneDescription::WriteMeshCache(const std::string& path, uint64_t hash, ImportedModel& model) {
+    auto& nodes = model.tree->GetNodes();
+    std::vector<CacheFile::Section> sections(MeshCacheSectionCount);
+    sections[MeshVerticesSection] = { model.vertices.data(), model.vertices.size(), sizeof(TraceVertex) };
+    sections[MeshPrimitivesSection] = { model.primitives.data(), model.primitives.size(), sizeof(TraceModelPrimitive) };
+    sections[MeshTreeSection] = { nodes.data(), nodes.size(), sizeof(BVHTreeNode) };
+
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+    CacheFile::Write(path, MeshCacheVersion, hash, sections);
+}
+
+void SceneDescription::LoadJSON(const std::string& path) {
+    using namespace boost::property_tree;
+
+    boost::property_tree::ptree pt;
+    boost::property_tree::json_parser::read_json(path, pt);
+
+    auto oldCwd = std::filesystem::current_path();
+
+    std::filesystem::path cwd = std::filesystem::absolute(path);
+    std::filesystem::current_path(cwd.parent_path());
+
+    mVersion = pt.get_child("Version").get_value<unsigned int>();
+    EVALUATE(mVersion == 1, "Invalid version for this build (", mVersion, "). Maximum supported = 1");
+
+    LoadSkybox(path, pt);
+    LoadSpheres(path, pt);
+    LoadLines(path, pt);
+    LoadLights(path, pt);
+    LoadMaterials(path, pt);
+    LoadModels(path, pt);
+
+    std::filesystem::current_path(oldCwd);
+
+    Oblivion::DebugPrintLine("Finished loading file: ", path);
+}
+
@@ -0,0 +1,198 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "ShaderObjects.h"
+#include "Scene.h"
+#include "Model.h"
+#include "CompactVertex.h"
+#include "Optimizations/WideBvhTree.h"
+
+#include <variant>
+
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+// Everything a scene file describes, loaded and optimized on the CPU: the objects, the materials and the flattened
+// buffers of the two level BVH, laid out as the shaders read them. Doesn't touch the GPU, so that the scene can be traced
+// without D3D12. SceneLoader uploads it for the shaders
+class SceneDescription {
+
+public:
+    SceneDescription(const std::vector<std::string>& inputFiles);
+    virtual ~SceneDescription() = default;
+
+public:
+    void Load();
+
+    const std::vector<Sphere>& GetSpheres() const;
+    const std::vector<Line>& GetLines() const;
+    const std::vector<Light>& GetLights() const;
+    const std::vector<Material>& GetMaterials() const;
+
+    const std::vector<TraceVertex>& GetVertexBuffer() const;
+    // Empty until CompactVertexBuffer is called
+    const std::vector<CompactTraceVertex>& GetCompactVertexBuffer() const;
+    const std::vector<TraceModelPrimitive>& GetModelPrimitives() const;
+    const std::vector<TraceScenePrimitive>& GetScenePrimitives() const;
+    const std::vector<BVHTreeNode>& GetSceneTree() const;
+    const std::vector<BVHTreeNode>& GetModelTrees() const;
+
+    // Absolute paths, empty when the scene has no skybox
+    const std::string& GetSkyboxPath() const;
+    const std::vector<std::string>& GetTexturesToLoad() const;
+
+    // 2 for the binary trees of the shaders, or 4 / 8 when the scene asks for a wide tree
+    unsigned int GetTraversalWidth() const;
+    // Whether the wide tree has quantized nodes
+    bool GetCompressedNodes() const;
+    // Wide trees the CPU tracer walks single rays with, only built when the scene asks for them through "TraversalWidth"
+    // and "CompressedNodes". Returns nullptr when the scene uses another kind of tree
+    template <typename WideSceneTreeType>
+    const WideSceneTreeType* GetWideSceneTree() const {
+        return std::get_if<WideSceneTreeType>(&mWideSceneTree);
+    }
+
+    // Replaces the vertex buffer with CompactTraceVertex, for the CPU tracer. GetVertexBuffer is empty afterwards, so the
+    // scene can't be uploaded to the GPU anymore
+    void CompactVertexBuffer();
+
+    // Animation of a loaded scene, without importing the models or building their trees again. SetModelVertices and
+    // SetInstanceTransform record the changes, then UpdateTrees refits the trees of the models whose vertices moved
+    // (BvhTree::Refit), builds the scene tree over the instances again, and rewrites GetSceneTree, GetScenePrimitives,
+    // GetModelTrees and the wide tree. Anything built over the scene before, like a CpuPathTracer, must be built again
+    unsigned int GetModelCount() const;
+    // The vertices of a model are contiguous in the vertex buffer, in the order SetModelVertices takes them
+    unsigned int GetModelFirstVertex(unsigned int modelIndex) const;
+    unsigned int GetModelVertexCount(unsigned int modelIndex) const;
+    void SetModelVertices(unsigned int modelIndex, const std::vector<TraceVertex>& vertices);
+    // Instances are numbered in the order of the scene files: every instance of the first model, then of the next one
+    void SetInstanceTransform(unsigned int instanceIndex, const DirectX::XMFLOAT3X4& objectToWorld);
+    void UpdateTrees();
+
+private:
+    void LoadFile(const std::string& path);
+
+    void LoadJSON(const std::string& path);
+
+private:
+    void LoadSkybox(const std::string& path, const boost::property_tree::ptree& pt);
+    void LoadSpheres(const std::string& path, const boost::property_tree::ptree& pt);
+    void LoadLines(const std::string& path, const boost::property_tree::ptree& pt);
+    void LoadLights(const std::string& path, const boost::property_tree::ptree& pt);
+    void LoadMaterials(const std::string& path, const boost::property_tree::ptree& pt);
+    void LoadModels(const std::string& path, const boost::property_tree::ptree& pt);
+
+private:
+    void CentralizeModels();
+    void BuildWideSceneTree();
+
+    std::vector<SceneInstance> GetSceneInstances() const;
+    // Builds the scene tree of mScene, into mSceneTree and mScenePrimitives
+    void BuildSceneTree();
+    // Copies the model trees of mScene into mModelTrees, with the leaves moved to the primitives of their model
+    void FlattenModelTrees();
+    // A scene read from the cache has none of the trees UpdateTrees works on. They are taken back from mModelTrees
+    void RestoreModelTrees();
+
+private:
+    // Binary copy of everything CentralizeModels builds, next to the first scene file, so that a scene that didn't change
+    // since the last run skips the import of the models and the build of the trees
+    std::string GetCachePath() const;
+    // Covers the paths and the content of the scene files and of the files of the models, and the layout of the cache.
+    // Scenes that set "SceneCacheMetadataKey" only cover the size and modification time of the files instead of their
+    // content, so that a warm start doesn't read them, at the cost of missing edits that keep both
+    uint64_t GetCacheHash() const;
+    void LoadCache(const std::string& path, uint64_t hash);
+    void WriteCache(const std::string& path, uint64_t hash) const;
+
+private:
+    struct InstanceInfo {
+        DirectX::XMFLOAT3X4 objectToWorld;
+        // Empty when the instance uses the material of its model
+        std::string materialName;
+        InstanceInfo(const DirectX::XMFLOAT3X4& objectToWorld, std::string materialName) :
+            objectToWorld(objectToWorld), materialName(std::move(materialName)) {};
+    };
+
+    struct AcceleratedStructureInfo {
+        std::string path;
+        BvhTree::SplitMethod splitMethod;
+        unsigned int maxPrimitivesInNode;
+        BvhTree::BuildParameters buildParameters;
+        Model::WeldParameters weldParameters;
+        bool wireframeRender;
+        bool bvhRender;
+        std::string usedMaterialName;
+        std::vector<InstanceInfo> instances;
+        AcceleratedStructureInfo(std::string path, BvhTree::SplitMethod splitMethod, unsigned int maxPrimitivesInNode,
+                                 BvhTree::BuildParameters buildParameters, Model::WeldParameters weldParameters, bool wireframeRender,
+                                 bool bvhRender, std::string usedMaterialName, std::vector<InstanceInfo> instances) :
+            path(std::move(path)), splitMethod(splitMethod), maxPrimitivesInNode(maxPrimitivesInNode),
+            buildParameters(buildParameters), weldParameters(weldParameters), wireframeRender(wireframeRender), bvhRender(bvhRender),
+            usedMaterialName(std::move(usedMaterialName)), instances(std::move(instances)) {};
+    };
+
+    std::vector<InstanceInfo> LoadInstances(const boost::property_tree::ptree& model);
+
+private:
+    struct ImportedModel;
+
+    // Every model is cached on its own in a directory next to the first scene file, under a hash of its content and of
+    // the settings of its import and build, so that only the models that changed are imported again when the scene cache
+    // is out of date
+    std::string GetMeshCachePath(uint64_t hash) const;
+    static uint64_t GetMeshCacheHash(const AcceleratedStructureInfo& modelInfo);
+    static void LoadMeshCache(const std::string& path, uint64_t hash, ImportedModel& model);
+    static void WriteMeshCache(const std::string& path, uint64_t hash, ImportedModel& model);
+
+
+protected:
+    std::vector<std::string> mInputFiles;
+
+    std::string mSkyboxPath;
+
+    std::vector<Sphere> mSpheres;
+    std::vector<Line> mLines;
+    std::vector<Light> mLights;
+
+    std::vector<TraceVertex> mVertexBuffer;
+    std::vector<CompactTraceVertex> mCompactVertexBuffer;
+
+    std::vector<AcceleratedStructureInfo> mModelsInfo;
+    BvhTree::SplitMethod mSceneSplit = BvhTree::SplitMethod::SAH;
+
+    std::vector<TraceModelPrimitive> mModelPrimitives;
+    std::vector<TraceScenePrimitive> mScenePrimitives;
+
+    std::vector<BVHTreeNode> mSceneTree;
+    std::vector<BVHTreeNode> mModelTrees;
+
+    // Where every model starts in mModelTrees, mModelPrimitives and the vertex buffer
+    struct ModelRange {
+        unsigned int firstNode;
+        unsigned int firstPrimitive;
+        unsigned int firstVertex;
+    };
+    std::vector<ModelRange> mModelRanges;
+    // The trees of the models, with offsets into their own primitives, and the scene over their instances, kept for
+    // UpdateTrees. mMovedModels[i] is set by SetModelVertices until the next UpdateTrees refits the tree of model i
+    std::vector<std::shared_ptr<BvhTree>> mModelBvhTrees;
+    std::unique_ptr<Scene> mScene;
+    std::vector<bool> mMovedModels;
+
+    unsigned int mTraversalWidth = 2;
+    bool mCompressedNodes = false;
+    bool mUseCache = true;
+    bool mCacheMetadataKey = false;
+    std::variant<std::monostate, WideSceneTree<4>, WideSceneTree<8>, WideSceneTree<4, true>, WideSceneTree<8, true>> mWideSceneTree;
+
+    std::unordered_map<std::string, unsigned int> mMaterialNameToMaterialIndex;
+    std::vector<Material> mMaterials;
+
+    std::vector<std::string> mTexturesToLoad;
+
+    unsigned int mVersion = 0;
+};
@@ -1,22 +1,15 @@
 #include "SceneLoader.h"
-#include "Optimizations/BvhTree.h"
-#include "../Utils/Threading.h"
 #include "../Common/Limits.h"
 #include "Direct3D.h"
 
-SceneLoader::SceneLoader(const std::vector<std::string>& inputFiles) : mInputFiles(inputFiles) {
+SceneLoader::SceneLoader(const std::vector<std::string>& inputFiles) : SceneDescription(inputFiles) {
 }
 
 void SceneLoader::Load(ComPtr<ID3D12GraphicsCommandList> cmdList) {
 
-    for (const auto& it : mInputFiles) {
-        LoadFile(it, cmdList);
-    }
-
-    EVALUATE(mSpheres.size() < MAX_SPHERES, "Too many spheres provided (", mSpheres.size(), " >= ", MAX_SPHERES, ")");
-    // EVALUATE(mLines.size() < MAX_LINES, "Too many lines provided (%lld >= %d)", mLines.size(), MAX_LINES);
+    SceneDescription::Load();
 
-    CentralizeModels();
+    LoadSkybox(cmdList);
     BuildBuffers(cmdList);
     BuildTextures(cmdList);
 }
@@ -56,6 +49,7 @@ std::shared_ptr<Skymap> SceneLoader::GetSkybox() const {
     return mSkybox;
 }
 
+
 void SceneLoader::BindScene(ID3D12DescriptorHeap* heap, std::size_t& offset) {
 
     mSpheresCB->CreateViewInHeap(heap, offset);
@@ -97,299 +91,17 @@ std::shared_ptr<UploadBuffer<SpheresCB>> SceneLoader::GetSpheresCB() const {
     return mSpheresCB;
 }
 
-void SceneLoader::LoadFile(const std::string& path, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-
-    std::string jsonExtension = ".json";
-    if (boost::algorithm::ends_with(path, jsonExtension)) {
-        LoadJSON(path, cmdList);
-    }
-}
-
-void SceneLoader::LoadSkybox(const std::string& path, const boost::property_tree::ptree&pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
+void SceneLoader::LoadSkybox(ComPtr<ID3D12GraphicsCommandList> cmdList) {
 
-    auto optionalSkybox = pt.get_child_optional("Skybox");
-    if (optionalSkybox.has_value()) {
+    if (!mSkyboxPath.empty()) {
         TRY_PRINT_ERROR_AND_MESSAGE(
             {
-                std::string skyboxPathString = optionalSkybox->get_value<std::string>();
-                mSkybox = std::make_shared<Skymap>(skyboxPathString, D3D12_RESOURCE_FLAGS::D3D12_RESOURCE_FLAG_NONE,
+                mSkybox = std::make_shared<Skymap>(mSkyboxPath, D3D12_RESOURCE_FLAGS::D3D12_RESOURCE_FLAG_NONE,
                                                     cmdList, D3D12_RESOURCE_STATES::D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
-                Oblivion::DebugPrintLine("Successfully loaded skybox from: ", path.c_str());
-            }, "Unable to load skybox from input file: %s", path.c_str());
-    }
-
-}
-
-void SceneLoader::LoadSpheres(const std::string& path, const boost::property_tree::ptree& pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-    
-    // Maybe improve this?
-    auto spheresOptional = pt.get_child_optional("Spheres");
-    if (spheresOptional.has_value()) {
-        auto& spheres = *spheresOptional;
-        mSpheres.reserve(spheres.size());
-        for (auto it = spheres.begin(); it != spheres.end(); ++it) {
-            auto& currentSphere = it->second;
-
-            auto position = currentSphere.get_child("Position").get_value<DirectX::XMFLOAT3>();
-            auto radius = currentSphere.get_child("Radius").get_value<float>();
-            auto color = currentSphere.get_child("Color").get_value<DirectX::XMFLOAT4>();
-            auto lightPropertiesOptional = currentSphere.get_child_optional("Light Properties");
-            DirectX::XMFLOAT2 lightProperties;
-            if (lightPropertiesOptional.has_value()) {
-                lightProperties = lightPropertiesOptional.get().get_value<DirectX::XMFLOAT2>();
-            } else {
-                lightProperties = { 0.0f,0.0f };
-            }
-
-            mSpheres.emplace_back(position, radius, color, lightProperties);
-        }
-    }
-
-}
-
-void SceneLoader::LoadLines(const std::string& path, const boost::property_tree::ptree& pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-    auto linesOptional = pt.get_child_optional("Lines");
-    if (linesOptional.has_value()) {
-        auto& lines = *linesOptional;
-        mLines.reserve(lines.size());
-        for (auto it = lines.begin(); it != lines.end(); ++it) {
-            auto& currentLine = it->second;
-
-            auto start = currentLine.get_child("Start").get_value<DirectX::XMFLOAT3>();
-            auto end = currentLine.get_child("End").get_value<DirectX::XMFLOAT3>();
-            auto color = currentLine.get_child("Color").get_value<DirectX::XMFLOAT4>();
-
-            mLines.emplace_back(start, end, color);
-        }
-    }
-}
-
-void SceneLoader::LoadLights(const std::string& path, const boost::property_tree::ptree& pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-    auto lightsOptional = pt.get_child_optional("Lights");
-    if (lightsOptional.has_value()) {
-        auto& lights = lightsOptional.get();
-        for (auto it = lights.begin(); it != lights.end(); ++it) {
-            auto& currentLight = it->second;
-
-            auto position = currentLight.get_child("Position").get_value<DirectX::XMFLOAT3>();
-            auto radius = currentLight.get_child("Radius").get_value<float>();
-            auto emission = currentLight.get_child("Emissive").get_value<DirectX::XMFLOAT4>();
-
-            mLights.emplace_back(position, emission, radius);
-        }
-    }
-}
-
-void SceneLoader::LoadMaterials(const std::string& path, const boost::property_tree::ptree& pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-    auto materials = pt.get_child("Material");
-
-    mMaterials.reserve(materials.size());
-    for (auto it = materials.begin(); it != materials.end(); ++it) {
-        auto& currentMaterial = it->second;
-        std::string materialName = it->first;
-
-        if (mMaterialNameToMaterialIndex.find(materialName) != mMaterialNameToMaterialIndex.end()) {
-            Oblivion::DebugPrintLine("Material ", materialName, " already loaded... Skipping");
-            break;
-        }
-
-        Oblivion::DebugPrintLine("Loading material ", materialName);
-
-        Material m;
-
-        auto diffuseOptional = currentMaterial.get_child_optional("Diffuse");
-        if (diffuseOptional.has_value()) {
-            auto color = diffuseOptional->get_value<DirectX::XMFLOAT3>();
-            m.diffuseColor = DirectX::XMFLOAT4(color.x, color.y, color.z, 1.0f);
-        }
-
-        auto emissiveOptional = currentMaterial.get_child_optional("Emissive");
-        if (emissiveOptional.has_value()) {
-            auto color = emissiveOptional->get_value<DirectX::XMFLOAT3>();
-            m.emissiveColor = DirectX::XMFLOAT4(color.x, color.y, color.z, 1.0f);
-        }
-
-        auto metallicOptional = currentMaterial.get_child_optional("Metallic");
-        if (metallicOptional.has_value()) {
-            m.metallic = metallicOptional->get_value<float>();
-        }
-
-        auto roughnessOptional = currentMaterial.get_child_optional("Roughness");
-        if (roughnessOptional.has_value()) {
-            m.roughness = roughnessOptional->get_value<float>();
-        }
-
-        auto iorOptional = currentMaterial.get_child_optional("IoR");
-        if (iorOptional.has_value()) {
-            m.ior = iorOptional->get_value<float>();
-        }
-
-        auto textureNameOptional = currentMaterial.get_child_optional("Diffuse Texture");
-        if (textureNameOptional.has_value()) {
-            m.textureIndex = mTexturesToLoad.size();
-            std::string path = std::filesystem::absolute(std::filesystem::path(textureNameOptional->get_value<std::string>())).string();
-            mTexturesToLoad.push_back(path);
-        }
-
-        auto materialTypeOptional = currentMaterial.get_child_optional("Material Type");
-        if (materialTypeOptional.has_value()) {
-            MaterialType type;
-            auto materialType = materialTypeOptional->get_value<std::string>();
-            if (boost::iequals(materialType, "diffuse")) {
-                type = MaterialType::Diffuse;
-            } else if (boost::iequals(materialType, "specular")) {
-                type = MaterialType::Specular;
-            } else {
-                EVALUATE(false, "Material type: ", materialType, " does not exist. Try: \"diffuse\" or \"specular\"");
-            }
-            m.materialType = type;
-        }
-
-        mMaterialNameToMaterialIndex.insert({ materialName, (unsigned int)mMaterials.size() });
-        mMaterials.push_back(m);
-    }
-    
-}
-
-void SceneLoader::LoadModels(const std::string& path, const boost::property_tree::ptree& pt, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-
-    // Todo: split this in LoadModels & BuildModels & AggregateModels
-
-    auto acceleratedStructuresOptional = pt.get_child_optional("AcceleratedModel");
-    if (!acceleratedStructuresOptional.has_value()) {
-        return;
-    }
-
-    auto& acceleratedStructures = *acceleratedStructuresOptional;
-    if (acceleratedStructures.size() == 0) {
-        return;
-    }
-    Oblivion::DebugPrintLine("Preparing to load ", acceleratedStructures.size(), " models");
-    mModelsInfo.reserve(acceleratedStructures.size() + mModelsInfo.size());
-    for (auto it = acceleratedStructures.begin(); it != acceleratedStructures.end(); ++it) {
-        auto& currentModel = it->second;
-
-        auto path = currentModel.get_child("Path").get_value<std::string>();
-        auto maxPrimitivesInNode = currentModel.get_child("MaxPrimitivesInNode").get_value<unsigned int>();
-        
-        auto splitMethod = BvhTree::GetSplitMethodByName(currentModel.get_child("SplitMethod").get_value<std::string>());
-        EVALUATE(splitMethod.has_value(), "Invalid split method for mesh at index ", mModelsInfo.size() + 1);
-
-        bool wireframeRender = false;
-        auto wireframeRenderOptional = currentModel.get_child_optional("WireframeRender");
-        if (wireframeRenderOptional.has_value()) {
-            wireframeRender = wireframeRenderOptional.get().get_value<bool>();
-        }
-
-        bool bvhRender = false;
-        auto bvhRenderOptional = currentModel.get_child_optional("BvhRender");
-        if (bvhRenderOptional.has_value()) {
-            bvhRender = bvhRenderOptional.get().get_value<bool>();
-        }
-
-        auto materialName = currentModel.get_child("Material").get_value<std::string>();
-
-        path = std::filesystem::absolute(std::filesystem::path(path)).string();
-        mModelsInfo.emplace_back(path, *splitMethod, maxPrimitivesInNode, wireframeRender, bvhRender, materialName);
+                Oblivion::DebugPrintLine("Successfully loaded skybox from: ", mSkyboxPath.c_str());
+            }, "Unable to load skybox from: %s", mSkyboxPath.c_str());
     }
 
-    try {
-        auto sceneSplitMethod = BvhTree::GetSplitMethodByName(pt.get_child("SceneAcceleration").get_value<std::string>());
-        EVALUATE(sceneSplitMethod.has_value());
-        mSceneSplit = *sceneSplitMethod;
-    } catch (...) {
-        Oblivion::DebugPrintLine("Cannot covnert to scene split method. Using default = SAH");
-        mSceneSplit = BvhTree::SplitMethod::SAH;
-    }
-}
-
-void SceneLoader::CentralizeModels() {
-    Oblivion::DebugPrintLine("Start loading ", mModelsInfo.size(), " models");
-    std::vector<std::unique_ptr<Model>> models;
-    models.resize(mModelsInfo.size());
-    std::mutex linesMutex;
-    std::atomic<unsigned int> totalVertices = 0;
-    Threading::Get()->ParralelForImmediate(
-        [&](int64_t index) {
-            const auto& constructionInfo = mModelsInfo.at(index);
-            auto model = std::make_unique<Model>(constructionInfo.path);
-            totalVertices += model->GetVertexCount();
-            if (constructionInfo.wireframeRender) {
-                const auto& renderLines = model->GetRenderLines();
-                std::unique_lock<std::mutex> lock(linesMutex);
-                std::move(renderLines.begin(), renderLines.end(), std::back_inserter(mLines));
-            }
-            models[index] = std::move(model);
-        }, mModelsInfo.size(), 1);
-
-    Oblivion::DebugPrintLine("Finished loading ", mModelsInfo.size(), " models. Start optimizing . . .");
-    std::vector<std::shared_ptr<BvhTree>> bvhTrees;
-    bvhTrees.resize(mModelsInfo.size());
-    Threading::Get()->ParralelForImmediate(
-        [&](int64_t index) {
-            const auto& currentModel = models.at(index);
-            const auto& constructionInfo = mModelsInfo.at(index);
-            auto bvhTree = BvhTree::Create(currentModel.get(), constructionInfo.splitMethod, constructionInfo.maxPrimitivesInNode, 65536);
-            if (constructionInfo.bvhRender) {
-                const auto& renderLines = bvhTree->GetRenderLines();
-                std::unique_lock<std::mutex> lock(linesMutex);
-                std::move(renderLines.begin(), renderLines.end(), std::back_inserter(mLines));
-            }
-            bvhTrees[index] = std::move(bvhTree);
-        }, models.size(), 1);
-
-    {
-        unsigned int totalPrimitives = 0;
-        Oblivion::DebugPrintLine("Centralizing Vertex & Index Buffers & Primitives & Materials");
-        mVertexBuffer.reserve(totalVertices);
-        for (unsigned int i = 0; i < models.size(); ++i) {
-            auto& model = models[i];
-            auto& constructionInfo = mModelsInfo.at(i);
-
-            auto& currentVertexBuffer = model->GetVertices();
-
-            auto& bvhTree = bvhTrees[i]->GetNodes();
-            for (auto& node : bvhTree) {
-                if (node.numberOfPrimitives != 0) {
-                    // It's a leaf
-                    node.primitiveOffset += (unsigned int)mModelPrimitives.size();
-                }
-            }
-
-            for (auto& vertex : currentVertexBuffer) {
-                vertex.materialIndex = mMaterialNameToMaterialIndex[constructionInfo.usedMaterialName];
-            }
-
-            auto modelPrimitives = model->GetPrimitives();
-            mModelPrimitives.reserve(modelPrimitives.size() + mModelPrimitives.size());
-            for (auto primitive : modelPrimitives) {
-                primitive->indices[0] += (unsigned int)mVertexBuffer.size();
-                primitive->indices[1] += (unsigned int)mVertexBuffer.size();
-                primitive->indices[2] += (unsigned int)mVertexBuffer.size();
-                mModelPrimitives.push_back(*primitive);
-            }
-
-            std::move(currentVertexBuffer.begin(), currentVertexBuffer.end(), std::back_inserter(mVertexBuffer));
-        }
-    }
-
-    {
-        Oblivion::DebugPrintLine("Building scene BVH");
-        auto scene = std::make_unique<Scene>(bvhTrees);
-        auto sceneBvh = BvhTree::Create(scene.get(), mSceneSplit, 5, 65536);
-        mSceneTree = std::move(sceneBvh->GetNodes());
-        auto scenePrimitives = scene->GetPrimitives();
-        mScenePrimitives.reserve(scenePrimitives.size());
-        for (const auto it : scenePrimitives) {
-            mScenePrimitives.push_back(*it.get());
-        }
-
-        Oblivion::DebugPrintLine("Centralizing Scene BVH and Models BVH");
-        mSceneTree; // Already centralized from before
-
-        Oblivion::DebugPrintLine("Scene tree: ", mSceneTree);
-        mModelTrees = std::move(scene->GetModelTree());
-    }
 }
 
 void SceneLoader::BuildBuffers(ComPtr<ID3D12GraphicsCommandList> cmdList) {
@@ -470,29 +182,3 @@ void SceneLoader::BuildTextures(ComPtr<ID3D12GraphicsCommandList> cmdList) {
      }
 }
 
-void SceneLoader::LoadJSON(const std::string& path, ComPtr<ID3D12GraphicsCommandList> cmdList) {
-    using namespace boost::property_tree;
-
-    boost::property_tree::ptree pt;
-    boost::property_tree::json_parser::read_json(path, pt);
-
-    auto oldCwd = std::filesystem::current_path();
-
-    std::filesystem::path cwd = path;
-    std::filesystem::current_path(cwd.parent_path());
-
-    mVersion = pt.get_child("Version").get_value<unsigned int>();
-    EVALUATE(mVersion == 1, "Invalid version for this build (", mVersion, "). Maximum supported = 1");
-
-    LoadSkybox(path, pt, cmdList);
-    LoadSpheres(path, pt, cmdList);
-    LoadLines(path, pt, cmdList);
-    LoadLights(path, pt, cmdList);
-    LoadMaterials(path, pt, cmdList);
-    LoadModels(path, pt, cmdList);
-
-    std::filesystem::current_path(oldCwd);
-
-    Oblivion::DebugPrintLine("Finished loading file: ", path);
-}
-
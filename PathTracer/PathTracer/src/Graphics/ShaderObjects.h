@@ -45,7 +45,7 @@ struct Light {
 
 	Light() = default;
 	Light(const DirectX::XMFLOAT3& position, const DirectX::XMFLOAT4& emissive, float radius) :
-		Position(position), Emissive(emissive), Radius(radius) {};
+		Position(position), Radius(radius), Emissive(emissive) {};
 };
 
 struct SpheresCB {
@@ -95,16 +95,15 @@ OBLIVION_ALIGN(16) struct BVHTreeNode {
 
 OBLIVION_ALIGN(16) struct TraceVertex {
 	DirectX::XMFLOAT3 position;
-	float pad;
+	float pad0;
 	DirectX::XMFLOAT3 normal;
-	unsigned int materialIndex;
+	float pad1;
 	DirectX::XMFLOAT4 texCoords;
 
 	friend std::ostream& operator << (std::ostream& stream, const TraceVertex& v) {
 		stream << "\n{";
 		stream << "position: " << v.position << ", ";
 		stream << "normal: " << v.normal << ", ";
-		stream << "materialIndex: " << v.materialIndex << ", ";
 		stream << "texCoords: " << v.texCoords;
 		stream << "}";
 		return stream;
@@ -122,7 +121,9 @@ OBLIVION_ALIGN(16) struct TraceScenePrimitive {
 	DirectX::XMFLOAT3 minAABB;
 	unsigned int modelOffset;
 	DirectX::XMFLOAT3 maxAABB;
-	float pad1;
+	unsigned int materialIndex;
+	// Rows of the matrix that moves world space rays into the space of the model
+	DirectX::XMFLOAT3X4 worldToObject;
 };
 
 enum MaterialType : int {
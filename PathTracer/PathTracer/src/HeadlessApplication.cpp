@@ -0,0 +1,137 @@
+#include "HeadlessApplication.h"
+#include "Utils/Threading.h"
+
+// Boost stuff
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+
+HeadlessApplication::HeadlessApplication(const OblivionInitialization& initData) : mInitData(initData) {
+    if (!TRY_RETURN_VALUE(InitFromConfigFile(initData.configFile), true, false)) {
+        Oblivion::DebugPrintLine("Using default settings");
+        InitFromDefaultConfigurations();
+    }
+    if (initData.width > 0) {
+        mClientWidth = initData.width;
+    }
+    if (initData.height > 0) {
+        mClientHeight = initData.height;
+    }
+    EVALUATE(mClientWidth > 0 && mClientHeight > 0, "Cannot render an image of ", mClientWidth, " * ", mClientHeight, " pixels");
+}
+
+HeadlessApplication::~HeadlessApplication() {
+    Threading::Reset();
+}
+
+void HeadlessApplication::InitFromConfigFile(const std::string& path) {
+    using namespace boost::property_tree;
+
+    ptree pt;
+    json_parser::read_json(path, pt);
+
+    mClientWidth = pt.get_child("Client.Width").get_value<unsigned int>();
+    mClientHeight = pt.get_child("Client.Height").get_value<unsigned int>();
+
+    mInvGamma = pt.get_child("Render.InvGamma").get_value<float>();
+    mDepth = pt.get_child("Render.Depth").get_value<unsigned int>();
+}
+
+void HeadlessApplication::InitFromDefaultConfigurations() {
+    mClientWidth = 1280;
+    mClientHeight = 720;
+}
+
+void HeadlessApplication::InitModels() {
+
+    mScene = std::make_unique<SceneDescription>(mInitData.inputFiles);
+    mScene->Load();
+    if (mInitData.cpuVertexFormat == CpuVertexFormat::Compact) {
+        mScene->CompactVertexBuffer();
+    }
+
+    mPathTracer = std::make_unique<CpuPathTracer>(*mScene);
+    mPathTracer->SetTraversal(mInitData.cpuTraversal, mInitData.packetSize);
+    mPathTracer->SetPipeline(mInitData.cpuPipeline);
+
+    Oblivion::DebugPrintLine("Successfully loaded models");
+}
+
+void HeadlessApplication::InitGameplayObjects() {
+
+    mCamera = std::make_unique<Camera>(DirectX::XMFLOAT3(1.0f, 3.0f, -5.0f), DirectX::XMFLOAT3(0.0f, 0.0f, 1.0f),
+                                       DirectX::XMFLOAT3(1.0f, 0.0f, 0.0f), 1.0f, 60.f);
+    mCamera->Construct();
+
+    mUniformRandom = std::uniform_real_distribution<float>(-1.0f, 1.0f);
+
+    Oblivion::DebugPrintLine("Successfully initialized gameplay objects");
+}
+
+void HeadlessApplication::Run() {
+    using Seconds = std::chrono::duration<double>;
+
+    auto loadStart = std::chrono::high_resolution_clock::now();
+    InitModels();
+    InitGameplayObjects();
+    Seconds loadTime = std::chrono::high_resolution_clock::now() - loadStart;
+
+    mAccumulated.assign((size_t)mClientWidth * mClientHeight, DirectX::XMFLOAT4(0.0f, 0.0f, 0.0f, 0.0f));
+    mNumPasses = 0;
+
+    Oblivion::DebugPrintLine("Path tracing ", mInitData.numSamples, " samples of ", mClientWidth, " * ", mClientHeight,
+                             " pixels on the CPU");
+    auto renderStart = std::chrono::high_resolution_clock::now();
+    Seconds renderTime(0.0);
+    uint64_t raysTraced = 0;
+    while (mNumPasses < mInitData.numSamples) {
+        // Stop before a pass that would end past the budget. The first pass always runs, so that there is an image
+        if (mNumPasses > 0 && renderTime.count() * (mNumPasses + 1) / mNumPasses > mInitData.timeBudget) {
+            Oblivion::DebugPrintLine("Stopping after ", mNumPasses, " samples: the time budget of ", mInitData.timeBudget,
+                                     "s would be exceeded");
+            break;
+        }
+        DirectX::XMFLOAT2 randomVector(mUniformRandom(mRandomGenerator), mUniformRandom(mRandomGenerator));
+        raysTraced += mPathTracer->TracePass(mCamera->GetCameraCB(), mClientWidth, mClientHeight, mDepth, randomVector, mAccumulated);
+        mNumPasses++;
+        renderTime = std::chrono::high_resolution_clock::now() - renderStart;
+    }
+
+    auto writeStart = std::chrono::high_resolution_clock::now();
+    std::string outputFile = mInitData.outputFile.empty() ? DefaultOutputFile : mInitData.outputFile;
+    WriteImage(outputFile);
+    Seconds writeTime = std::chrono::high_resolution_clock::now() - writeStart;
+
+    // Printed even without logs, for the scripts that schedule the renders
+    double samplesPerSecond = renderTime.count() > 0.0 ? (double)mClientWidth * mClientHeight * mNumPasses / renderTime.count() : 0.0;
+    std::cout << "Rendered " << outputFile << ": " << mClientWidth << " * " << mClientHeight << " pixels, "
+              << mNumPasses << " / " << mInitData.numSamples << " samples per pixel\n"
+              << "Scene load: " << loadTime.count() << "s\n"
+              << "Render: " << renderTime.count() << "s (" << (mNumPasses > 0 ? renderTime.count() / mNumPasses : 0.0)
+              << "s per sample, " << samplesPerSecond / 1e6 << " M samples/s, "
+              << (renderTime.count() > 0.0 ? raysTraced / renderTime.count() : 0.0) / 1e6 << " M rays/s)\n"
+              << "Image write: " << writeTime.count() << "s" << std::endl;
+}
+
+void HeadlessApplication::WriteImage(const std::string& path) const {
+    std::ofstream output(path, std::ios::binary);
+    EVALUATE(output.is_open(), "Unable to open ", path, " for writing");
+
+    output << "P6\n" << mClientWidth << " " << mClientHeight << "\n255\n";
+
+    // The shaders fill the texture from the bottom of the view up, and the quad shows its last row at the top
+    std::vector<unsigned char> row(3 * (size_t)mClientWidth);
+    float invPasses = mNumPasses > 0 ? 1.0f / (float)mNumPasses : 0.0f;
+    for (unsigned int y = mClientHeight; y-- > 0;) {
+        for (unsigned int x = 0; x < mClientWidth; ++x) {
+            const auto& pixel = mAccumulated[(size_t)y * mClientWidth + x];
+            float channels[3] = { pixel.x, pixel.y, pixel.z };
+            for (unsigned int channel = 0; channel < 3; ++channel) {
+                float value = powf(std::max(channels[channel] * invPasses, 0.0f), 1.0f / mInvGamma);
+                row[3 * x + channel] = (unsigned char)std::clamp(value * 255.0f + 0.5f, 0.0f, 255.0f);
+            }
+        }
+        output.write((const char*)row.data(), row.size());
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Graphics/SceneDescription.h"
+#include "Gameplay/Camera.h"
+#include "Tracing/CpuPathTracer.h"
+#include "OblivionInitialization.h"
+
+// Renders the input files with CpuPathTracer, without a window or a GPU, and writes the image to disk. Takes the same
+// configuration file and camera as Application, but never writes the configuration back
+class HeadlessApplication : public ISingletone<HeadlessApplication> {
+    MAKE_SINGLETONE_CAPABLE(HeadlessApplication);
+    constexpr static const char* DefaultOutputFile = "PathTracer.ppm";
+private:
+    HeadlessApplication(const OblivionInitialization& initData);
+    ~HeadlessApplication();
+
+private:
+    void InitFromConfigFile(const std::string& path);
+    void InitFromDefaultConfigurations();
+
+    void InitModels();
+    void InitGameplayObjects();
+
+public:
+    void Run();
+
+private:
+    // Binary PPM, with the gamma correction of SimplePixelShader applied to the average of the passes
+    void WriteImage(const std::string& path) const;
+
+private: // Configurations
+    OblivionInitialization mInitData;
+
+    unsigned int mClientWidth;
+    unsigned int mClientHeight;
+
+    float mInvGamma = 1.0f;
+    unsigned int mDepth = 4;
+
+private:
+    std::unique_ptr<SceneDescription> mScene;
+    std::unique_ptr<CpuPathTracer> mPathTracer;
+    std::unique_ptr<Camera> mCamera;
+
+    std::vector<DirectX::XMFLOAT4> mAccumulated;
+    unsigned int mNumPasses = 0;
+
+    std::mt19937 mRandomGenerator;
+    std::uniform_real_distribution<float> mUniformRandom;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Tracing/CpuTracingOptions.h"
+
+enum class OblivionMode {
+    Debug, None
+};
+
+struct OblivionInitialization {
+    unsigned int numSamples;
+    OblivionMode applicationMode;
+    std::vector<std::string> inputFiles;
+    std::string outputFile;
+    std::string configFile;
+    float maxSecondsPerFrame;
+    // Path trace on the CPU, without a window. Always the case where D3D12 is not available
+    bool cpuBackend;
+    CpuTraversal cpuTraversal;
+    CpuPipeline cpuPipeline;
+    CpuVertexFormat cpuVertexFormat;
+    unsigned int packetSize;
+
+    // Set by --output: render until numSamples passes or timeBudget seconds, write outputFile and exit
+    bool batchMode;
+    // Zero keeps the size of the configuration file
+    unsigned int width;
+    unsigned int height;
+    float timeBudget;
+};
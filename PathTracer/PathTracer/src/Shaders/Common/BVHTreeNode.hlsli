@@ -69,6 +69,13 @@ BVHTreeNode GetNodeFromTexture(in Texture2D tex, int index)
     return node;
 }
 
+// Ordered traversal: the child on the side the ray comes from is visited first
+bool IsSecondChildNearer(in BVHTreeNode node, in int dirIsNeg[3])
+{
+    bool firstChildAbove = (node.axis & BVH_FIRST_CHILD_ABOVE) != 0;
+    return (dirIsNeg[node.axis & BVH_AXIS_MASK] != 0) != firstChildAbove;
+}
+
 bool IntersectSceneNode(in int currentOffset, in Ray r, out SceneHitPoint shp)
 {
     int dirIsNeg[3] = { r.direction.x < 0, r.direction.y < 0, r.direction.z < 0 };
@@ -105,7 +112,7 @@ bool IntersectSceneNode(in int currentOffset, in Ray r, out SceneHitPoint shp)
             else
             {
                 [flatten]
-                if (dirIsNeg[currentNode.axis])
+                if (IsSecondChildNearer(currentNode, dirIsNeg))
                 {
                     stack[stackIndex++] = currentOffset + 1;
                     currentOffset = currentNode.secondChildOffset;
@@ -128,7 +135,7 @@ bool IntersectSceneNode(in int currentOffset, in Ray r, out SceneHitPoint shp)
     return hit;
 }
 
-bool IntersectModelNode(in int currentOffset, inout Ray r, out HitPoint hp)
+bool IntersectModelNode(in int currentOffset, in unsigned int materialIndex, inout Ray r, inout HitPoint hp)
 {
     int dirIsNeg[3] = { r.direction.x < 0, r.direction.y < 0, r.direction.z < 0 };
     bool hit = false;
@@ -164,7 +171,6 @@ bool IntersectModelNode(in int currentOffset, inout Ray r, out HitPoint hp)
                         hp.Normal = u * primitiveFace[1].normal + v * primitiveFace[2].normal + (1 - u - v) * primitiveFace[0].normal;
                         hp.Normal = normalize(hp.Normal);
                         
-                        unsigned int materialIndex = primitiveFace[0].materialIndex; // Should be the same for all vertices in triangle
                         Material m = GetMaterialByIndex(materialIndex);
                         if (m.textureIndex == -1)
                         {
@@ -193,7 +199,7 @@ bool IntersectModelNode(in int currentOffset, inout Ray r, out HitPoint hp)
             else
             {
                 [flatten]
-                if (dirIsNeg[currentNode.axis])
+                if (IsSecondChildNearer(currentNode, dirIsNeg))
                 {
                     stack[stackIndex++] = currentOffset + 1;
                     currentOffset = currentNode.secondChildOffset;
@@ -245,10 +251,17 @@ bool IntersectScene(in Ray r, out HitPoint hp)
                 {
                     ScenePrimitive sp = GetScenePrimitive(currentNode.primitiveOffset + i);
                     float t;
-                    if (IntersectAABB(sp.minAABB, sp.maxAABB, r, t) && IntersectModelNode(sp.modelOffset, originalRay, hp))
+                    if (IntersectAABB(sp.minAABB, sp.maxAABB, r, t))
                     {
-                        r.length *= t;
-                        hit = true;
+                        Ray objectRay = TransformRayToObject(sp, originalRay);
+                        if (IntersectModelNode(sp.modelOffset, sp.materialIndex, objectRay, hp))
+                        {
+                            originalRay.length = objectRay.length;
+                            r.length = objectRay.length;
+                            hp.Position = originalRay.position + originalRay.direction * originalRay.length;
+                            hp.Normal = TransformNormalToWorld(sp, hp.Normal);
+                            hit = true;
+                        }
                     }
                 }
                 if (stackIndex == 0)
@@ -258,7 +271,7 @@ bool IntersectScene(in Ray r, out HitPoint hp)
             else
             {
                 [flatten]
-                if (dirIsNeg[currentNode.axis])
+                if (IsSecondChildNearer(currentNode, dirIsNeg))
                 {
                     stack[stackIndex++] = currentOffset + 1;
                     currentOffset = currentNode.secondChildOffset;
@@ -281,18 +294,71 @@ bool IntersectScene(in Ray r, out HitPoint hp)
     return hit;
 }
 
-bool IntersectAny(in Ray r, out HitPoint hp)
+// Any hit version of IntersectModelNode for visibility queries: stops at the first triangle closer than r.length, without
+// shading it or sampling its texture
+bool OccludedModelNode(in int currentOffset, in Ray r)
 {
     int dirIsNeg[3] = { r.direction.x < 0, r.direction.y < 0, r.direction.z < 0 };
-    bool hit = false;
     int stackIndex = 0;
     int stack[64];
-    int currentOffset = 0;
     
-    Ray originalRay;
-    originalRay.direction = r.direction;
-    originalRay.position = r.position;
-    originalRay.length = r.length;
+    while (true)
+    {
+        BVHTreeNode currentNode = GetNodeFromTexture(ModelsTrees, currentOffset);
+        float tIntersectNode;
+        
+        [branch]
+        if (IntersectAABB(currentNode.minAABB, currentNode.maxAABB, r, tIntersectNode))
+        {
+            [branch]
+            if (currentNode.numberOfPrimitives > 0)
+            {
+                for (int i = 0; i < currentNode.numberOfPrimitives; ++i)
+                {
+                    ModelPrimitive mp = GetModelPrimitive(currentNode.primitiveOffset + i);
+                    float t, u, v;
+                    if (IntersectTriangleFast(GetVertex(mp.index0).position, GetVertex(mp.index1).position, GetVertex(mp.index2).position, r, t, u, v))
+                    {
+                        return true;
+                    }
+                }
+                if (stackIndex == 0)
+                    break;
+                currentOffset = stack[--stackIndex];
+            }
+            else
+            {
+                [flatten]
+                if (IsSecondChildNearer(currentNode, dirIsNeg))
+                {
+                    stack[stackIndex++] = currentOffset + 1;
+                    currentOffset = currentNode.secondChildOffset;
+                }
+                else
+                {
+                    stack[stackIndex++] = currentNode.secondChildOffset;
+                    currentOffset = currentOffset + 1;
+                }
+            }
+        }
+        else
+        {
+            if (stackIndex == 0)
+                break;
+            currentOffset = stack[--stackIndex];
+        }
+    }
+    
+    return false;
+}
+
+// True when a model of the scene is hit closer than r.length. Returns on the first hit found, not the closest one
+bool IntersectAny(in Ray r)
+{
+    int dirIsNeg[3] = { r.direction.x < 0, r.direction.y < 0, r.direction.z < 0 };
+    int stackIndex = 0;
+    int stack[64];
+    int currentOffset = 0;
     
     while (true)
     {
@@ -309,9 +375,8 @@ bool IntersectAny(in Ray r, out HitPoint hp)
                 {
                     ScenePrimitive sp = GetScenePrimitive(currentNode.primitiveOffset + i);
                     float t;
-                    if (IntersectAABB(sp.minAABB, sp.maxAABB, r, t) && IntersectModelNode(sp.modelOffset, originalRay, hp))
+                    if (IntersectAABB(sp.minAABB, sp.maxAABB, r, t) && OccludedModelNode(sp.modelOffset, TransformRayToObject(sp, r)))
                     {
-                        r.length *= t;
                         return true;
                     }
                 }
@@ -322,7 +387,7 @@ bool IntersectAny(in Ray r, out HitPoint hp)
             else
             {
                 [flatten]
-                if (dirIsNeg[currentNode.axis])
+                if (IsSecondChildNearer(currentNode, dirIsNeg))
                 {
                     stack[stackIndex++] = currentOffset + 1;
                     currentOffset = currentNode.secondChildOffset;
@@ -342,7 +407,7 @@ bool IntersectAny(in Ray r, out HitPoint hp)
         }
     }
     
-    return hit;
+    return false;
 }
 
 #endif
@@ -3,13 +3,16 @@
 #define _SCENE_PRIMITIVE_HLSLI_
 
 #include "Utils.hlsli"
+#include "Ray.hlsli"
 
 struct ScenePrimitive
 {
     float3 minAABB;
     unsigned int modelOffset;
     float3 maxAABB;
-    float pad1;
+    unsigned int materialIndex;
+    // Rows of the matrix that moves world space rays into the space of the model
+    float4 worldToObject[3];
 };
 
 ScenePrimitive EmptyScenePrimitive()
@@ -19,7 +22,10 @@ ScenePrimitive EmptyScenePrimitive()
     sp.minAABB = float3(0.0f, 0.0f, 0.0f);
     sp.maxAABB = float3(0.0f, 0.0f, 0.0f);
     sp.modelOffset = 0;
-    sp.pad1 = 0.f;
+    sp.materialIndex = 0;
+    sp.worldToObject[0] = float4(1.0f, 0.0f, 0.0f, 0.0f);
+    sp.worldToObject[1] = float4(0.0f, 1.0f, 0.0f, 0.0f);
+    sp.worldToObject[2] = float4(0.0f, 0.0f, 1.0f, 0.0f);
     
     return sp;
 }
@@ -37,8 +43,32 @@ ScenePrimitive GetScenePrimitive(in int index)
     sp.minAABB = firstRead.xyz;
     sp.modelOffset = asuint(firstRead.w);
     sp.maxAABB = secondRead.xyz;
+    sp.materialIndex = asuint(secondRead.w);
+    sp.worldToObject[0] = GetColorFromTextureByIndex(ScenePrimitives, offset + 2);
+    sp.worldToObject[1] = GetColorFromTextureByIndex(ScenePrimitives, offset + 3);
+    sp.worldToObject[2] = GetColorFromTextureByIndex(ScenePrimitives, offset + 4);
     
     return sp;
 }
 
+// The direction is not normalized, so distances along the ray are the same in both spaces
+Ray TransformRayToObject(in ScenePrimitive sp, in Ray r)
+{
+    Ray objectRay;
+    objectRay.position = float3(dot(sp.worldToObject[0], float4(r.position, 1.0f)),
+                                dot(sp.worldToObject[1], float4(r.position, 1.0f)),
+                                dot(sp.worldToObject[2], float4(r.position, 1.0f)));
+    objectRay.direction = float3(dot(sp.worldToObject[0].xyz, r.direction),
+                                 dot(sp.worldToObject[1].xyz, r.direction),
+                                 dot(sp.worldToObject[2].xyz, r.direction));
+    objectRay.length = r.length;
+    return objectRay;
+}
+
+// Normals are moved back to world space by the transpose of the world to object matrix
+float3 TransformNormalToWorld(in ScenePrimitive sp, in float3 normal)
+{
+    return normalize(sp.worldToObject[0].xyz * normal.x + sp.worldToObject[1].xyz * normal.y + sp.worldToObject[2].xyz * normal.z);
+}
+
 #endif
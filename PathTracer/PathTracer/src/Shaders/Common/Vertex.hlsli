@@ -7,9 +7,9 @@
 struct Vertex
 {
     float3 position;
-    float pad;
+    float pad0;
     float3 normal;
-    unsigned int materialIndex;
+    float pad1;
     float4 texCoords;
 };
 
@@ -17,9 +17,9 @@ Vertex EmptyVertex()
 {
     Vertex v;
     v.position = float3(0.f, 0.f, 0.f);
-    v.pad = 0.f;
+    v.pad0 = 0.f;
     v.normal = float3(0.f, 0.f, 0.f);
-    v.materialIndex = 0;
+    v.pad1 = 0.f;
     v.texCoords = float4(0.f, 0.f, 0.f, 0.f);
     return v;
 }
@@ -35,7 +35,6 @@ Vertex GetVertex(in int index)
     
     v.position = firstRead.xyz;
     v.normal = secondRead.xyz;
-    v.materialIndex = asuint(secondRead.w);
     v.texCoords = thirdRead.xyzw;
     
     return v;
@@ -129,6 +129,32 @@ bool ClosestHit(in Ray r, out HitPoint hp)
 }
 
 
+// Visibility query used by shadow rays: true when anything but a light is hit closer than r.length. Stops at the first
+// hit and fills no hit point
+bool Occluded(in Ray r)
+{
+    for (int i = 0; i < cb2.numSpheres; ++i)
+    {
+        float2 t;
+        if (cb2.spheres[i].Intersect(r, t) && t.x <= r.length && t.x > 0.0f && t.y > 0.0f)
+        {
+            return true;
+        }
+    }
+    
+    for (int j = 0; j < cb3.numLines; ++j)
+    {
+        float t;
+        if (cb3.lines[j].Intersect(r, t) && t < r.length)
+        {
+            return true;
+        }
+    }
+    
+    return IntersectAny(r);
+}
+
+
 float4 RayTrace(in Ray r) {
 	
 	float4 finalColor = float4(0.0f, 0.0f, 0.0f, 0.0f);
@@ -146,8 +172,7 @@ float4 RayTrace(in Ray r) {
 		toLightRay.direction = sunDir;
         toLightRay.length = MAXIMUM_RAY_LENGTH;
 		float lightIntensity = 1.0f;
-		HitPoint lightHp = EmptyHitPoint();
-        if (ClosestHit(toLightRay, lightHp))
+        if (Occluded(toLightRay))
         {
             lightIntensity = 0.1f;
         }
@@ -237,10 +262,10 @@ float4 GetDirectLight(float3 position, float3 normal, RandomGenerator rg)
         Ray toLightRay;
         toLightRay.position = position + normal * EPSILON;
         toLightRay.direction = -lightDir;
-        toLightRay.length = MAXIMUM_RAY_LENGTH;
+        // Only what lies between the point and the light can shadow it
+        toLightRay.length = distance;
 
-        HitPoint hp = EmptyHitPoint();
-        bool inShadow = ClosestHit(toLightRay, hp); // TODO: Replace this with an intersection function that stops after first intersection
+        bool inShadow = Occluded(toLightRay);
         
         directLighting += (1.0f - inShadow) * max(0.0f, dot(normal, -lightDir)) * lightIntensity;
     }
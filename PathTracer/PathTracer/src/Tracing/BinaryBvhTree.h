@@ -0,0 +1,188 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Ray.h"
+#include "Graphics/ShaderObjects.h"
+
+// IntersectAABB of Utils.hlsli: the entry point, or the exit point when the ray starts inside, must be in (0, tMax)
+inline bool IntersectAABB(const DirectX::XMFLOAT3& minAABB, const DirectX::XMFLOAT3& maxAABB, const Ray& ray, float& t) {
+	float invX = 1.0f / ray.direction.x, invY = 1.0f / ray.direction.y, invZ = 1.0f / ray.direction.z;
+	float fX = (minAABB.x - ray.origin.x) * invX, nX = (maxAABB.x - ray.origin.x) * invX;
+	float fY = (minAABB.y - ray.origin.y) * invY, nY = (maxAABB.y - ray.origin.y) * invY;
+	float fZ = (minAABB.z - ray.origin.z) * invZ, nZ = (maxAABB.z - ray.origin.z) * invZ;
+
+	// fminf / fmaxf ignore NaN operands like the min / max of HLSL
+	float t0 = fmaxf(fminf(fX, nX), fmaxf(fminf(fY, nY), fminf(fZ, nZ)));
+	float t1 = fminf(fmaxf(fX, nX), fminf(fmaxf(fY, nY), fmaxf(fZ, nZ)));
+	if (t1 < t0) {
+		return false;
+	}
+	float tTemp = t0 > 0.0f ? t0 : t1;
+	if (tTemp > 0.0f && tTemp < ray.tMax) {
+		t = tTemp;
+		return true;
+	}
+	return false;
+}
+
+// Ordered traversal: the child on the side the ray comes from is visited first
+inline bool IsSecondChildNearer(const BVHTreeNode& node, const Ray& ray) {
+	float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	bool firstChildAbove = (node.axis & BVH_FIRST_CHILD_ABOVE) != 0;
+	return (direction[node.axis & BVH_AXIS_MASK] < 0.0f) != firstChildAbove;
+}
+
+// The flattened binary nodes built by BvhTree, walked like the shaders walk them, behind the interface of WideBvhTree so
+// that the CPU runs the same code over every kind of tree
+class BinaryBvhTree {
+public:
+	// Stack of the shaders
+	static constexpr const unsigned int StackSize = 64;
+
+public:
+	BinaryBvhTree(const std::vector<BVHTreeNode>& nodes) : mNodes(nodes) { };
+
+	// Closest hit traversal of the tree rooted at rootIndex, with the contract of WideBvhTree::Intersect
+	template <typename LeafIntersector>
+	bool Intersect(Ray& ray, unsigned int rootIndex, LeafIntersector&& intersectLeaf) const;
+	// Any hit traversal with the contract of WideBvhTree::Occluded. Children are still ordered, as in the shaders
+	template <typename LeafOccluder>
+	bool Occluded(const Ray& ray, unsigned int rootIndex, LeafOccluder&& occludedLeaf) const;
+
+	const std::vector<BVHTreeNode>& GetNodes() const { return mNodes; };
+
+private:
+	// Walks the tree from rootIndex and calls visitLeaf(node) on every leaf hit by the ray, until it returns true
+	template <typename LeafVisitor>
+	bool Traverse(const Ray& ray, unsigned int rootIndex, LeafVisitor&& visitLeaf) const;
+
+private:
+	const std::vector<BVHTreeNode>& mNodes;
+};
+
+// The scene tree and the model trees of SceneLoader, as the shaders walk them, with the interface of WideSceneTree
+class BinarySceneTree {
+public:
+	BinarySceneTree(const std::vector<BVHTreeNode>& sceneTree, const std::vector<TraceScenePrimitive>& scenePrimitives,
+					const std::vector<BVHTreeNode>& modelTrees) :
+		mSceneTree(sceneTree), mScenePrimitives(scenePrimitives), mModelTrees(modelTrees) { };
+
+	// Contracts of WideSceneTree::Intersect and WideSceneTree::Occluded. rootIndex lets a packet finish the walk of a
+	// subtree of the scene tree with single rays
+	template <typename ModelLeafIntersector>
+	bool Intersect(Ray& ray, ModelLeafIntersector&& intersectModelLeaf, unsigned int rootIndex = 0) const;
+	template <typename ModelLeafOccluder>
+	bool Occluded(const Ray& ray, ModelLeafOccluder&& occludedModelLeaf, unsigned int rootIndex = 0) const;
+
+	const BinaryBvhTree& GetSceneTree() const { return mSceneTree; };
+	const BinaryBvhTree& GetModelTrees() const { return mModelTrees; };
+
+private:
+	BinaryBvhTree mSceneTree;
+	const std::vector<TraceScenePrimitive>& mScenePrimitives;
+	BinaryBvhTree mModelTrees;
+};
+
+template <typename LeafVisitor>
+bool BinaryBvhTree::Traverse(const Ray& ray, unsigned int rootIndex, LeafVisitor&& visitLeaf) const {
+	unsigned int stackIndex = 0;
+	unsigned int stack[StackSize];
+	unsigned int currentOffset = rootIndex;
+
+	while (true) {
+		const auto& currentNode = mNodes[currentOffset];
+		float tIntersectNode;
+		if (IntersectAABB(currentNode.minAABB, currentNode.maxAABB, ray, tIntersectNode)) {
+			if (currentNode.numberOfPrimitives > 0) {
+				if (visitLeaf(currentNode)) {
+					return true;
+				}
+				if (stackIndex == 0) {
+					break;
+				}
+				currentOffset = stack[--stackIndex];
+			} else if (IsSecondChildNearer(currentNode, ray)) {
+				stack[stackIndex++] = currentOffset + 1;
+				currentOffset = currentNode.secondChildOffset;
+			} else {
+				stack[stackIndex++] = currentNode.secondChildOffset;
+				currentOffset = currentOffset + 1;
+			}
+		} else {
+			if (stackIndex == 0) {
+				break;
+			}
+			currentOffset = stack[--stackIndex];
+		}
+	}
+
+	return false;
+}
+
+template <typename LeafIntersector>
+bool BinaryBvhTree::Intersect(Ray& ray, unsigned int rootIndex, LeafIntersector&& intersectLeaf) const {
+	// The leaves shrink ray.tMax, which the following boxes are tested against
+	bool hit = false;
+	Traverse(ray, rootIndex, [&](const BVHTreeNode& leaf) {
+		if (intersectLeaf(leaf.primitiveOffset, leaf.numberOfPrimitives, ray)) {
+			hit = true;
+		}
+		return false;
+	});
+	return hit;
+}
+
+template <typename LeafOccluder>
+bool BinaryBvhTree::Occluded(const Ray& ray, unsigned int rootIndex, LeafOccluder&& occludedLeaf) const {
+	return Traverse(ray, rootIndex, [&](const BVHTreeNode& leaf) {
+		return occludedLeaf(leaf.primitiveOffset, leaf.numberOfPrimitives, ray);
+	});
+}
+
+template <typename ModelLeafIntersector>
+bool BinarySceneTree::Intersect(Ray& ray, ModelLeafIntersector&& intersectModelLeaf, unsigned int rootIndex) const {
+	return mSceneTree.Intersect(ray, rootIndex,
+		[&](unsigned int primitiveOffset, unsigned int numberOfPrimitives, Ray& sceneRay) {
+			bool hit = false;
+			for (unsigned int i = primitiveOffset; i < primitiveOffset + numberOfPrimitives; ++i) {
+				const auto& sp = mScenePrimitives[i];
+				float t;
+				if (!IntersectAABB(sp.minAABB, sp.maxAABB, sceneRay, t)) {
+					continue;
+				}
+				Ray objectRay = TransformRay(sp.worldToObject, sceneRay);
+				bool instanceHit = mModelTrees.Intersect(objectRay, sp.modelOffset,
+					[&](unsigned int modelPrimitiveOffset, unsigned int modelNumberOfPrimitives, Ray& modelRay) {
+						return intersectModelLeaf(i, modelPrimitiveOffset, modelNumberOfPrimitives, modelRay);
+					});
+				if (instanceHit) {
+					sceneRay.tMax = objectRay.tMax;
+					hit = true;
+				}
+			}
+			return hit;
+		});
+}
+
+template <typename ModelLeafOccluder>
+bool BinarySceneTree::Occluded(const Ray& ray, ModelLeafOccluder&& occludedModelLeaf, unsigned int rootIndex) const {
+	return mSceneTree.Occluded(ray, rootIndex,
+		[&](unsigned int primitiveOffset, unsigned int numberOfPrimitives, const Ray& sceneRay) {
+			for (unsigned int i = primitiveOffset; i < primitiveOffset + numberOfPrimitives; ++i) {
+				const auto& sp = mScenePrimitives[i];
+				float t;
+				if (!IntersectAABB(sp.minAABB, sp.maxAABB, sceneRay, t)) {
+					continue;
+				}
+				bool instanceOccluded = mModelTrees.Occluded(TransformRay(sp.worldToObject, sceneRay), sp.modelOffset,
+					[&](unsigned int modelPrimitiveOffset, unsigned int modelNumberOfPrimitives, const Ray& modelRay) {
+						return occludedModelLeaf(i, modelPrimitiveOffset, modelNumberOfPrimitives, modelRay);
+					});
+				if (instanceOccluded) {
+					return true;
+				}
+			}
+			return false;
+		});
+}
@@ -0,0 +1,1087 @@
+#include "CpuPathTracer.h"
+
+#include "Utils/Threading.h"
+
+#include <immintrin.h>
+#include <numeric>
+
+using namespace DirectX;
+
+// Constants of ConstantBuffers.hlsli and Ray.hlsli
+constexpr const float Epsilon = 1e-5f;
+constexpr const float MaximumRayLength = 10000.0f;
+constexpr const unsigned int MaxStackSize = 64;
+// Streams leave the packet once fewer than 1 / MinPacketFraction of its rays reach a node
+constexpr const unsigned int MinPacketFraction = 4;
+// Width of the tiles of pixels traced by a packet
+constexpr const unsigned int TileWidth = 4;
+// Paths in flight in the wavefront pipeline, and paths of a queue handled by a task
+constexpr const unsigned int WavefrontBatchSize = 1 << 16;
+constexpr const unsigned int WavefrontChunkSize = 256;
+
+// Rays traced by the thread, read around every task of a pass
+thread_local uint64_t tRaysTraced = 0;
+
+inline float Dot3(FXMVECTOR a, FXMVECTOR b) {
+	return XMVectorGetX(XMVector3Dot(a, b));
+}
+
+inline float MaxChannel(FXMVECTOR v) {
+	return std::max(std::max(XMVectorGetX(v), XMVectorGetY(v)), std::max(XMVectorGetZ(v), XMVectorGetW(v)));
+}
+
+inline XMVECTOR PointOnRay(const Ray& ray, float t) {
+	return XMLoadFloat3(&ray.origin) + XMLoadFloat3(&ray.direction) * t;
+}
+
+inline Ray MakeRay(FXMVECTOR origin, FXMVECTOR direction, float length) {
+	Ray ray;
+	XMStoreFloat3(&ray.origin, origin);
+	XMStoreFloat3(&ray.direction, direction);
+	ray.tMax = length;
+	return ray;
+}
+
+// Intersect of Sphere.hlsli and of the lights. Expects a normalized direction
+inline bool IntersectSphere(const XMFLOAT3& center, float radius, const Ray& ray, float& tNear, float& tFar) {
+	XMVECTOR l = XMLoadFloat3(&center) - XMLoadFloat3(&ray.origin);
+	float tca = Dot3(l, XMLoadFloat3(&ray.direction));
+	if (tca < 0.0f) {
+		return false;
+	}
+	float d2 = Dot3(l, l) - tca * tca;
+	if (d2 > radius * radius) {
+		return false;
+	}
+	float thc = sqrtf(radius * radius - d2);
+	tNear = tca - thc;
+	tFar = tca + thc;
+	return true;
+}
+
+inline XMVECTOR TransformNormalToWorld(const XMFLOAT3X4& worldToObject, FXMVECTOR normal) {
+	XMVECTOR row0 = XMVectorSet(worldToObject.m[0][0], worldToObject.m[0][1], worldToObject.m[0][2], 0.0f);
+	XMVECTOR row1 = XMVectorSet(worldToObject.m[1][0], worldToObject.m[1][1], worldToObject.m[1][2], 0.0f);
+	XMVECTOR row2 = XMVectorSet(worldToObject.m[2][0], worldToObject.m[2][1], worldToObject.m[2][2], 0.0f);
+	return XMVector3Normalize(row0 * XMVectorGetX(normal) + row1 * XMVectorGetY(normal) + row2 * XMVectorGetZ(normal));
+}
+
+// Utils.hlsli
+inline float GTR2(float NH, float a) {
+	float t = 1.0f + (a * a - 1.0f) * NH * NH;
+	return (a * a) / (Math::PI * t * t);
+}
+
+inline float SmithG_GGX(float NV, float alpha) {
+	float a = alpha * alpha;
+	float b = NV * NV;
+	return 1.0f / (NV + sqrtf(a + b - a * b));
+}
+
+inline float SchlickFresnel(float u) {
+	float m = std::clamp(1.0f - u, 0.0f, 1.0f);
+	float m2 = m * m;
+	return m2 * m2 * m;
+}
+
+inline void CreateLocalCoordinateSystem(FXMVECTOR N, XMVECTOR& Nt, XMVECTOR& Nb) {
+	if (fabsf(XMVectorGetX(N)) > fabsf(XMVectorGetY(N))) {
+		Nt = XMVectorSet(XMVectorGetZ(N), 0.0f, -XMVectorGetX(N), 0.0f);
+	} else {
+		Nt = XMVectorSet(0.0f, -XMVectorGetZ(N), XMVectorGetY(N), 0.0f);
+	}
+	Nt = XMVector3Normalize(Nt);
+	Nb = XMVector3Cross(N, Nt);
+}
+
+inline XMVECTOR SampleDirectionFromHemisphere(float r1, float r2) {
+	float sinTheta = sqrtf(1.0f - r1 * r1);
+	float phi = 2.0f * Math::PI * r2;
+	return XMVectorSet(sinTheta * cosf(phi), r1, sinTheta * sinf(phi), 0.0f);
+}
+
+inline XMVECTOR GetDirectionFromCoordinateSystemAndDirection(FXMVECTOR N, FXMVECTOR Nt, FXMVECTOR Nb, GXMVECTOR direction) {
+	return Nt * XMVectorGetX(direction) + N * XMVectorGetY(direction) + Nb * XMVectorGetZ(direction);
+}
+
+// Ray generation of PathTrace_CS.hlsl. Seeds rg with the pixel and draws the jitter from it
+inline Ray GetCameraRay(const Camera::CameraCB& camera, unsigned int x, unsigned int y, unsigned int width, unsigned int height,
+						const XMFLOAT2& randomVector, CpuPathTracer::RandomGenerator& rg) {
+	float scale = tanf(Math::Radians(camera.fov) * 0.5f);
+	XMFLOAT2 coords(2.0f * ((float)x / (float)width) - 1.0f, 2.0f * ((float)y / (float)height) - 1.0f);
+
+	rg = { coords, randomVector };
+	float r1 = 2.0f * rg.GetRandomNumber();
+	float r2 = 2.0f * rg.GetRandomNumber();
+
+	XMFLOAT2 jitter;
+	jitter.x = r1 < 1.0f ? sqrtf(r1) - 1.0f : 1.0f - sqrtf(2.0f - r1);
+	jitter.y = r2 < 1.0f ? sqrtf(r2) - 1.0f : 1.0f - sqrtf(2.0f - r2);
+
+	float dX = (coords.x + jitter.x / ((float)width * 0.5f)) * scale;
+	float dY = (coords.y + jitter.y / ((float)height * 0.5f)) * ((float)height / (float)width) * scale;
+	XMVECTOR direction = XMVector3Normalize(XMLoadFloat3(&camera.right) * dX + XMLoadFloat3(&camera.up) * dY + XMLoadFloat3(&camera.direction));
+	XMVECTOR focalPoint = direction * camera.focalDist;
+
+	return MakeRay(XMLoadFloat3(&camera.position), XMVector3Normalize(focalPoint), MaximumRayLength);
+}
+
+// Light::Illuminate: the shadow ray towards a random point on a disk of the light, facing the point, and the light that
+// comes through it when nothing is in the way
+inline Ray SampleLight(const Light& light, FXMVECTOR position, FXMVECTOR normal, CpuPathTracer::RandomGenerator& rg, XMVECTOR& contribution) {
+	float jitterX = 2.0f * rg.GetRandomNumber() - 1.0f;
+	float jitterY = 2.0f * rg.GetRandomNumber() - 1.0f;
+
+	XMVECTOR lightPosition = XMLoadFloat3(&light.Position);
+	XMVECTOR lightDirection = lightPosition - position;
+	XMVECTOR u = XMVector3Cross(XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), lightDirection);
+	XMVECTOR v = XMVector3Cross(lightDirection, u);
+	XMVECTOR newPoint = lightPosition + u * (jitterX * light.Radius) + v * (jitterY * light.Radius);
+
+	XMVECTOR lightDir = position - newPoint;
+	float distance = XMVectorGetX(XMVector3Length(lightDir));
+	lightDir = XMVector3Normalize(lightDir);
+	XMVECTOR lightIntensity = XMLoadFloat4(&light.Emissive) / (4.0f * Math::PI * distance * distance);
+	contribution = lightIntensity * std::max(0.0f, Dot3(normal, -lightDir));
+
+	// Only what lies between the point and the light can shadow it
+	return MakeRay(position + normal * Epsilon, -lightDir, distance);
+}
+
+// Runs stage(i) for every i in [0, count) on the thread pool and returns the number of rays it traced
+template <typename Stage>
+uint64_t RunWavefrontStage(size_t count, const Stage& stage) {
+	if (count == 0) {
+		return 0;
+	}
+	std::atomic<uint64_t> raysTraced = 0;
+	Threading::Get()->ParralelForImmediate(
+		[&](int64_t chunk) {
+			uint64_t raysBefore = tRaysTraced;
+			size_t end = std::min(count, (size_t)(chunk + 1) * WavefrontChunkSize);
+			for (size_t i = (size_t)chunk * WavefrontChunkSize; i < end; ++i) {
+				stage(i);
+			}
+			raysTraced += tRaysTraced - raysBefore;
+		}, (count + WavefrontChunkSize - 1) / WavefrontChunkSize, 1);
+	return raysTraced;
+}
+
+float CpuPathTracer::RandomGenerator::GetRandomNumber() {
+	seed.x -= step.x;
+	seed.y -= step.y;
+	float value = sinf(seed.x * 12.9898f + seed.y * 78.233f) * 43758.5453f;
+	return value - floorf(value);
+}
+
+CpuPathTracer::CpuPathTracer(const SceneDescription& scene) :
+	mScene(scene), mBinaryTree(scene.GetSceneTree(), scene.GetScenePrimitives(), scene.GetModelTrees()) {
+	// The shaders only get the lights that fit in their constant buffer
+	mNumberOfLights = std::min((unsigned int)mScene.GetLights().size(), (unsigned int)MAX_LIGHTS);
+	EVALUATE(!mScene.GetSceneTree().empty(), "The CPU path tracer needs a scene with at least one model");
+	if (!mScene.GetTexturesToLoad().empty()) {
+		Oblivion::DebugPrintLine("Textures are not sampled on the CPU. Surfaces use the diffuse color of their material");
+	}
+	if (!mScene.GetSkyboxPath().empty()) {
+		Oblivion::DebugPrintLine("The skybox is not sampled on the CPU. Rays leaving the scene return black");
+	}
+	mCompactVertices = !mScene.GetCompactVertexBuffer().empty();
+	if (mCompactVertices) {
+		mTriangles.Build(mScene.GetModelTrees(), mScene.GetModelPrimitives(), mScene.GetCompactVertexBuffer());
+	} else {
+		mTriangles.Build(mScene.GetModelTrees(), mScene.GetModelPrimitives(), mScene.GetVertexBuffer());
+	}
+	Oblivion::DebugPrintLine("Intersecting triangles with the ", TriangleBlocks::GetKernelName(mTriangles.GetKernel()), " kernel");
+	if (mScene.GetTraversalWidth() > 2) {
+		Oblivion::DebugPrintLine("Single rays walk the ", mScene.GetTraversalWidth(), " wide", mScene.GetCompressedNodes() ? " quantized" : "",
+								 " tree of the scene, packets the binary one");
+	}
+}
+
+void CpuPathTracer::SetTraversal(CpuTraversal traversal, unsigned int packetSize) {
+	EVALUATE(packetSize == 8 || packetSize == 16, "Packets hold 8 or 16 rays, not ", packetSize);
+	mTraversal = traversal;
+	mPacketSize = packetSize;
+}
+
+void CpuPathTracer::SetPipeline(CpuPipeline pipeline) {
+	mPipeline = pipeline;
+}
+
+uint64_t CpuPathTracer::TracePass(const Camera::CameraCB& camera, unsigned int width, unsigned int height, unsigned int depth,
+								  const XMFLOAT2& randomVector, std::vector<XMFLOAT4>& accumulated) const {
+	EVALUATE(accumulated.size() == (size_t)width * height, "The accumulated image has ", accumulated.size(), " pixels instead of ",
+			 width, " * ", height);
+	if (mPipeline == CpuPipeline::Wavefront) {
+		return TracePassWavefront(camera, width, height, depth, randomVector, accumulated);
+	}
+
+	std::atomic<uint64_t> raysTraced = 0;
+	if (mTraversal == CpuTraversal::Single) {
+		// One task per row
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t y) {
+				uint64_t raysBefore = tRaysTraced;
+				for (unsigned int x = 0; x < width; ++x) {
+					RandomGenerator rg;
+					Ray ray = GetCameraRay(camera, x, (unsigned int)y, width, height, randomVector, rg);
+
+					auto& pixel = accumulated[y * width + x];
+					XMStoreFloat4(&pixel, XMLoadFloat4(&pixel) + PathTrace(ray, depth, rg));
+				}
+				raysTraced += tRaysTraced - raysBefore;
+			}, height, 1);
+	} else {
+		// One task per row of tiles
+		unsigned int tileHeight = mPacketSize / TileWidth;
+		Threading::Get()->ParralelForImmediate(
+			[&](int64_t tileY) {
+				uint64_t raysBefore = tRaysTraced;
+				unsigned int y = (unsigned int)tileY * tileHeight;
+				for (unsigned int x = 0; x < width; x += TileWidth) {
+					TraceTile(camera, x, y, std::min(TileWidth, width - x), std::min(tileHeight, height - y), width, height, depth,
+							  randomVector, accumulated);
+				}
+				raysTraced += tRaysTraced - raysBefore;
+			}, (height + tileHeight - 1) / tileHeight, 1);
+	}
+	return raysTraced;
+}
+
+void CpuPathTracer::TraceTile(const Camera::CameraCB& camera, unsigned int x, unsigned int y, unsigned int tileWidth, unsigned int tileHeight,
+							  unsigned int width, unsigned int height, unsigned int depth, const XMFLOAT2& randomVector,
+							  std::vector<XMFLOAT4>& accumulated) const {
+	RayPacket cameraRays;
+	RandomGenerator generators[MaxPacketSize];
+	unsigned int pixels[MaxPacketSize];
+	for (unsigned int j = 0; j < tileHeight; ++j) {
+		for (unsigned int i = 0; i < tileWidth; ++i) {
+			pixels[cameraRays.size] = (y + j) * width + x + i;
+			cameraRays.rays[cameraRays.size] = GetCameraRay(camera, x + i, y + j, width, height, randomVector, generators[cameraRays.size]);
+			cameraRays.size++;
+		}
+	}
+	uint32_t mask = (1u << cameraRays.size) - 1;
+	cameraRays.Prepare(mask);
+
+	// The models, the lights and the spheres are intersected on their own by ClosestHitEx, every one of them with the whole ray
+	RayPacket sceneRays = cameraRays;
+	HitPoint sceneHits[MaxPacketSize];
+	uint32_t sceneMask = IntersectScenePacket(sceneRays, mask, sceneHits);
+	tRaysTraced += cameraRays.size;
+
+	// PathTrace draws the russian roulette of the first bounce before anything else. The throughput is still one, so it
+	// always passes, and the light of the first hit is sampled with the generator it leaves
+	PrimaryHit primaryHits[MaxPacketSize];
+	RandomGenerator lightGenerators[MaxPacketSize];
+	uint32_t shadedMask = 0;
+	for (unsigned int i = 0; i < cameraRays.size; ++i) {
+		auto& primaryHit = primaryHits[i];
+		primaryHit.found = ClosestHitEx(cameraRays.rays[i], (sceneMask & (1u << i)) ? &sceneHits[i] : nullptr, primaryHit.hp);
+		primaryHit.directLight = XMVectorZero();
+		lightGenerators[i] = generators[i];
+		lightGenerators[i].GetRandomNumber();
+		if (primaryHit.found && !primaryHit.hp.isLight) {
+			shadedMask |= 1u << i;
+		}
+	}
+
+	// The shadow rays of a light from the hits of the tile, as GetDirectLight draws them
+	const auto& lights = mScene.GetLights();
+	for (unsigned int light = 0; light < mNumberOfLights && shadedMask != 0; ++light) {
+		RayPacket shadowRays;
+		shadowRays.size = cameraRays.size;
+		XMVECTOR contributions[MaxPacketSize];
+		for (unsigned int i = 0; i < cameraRays.size; ++i) {
+			if (shadedMask & (1u << i)) {
+				shadowRays.rays[i] = SampleLight(lights[light], primaryHits[i].hp.position, primaryHits[i].hp.normal, lightGenerators[i],
+												 contributions[i]);
+			}
+		}
+		shadowRays.Prepare(shadedMask);
+		uint32_t litMask = shadedMask & ~OccludedPacket(shadowRays, shadedMask);
+		tRaysTraced += CountRays(shadedMask);
+		for (unsigned int i = 0; i < cameraRays.size; ++i) {
+			if (litMask & (1u << i)) {
+				primaryHits[i].directLight += contributions[i];
+			}
+		}
+	}
+
+	for (unsigned int i = 0; i < cameraRays.size; ++i) {
+		auto& pixel = accumulated[pixels[i]];
+		XMStoreFloat4(&pixel, XMLoadFloat4(&pixel) + PathTrace(cameraRays.rays[i], depth, generators[i], &primaryHits[i]));
+	}
+}
+
+uint64_t CpuPathTracer::TracePassWavefront(const Camera::CameraCB& camera, unsigned int width, unsigned int height, unsigned int depth,
+										   const XMFLOAT2& randomVector, std::vector<XMFLOAT4>& accumulated) const {
+	const auto& materials = mScene.GetMaterials();
+	const auto& lights = mScene.GetLights();
+	unsigned int numberOfPixels = width * height;
+	uint64_t raysTraced = 0;
+
+	std::vector<WavefrontPath> paths(std::min(numberOfPixels, WavefrontBatchSize));
+	std::vector<unsigned int> activePaths, shadedPaths;
+	std::vector<unsigned int> materialQueues[2];
+	std::vector<ShadowRay> shadowRays;
+	for (unsigned int firstPixel = 0; firstPixel < numberOfPixels; firstPixel += WavefrontBatchSize) {
+		unsigned int batchSize = std::min(WavefrontBatchSize, numberOfPixels - firstPixel);
+
+		// Generate
+		RunWavefrontStage(batchSize, [&](size_t i) {
+			auto& path = paths[i];
+			path.pixel = firstPixel + (unsigned int)i;
+			path.cameraRay = GetCameraRay(camera, path.pixel % width, path.pixel / width, width, height, randomVector, path.rg);
+			path.ray = path.cameraRay;
+			path.radiance = XMVectorZero();
+			path.throughput = XMVectorSplatOne();
+			path.alive = true;
+		});
+		activePaths.resize(batchSize);
+		std::iota(activePaths.begin(), activePaths.end(), 0);
+
+		for (unsigned int bounce = 0; bounce < depth && !activePaths.empty(); ++bounce) {
+			// Extend: russian roulette, then the closest hit. Misses and lights end the path
+			raysTraced += RunWavefrontStage(activePaths.size(), [&](size_t i) {
+				auto& path = paths[activePaths[i]];
+				float throughputValue = std::max(std::max(XMVectorGetX(path.throughput), std::max(XMVectorGetY(path.throughput),
+																								 XMVectorGetZ(path.throughput))),
+												 0.001f);
+				if (path.rg.GetRandomNumber() > throughputValue) {
+					path.alive = false;
+					return;
+				}
+				path.throughput = path.throughput * (1.0f / throughputValue);
+
+				if (!ClosestHitEx(path.ray, path.hp)) {
+					path.radiance += XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f) * path.throughput;
+					path.alive = false;
+				} else if (path.hp.isLight) {
+					path.radiance += path.hp.color * path.throughput;
+					path.alive = false;
+				}
+			});
+
+			// Every material type gets a queue of its own, so that the paths of a loop take the same branches
+			for (auto& queue : materialQueues) {
+				queue.clear();
+			}
+			for (unsigned int index : activePaths) {
+				if (paths[index].alive) {
+					bool diffuse = materials[paths[index].hp.material].materialType == MaterialType::Diffuse;
+					materialQueues[diffuse ? MaterialType::Diffuse : MaterialType::Specular].push_back(index);
+				}
+			}
+
+			// Shade: the direction of the bounce. The generator is passed by value, as in PathTrace
+			for (const auto& queue : materialQueues) {
+				RunWavefrontStage(queue.size(), [&](size_t i) {
+					auto& path = paths[queue[i]];
+					const auto& m = materials[path.hp.material];
+					path.newDirection = GetMaterialSample(m, path.cameraRay, path.hp, path.rg);
+					path.alive = GetMaterialPDF(m, path.cameraRay, path.hp, path.newDirection) > 0.0f;
+					if (path.alive) {
+						path.eval = GetMaterialEval(m, path.cameraRay, path.hp, path.newDirection);
+						path.cosine = std::max(0.0f, Dot3(path.hp.normal, path.newDirection));
+					}
+				});
+			}
+			shadedPaths.assign(materialQueues[0].begin(), materialQueues[0].end());
+			shadedPaths.insert(shadedPaths.end(), materialQueues[1].begin(), materialQueues[1].end());
+
+			// Shadow: one ray per light and shaded path, drawn as GetDirectLight does
+			shadowRays.resize(shadedPaths.size() * mNumberOfLights);
+			RunWavefrontStage(shadedPaths.size(), [&](size_t i) {
+				const auto& path = paths[shadedPaths[i]];
+				RandomGenerator rg = path.rg;
+				for (unsigned int light = 0; light < mNumberOfLights; ++light) {
+					auto& shadowRay = shadowRays[i * mNumberOfLights + light];
+					shadowRay.ray = SampleLight(lights[light], path.hp.position, path.hp.normal, rg, shadowRay.contribution);
+				}
+			});
+			raysTraced += RunWavefrontStage(shadowRays.size(), [&](size_t i) {
+				shadowRays[i].occluded = Occluded(shadowRays[i].ray);
+			});
+
+			// Add the direct light and move the paths that scattered to their next ray
+			RunWavefrontStage(shadedPaths.size(), [&](size_t i) {
+				auto& path = paths[shadedPaths[i]];
+				XMVECTOR directLight = XMVectorZero();
+				for (unsigned int light = 0; light < mNumberOfLights; ++light) {
+					const auto& shadowRay = shadowRays[i * mNumberOfLights + light];
+					if (!shadowRay.occluded) {
+						directLight += shadowRay.contribution;
+					}
+				}
+				path.radiance += directLight * path.hp.color * path.throughput;
+				if (path.alive) {
+					path.throughput = path.throughput * path.eval * path.cosine;
+					path.ray = MakeRay(path.hp.position + path.newDirection * Epsilon, path.newDirection, MaximumRayLength);
+				}
+			});
+
+			activePaths.clear();
+			for (unsigned int index : shadedPaths) {
+				if (paths[index].alive) {
+					activePaths.push_back(index);
+				}
+			}
+		}
+
+		// Accumulate
+		RunWavefrontStage(batchSize, [&](size_t i) {
+			auto& pixel = accumulated[paths[i].pixel];
+			XMStoreFloat4(&pixel, XMLoadFloat4(&pixel) + paths[i].radiance);
+		});
+	}
+	return raysTraced;
+}
+
+XMVECTOR CpuPathTracer::PathTrace(const Ray& ray, unsigned int depth, RandomGenerator rg) const {
+	return PathTrace(ray, depth, rg, nullptr);
+}
+
+XMVECTOR CpuPathTracer::PathTrace(const Ray& ray, unsigned int depth, RandomGenerator rg, const PrimaryHit* primaryHit) const {
+	XMVECTOR radiance = XMVectorZero(), throughput = XMVectorSplatOne();
+	HitPoint hp;
+	Ray currentRay = ray;
+	for (unsigned int i = 0; i < depth; ++i) {
+
+		// Russian roulette
+		float throughputValue = std::max(std::max(XMVectorGetX(throughput), std::max(XMVectorGetY(throughput), XMVectorGetZ(throughput))),
+										 0.001f);
+		if (rg.GetRandomNumber() > throughputValue) {
+			break;
+		}
+		throughput = throughput * (1.0f / throughputValue);
+
+		bool found;
+		if (i == 0 && primaryHit) {
+			found = primaryHit->found;
+			hp = primaryHit->hp;
+		} else {
+			found = ClosestHitEx(currentRay, hp);
+		}
+		if (!found) {
+			// No skybox on the CPU
+			radiance += XMVectorSet(0.0f, 0.0f, 0.0f, 1.0f) * throughput;
+			break;
+		}
+		if (hp.isLight) {
+			radiance += hp.color * throughput;
+			break;
+		}
+
+		const auto& m = mScene.GetMaterials()[hp.material];
+
+		// The shaders pass the generator by value, so only the russian roulette advances it
+		XMVECTOR newDirection = GetMaterialSample(m, ray, hp, rg);
+
+		XMVECTOR directLight = i == 0 && primaryHit ? primaryHit->directLight : GetDirectLight(hp.position, hp.normal, rg);
+		float pdf = GetMaterialPDF(m, ray, hp, newDirection);
+
+		radiance += directLight * hp.color * throughput;
+
+		if (pdf > 0.0f) {
+			throughput = throughput * GetMaterialEval(m, ray, hp, newDirection) * std::max(0.0f, Dot3(hp.normal, newDirection));
+		} else {
+			break;
+		}
+
+		currentRay = MakeRay(hp.position + newDirection * Epsilon, newDirection, MaximumRayLength);
+	}
+	return radiance;
+}
+
+bool CpuPathTracer::ClosestHitEx(const Ray& ray, HitPoint& hp) const {
+	tRaysTraced++;
+	HitPoint sceneHitPoint;
+	bool sceneHit = IntersectScene(ray, sceneHitPoint);
+	return ClosestHitEx(ray, sceneHit ? &sceneHitPoint : nullptr, hp);
+}
+
+bool CpuPathTracer::ClosestHitEx(const Ray& ray, const HitPoint* sceneHit, HitPoint& hp) const {
+	XMVECTOR origin = XMLoadFloat3(&ray.origin);
+	HitPoint currentHitPoint;
+	bool found = false;
+
+	auto KeepClosest = [&](bool isLight) {
+		if (!found || XMVectorGetX(XMVector3Length(currentHitPoint.position - origin)) < XMVectorGetX(XMVector3Length(hp.position - origin))) {
+			hp = currentHitPoint;
+			hp.isLight = isLight;
+		}
+		found = true;
+	};
+
+	if (IntersectLight(ray, currentHitPoint)) {
+		KeepClosest(true);
+	}
+	if (sceneHit) {
+		currentHitPoint = *sceneHit;
+		KeepClosest(false);
+	}
+	if (ClosestHitSphere(ray, currentHitPoint)) {
+		KeepClosest(false);
+	}
+	// Lines are never hit: their intersection test is disabled in Line.hlsli
+
+	return found;
+}
+
+bool CpuPathTracer::ClosestHitSphere(const Ray& ray, HitPoint& hp) const {
+	const auto& spheres = mScene.GetSpheres();
+	float closestHit = FLT_MAX;
+	int objectIndex = -1;
+	for (unsigned int i = 0; i < spheres.size(); ++i) {
+		float tNear, tFar;
+		if (IntersectSphere(spheres[i].Position, spheres[i].Radius, ray, tNear, tFar) && tNear < closestHit && tNear <= ray.tMax &&
+			tNear > 0.0f && tFar > 0.0f) {
+			closestHit = tNear;
+			objectIndex = (int)i;
+		}
+	}
+	if (objectIndex == -1) {
+		return false;
+	}
+
+	const auto& sphere = spheres[objectIndex];
+	hp.position = PointOnRay(ray, closestHit);
+	hp.normal = XMVector3Normalize(hp.position - XMLoadFloat3(&sphere.Position));
+	if (Dot3(XMLoadFloat3(&ray.direction), hp.normal) > 0.0f) {
+		hp.normal = -hp.normal;
+	}
+	hp.color = XMLoadFloat4(&sphere.Color);
+	hp.material = 0;
+	return true;
+}
+
+bool CpuPathTracer::IntersectLight(const Ray& ray, HitPoint& hp) const {
+	const auto& lights = mScene.GetLights();
+	float closestHit = FLT_MAX;
+	int lightIndex = -1;
+	for (unsigned int i = 0; i < mNumberOfLights; ++i) {
+		float tNear, tFar;
+		if (IntersectSphere(lights[i].Position, lights[i].Radius, ray, tNear, tFar) && tNear < closestHit && tNear <= ray.tMax &&
+			tNear > 0.0f) {
+			closestHit = tNear;
+			lightIndex = (int)i;
+		}
+	}
+	if (lightIndex == -1) {
+		return false;
+	}
+
+	XMVECTOR emissive = XMLoadFloat4(&lights[lightIndex].Emissive);
+	hp.color = emissive / MaxChannel(emissive);
+	hp.position = PointOnRay(ray, closestHit);
+	hp.isLight = true;
+	return true;
+}
+
+template <typename Visitor>
+auto CpuPathTracer::VisitSceneTree(Visitor&& visitor) const {
+	if (const auto* sceneTree = mScene.GetWideSceneTree<WideSceneTree<4>>()) {
+		return visitor(*sceneTree);
+	}
+	if (const auto* sceneTree = mScene.GetWideSceneTree<WideSceneTree<8>>()) {
+		return visitor(*sceneTree);
+	}
+	if (const auto* sceneTree = mScene.GetWideSceneTree<WideSceneTree<4, true>>()) {
+		return visitor(*sceneTree);
+	}
+	if (const auto* sceneTree = mScene.GetWideSceneTree<WideSceneTree<8, true>>()) {
+		return visitor(*sceneTree);
+	}
+	return visitor(mBinaryTree);
+}
+
+auto CpuPathTracer::IntersectLeafClosest(InstanceHit& hit) const {
+	return [this, &hit](unsigned int instanceIndex, unsigned int primitiveOffset, unsigned int, Ray& objectRay) {
+		if (mTriangles.IntersectClosest(mTriangles.FindLeaf(primitiveOffset), objectRay, hit.triangle)) {
+			hit.instance = instanceIndex;
+			return true;
+		}
+		return false;
+	};
+}
+
+auto CpuPathTracer::OccludedLeaf() const {
+	return [this](unsigned int, unsigned int primitiveOffset, unsigned int, const Ray& objectRay) {
+		return mTriangles.IntersectAny(mTriangles.FindLeaf(primitiveOffset), objectRay);
+	};
+}
+
+bool CpuPathTracer::IntersectScene(Ray ray, HitPoint& hp) const {
+	return VisitSceneTree([&](const auto& sceneTree) {
+		InstanceHit hit;
+		if (!sceneTree.Intersect(ray, IntersectLeafClosest(hit))) {
+			return false;
+		}
+		SetInstanceHit(ray, hit, hp);
+		return true;
+	});
+}
+
+bool CpuPathTracer::IntersectSceneNode(unsigned int currentOffset, Ray& ray, HitPoint& hp) const {
+	InstanceHit hit;
+	if (!mBinaryTree.Intersect(ray, IntersectLeafClosest(hit), currentOffset)) {
+		return false;
+	}
+	SetInstanceHit(ray, hit, hp);
+	return true;
+}
+
+bool CpuPathTracer::IntersectModelNode(unsigned int currentOffset, unsigned int materialIndex, Ray& ray, HitPoint& hp) const {
+	TriangleBlocks::Hit triangleHit;
+	bool hit = mBinaryTree.GetModelTrees().Intersect(ray, currentOffset,
+		[&](unsigned int primitiveOffset, unsigned int, Ray& modelRay) {
+			return mTriangles.IntersectClosest(mTriangles.FindLeaf(primitiveOffset), modelRay, triangleHit);
+		});
+	if (hit) {
+		SetTriangleHit(triangleHit, materialIndex, hp);
+	}
+	return hit;
+}
+
+void CpuPathTracer::SetInstanceHit(const Ray& ray, const InstanceHit& hit, HitPoint& hp) const {
+	const auto& sp = mScene.GetScenePrimitives()[hit.instance];
+	SetTriangleHit(hit.triangle, sp.materialIndex, hp);
+	hp.position = PointOnRay(ray, ray.tMax);
+	hp.normal = TransformNormalToWorld(sp.worldToObject, hp.normal);
+}
+
+void CpuPathTracer::SetTriangleHit(const TriangleBlocks::Hit& triangleHit, unsigned int materialIndex, HitPoint& hp) const {
+	const auto& mp = mScene.GetModelPrimitives()[triangleHit.primitive];
+	float u = triangleHit.u, v = triangleHit.v;
+	if (mCompactVertices) {
+		const auto& vertices = mScene.GetCompactVertexBuffer();
+		hp.normal = XMVector3Normalize(DecodeNormal(vertices[mp.index1]) * u + DecodeNormal(vertices[mp.index2]) * v +
+									   DecodeNormal(vertices[mp.index0]) * (1.0f - u - v));
+	} else {
+		const auto& vertices = mScene.GetVertexBuffer();
+		const auto& v0 = vertices[mp.index0];
+		const auto& v1 = vertices[mp.index1];
+		const auto& v2 = vertices[mp.index2];
+		hp.normal = XMVector3Normalize(XMLoadFloat3(&v1.normal) * u + XMLoadFloat3(&v2.normal) * v + XMLoadFloat3(&v0.normal) * (1.0f - u - v));
+	}
+	hp.color = XMLoadFloat4(&mScene.GetMaterials()[materialIndex].diffuseColor);
+	hp.material = materialIndex;
+}
+
+bool CpuPathTracer::Occluded(const Ray& ray) const {
+	tRaysTraced++;
+	for (const auto& sphere : mScene.GetSpheres()) {
+		float tNear, tFar;
+		if (IntersectSphere(sphere.Position, sphere.Radius, ray, tNear, tFar) && tNear <= ray.tMax && tNear > 0.0f && tFar > 0.0f) {
+			return true;
+		}
+	}
+	return VisitSceneTree([&](const auto& sceneTree) {
+		return sceneTree.Occluded(ray, OccludedLeaf());
+	});
+}
+
+uint32_t CpuPathTracer::IntersectPacketNode(const BVHTreeNode& node, const RayPacket& packet, uint32_t mask) const {
+	if (packet.MissesBox(node.minAABB, node.maxAABB)) {
+		return 0;
+	}
+
+	// IntersectAABB, four rays at a time
+	const __m128 minX = _mm_set1_ps(node.minAABB.x), minY = _mm_set1_ps(node.minAABB.y), minZ = _mm_set1_ps(node.minAABB.z);
+	const __m128 maxX = _mm_set1_ps(node.maxAABB.x), maxY = _mm_set1_ps(node.maxAABB.y), maxZ = _mm_set1_ps(node.maxAABB.z);
+	const __m128 zero = _mm_setzero_ps();
+	uint32_t hitMask = 0;
+	for (unsigned int i = 0; i < packet.size; i += 4) {
+		if (!(mask & (0xFu << i))) {
+			continue;
+		}
+		__m128 originX = _mm_load_ps(packet.originX + i), originY = _mm_load_ps(packet.originY + i), originZ = _mm_load_ps(packet.originZ + i);
+		__m128 invX = _mm_load_ps(packet.invDirectionX + i), invY = _mm_load_ps(packet.invDirectionY + i), invZ = _mm_load_ps(packet.invDirectionZ + i);
+		__m128 tMax = _mm_set_ps(packet.rays[i + 3].tMax, packet.rays[i + 2].tMax, packet.rays[i + 1].tMax, packet.rays[i].tMax);
+
+		__m128 fX = _mm_mul_ps(_mm_sub_ps(minX, originX), invX), nX = _mm_mul_ps(_mm_sub_ps(maxX, originX), invX);
+		__m128 fY = _mm_mul_ps(_mm_sub_ps(minY, originY), invY), nY = _mm_mul_ps(_mm_sub_ps(maxY, originY), invY);
+		__m128 fZ = _mm_mul_ps(_mm_sub_ps(minZ, originZ), invZ), nZ = _mm_mul_ps(_mm_sub_ps(maxZ, originZ), invZ);
+		__m128 t0 = _mm_max_ps(_mm_min_ps(fX, nX), _mm_max_ps(_mm_min_ps(fY, nY), _mm_min_ps(fZ, nZ)));
+		__m128 t1 = _mm_min_ps(_mm_max_ps(fX, nX), _mm_min_ps(_mm_max_ps(fY, nY), _mm_max_ps(fZ, nZ)));
+
+		__m128 entersAhead = _mm_cmpgt_ps(t0, zero);
+		__m128 t = _mm_or_ps(_mm_and_ps(entersAhead, t0), _mm_andnot_ps(entersAhead, t1));
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(t0, t1), _mm_and_ps(_mm_cmpgt_ps(t, zero), _mm_cmplt_ps(t, tMax)));
+		hitMask |= (uint32_t)_mm_movemask_ps(hit) << i;
+	}
+	return hitMask & mask;
+}
+
+bool CpuPathTracer::ShouldSplitPacket(uint32_t mask) const {
+	return mTraversal == CpuTraversal::Stream && CountRays(mask) * MinPacketFraction < mPacketSize;
+}
+
+uint32_t CpuPathTracer::IntersectScenePacket(RayPacket& packet, uint32_t mask, HitPoint* hps) const {
+	const auto& sceneTree = mScene.GetSceneTree();
+	const auto& scenePrimitives = mScene.GetScenePrimitives();
+	uint32_t hitMask = 0;
+	unsigned int stackIndex = 0;
+	unsigned int stack[MaxStackSize];
+	uint32_t stackMasks[MaxStackSize];
+	unsigned int currentOffset = 0;
+	uint32_t currentMask = mask;
+
+	while (true) {
+		const auto& currentNode = sceneTree[currentOffset];
+		currentMask = IntersectPacketNode(currentNode, packet, currentMask);
+		if (currentMask != 0 && ShouldSplitPacket(currentMask)) {
+			for (unsigned int i = 0; i < packet.size; ++i) {
+				if ((currentMask & (1u << i)) && IntersectSceneNode(currentOffset, packet.rays[i], hps[i])) {
+					hitMask |= 1u << i;
+				}
+			}
+		} else if (currentMask != 0 && currentNode.numberOfPrimitives == 0) {
+			// Ordered by the first ray of the packet
+			if (IsSecondChildNearer(currentNode, packet.rays[FirstRay(currentMask)])) {
+				stackMasks[stackIndex] = currentMask;
+				stack[stackIndex++] = currentOffset + 1;
+				currentOffset = currentNode.secondChildOffset;
+			} else {
+				stackMasks[stackIndex] = currentMask;
+				stack[stackIndex++] = currentNode.secondChildOffset;
+				currentOffset = currentOffset + 1;
+			}
+			continue;
+		} else if (currentMask != 0) {
+			for (unsigned int j = 0; j < currentNode.numberOfPrimitives; ++j) {
+				const auto& sp = scenePrimitives[currentNode.primitiveOffset + j];
+				RayPacket objectPacket;
+				objectPacket.size = packet.size;
+				uint32_t primitiveMask = 0;
+				for (unsigned int i = 0; i < packet.size; ++i) {
+					float t;
+					if ((currentMask & (1u << i)) && IntersectAABB(sp.minAABB, sp.maxAABB, packet.rays[i], t)) {
+						objectPacket.rays[i] = TransformRay(sp.worldToObject, packet.rays[i]);
+						primitiveMask |= 1u << i;
+					}
+				}
+				if (primitiveMask == 0) {
+					continue;
+				}
+				objectPacket.Prepare(primitiveMask);
+				uint32_t modelMask = IntersectModelPacket(sp.modelOffset, sp.materialIndex, objectPacket, primitiveMask, hps);
+				for (unsigned int i = 0; i < packet.size; ++i) {
+					if (modelMask & (1u << i)) {
+						auto& ray = packet.rays[i];
+						ray.tMax = objectPacket.rays[i].tMax;
+						hps[i].position = PointOnRay(ray, ray.tMax);
+						hps[i].normal = TransformNormalToWorld(sp.worldToObject, hps[i].normal);
+					}
+				}
+				hitMask |= modelMask;
+			}
+		}
+
+		if (stackIndex == 0) {
+			break;
+		}
+		--stackIndex;
+		currentOffset = stack[stackIndex];
+		currentMask = stackMasks[stackIndex];
+	}
+
+	return hitMask;
+}
+
+uint32_t CpuPathTracer::IntersectModelPacket(unsigned int currentOffset, unsigned int materialIndex, RayPacket& packet, uint32_t mask,
+											 HitPoint* hps) const {
+	const auto& modelTrees = mScene.GetModelTrees();
+	uint32_t hitMask = 0;
+	unsigned int stackIndex = 0;
+	unsigned int stack[MaxStackSize];
+	uint32_t stackMasks[MaxStackSize];
+	uint32_t currentMask = mask;
+
+	while (true) {
+		const auto& currentNode = modelTrees[currentOffset];
+		currentMask = IntersectPacketNode(currentNode, packet, currentMask);
+		if (currentMask != 0 && ShouldSplitPacket(currentMask)) {
+			for (unsigned int i = 0; i < packet.size; ++i) {
+				if ((currentMask & (1u << i)) && IntersectModelNode(currentOffset, materialIndex, packet.rays[i], hps[i])) {
+					hitMask |= 1u << i;
+				}
+			}
+		} else if (currentMask != 0 && currentNode.numberOfPrimitives == 0) {
+			if (IsSecondChildNearer(currentNode, packet.rays[FirstRay(currentMask)])) {
+				stackMasks[stackIndex] = currentMask;
+				stack[stackIndex++] = currentOffset + 1;
+				currentOffset = currentNode.secondChildOffset;
+			} else {
+				stackMasks[stackIndex] = currentMask;
+				stack[stackIndex++] = currentNode.secondChildOffset;
+				currentOffset = currentOffset + 1;
+			}
+			continue;
+		} else if (currentMask != 0) {
+			unsigned int leaf = mTriangles.FindLeaf(currentNode.primitiveOffset);
+			for (unsigned int i = 0; i < packet.size; ++i) {
+				TriangleBlocks::Hit triangleHit;
+				if ((currentMask & (1u << i)) && mTriangles.IntersectClosest(leaf, packet.rays[i], triangleHit)) {
+					SetTriangleHit(triangleHit, materialIndex, hps[i]);
+					hitMask |= 1u << i;
+				}
+			}
+		}
+
+		if (stackIndex == 0) {
+			break;
+		}
+		--stackIndex;
+		currentOffset = stack[stackIndex];
+		currentMask = stackMasks[stackIndex];
+	}
+
+	return hitMask;
+}
+
+uint32_t CpuPathTracer::OccludedPacket(RayPacket& packet, uint32_t mask) const {
+	const auto& sceneTree = mScene.GetSceneTree();
+	const auto& scenePrimitives = mScene.GetScenePrimitives();
+
+	uint32_t occludedMask = 0;
+	for (unsigned int i = 0; i < packet.size; ++i) {
+		if (!(mask & (1u << i))) {
+			continue;
+		}
+		for (const auto& sphere : mScene.GetSpheres()) {
+			float tNear, tFar;
+			const auto& ray = packet.rays[i];
+			if (IntersectSphere(sphere.Position, sphere.Radius, ray, tNear, tFar) && tNear <= ray.tMax && tNear > 0.0f && tFar > 0.0f) {
+				occludedMask |= 1u << i;
+				break;
+			}
+		}
+	}
+
+	// Rays leave the walk as soon as they are found occluded
+	unsigned int stackIndex = 0;
+	unsigned int stack[MaxStackSize];
+	uint32_t stackMasks[MaxStackSize];
+	unsigned int currentOffset = 0;
+	uint32_t currentMask = mask & ~occludedMask;
+
+	while (currentMask != 0 || stackIndex != 0) {
+		if (currentMask != 0) {
+			const auto& currentNode = sceneTree[currentOffset];
+			currentMask = IntersectPacketNode(currentNode, packet, currentMask);
+			if (currentMask != 0 && ShouldSplitPacket(currentMask)) {
+				for (unsigned int i = 0; i < packet.size; ++i) {
+					if ((currentMask & (1u << i)) && mBinaryTree.Occluded(packet.rays[i], OccludedLeaf(), currentOffset)) {
+						occludedMask |= 1u << i;
+					}
+				}
+			} else if (currentMask != 0 && currentNode.numberOfPrimitives == 0) {
+				if (IsSecondChildNearer(currentNode, packet.rays[FirstRay(currentMask)])) {
+					stackMasks[stackIndex] = currentMask;
+					stack[stackIndex++] = currentOffset + 1;
+					currentOffset = currentNode.secondChildOffset;
+				} else {
+					stackMasks[stackIndex] = currentMask;
+					stack[stackIndex++] = currentNode.secondChildOffset;
+					currentOffset = currentOffset + 1;
+				}
+				continue;
+			} else if (currentMask != 0) {
+				for (unsigned int j = 0; j < currentNode.numberOfPrimitives; ++j) {
+					const auto& sp = scenePrimitives[currentNode.primitiveOffset + j];
+					RayPacket objectPacket;
+					objectPacket.size = packet.size;
+					uint32_t primitiveMask = 0;
+					for (unsigned int i = 0; i < packet.size; ++i) {
+						float t;
+						if ((currentMask & ~occludedMask & (1u << i)) && IntersectAABB(sp.minAABB, sp.maxAABB, packet.rays[i], t)) {
+							objectPacket.rays[i] = TransformRay(sp.worldToObject, packet.rays[i]);
+							primitiveMask |= 1u << i;
+						}
+					}
+					if (primitiveMask != 0) {
+						objectPacket.Prepare(primitiveMask);
+						occludedMask |= OccludedModelPacket(sp.modelOffset, objectPacket, primitiveMask);
+					}
+				}
+			}
+		}
+
+		if (stackIndex == 0) {
+			break;
+		}
+		--stackIndex;
+		currentOffset = stack[stackIndex];
+		currentMask = stackMasks[stackIndex] & ~occludedMask;
+	}
+
+	return occludedMask;
+}
+
+uint32_t CpuPathTracer::OccludedModelPacket(unsigned int currentOffset, RayPacket& packet, uint32_t mask) const {
+	const auto& modelTrees = mScene.GetModelTrees();
+	uint32_t occludedMask = 0;
+	unsigned int stackIndex = 0;
+	unsigned int stack[MaxStackSize];
+	uint32_t stackMasks[MaxStackSize];
+	uint32_t currentMask = mask;
+
+	while (currentMask != 0 || stackIndex != 0) {
+		if (currentMask != 0) {
+			const auto& currentNode = modelTrees[currentOffset];
+			currentMask = IntersectPacketNode(currentNode, packet, currentMask);
+			if (currentMask != 0 && ShouldSplitPacket(currentMask)) {
+				for (unsigned int i = 0; i < packet.size; ++i) {
+					if (!(currentMask & (1u << i))) {
+						continue;
+					}
+					bool occluded = mBinaryTree.GetModelTrees().Occluded(packet.rays[i], currentOffset,
+						[&](unsigned int primitiveOffset, unsigned int, const Ray& modelRay) {
+							return mTriangles.IntersectAny(mTriangles.FindLeaf(primitiveOffset), modelRay);
+						});
+					if (occluded) {
+						occludedMask |= 1u << i;
+					}
+				}
+			} else if (currentMask != 0 && currentNode.numberOfPrimitives == 0) {
+				if (IsSecondChildNearer(currentNode, packet.rays[FirstRay(currentMask)])) {
+					stackMasks[stackIndex] = currentMask;
+					stack[stackIndex++] = currentOffset + 1;
+					currentOffset = currentNode.secondChildOffset;
+				} else {
+					stackMasks[stackIndex] = currentMask;
+					stack[stackIndex++] = currentNode.secondChildOffset;
+					currentOffset = currentOffset + 1;
+				}
+				continue;
+			} else if (currentMask != 0) {
+				unsigned int leaf = mTriangles.FindLeaf(currentNode.primitiveOffset);
+				for (unsigned int i = 0; i < packet.size; ++i) {
+					if ((currentMask & (1u << i)) && mTriangles.IntersectAny(leaf, packet.rays[i])) {
+						occludedMask |= 1u << i;
+					}
+				}
+			}
+		}
+
+		if (stackIndex == 0) {
+			break;
+		}
+		--stackIndex;
+		currentOffset = stack[stackIndex];
+		currentMask = stackMasks[stackIndex] & ~occludedMask;
+	}
+
+	return occludedMask;
+}
+
+XMVECTOR CpuPathTracer::GetDirectLight(FXMVECTOR position, FXMVECTOR normal, RandomGenerator rg) const {
+	const auto& lights = mScene.GetLights();
+	XMVECTOR directLighting = XMVectorZero();
+
+	for (unsigned int i = 0; i < mNumberOfLights; ++i) {
+		XMVECTOR contribution;
+		Ray toLightRay = SampleLight(lights[i], position, normal, rg, contribution);
+		if (!Occluded(toLightRay)) {
+			directLighting += contribution;
+		}
+	}
+
+	return directLighting;
+}
+
+float CpuPathTracer::GetMaterialPDF(const Material& m, const Ray& ray, const HitPoint& hp, FXMVECTOR direction) {
+	if (m.materialType != MaterialType::Diffuse) {
+		return 1.0f;
+	}
+
+	XMVECTOR N = hp.normal;
+	XMVECTOR V = -XMLoadFloat3(&ray.direction);
+	XMVECTOR L = direction;
+
+	float specularAlpha = std::max(0.001f, m.roughness);
+	float diffuseRatio = 0.5f * (1.0f - m.metallic);
+	float specularRatio = 1.0f - diffuseRatio;
+
+	XMVECTOR halfDirection = XMVector3Normalize(V + L);
+	float cosTheta = fabsf(Dot3(halfDirection, N));
+	float pdfGTR2 = GTR2(cosTheta, specularAlpha) * cosTheta;
+
+	float specularPDF = pdfGTR2 / (4.0f * fabsf(Dot3(L, halfDirection)));
+	float diffusePDF = fabsf(Dot3(L, N)) * (1.0f / Math::PI);
+
+	return specularPDF * specularRatio + diffusePDF * diffuseRatio;
+}
+
+XMVECTOR CpuPathTracer::GetMaterialSample(const Material& m, const Ray& ray, const HitPoint& hp, RandomGenerator rg) {
+	XMVECTOR direction = XMLoadFloat3(&ray.direction);
+
+	if (m.materialType != MaterialType::Diffuse) {
+		float n1 = 1.0f; // air IoR
+		float n2 = m.ior;
+		bool isInside = Dot3(-direction, hp.normal) < 0.0f;
+		float refractionIndex = isInside ? (n2 / n1) : (n1 / n2);
+
+		if (rg.GetRandomNumber() < m.metallic) {
+			return XMVector3Normalize(XMVector3Reflect(direction, hp.normal));
+		}
+		return XMVector3Normalize(XMVector3Refract(direction, hp.normal, refractionIndex));
+	}
+
+	float probability = rg.GetRandomNumber();
+	float diffuseRatio = 0.5f * (1.0f - m.metallic);
+
+	XMVECTOR tangent, binormal;
+	CreateLocalCoordinateSystem(hp.normal, tangent, binormal);
+
+	float r1 = rg.GetRandomNumber();
+	float r2 = rg.GetRandomNumber();
+
+	if (probability < diffuseRatio) {
+		XMVECTOR hemisphereDirection = SampleDirectionFromHemisphere(r1, r2);
+		return XMVector3Normalize(GetDirectionFromCoordinateSystemAndDirection(hp.normal, tangent, binormal, hemisphereDirection));
+	}
+
+	float specularAlpha = std::max(0.001f, m.roughness);
+	float phi = r1 * 2.0f * Math::PI;
+	float cosTheta = sqrtf((1.0f - r2) / (1.0f + (specularAlpha * specularAlpha - 1.0f) * r2));
+	float sinTheta = std::clamp(sqrtf(1.0f - cosTheta * cosTheta), 0.0f, 1.0f);
+
+	XMVECTOR newDirection = XMVectorSet(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta, 0.0f);
+	XMVECTOR sample = GetDirectionFromCoordinateSystemAndDirection(hp.normal, tangent, binormal, newDirection);
+	return XMVector3Normalize(XMVector3Reflect(-direction, sample));
+}
+
+XMVECTOR CpuPathTracer::GetMaterialEval(const Material& m, const Ray& ray, const HitPoint& hp, FXMVECTOR direction) {
+	if (m.materialType != MaterialType::Diffuse) {
+		return XMVectorSplatOne();
+	}
+
+	XMVECTOR N = hp.normal;
+	XMVECTOR V = -XMLoadFloat3(&ray.direction);
+	XMVECTOR L = direction;
+
+	float NL = Dot3(N, L);
+	float NV = Dot3(N, V);
+	if (NL <= 0.0f || NV <= 0.0f) {
+		return XMVectorZero();
+	}
+
+	XMVECTOR halfDirection = XMVector3Normalize(L + V);
+	float NH = Dot3(N, halfDirection);
+	float LH = Dot3(L, halfDirection);
+
+	float specular = 0.5f;
+	XMVECTOR specularColor = XMVectorLerp(XMVectorReplicate(specular), hp.color, m.metallic);
+	float specularAlpha = std::max(0.001f, m.roughness);
+
+	float Ds = GTR2(NH, specularAlpha);
+	float FH = SchlickFresnel(LH);
+	XMVECTOR Fs = XMVectorLerp(specularColor, XMVectorSplatOne(), FH);
+	float roughnessCoefficient = m.roughness * m.roughness;
+	float Gs = SmithG_GGX(NL, roughnessCoefficient) * SmithG_GGX(NV, roughnessCoefficient);
+
+	return (hp.color / Math::PI) * (1.0f - m.metallic) + Fs * (Gs * Ds);
+}
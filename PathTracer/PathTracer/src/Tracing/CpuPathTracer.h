@@ -0,0 +1,159 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Ray.h"
+#include "BinaryBvhTree.h"
+#include "TriangleBlocks.h"
+#include "RayPacket.h"
+#include "CpuTracingOptions.h"
+#include "Graphics/SceneDescription.h"
+#include "Gameplay/Camera.h"
+
+// Port of PathTrace from Shaders/Computing/Trace.hlsli, for machines without a GPU. It reads the same flattened buffers
+// the shaders get from SceneLoader and follows the shaders step by step, random numbers included, so that both backends
+// converge to the same image. Textures and the skybox are not sampled: surfaces use the diffuse color of their
+// material and rays that leave the scene return black, as on the GPU when the scene has no skybox
+class CpuPathTracer {
+public:
+	// Random numbers of the shaders: a hash of the pixel coordinates, moved by the random vector of the pass
+	struct RandomGenerator {
+		DirectX::XMFLOAT2 seed;
+		DirectX::XMFLOAT2 step;
+
+		float GetRandomNumber();
+	};
+
+public:
+	// Reads the compact vertex buffer of the scene when SceneDescription::CompactVertexBuffer was called
+	CpuPathTracer(const SceneDescription& scene);
+
+public:
+	// packetSize is 8 (tiles of 4 * 2 pixels) or 16 (tiles of 4 * 4 pixels), and is ignored by CpuTraversal::Single
+	void SetTraversal(CpuTraversal traversal, unsigned int packetSize);
+	// The wavefront pipeline traces the camera rays one at a time, whatever the traversal
+	void SetPipeline(CpuPipeline pipeline);
+
+	// One dispatch of PathTrace_CS: adds a sample of every pixel to accumulated, which holds width * height colors, row by
+	// row in the order of the texture of the shaders. randomVector is the one of the constant buffer, fresh for every pass.
+	// Returns the number of rays traced, shadow rays included
+	uint64_t TracePass(const Camera::CameraCB& camera, unsigned int width, unsigned int height, unsigned int depth,
+					   const DirectX::XMFLOAT2& randomVector, std::vector<DirectX::XMFLOAT4>& accumulated) const;
+
+	DirectX::XMVECTOR PathTrace(const Ray& ray, unsigned int depth, RandomGenerator rg) const;
+
+private:
+	struct HitPoint {
+		DirectX::XMVECTOR color;
+		DirectX::XMVECTOR position;
+		DirectX::XMVECTOR normal;
+		bool isLight = false;
+		unsigned int material = 0;
+	};
+
+	// The first bounce of a path, traced ahead of PathTrace by a packet
+	struct PrimaryHit {
+		bool found = false;
+		HitPoint hp;
+		DirectX::XMVECTOR directLight;
+	};
+
+	DirectX::XMVECTOR PathTrace(const Ray& ray, unsigned int depth, RandomGenerator rg, const PrimaryHit* primaryHit) const;
+
+	// A path between the stages of the wavefront pipeline. Every stage does for all the paths of a queue the part of an
+	// iteration of PathTrace it is named after, in the same order, so that both pipelines draw the same random numbers
+	struct WavefrontPath {
+		// The shaders give the materials the camera ray
+		Ray cameraRay;
+		Ray ray;
+		RandomGenerator rg;
+		unsigned int pixel;
+		DirectX::XMVECTOR radiance;
+		DirectX::XMVECTOR throughput;
+		HitPoint hp;
+		DirectX::XMVECTOR newDirection;
+		DirectX::XMVECTOR eval;
+		float cosine;
+		// Cleared when the path ends, which it still does after its direct light is added when the material can't
+		// scatter it towards newDirection
+		bool alive;
+	};
+
+	struct ShadowRay {
+		Ray ray;
+		DirectX::XMVECTOR contribution;
+		bool occluded;
+	};
+
+	uint64_t TracePassWavefront(const Camera::CameraCB& camera, unsigned int width, unsigned int height, unsigned int depth,
+								const DirectX::XMFLOAT2& randomVector, std::vector<DirectX::XMFLOAT4>& accumulated) const;
+	// Traces the camera rays of the pixels [x, x + tileWidth) * [y, y + tileHeight) in one packet
+	void TraceTile(const Camera::CameraCB& camera, unsigned int x, unsigned int y, unsigned int tileWidth, unsigned int tileHeight,
+				   unsigned int width, unsigned int height, unsigned int depth, const DirectX::XMFLOAT2& randomVector,
+				   std::vector<DirectX::XMFLOAT4>& accumulated) const;
+
+	bool ClosestHitEx(const Ray& ray, HitPoint& hp) const;
+	// The closest of the lights, the spheres and sceneHit, the hit of the models when there is one
+	bool ClosestHitEx(const Ray& ray, const HitPoint* sceneHit, HitPoint& hp) const;
+	bool ClosestHitSphere(const Ray& ray, HitPoint& hp) const;
+	bool IntersectLight(const Ray& ray, HitPoint& hp) const;
+	// Single rays walk the wide scene tree when the scene has one, and the binary trees of the shaders otherwise.
+	// visitor(sceneTree) gets a BinarySceneTree or a WideSceneTree, which have the same interface
+	template <typename Visitor>
+	auto VisitSceneTree(Visitor&& visitor) const;
+
+	// Closest triangle of a model, and the instance it was found in
+	struct InstanceHit {
+		unsigned int instance = 0;
+		TriangleBlocks::Hit triangle;
+	};
+	// Leaf intersector of the Intersect of the scene trees, which keeps the closest triangle in hit
+	auto IntersectLeafClosest(InstanceHit& hit) const;
+
+	bool IntersectScene(Ray ray, HitPoint& hp) const;
+	// Closest hits of the rays a packet leaves at a node of the binary scene tree, or of a model tree, in the space of
+	// the model
+	bool IntersectSceneNode(unsigned int currentOffset, Ray& ray, HitPoint& hp) const;
+	bool IntersectModelNode(unsigned int currentOffset, unsigned int materialIndex, Ray& ray, HitPoint& hp) const;
+	// ray.tMax is the distance of the hit
+	void SetInstanceHit(const Ray& ray, const InstanceHit& hit, HitPoint& hp) const;
+	void SetTriangleHit(const TriangleBlocks::Hit& triangleHit, unsigned int materialIndex, HitPoint& hp) const;
+
+	// Visibility queries of the shadow rays, which stop at the first hit closer than ray.tMax. The models are walked
+	// with the Occluded of the tree VisitSceneTree picks
+	bool Occluded(const Ray& ray) const;
+	// Leaf occluder of the Occluded of the scene trees
+	auto OccludedLeaf() const;
+
+	// The same queries for the rays of the mask of a packet. Return the mask of the rays that hit. Packets always walk
+	// the binary trees
+	uint32_t IntersectScenePacket(RayPacket& packet, uint32_t mask, HitPoint* hps) const;
+	uint32_t IntersectModelPacket(unsigned int currentOffset, unsigned int materialIndex, RayPacket& packet, uint32_t mask,
+								  HitPoint* hps) const;
+	uint32_t OccludedPacket(RayPacket& packet, uint32_t mask) const;
+	uint32_t OccludedModelPacket(unsigned int currentOffset, RayPacket& packet, uint32_t mask) const;
+	// Rays of the mask whose ray hits the box of the node
+	uint32_t IntersectPacketNode(const BVHTreeNode& node, const RayPacket& packet, uint32_t mask) const;
+	// Whether the rays of the mask are few enough to leave the packet and finish the subtree on their own
+	bool ShouldSplitPacket(uint32_t mask) const;
+
+	DirectX::XMVECTOR GetDirectLight(DirectX::FXMVECTOR position, DirectX::FXMVECTOR normal, RandomGenerator rg) const;
+
+	// Material.hlsli. The shaders give the materials the camera ray instead of the current one, which is kept so that
+	// the images match
+	static float GetMaterialPDF(const Material& m, const Ray& ray, const HitPoint& hp, DirectX::FXMVECTOR direction);
+	static DirectX::XMVECTOR GetMaterialSample(const Material& m, const Ray& ray, const HitPoint& hp, RandomGenerator rg);
+	static DirectX::XMVECTOR GetMaterialEval(const Material& m, const Ray& ray, const HitPoint& hp, DirectX::FXMVECTOR direction);
+
+private:
+	const SceneDescription& mScene;
+	unsigned int mNumberOfLights;
+	BinarySceneTree mBinaryTree;
+	// The leaves of the model trees, packed for the widest triangle kernel of the CPU
+	TriangleBlocks mTriangles;
+	bool mCompactVertices;
+
+	CpuPipeline mPipeline = CpuPipeline::Megakernel;
+	CpuTraversal mTraversal = CpuTraversal::Single;
+	unsigned int mPacketSize = MaxPacketSize;
+};
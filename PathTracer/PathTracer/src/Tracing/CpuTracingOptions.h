@@ -0,0 +1,30 @@
+#pragma once
+
+
+// How CpuPathTracer walks the trees with the camera rays and their shadow rays. Bounces are always traced one at a time
+enum class CpuTraversal {
+	// Every ray on its own
+	Single,
+	// Rays of a tile of pixels share one walk of the trees
+	Packet,
+	// Like Packet, but the subtrees only a few rays of the packet reach are finished one ray at a time
+	Stream
+};
+
+// How CpuPathTracer runs the bounces of the paths
+enum class CpuPipeline {
+	// Every path runs all its bounces in PathTrace, as PathTrace_CS does on the GPU
+	Megakernel,
+	// The paths of a batch of pixels go through every stage of a bounce together: extension rays, shading of every
+	// material type, shadow rays. Each stage is one loop over a queue of paths
+	Wavefront
+};
+
+// Vertices CpuPathTracer reads. Only the CPU tracer has a compact format: Vertex.hlsli has no decoder for it, so the
+// D3D12 backend always uploads TraceVertex and the shaders read 48 bytes per vertex whatever is picked here
+enum class CpuVertexFormat {
+	// TraceVertex, as the shaders read them
+	Full,
+	// CompactTraceVertex: 20 bytes instead of 48, with normals a few thousandths of a degree off
+	Compact
+};
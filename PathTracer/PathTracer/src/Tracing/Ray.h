@@ -0,0 +1,32 @@
+#pragma once
+
+
+#include <Oblivion.h>
+
+// Ray used by the CPU traversal kernels. Hits are accepted in [tMin, tMax]; closest hit queries shrink tMax
+struct Ray {
+	DirectX::XMFLOAT3 origin;
+	float tMin = 0.0f;
+	DirectX::XMFLOAT3 direction;
+	float tMax = std::numeric_limits<float>::infinity();
+
+	Ray() = default;
+	Ray(const DirectX::XMFLOAT3& origin, const DirectX::XMFLOAT3& direction,
+		float tMin = 0.0f, float tMax = std::numeric_limits<float>::infinity()) :
+		origin(origin), tMin(tMin), direction(direction), tMax(tMax) { };
+};
+
+// Moves the ray with the rows of a 3x4 matrix. The direction is not normalized, so distances along the ray, and with them
+// tMin and tMax, stay the same
+inline Ray TransformRay(const DirectX::XMFLOAT3X4& transform, const Ray& ray) {
+	Ray transformed = ray;
+	transformed.origin = DirectX::XMFLOAT3(
+		transform.m[0][0] * ray.origin.x + transform.m[0][1] * ray.origin.y + transform.m[0][2] * ray.origin.z + transform.m[0][3],
+		transform.m[1][0] * ray.origin.x + transform.m[1][1] * ray.origin.y + transform.m[1][2] * ray.origin.z + transform.m[1][3],
+		transform.m[2][0] * ray.origin.x + transform.m[2][1] * ray.origin.y + transform.m[2][2] * ray.origin.z + transform.m[2][3]);
+	transformed.direction = DirectX::XMFLOAT3(
+		transform.m[0][0] * ray.direction.x + transform.m[0][1] * ray.direction.y + transform.m[0][2] * ray.direction.z,
+		transform.m[1][0] * ray.direction.x + transform.m[1][1] * ray.direction.y + transform.m[1][2] * ray.direction.z,
+		transform.m[2][0] * ray.direction.x + transform.m[2][1] * ray.direction.y + transform.m[2][2] * ray.direction.z);
+	return transformed;
+}
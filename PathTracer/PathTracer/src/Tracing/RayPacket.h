@@ -0,0 +1,112 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Ray.h"
+
+constexpr const unsigned int MaxPacketSize = 16;
+
+// Rays that walk the trees together. Masks have a bit per ray of the packet
+struct RayPacket {
+	unsigned int size = 0;
+	Ray rays[MaxPacketSize];
+
+	// The origins and inverse directions of the rays as a structure of arrays, for testing boxes four rays at a time
+	alignas(16) float originX[MaxPacketSize];
+	alignas(16) float originY[MaxPacketSize];
+	alignas(16) float originZ[MaxPacketSize];
+	alignas(16) float invDirectionX[MaxPacketSize];
+	alignas(16) float invDirectionY[MaxPacketSize];
+	alignas(16) float invDirectionZ[MaxPacketSize];
+
+	// Bounds of the origins and of the inverse directions of the rays in a mask. Only valid when the directions of all of
+	// them have the same sign on every axis, which is the case of the camera rays of a tile
+	bool coherent = false;
+	DirectX::XMFLOAT3 minOrigin, maxOrigin;
+	DirectX::XMFLOAT3 minInvDirection, maxInvDirection;
+	float maxLength = 0.0f;
+
+	// Fills the arrays and the bounds once the rays of the mask are set. The rays that are not in the mask never hit
+	void Prepare(uint32_t mask) {
+		float minO[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, maxO[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		float minD[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, maxD[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int signs[3] = { 0, 0, 0 };
+		coherent = true;
+		maxLength = 0.0f;
+		for (unsigned int i = 0; i < MaxPacketSize; ++i) {
+			if (!(mask & (1u << i))) {
+				originX[i] = originY[i] = originZ[i] = 0.0f;
+				invDirectionX[i] = invDirectionY[i] = invDirectionZ[i] = 0.0f;
+				continue;
+			}
+			originX[i] = rays[i].origin.x;
+			originY[i] = rays[i].origin.y;
+			originZ[i] = rays[i].origin.z;
+			invDirectionX[i] = 1.0f / rays[i].direction.x;
+			invDirectionY[i] = 1.0f / rays[i].direction.y;
+			invDirectionZ[i] = 1.0f / rays[i].direction.z;
+			const float origin[3] = { rays[i].origin.x, rays[i].origin.y, rays[i].origin.z };
+			const float direction[3] = { rays[i].direction.x, rays[i].direction.y, rays[i].direction.z };
+			for (unsigned int axis = 0; axis < 3; ++axis) {
+				int sign = direction[axis] > 0.0f ? 1 : (direction[axis] < 0.0f ? -1 : 0);
+				if (sign == 0 || (signs[axis] != 0 && signs[axis] != sign)) {
+					coherent = false;
+				}
+				signs[axis] = sign;
+				float invDirection = 1.0f / direction[axis];
+				minO[axis] = std::min(minO[axis], origin[axis]);
+				maxO[axis] = std::max(maxO[axis], origin[axis]);
+				minD[axis] = std::min(minD[axis], invDirection);
+				maxD[axis] = std::max(maxD[axis], invDirection);
+			}
+			maxLength = std::max(maxLength, rays[i].tMax);
+		}
+		minOrigin = DirectX::XMFLOAT3(minO[0], minO[1], minO[2]);
+		maxOrigin = DirectX::XMFLOAT3(maxO[0], maxO[1], maxO[2]);
+		minInvDirection = DirectX::XMFLOAT3(minD[0], minD[1], minD[2]);
+		maxInvDirection = DirectX::XMFLOAT3(maxD[0], maxD[1], maxD[2]);
+	}
+
+	// Interval arithmetic over the bounds: true when no ray of the mask the bounds were computed for can hit the box.
+	// Conservative, so a false doesn't mean that one of them does
+	bool MissesBox(const DirectX::XMFLOAT3& minAABB, const DirectX::XMFLOAT3& maxAABB) const {
+		if (!coherent) {
+			return false;
+		}
+		const float boxMin[3] = { minAABB.x, minAABB.y, minAABB.z }, boxMax[3] = { maxAABB.x, maxAABB.y, maxAABB.z };
+		const float minO[3] = { minOrigin.x, minOrigin.y, minOrigin.z }, maxO[3] = { maxOrigin.x, maxOrigin.y, maxOrigin.z };
+		const float minD[3] = { minInvDirection.x, minInvDirection.y, minInvDirection.z };
+		const float maxD[3] = { maxInvDirection.x, maxInvDirection.y, maxInvDirection.z };
+
+		// Lowest entry and highest exit of any ray of the packet, on every axis
+		float entry = -FLT_MAX, exit = FLT_MAX;
+		for (unsigned int axis = 0; axis < 3; ++axis) {
+			bool positive = minD[axis] > 0.0f;
+			float nearPlane = positive ? boxMin[axis] : boxMax[axis];
+			float farPlane = positive ? boxMax[axis] : boxMin[axis];
+			float nearLow = nearPlane - maxO[axis], nearHigh = nearPlane - minO[axis];
+			float farLow = farPlane - maxO[axis], farHigh = farPlane - minO[axis];
+			entry = std::max(entry, std::min(std::min(nearLow * minD[axis], nearLow * maxD[axis]),
+											 std::min(nearHigh * minD[axis], nearHigh * maxD[axis])));
+			exit = std::min(exit, std::max(std::max(farLow * minD[axis], farLow * maxD[axis]),
+										   std::max(farHigh * minD[axis], farHigh * maxD[axis])));
+		}
+		return entry > exit || exit <= 0.0f || entry >= maxLength;
+	}
+};
+
+inline unsigned int CountRays(uint32_t mask) {
+	unsigned int count = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		++count;
+	}
+	return count;
+}
+
+inline unsigned int FirstRay(uint32_t mask) {
+	unsigned int index = 0;
+	for (; !(mask & 1u); mask >>= 1) {
+		++index;
+	}
+	return index;
+}
@@ -0,0 +1,326 @@
+#include "TriangleBlocks.h"
+#include "Graphics/CompactVertex.h"
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC emits the intrinsics of any instruction set, GCC and Clang only in functions that ask for it
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Epsilon of IntersectTriangleFast
+constexpr const float Epsilon = 1e-5f;
+
+// Keeps the closest of the lanes in laneMask, lowest lane first on a tie, if it is closer than the ray
+inline bool SelectClosestLane(int laneMask, const float* t, const float* u, const float* v, const unsigned int* primitive,
+							  Ray& ray, TriangleBlocks::Hit& hit) {
+	bool found = false;
+	for (unsigned int lane = 0; laneMask != 0; ++lane, laneMask >>= 1) {
+		if ((laneMask & 1) && t[lane] < ray.tMax) {
+			ray.tMax = t[lane];
+			hit = { t[lane], u[lane], v[lane], primitive[lane] };
+			found = true;
+		}
+	}
+	return found;
+}
+
+template <bool AnyHit>
+bool IntersectBlocksScalar(const TriangleBlock<4>* blocks, unsigned int numberOfBlocks, Ray& ray, TriangleBlocks::Hit& hit) {
+	const float* origin = &ray.origin.x;
+	const float* direction = &ray.direction.x;
+	bool found = false;
+	for (unsigned int i = 0; i < numberOfBlocks; ++i) {
+		const auto& block = blocks[i];
+		for (unsigned int lane = 0; lane < 4; ++lane) {
+			float e1[3] = { block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane] };
+			float e2[3] = { block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane] };
+
+			float p[3] = {
+				direction[1] * e2[2] - direction[2] * e2[1],
+				direction[2] * e2[0] - direction[0] * e2[2],
+				direction[0] * e2[1] - direction[1] * e2[0] };
+			float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+			if (fabsf(det) <= Epsilon) {
+				continue;
+			}
+			float invDet = 1.0f / det;
+
+			float toOrigin[3] = { origin[0] - block.v0[0][lane], origin[1] - block.v0[1][lane], origin[2] - block.v0[2][lane] };
+			float q[3] = {
+				toOrigin[1] * e1[2] - toOrigin[2] * e1[1],
+				toOrigin[2] * e1[0] - toOrigin[0] * e1[2],
+				toOrigin[0] * e1[1] - toOrigin[1] * e1[0] };
+			float u = (toOrigin[0] * p[0] + toOrigin[1] * p[1] + toOrigin[2] * p[2]) * invDet;
+			float v = (direction[0] * q[0] + direction[1] * q[1] + direction[2] * q[2]) * invDet;
+			if (u < 0.0f || u > 1.0f || v < 0.0f || u + v > 1.0f) {
+				continue;
+			}
+
+			float t = (q[0] * e2[0] + q[1] * e2[1] + q[2] * e2[2]) * invDet;
+			if (t > ray.tMin && t < ray.tMax) {
+				if (AnyHit) {
+					return true;
+				}
+				ray.tMax = t;
+				hit = { t, u, v, block.primitive[lane] };
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+template <bool AnyHit>
+bool IntersectBlocksSSE(const TriangleBlock<4>* blocks, unsigned int numberOfBlocks, Ray& ray, TriangleBlocks::Hit& hit) {
+	const __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	const __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), epsilon = _mm_set1_ps(Epsilon), sign = _mm_set1_ps(-0.0f);
+	const __m128 tMin = _mm_set1_ps(ray.tMin);
+	__m128 tMax = _mm_set1_ps(ray.tMax);
+	bool found = false;
+
+	for (unsigned int i = 0; i < numberOfBlocks; ++i) {
+		const auto& block = blocks[i];
+		__m128 e1x = _mm_loadu_ps(block.edge1[0]), e1y = _mm_loadu_ps(block.edge1[1]), e1z = _mm_loadu_ps(block.edge1[2]);
+		__m128 e2x = _mm_loadu_ps(block.edge2[0]), e2y = _mm_loadu_ps(block.edge2[1]), e2z = _mm_loadu_ps(block.edge2[2]);
+
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 invDet = _mm_div_ps(one, det);
+
+		__m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(block.v0[0]));
+		__m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(block.v0[1]));
+		__m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(block.v0[2]));
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, e2x), _mm_mul_ps(qy, e2y)), _mm_mul_ps(qz, e2z)), invDet);
+
+		__m128 mask = _mm_cmpgt_ps(_mm_andnot_ps(sign, det), epsilon);
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+		mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpgt_ps(t, tMin), _mm_cmplt_ps(t, tMax)));
+
+		int laneMask = _mm_movemask_ps(mask);
+		if (laneMask == 0) {
+			continue;
+		}
+		if (AnyHit) {
+			return true;
+		}
+		alignas(16) float tLanes[4], uLanes[4], vLanes[4];
+		_mm_store_ps(tLanes, t);
+		_mm_store_ps(uLanes, u);
+		_mm_store_ps(vLanes, v);
+		found |= SelectClosestLane(laneMask, tLanes, uLanes, vLanes, block.primitive, ray, hit);
+		tMax = _mm_set1_ps(ray.tMax);
+	}
+	return found;
+}
+
+template <bool AnyHit>
+TARGET_AVX2 bool IntersectBlocksAVX2(const TriangleBlock<8>* blocks, unsigned int numberOfBlocks, Ray& ray, TriangleBlocks::Hit& hit) {
+	const __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+	const __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+	const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), epsilon = _mm256_set1_ps(Epsilon), sign = _mm256_set1_ps(-0.0f);
+	const __m256 tMin = _mm256_set1_ps(ray.tMin);
+	__m256 tMax = _mm256_set1_ps(ray.tMax);
+	bool found = false;
+
+	for (unsigned int i = 0; i < numberOfBlocks; ++i) {
+		const auto& block = blocks[i];
+		__m256 e1x = _mm256_loadu_ps(block.edge1[0]), e1y = _mm256_loadu_ps(block.edge1[1]), e1z = _mm256_loadu_ps(block.edge1[2]);
+		__m256 e2x = _mm256_loadu_ps(block.edge2[0]), e2y = _mm256_loadu_ps(block.edge2[1]), e2z = _mm256_loadu_ps(block.edge2[2]);
+
+		// No FMA, so that every kernel rounds as the scalar one does
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 invDet = _mm256_div_ps(one, det);
+
+		__m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(block.v0[0]));
+		__m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(block.v0[1]));
+		__m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(block.v0[2]));
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(qx, e2x), _mm256_mul_ps(qy, e2y)), _mm256_mul_ps(qz, e2z)), invDet);
+
+		__m256 mask = _mm256_cmp_ps(_mm256_andnot_ps(sign, det), epsilon, _CMP_GT_OQ);
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+		mask = _mm256_and_ps(mask, _mm256_and_ps(_mm256_cmp_ps(t, tMin, _CMP_GT_OQ), _mm256_cmp_ps(t, tMax, _CMP_LT_OQ)));
+
+		int laneMask = _mm256_movemask_ps(mask);
+		if (laneMask == 0) {
+			continue;
+		}
+		if (AnyHit) {
+			return true;
+		}
+		alignas(32) float tLanes[8], uLanes[8], vLanes[8];
+		_mm256_store_ps(tLanes, t);
+		_mm256_store_ps(uLanes, u);
+		_mm256_store_ps(vLanes, v);
+		found |= SelectClosestLane(laneMask, tLanes, uLanes, vLanes, block.primitive, ray, hit);
+		tMax = _mm256_set1_ps(ray.tMax);
+	}
+	return found;
+}
+
+TriangleKernel TriangleBlocks::GetBestKernel() {
+	static const TriangleKernel bestKernel = []() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return TriangleKernel::SSE;
+		}
+		// AVX needs the OS to save the ymm registers
+		__cpuid(info, 1);
+		bool osSavesAVX = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+		__cpuidex(info, 7, 0);
+		bool hasAVX2 = (info[1] & (1 << 5)) != 0;
+		return osSavesAVX && hasAVX2 ? TriangleKernel::AVX2 : TriangleKernel::SSE;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") ? TriangleKernel::AVX2 : TriangleKernel::SSE;
+#endif
+	}();
+	return bestKernel;
+}
+
+const char* TriangleBlocks::GetKernelName(TriangleKernel kernel) {
+	switch (kernel) {
+	case TriangleKernel::Scalar:
+		return "Scalar";
+	case TriangleKernel::SSE:
+		return "SSE";
+	case TriangleKernel::AVX2:
+		return "AVX2";
+	}
+	return "Unknown";
+}
+
+unsigned int TriangleBlocks::GetKernelWidth(TriangleKernel kernel) {
+	return kernel == TriangleKernel::AVX2 ? 8 : 4;
+}
+
+TriangleBlocks::TriangleBlocks(TriangleKernel kernel) : mKernel(kernel) {
+}
+
+template <typename Vertex>
+void TriangleBlocks::Build(const std::vector<BVHTreeNode>& nodes, const std::vector<TraceModelPrimitive>& primitives,
+						   const std::vector<Vertex>& vertices) {
+	mLeaves.clear();
+	mBlocks4.clear();
+	mBlocks8.clear();
+
+	mLeaves.reserve(nodes.size() / 2 + 1);
+	mLeafOfPrimitive.assign(primitives.size(), 0);
+	for (const auto& node : nodes) {
+		if (node.numberOfPrimitives > 0) {
+			mLeafOfPrimitive[node.primitiveOffset] = AddLeaf(primitives, node.primitiveOffset, node.numberOfPrimitives, vertices);
+		}
+	}
+}
+
+template <typename Vertex>
+unsigned int TriangleBlocks::AddLeaf(const std::vector<TraceModelPrimitive>& primitives, unsigned int firstPrimitive, unsigned int count,
+									 const std::vector<Vertex>& vertices) {
+	if (GetWidth() == 8) {
+		PackLeaf(mBlocks8, primitives, firstPrimitive, count, vertices);
+	} else {
+		PackLeaf(mBlocks4, primitives, firstPrimitive, count, vertices);
+	}
+	return (unsigned int)mLeaves.size() - 1;
+}
+
+template <unsigned int Width, typename Vertex>
+void TriangleBlocks::PackLeaf(std::vector<TriangleBlock<Width>>& blocks, const std::vector<TraceModelPrimitive>& primitives,
+							  unsigned int firstPrimitive, unsigned int count, const std::vector<Vertex>& vertices) {
+	auto& leaf = mLeaves.emplace_back();
+	leaf.firstBlock = (unsigned int)blocks.size();
+	leaf.numberOfBlocks = (count + Width - 1) / Width;
+
+	for (unsigned int i = 0; i < leaf.numberOfBlocks; ++i) {
+		auto& block = blocks.emplace_back();
+		std::memset(&block, 0, sizeof(block));
+		for (unsigned int lane = 0; lane < Width && i * Width + lane < count; ++lane) {
+			unsigned int primitiveIndex = firstPrimitive + i * Width + lane;
+			const auto& primitive = primitives[primitiveIndex];
+			const auto& a = vertices[primitive.index0].position;
+			const auto& b = vertices[primitive.index1].position;
+			const auto& c = vertices[primitive.index2].position;
+			block.v0[0][lane] = a.x;
+			block.v0[1][lane] = a.y;
+			block.v0[2][lane] = a.z;
+			block.edge1[0][lane] = b.x - a.x;
+			block.edge1[1][lane] = b.y - a.y;
+			block.edge1[2][lane] = b.z - a.z;
+			block.edge2[0][lane] = c.x - a.x;
+			block.edge2[1][lane] = c.y - a.y;
+			block.edge2[2][lane] = c.z - a.z;
+			block.primitive[lane] = primitiveIndex;
+		}
+	}
+}
+
+template void TriangleBlocks::Build(const std::vector<BVHTreeNode>&, const std::vector<TraceModelPrimitive>&,
+									const std::vector<TraceVertex>&);
+template void TriangleBlocks::Build(const std::vector<BVHTreeNode>&, const std::vector<TraceModelPrimitive>&,
+									const std::vector<CompactTraceVertex>&);
+template unsigned int TriangleBlocks::AddLeaf(const std::vector<TraceModelPrimitive>&, unsigned int, unsigned int,
+											  const std::vector<TraceVertex>&);
+template unsigned int TriangleBlocks::AddLeaf(const std::vector<TraceModelPrimitive>&, unsigned int, unsigned int,
+											  const std::vector<CompactTraceVertex>&);
+
+template <bool AnyHit>
+bool TriangleBlocks::Intersect(unsigned int leaf, Ray& ray, Hit& hit) const {
+	const auto& blocks = mLeaves[leaf];
+	switch (mKernel) {
+	case TriangleKernel::AVX2:
+		return IntersectBlocksAVX2<AnyHit>(mBlocks8.data() + blocks.firstBlock, blocks.numberOfBlocks, ray, hit);
+	case TriangleKernel::SSE:
+		return IntersectBlocksSSE<AnyHit>(mBlocks4.data() + blocks.firstBlock, blocks.numberOfBlocks, ray, hit);
+	default:
+		return IntersectBlocksScalar<AnyHit>(mBlocks4.data() + blocks.firstBlock, blocks.numberOfBlocks, ray, hit);
+	}
+}
+
+bool TriangleBlocks::IntersectClosest(unsigned int leaf, Ray& ray, Hit& hit) const {
+	return Intersect<false>(leaf, ray, hit);
+}
+
+bool TriangleBlocks::IntersectAny(unsigned int leaf, const Ray& ray) const {
+	Ray anyHitRay = ray;
+	Hit hit;
+	return Intersect<true>(leaf, anyHitRay, hit);
+}
+
+unsigned int TriangleBlocks::FindLeaf(unsigned int firstPrimitive) const {
+	return mLeafOfPrimitive[firstPrimitive];
+}
+
+TriangleKernel TriangleBlocks::GetKernel() const {
+	return mKernel;
+}
+
+unsigned int TriangleBlocks::GetWidth() const {
+	return GetKernelWidth(mKernel);
+}
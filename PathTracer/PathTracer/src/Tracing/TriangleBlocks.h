@@ -0,0 +1,91 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "Ray.h"
+#include "Graphics/ShaderObjects.h"
+
+// Triangles of a leaf stored as a structure of arrays: the first vertex and the two edges leaving it, which is all
+// Moller-Trumbore needs, so that a block is intersected with a few vector instructions and no index lookups. Lanes past
+// the end of a leaf are degenerate and never hit
+template <unsigned int Width>
+struct TriangleBlock {
+	float v0[3][Width];
+	float edge1[3][Width];
+	float edge2[3][Width];
+	// Index of the triangle in the model primitives
+	unsigned int primitive[Width];
+};
+
+enum class TriangleKernel {
+	// 4 wide blocks tested one lane at a time, as IntersectTriangleFast does. The reference of the other kernels
+	Scalar,
+	// 4 wide blocks
+	SSE,
+	// 8 wide blocks
+	AVX2
+};
+
+// Leaves of the model trees repacked into triangle blocks for one kernel. The kernel is picked once from what the CPU
+// supports and every block of the object has its width
+class TriangleBlocks {
+public:
+	struct Hit {
+		float t;
+		float u;
+		float v;
+		unsigned int primitive;
+	};
+
+public:
+	static TriangleKernel GetBestKernel();
+	static const char* GetKernelName(TriangleKernel kernel);
+	static unsigned int GetKernelWidth(TriangleKernel kernel);
+
+public:
+	TriangleBlocks(TriangleKernel kernel = GetBestKernel());
+
+	// Packs every leaf of the flattened model trees of SceneDescription. Leaves are then found by their first primitive,
+	// which the binary and the wide trees both keep. Only the positions are read, so the vertices can be TraceVertex or
+	// CompactTraceVertex
+	template <typename Vertex>
+	void Build(const std::vector<BVHTreeNode>& nodes, const std::vector<TraceModelPrimitive>& primitives,
+			   const std::vector<Vertex>& vertices);
+	// Packs primitives [firstPrimitive, firstPrimitive + count) as one more leaf, for callers without a tree, and returns its index
+	template <typename Vertex>
+	unsigned int AddLeaf(const std::vector<TraceModelPrimitive>& primitives, unsigned int firstPrimitive, unsigned int count,
+						 const std::vector<Vertex>& vertices);
+
+	// Closest triangle of the leaf hit in (ray.tMin, ray.tMax). Shrinks ray.tMax to it. Of two hits at the same distance, the
+	// first primitive of the leaf wins, like in the scalar loop of the shaders
+	bool IntersectClosest(unsigned int leaf, Ray& ray, Hit& hit) const;
+	// Stops at the first triangle of the leaf hit in (ray.tMin, ray.tMax)
+	bool IntersectAny(unsigned int leaf, const Ray& ray) const;
+	// Leaf packed by Build that starts at the primitive
+	unsigned int FindLeaf(unsigned int firstPrimitive) const;
+
+	TriangleKernel GetKernel() const;
+	unsigned int GetWidth() const;
+
+private:
+	template <unsigned int Width, typename Vertex>
+	void PackLeaf(std::vector<TriangleBlock<Width>>& blocks, const std::vector<TraceModelPrimitive>& primitives, unsigned int firstPrimitive,
+				  unsigned int count, const std::vector<Vertex>& vertices);
+
+	template <bool AnyHit>
+	bool Intersect(unsigned int leaf, Ray& ray, Hit& hit) const;
+
+private:
+	struct LeafBlocks {
+		unsigned int firstBlock = 0;
+		unsigned int numberOfBlocks = 0;
+	};
+
+	TriangleKernel mKernel;
+	std::vector<LeafBlocks> mLeaves;
+	// Leaf of the first primitive of every leaf of the trees given to Build
+	std::vector<unsigned int> mLeafOfPrimitive;
+	// Only the vector of the width of the kernel is used
+	std::vector<TriangleBlock<4>> mBlocks4;
+	std::vector<TriangleBlock<8>> mBlocks8;
+};
@@ -0,0 +1,58 @@
+#include "CacheFile.h"
+
+constexpr const char CacheMagic[8] = { 'O', 'B', 'L', 'C', 'A', 'C', 'H', 'E' };
+
+CacheFile::CacheFile(const std::string& path, uint32_t version, uint64_t hash, unsigned int numberOfSections) :
+	mPath(path), mFile(path) {
+	EVALUATE(mFile.GetSize() >= sizeof(Header), "Cache ", path, " is too small");
+
+	Header header;
+	memcpy(&header, mFile.GetData(), sizeof(header));
+	EVALUATE(memcmp(header.magic, CacheMagic, sizeof(header.magic)) == 0, path, " is not a cache");
+	EVALUATE(header.version == version && header.numberOfSections == numberOfSections, "Cache ", path, " has version ",
+			 header.version, " instead of ", version);
+	EVALUATE(header.hash == hash, "Cache ", path, " is out of date");
+	EVALUATE(mFile.GetSize() >= sizeof(Header) + numberOfSections * sizeof(SectionInfo), "Cache ", path, " is too small");
+
+	mSections.resize(numberOfSections);
+	memcpy(mSections.data(), mFile.GetData() + sizeof(Header), numberOfSections * sizeof(SectionInfo));
+	for (const auto& section : mSections) {
+		EVALUATE(section.offset % 16 == 0 && section.elementSize > 0 && section.offset <= mFile.GetSize() &&
+				 section.count <= (mFile.GetSize() - section.offset) / section.elementSize,
+				 "Cache section at ", section.offset, " with ", section.count, " elements is past the end of ", path);
+	}
+}
+
+uint64_t CacheFile::Write(const std::string& path, uint32_t version, uint64_t hash, const std::vector<Section>& sections) {
+	Header header{};
+	memcpy(header.magic, CacheMagic, sizeof(header.magic));
+	header.version = version;
+	header.numberOfSections = (uint32_t)sections.size();
+	header.hash = hash;
+
+	std::vector<SectionInfo> sectionsInfo(sections.size());
+	uint64_t offset = sizeof(Header) + sections.size() * sizeof(SectionInfo);
+	for (size_t i = 0; i < sections.size(); ++i) {
+		offset = (offset + 15) & ~uint64_t(15);
+		sectionsInfo[i] = { offset, sections[i].count, sections[i].elementSize };
+		offset += sections[i].count * sections[i].elementSize;
+	}
+
+	// Unique per thread, for the caches that are written in parallel
+	std::ostringstream temporaryPath;
+	temporaryPath << path << "." << std::this_thread::get_id() << ".tmp";
+	{
+		std::ofstream output(temporaryPath.str(), std::ios::binary);
+		EVALUATE(output.is_open(), "Unable to open ", temporaryPath.str(), " for writing");
+		output.write((const char*)&header, sizeof(header));
+		output.write((const char*)sectionsInfo.data(), sectionsInfo.size() * sizeof(SectionInfo));
+		const char padding[16] = {};
+		for (size_t i = 0; i < sections.size(); ++i) {
+			output.write(padding, sectionsInfo[i].offset - (uint64_t)output.tellp());
+			output.write((const char*)sections[i].data, sections[i].count * sections[i].elementSize);
+		}
+		EVALUATE(output.good(), "Unable to write ", temporaryPath.str());
+	}
+	std::filesystem::rename(temporaryPath.str(), path);
+	return offset;
+}
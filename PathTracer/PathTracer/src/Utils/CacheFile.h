@@ -0,0 +1,53 @@
+#pragma once
+
+
+#include <Oblivion.h>
+#include "MappedFile.h"
+
+
+// Files of arrays stored as they are in memory, behind a header with the version of the layout and a hash of the inputs
+// they were built from. Reading one back is a mapping and a copy per array, into vectors the caller owns and may change
+class CacheFile {
+public:
+	struct Section {
+		const void* data;
+		size_t count;
+		size_t elementSize;
+	};
+
+public:
+	// Throws when the file is not a cache of this version and hash with numberOfSections arrays
+	CacheFile(const std::string& path, uint32_t version, uint64_t hash, unsigned int numberOfSections);
+
+	template <typename T>
+	void ReadSection(unsigned int index, std::vector<T>& elements) const {
+		const auto& section = mSections.at(index);
+		EVALUATE(section.elementSize == sizeof(T), "Section ", index, " of ", mPath, " has elements of ", section.elementSize,
+				 " bytes instead of ", sizeof(T));
+		const T* first = reinterpret_cast<const T*>(mFile.GetData() + section.offset);
+		elements.assign(first, first + section.count);
+	}
+
+	// Writes next to path and renames once complete, so that an interrupted run never leaves a truncated cache behind.
+	// Returns the size of the file
+	static uint64_t Write(const std::string& path, uint32_t version, uint64_t hash, const std::vector<Section>& sections);
+
+private:
+	struct SectionInfo {
+		uint64_t offset;
+		uint64_t count;
+		uint64_t elementSize;
+	};
+
+	// Followed by numberOfSections SectionInfo, then by the arrays at 16 byte aligned offsets
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t numberOfSections;
+		uint64_t hash;
+	};
+
+	std::string mPath;
+	MappedFile mFile;
+	std::vector<SectionInfo> mSections;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+
+#include <Oblivion.h>
+
+
+// A file mapped read only into the address space, so that it is read by the OS on first access and without a copy
+class MappedFile {
+public:
+	MappedFile(const std::string& path);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+
+public:
+	const unsigned char* GetData() const;
+	size_t GetSize() const;
+
+private:
+	const unsigned char* mData = nullptr;
+	size_t mSize = 0;
+#if defined(_WIN32)
+	HANDLE mFile = INVALID_HANDLE_VALUE;
+	HANDLE mMapping = nullptr;
+#endif
+};
+
+// 64 bit hash of a buffer, for telling whether the content of a file changed. Not meant to resist collisions on purpose
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0);
+
+// HashBytes of the content of a file, whatever its path and its modification time
+uint64_t HashFileContent(const std::string& path, uint64_t seed = 0);
+
+// Hash of the path, size and modification time of a file, which changes whenever a save or a copy touches it. The file
+// is not read, so edits that keep the size and the time are missed
+uint64_t HashFileMetadata(const std::string& path, uint64_t seed = 0);
@@ -13,6 +13,7 @@ struct Task {
 	std::shared_ptr<Task> nextTask = nullptr;
 	int chunckSize;
 	int activeWorkers = 0;
+	bool inWorkList = true;
 	unsigned long long taskID;
 
 	bool Finished() {
@@ -27,8 +28,71 @@ std::condition_variable workerThreadConditionVariable;
 std::atomic_bool shouldClose = false;
 std::shared_ptr<Task> workList = nullptr;
 
-std::set<std::shared_ptr<Task>> finishedTasks;
 
+// Removes the task from the work list, wherever it is. Tasks can be pushed in front of it
+// by nested parallel loops, so it's not always the head of the list
+// workListMutex must be locked
+void UnlinkTask(const std::shared_ptr<Task>& task) {
+	if (!task->inWorkList) {
+		return;
+	}
+
+	if (workList == task) {
+		workList = task->nextTask;
+	} else {
+		for (auto it = workList; it != nullptr; it = it->nextTask) {
+			if (it->nextTask == task) {
+				it->nextTask = task->nextTask;
+				break;
+			}
+		}
+	}
+	task->nextTask = nullptr;
+	task->inWorkList = false;
+}
+
+// Executes the next chunk of the task. The lock is released while the chunk is running
+// workListMutex must be locked
+void RunNextChunk(std::unique_lock<std::mutex>& lock, std::shared_ptr<Task> task) {
+	int64_t indexStart = task->nextIndex;
+	int64_t indexEnd = std::min(indexStart + task->chunckSize, task->maxIndex);
+
+	task->nextIndex = indexEnd;
+	if (indexEnd == task->maxIndex) {
+		UnlinkTask(task);
+	}
+	task->activeWorkers++;
+
+	lock.unlock();
+
+	for (auto i = indexStart; i < indexEnd; ++i) {
+		if (task->function1D) {
+			task->function1D(i);
+		}
+	}
+
+	lock.lock();
+	task->activeWorkers--;
+	if (task->Finished()) {
+		workerThreadConditionVariable.notify_all();
+	}
+}
+
+// Runs chunks of the task until all of them are done. When every chunk was already picked up by
+// other threads, help with the rest of the work list instead of blocking, so nested parallel loops
+// can't starve the pool
+// workListMutex must be locked
+void WaitForTask(std::unique_lock<std::mutex>& lock, const std::shared_ptr<Task>& task) {
+	while (!task->Finished()) {
+		if (task->nextIndex < task->maxIndex) {
+			RunNextChunk(lock, task);
+		} else if (workList != nullptr) {
+			RunNextChunk(lock, workList);
+		} else {
+			workerThreadConditionVariable.wait(lock);
+		}
+	}
+}
 
 void workerThreadFunc(unsigned int threadIndex) {
 	Oblivion::DebugPrintLine("Starting thread ", threadIndex);
@@ -48,31 +112,7 @@ void workerThreadFunc(unsigned int threadIndex) {
 			if (workList == nullptr)
 				continue;
 
-			auto myTask = workList;
-
-			int64_t indexStart = myTask->nextIndex;
-			int64_t indexEnd = std::min(indexStart + myTask->chunckSize, myTask->maxIndex);
-
-			myTask->nextIndex = indexEnd;
-			if (indexEnd == myTask->maxIndex) {
-				finishedTasks.insert(myTask);
-				workList = myTask->nextTask;
-			}
-			myTask->activeWorkers++;
-
-			lock.unlock();
-
-			for (auto i = indexStart; i < indexEnd; ++i) {
-				if (myTask->function1D) {
-					myTask->function1D(i);
-				}
-			}
-
-			lock.lock();
-			myTask->activeWorkers--;
-			if (myTask->Finished()) {
-				workerThreadConditionVariable.notify_all();
-			}
+			RunNextChunk(lock, workList);
 		}
 	}
 }
@@ -99,48 +139,29 @@ void Threading::ParralelForImmediate(std::function<void(int64_t)> func, int64_t
 		for (int64_t i = 0; i < count; ++i) {
 			func(i);
 		}
+		return;
 	}
 
 	std::shared_ptr<Task> currentTask = std::make_shared<Task>(std::move(func), count, chunkSize);
-	workListMutex.lock();
-	currentTask->nextTask = workList;
-	workList = currentTask;
-	workListMutex.unlock();
 
 	std::unique_lock<std::mutex> lock(workListMutex);
+	currentTask->nextTask = workList;
+	workList = currentTask;
 	workerThreadConditionVariable.notify_all();
-	while (!currentTask->Finished()) {
-		int64_t indexStart = currentTask->nextIndex;
-		int64_t indexEnd = std::min(indexStart + currentTask->chunckSize, currentTask->maxIndex);
-
-		currentTask->nextIndex = indexEnd;
-		if (indexEnd == currentTask->maxIndex) {
-			finishedTasks.insert(currentTask);
-			workList = currentTask->nextTask;
-		}
-		currentTask->activeWorkers++;
 
-		lock.unlock();
-
-		for (auto i = indexStart; i < indexEnd; ++i) {
-			if (currentTask->function1D) {
-				currentTask->function1D(i);
-			}
-		}
-
-		lock.lock();
-		currentTask->activeWorkers--;
-	}
+	WaitForTask(lock, currentTask);
 }
 
 std::shared_ptr<Task> Threading::ParralelForDeffered(std::function<void(int64_t)> func, int64_t count, int chunkSize) {
 	std::shared_ptr<Task> currentTask = std::make_shared<Task>(std::move(func), count, chunkSize);
 	workListMutex.lock();
 	currentTask->nextTask = nullptr;
-	auto listIterator = workList;
 	if (workList != nullptr) {
-		while (workList->nextTask != nullptr);
-		workList->nextTask = currentTask;
+		auto listIterator = workList;
+		while (listIterator->nextTask != nullptr) {
+			listIterator = listIterator->nextTask;
+		}
+		listIterator->nextTask = currentTask;
 	} else {
 		workList = currentTask;
 	}
@@ -152,31 +173,7 @@ std::shared_ptr<Task> Threading::ParralelForDeffered(std::function<void(int64_t)
 }
 
 void Threading::Wait(std::shared_ptr<struct Task> currentTask) {
-	if (finishedTasks.find(currentTask) == finishedTasks.end()) {
-		// The task is not ready yet, come to the resque!
-		std::unique_lock<std::mutex> lock(workListMutex);
-		workerThreadConditionVariable.notify_all();
-		while (!currentTask->Finished()) {
-			int64_t indexStart = currentTask->nextIndex;
-			int64_t indexEnd = std::min(indexStart + currentTask->chunckSize, currentTask->maxIndex);
-
-			currentTask->nextIndex = indexEnd;
-			if (indexEnd == currentTask->maxIndex) {
-				finishedTasks.insert(currentTask);
-				workList = currentTask->nextTask;
-			}
-			currentTask->activeWorkers++;
-
-			lock.unlock();
-
-			for (auto i = indexStart; i < indexEnd; ++i) {
-				if (currentTask->function1D) {
-					currentTask->function1D(i);
-				}
-			}
-
-			lock.lock();
-			currentTask->activeWorkers--;
-		}
-	}
+	std::unique_lock<std::mutex> lock(workListMutex);
+	workerThreadConditionVariable.notify_all();
+	WaitForTask(lock, currentTask);
 }
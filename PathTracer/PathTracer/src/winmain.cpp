@@ -1,7 +1,10 @@
 #define BOOST_BIND_GLOBAL_PLACEHOLDERS
 
+#if defined(_WIN32)
 #include "Application.h"
 #include <dxgidebug.h>
+#endif
+#include "HeadlessApplication.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/program_options.hpp>
@@ -9,6 +12,7 @@
 std::ofstream gLogsFile;
 
 
+#if defined(_WIN32)
 void DXGICheckMemory() {
     ComPtr<IDXGIDebug> debugInterface = nullptr;
     ThrowIfFailed(DXGIGetDebugInterface1(0, IID_PPV_ARGS(&debugInterface)));
@@ -16,6 +20,7 @@ void DXGICheckMemory() {
     debugInterface->ReportLiveObjects(DXGI_DEBUG_ALL, DXGI_DEBUG_RLO_FLAGS::DXGI_DEBUG_RLO_ALL);
     debugInterface.Reset();
 }
+#endif
 
 OblivionMode GetApplicationModeFromString(const std::string& textInput) {
     if (boost::iequals("debug", textInput)) {
@@ -24,6 +29,35 @@ OblivionMode GetApplicationModeFromString(const std::string& textInput) {
     return OblivionMode::None;
 }
 
+std::optional<CpuTraversal> GetCpuTraversalFromString(const std::string& textInput) {
+    if (boost::iequals("single", textInput)) {
+        return CpuTraversal::Single;
+    } else if (boost::iequals("packet", textInput)) {
+        return CpuTraversal::Packet;
+    } else if (boost::iequals("stream", textInput)) {
+        return CpuTraversal::Stream;
+    }
+    return std::nullopt;
+}
+
+std::optional<CpuPipeline> GetCpuPipelineFromString(const std::string& textInput) {
+    if (boost::iequals("megakernel", textInput)) {
+        return CpuPipeline::Megakernel;
+    } else if (boost::iequals("wavefront", textInput)) {
+        return CpuPipeline::Wavefront;
+    }
+    return std::nullopt;
+}
+
+std::optional<CpuVertexFormat> GetCpuVertexFormatFromString(const std::string& textInput) {
+    if (boost::iequals("full", textInput)) {
+        return CpuVertexFormat::Full;
+    } else if (boost::iequals("compact", textInput)) {
+        return CpuVertexFormat::Compact;
+    }
+    return std::nullopt;
+}
+
 std::optional<OblivionInitialization> ParseCommandLine(int argc, const char* argv[]) {
     try {
         using namespace boost::program_options;
@@ -43,6 +77,25 @@ std::optional<OblivionInitialization> ParseCommandLine(int argc, const char* arg
             ("config-file", value<std::string>(&initStructure.configFile)->default_value("config.json"),
                             "Configuration file. If the specified file can not be opened, default options will be used")
             ("max-seconds-per-frame,s", value<float>(&initStructure.maxSecondsPerFrame)->default_value(FLT_MAX))
+            ("cpu", bool_switch(&initStructure.cpuBackend), "Path trace on the CPU and write the image, without a window")
+            ("cpu-traversal", value<std::string>()->default_value("stream"),
+                              "How the CPU traces camera and shadow rays: single, packet or stream")
+            ("packet-size", value<unsigned int>(&initStructure.packetSize)->default_value(16), "Rays in a packet of the CPU: 8 or 16")
+            ("cpu-pipeline", value<std::string>()->default_value("megakernel"),
+                             "How the CPU runs the paths: megakernel, one pixel at a time, or wavefront, one stage at a time")
+            ("cpu-vertices", value<std::string>()->default_value("full"),
+                             "Vertices the CPU backend reads: full, or compact, with quantized normals in less than half the memory")
+            ;
+
+        options_description batchOptions{ "Batch rendering" };
+        batchOptions.add_options()
+            ("output,o", value<std::string>(&initStructure.outputFile),
+                         "Render without a window, write the image (PPM) to this file and exit")
+            ("width", value<unsigned int>(&initStructure.width), "Width of the image. Overrides the configuration file")
+            ("height", value<unsigned int>(&initStructure.height), "Height of the image. Overrides the configuration file")
+            ("spp", value<unsigned int>(), "Samples per pixel. Same as --num-samples")
+            ("time-budget", value<float>(&initStructure.timeBudget)->default_value(FLT_MAX),
+                            "Seconds after which no new sample is started, even if fewer than --spp were taken")
             ;
 
         options_description hiddenOptions{ "Hidden options" };
@@ -51,13 +104,13 @@ std::optional<OblivionInitialization> ParseCommandLine(int argc, const char* arg
             ;
 
         options_description cmdlineOptions;
-        cmdlineOptions.add(genericOptions).add(configOptions).add(hiddenOptions);
+        cmdlineOptions.add(genericOptions).add(configOptions).add(batchOptions).add(hiddenOptions);
 
         options_description configFileOptions;
-        configFileOptions.add(configOptions).add(hiddenOptions);
+        configFileOptions.add(configOptions).add(batchOptions).add(hiddenOptions);
 
         options_description visibleOptions("Allowed options");
-        visibleOptions.add(genericOptions).add(configOptions);
+        visibleOptions.add(genericOptions).add(configOptions).add(batchOptions);
 
         positional_options_description inputFilesOption;
         inputFilesOption.add("input-files", -1);
@@ -74,11 +127,39 @@ std::optional<OblivionInitialization> ParseCommandLine(int argc, const char* arg
             Oblivion::DebugPrintLine("Current version: ", APP_VERSION);
             return std::nullopt;
         } else {
+            if (vm.count("spp")) {
+                initStructure.numSamples = vm["spp"].as<unsigned int>();
+            }
             Oblivion::DebugPrintLine("Number of samples: ", initStructure.numSamples);
             Oblivion::DebugPrintLine("Application mode: ", vm["app-mode"].as<std::string>());
             Oblivion::DebugPrintLine("Output file: ", initStructure.outputFile);
             Oblivion::DebugPrintLine("Input files ", initStructure.inputFiles);
             Oblivion::DebugPrintLine("Config file: ", initStructure.configFile);
+            // Batch renders have no window, which only the CPU backend can do
+            initStructure.batchMode = !initStructure.outputFile.empty();
+#if !defined(_WIN32)
+            initStructure.cpuBackend = true;
+#endif
+            initStructure.cpuBackend = initStructure.cpuBackend || initStructure.batchMode;
+            Oblivion::DebugPrintLine("Backend: ", initStructure.cpuBackend ? "CPU" : "D3D12");
+            auto cpuTraversal = GetCpuTraversalFromString(vm["cpu-traversal"].as<std::string>());
+            if (!cpuTraversal.has_value()) {
+                Oblivion::DebugPrintLine("Unable to parse CPU traversal. Defaulting to stream");
+            }
+            initStructure.cpuTraversal = cpuTraversal.value_or(CpuTraversal::Stream);
+            auto cpuPipeline = GetCpuPipelineFromString(vm["cpu-pipeline"].as<std::string>());
+            if (!cpuPipeline.has_value()) {
+                Oblivion::DebugPrintLine("Unable to parse CPU pipeline. Defaulting to megakernel");
+            }
+            initStructure.cpuPipeline = cpuPipeline.value_or(CpuPipeline::Megakernel);
+            auto cpuVertexFormat = GetCpuVertexFormatFromString(vm["cpu-vertices"].as<std::string>());
+            if (!cpuVertexFormat.has_value()) {
+                Oblivion::DebugPrintLine("Unable to parse CPU vertex format. Defaulting to full");
+            }
+            initStructure.cpuVertexFormat = cpuVertexFormat.value_or(CpuVertexFormat::Full);
+            if (initStructure.cpuVertexFormat == CpuVertexFormat::Compact && !initStructure.cpuBackend) {
+                Oblivion::DebugPrintLine("Compact vertices are only read by the CPU backend. The D3D12 backend uses full ones");
+            }
             initStructure.applicationMode = GetApplicationModeFromString(vm["app-mode"].as<std::string>());
             if (initStructure.applicationMode == OblivionMode::None) {
                 Oblivion::DebugPrintLine("Unable to parse application mode. Defaulting to Debug");
@@ -104,10 +185,19 @@ int main(int argc, const char* argv[]) {
         return 0;
     }
 
+    if (initStructure->cpuBackend) {
+        // Batch renders are scheduled by scripts, which need to know when they failed
+        bool succeeded = TRY_RETURN_VALUE(HeadlessApplication::Get(*initStructure)->Run(), true, false);
+        HeadlessApplication::Reset();
+        return succeeded ? 0 : 1;
+    }
+
+#if defined(_WIN32)
     HINSTANCE hCurrentInstance = GetModuleHandle(NULL);
     TRY_PRINT_ERROR(Application::Get(hCurrentInstance, *initStructure)->Run());
     Application::Reset();
     TRY_PRINT_ERROR(DXGICheckMemory());
+#endif
 
     return 0;
 